@@ -0,0 +1,86 @@
+////////////////////////////////////////////////////////////////////////////////
+// BlockCache.hpp
+// A set associative cache of unit image blocks, in controller RAM.
+//
+// The home block, directories, bitmaps and inodes that RT-11 and 2.11BSD read
+// over and over are kept here, so that reading them again doesn't go to the SD
+// card. A block can only be in one set, picked from its file and block number,
+// and within the set the line to replace is chosen by LRU or by CLOCK.
+//
+// Lines can be dirty, newer than the card, when the cache is used write-back.
+// The cache only chooses a dirty line to replace if it is on the drive the caller
+// says it can write to, and the caller writes it back before it reuses it.
+//
+// A read served from the cache isn't copied out of it. The transfer's buffer
+// points at the lines, which are pinned until the Qbus DMA has sent them, and
+// a line that is pinned is never chosen to be replaced. Likewise a read from the
+// raw backend can put the blocks it reads from the card straight into lines.
+//
+// Like the scheduler, the cache only moves data around in RAM and never suspends,
+// so the caller's locking decides who may use it. MSCP.cpp uses it under the lock
+// of the drive the block's file is on.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <stdint.h>
+#include "cmsis.h"
+
+#define BCACHE_SETS 32                                  // sets, a power of 2
+#define BCACHE_WAYS 4                                   // lines in each set
+#define BCACHE_BLOCK 512                                // bytes in a line, one block
+
+struct CacheLine
+    {
+    const void *file;                                   // the file the block is from, null if the line is empty
+    uint32_t block;                                     // the block number within the file
+    uint8_t drive;                                      // the drive the file is on
+    uint32_t used;                                      // for LRU, when the line was last used
+    bool ref;                                           // for CLOCK, the line has been used since the hand passed it
+    bool dirty;                                         // the line is newer than the card
+    uint8_t pins;                                       // Qbus transfers reading straight from the line, which may not be reused until they end
+    };
+
+class BlockCache
+    {
+    CacheLine lines[BCACHE_SETS][BCACHE_WAYS];
+    uint32_t data[BCACHE_SETS][BCACHE_WAYS][BCACHE_BLOCK/4] __ALIGNED(32);
+    uint8_t hand[BCACHE_SETS] = {};                     // for CLOCK, the next line to look at in each set
+    uint32_t now = 0;                                   // for LRU, counts uses
+
+    unsigned setOf(const void *file, uint32_t block);
+    void touch(CacheLine *l);
+
+    public:
+
+    bool clock = false;                                 // when true, replace by CLOCK rather than LRU
+
+    unsigned hits = 0;                                  // blocks read from the cache
+    unsigned misses = 0;                                // blocks that had to be read from the card
+    unsigned fills = 0;                                 // blocks put in the cache
+    unsigned evictions = 0;                             // blocks replaced by others
+    unsigned writebacks = 0;                            // dirty blocks written to the card
+    unsigned bypassed = 0;                              // blocks not cached because every line in their set was dirty
+    unsigned dirty = 0;                                 // dirty lines now
+
+    void reset();                                       // empty the cache and clear the counters, dropping dirty lines
+    CacheLine *find(const void *file, uint32_t block, bool use = true);    // the line holding a block, or null
+    CacheLine *victim(const void *file, uint32_t block, int drive); // the line to put a block in, dirty only if on <drive>, or null
+    void fill(CacheLine *l, const void *file, uint32_t block, unsigned drive);  // the line now holds the block
+    void setDirty(CacheLine *l, bool d);                // mark a line dirty, or clean once it has been written back
+    void drop(CacheLine *l);                            // empty a line, its block is stale
+    void invalidate(const void *file);                  // drop all of a file's lines, written back first
+    CacheLine *dirtyLine(const void *file = nullptr);   // a dirty line, of the file if one is given, or null
+
+    inline void pin(CacheLine *l) { ++l->pins; }
+    inline void unpin(CacheLine *l) { --l->pins; }
+
+    inline uint32_t *dataOf(CacheLine *l)
+        {
+        unsigned i = l - &lines[0][0];
+        return data[i / BCACHE_WAYS][i % BCACHE_WAYS];
+        }
+    };
+
+#endif // BLOCKCACHE_HPP
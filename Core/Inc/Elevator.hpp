@@ -0,0 +1,76 @@
+////////////////////////////////////////////////////////////////////////////////
+// Elevator.hpp
+// A request scheduler for MSCP disk transfers.
+//
+// Queued requests are served in ascending LBN order (C-LOOK) rather than arrival
+// order, and queued requests that continue where the chosen one ends are merged
+// with it, so that they can be moved with one multi-block SD card command.
+// No request can be passed over more than ELEVATOR_MAX_SKIPS times, and a request
+// is never started ahead of an earlier, overlapping one that involves a write.
+//
+// The scheduler only moves pointers around, it does no I/O, and never suspends,
+// so it can be called from any thread without locking.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef ELEVATOR_HPP
+#define ELEVATOR_HPP
+
+#include <stdint.h>
+
+#define ELEVATOR_MAX 16                                 // the most requests that can be queued or active at once
+#define ELEVATOR_UNITS 8                                // the number of units with their own head position
+#define ELEVATOR_MAX_SKIPS 8                            // the most times a request can be passed over
+#define ELEVATOR_MAX_MERGE (64*1024)                    // the most bytes in a merged transfer
+
+enum ReqKind
+    {
+    REQ_OTHER,                                          // not a transfer, runs alone, and nothing on its unit passes it
+    REQ_READ,
+    REQ_WRITE
+    };
+
+struct Request
+    {
+    Request *next;                                      // the next request merged into the same transfer
+    ReqKind kind;
+    unsigned unit;
+    uint32_t LBN;                                       // first block
+    unsigned size;                                      // bytes
+    uint32_t addr;                                      // PDP-11 buffer address
+    unsigned seq;                                       // arrival order
+    unsigned skips;                                     // number of times a later request was started first
+
+    uint32_t end() { return LBN + (size+511)/512; }     // the block after the last one
+    };
+
+class Elevator
+    {
+    Request *queue[ELEVATOR_MAX];                       // requests waiting to start, in arrival order
+    unsigned nqueued = 0;
+    Request *active[ELEVATOR_MAX];                      // the first requests of the transfers in progress
+    unsigned nactive = 0;
+    uint32_t head[ELEVATOR_UNITS] = {};                 // for each unit, the block after the last one started
+    unsigned seq = 0;
+
+    bool conflicts(Request *a, Request *b);
+    bool eligible(unsigned i);
+    Request *remove(unsigned i);
+
+    public:
+
+    bool reorder = true;                                // when false, start requests in arrival order and don't merge
+
+    unsigned taken = 0;                                 // transfers started
+    unsigned merged = 0;                                // requests merged into another's transfer
+    unsigned aged = 0;                                  // requests started because they had waited too long
+    unsigned maxskips = 0;                              // the most times any request was passed over
+
+    void reset();
+    bool add(Request *r);
+    Request *take();
+    void done(Request *r);
+
+    inline operator bool() { return nqueued != 0; }     // true if any request is waiting
+    };
+
+#endif // ELEVATOR_HPP
@@ -2,6 +2,8 @@
 #define MSCP_H
 
 #include <stdint.h>
+#include "cmsis.h"
+#include "ff.h"
 
 typedef short word;
 typedef unsigned short uword;
@@ -98,7 +100,7 @@ struct longword
 
 struct unit_identifier
     {
-    long serno_lo;                      // will be 3141592654 (for now)
+    int32_t serno_lo;                   // will be 3141592654 (for now)
     word serno_hi;                      // will be 0
     byte model;                         // model will be UID_RA92 (29) (fake ID)
     byte dev_class;                     // dev class will be UID_DISK (2)
@@ -113,7 +115,7 @@ struct command
     byte        vcid;
 
     // MSCP header
-    long        cmdref;
+    int32_t     cmdref;
     word        unit;
     word                    : 16;
     byte        opcode;
@@ -129,21 +131,21 @@ struct command
             {
             word                    : 16;
             word        unit_flags;
-            long                    : 32;
-            long                    : 32;
-            long                    : 32;
-            long        device_dependent;
-            long                    : 32;
+            int32_t                 : 32;
+            int32_t                 : 32;
+            int32_t                 : 32;
+            int32_t     device_dependent;
+            int32_t                 : 32;
             };
 
         // read/write command parameters
         struct
             {
-            long        bytecount;
-            long        buffer_address;
-            long                : 32;
-            long                : 32;
-            long        LBN;
+            int32_t     bytecount;
+            int32_t     buffer_address;
+            int32_t             : 32;
+            int32_t             : 32;
+            int32_t     LBN;
             };
 
 
@@ -160,7 +162,7 @@ struct response
     byte        vcid;
 
     // MSCP header
-    long        cmdref;
+    int32_t     cmdref;
     word        unit;
     word        sequence;
     byte        endcode;
@@ -177,40 +179,145 @@ struct response
             word        multiunit_code;
             word        unit_flags;
             byte        spndles;
-            long                    : 24;
+            int32_t                 : 24;
 
             struct unit_identifier id;                  // (8 bytes)
-            long        media_type_identifier;
-            long                    : 32;
-            long        unit_size;               // size in LBNs
-            long        volume_serial_number;    // optional, often zero
+            int32_t     media_type_identifier;
+            int32_t                 : 32;
+            int32_t     unit_size;               // size in LBNs
+            int32_t     volume_serial_number;    // optional, often zero
             };
 
         // read response parameters
         struct
             {
-            long                    : 32;
-            long                    : 32;
-            long                    : 32;
-            long                    : 32;
+            int32_t     bytecount;          // bytes transferred
+            int32_t                 : 32;
+            int32_t                 : 32;
+            int32_t                 : 32;
 
-            long        first_bad_LBN;      // first bad block
+            int32_t     first_bad_LBN;      // first bad block
             };
         };
     };
 
 
 
+#define UQ_RING_MAX 128     // the largest FIFO the host can ask for, in longwords
+#define UQ_BATCH 16         // the most descriptors read or written in one burst
+
 struct FIFOctl
     {
     uint32_t addr;      // address in PDP-11 memory of the FIFO data area
     uint32_t flag;      // address in PDP-11 memory of the flag word
     uint16_t size;      // size, in longwords, of the FIFO
-    uint16_t index;     //
+    uint16_t index;     // byte offset of the next descriptor to use
+    uint16_t used;      // number of descriptors before index used, but not yet given back to the host
+    uint16_t ahead;     // number of descriptors from index on already read, and owned by the controller
+    uint32_t desc[UQ_RING_MAX]; // copy of the descriptors read
+    };
+
+
+#define MSCP_NBUF 4                                     // number of buffers in each read/write pipeline
+#define MSCP_CHUNK 4096                                 // bytes per buffer, so the SD card can move several blocks per command
+#define MSCP_WBBUF 8                                    // number of buffers for write-behind data
+#define MSCP_WORKERS 4                                  // number of threads executing commands concurrently
+#define MSCP_OMP_THREADS (2*MSCP_WORKERS)               // pool threads MSCP_poll needs: the workers, and a second stage for each one's pipeline
+#define MSCP_OMP_TASKS (MSCP_WORKERS+1 + 2*MSCP_WORKERS)  // tasks: the dispatcher and the workers, and each pipeline's two
+
+// The OpenMP budget (libgomp.hpp). Background's region takes 4 tasks, and 3 pool threads,
+// one of them the console thread that runs MSCP_poll. MSCP_poll's region then takes
+// MSCP_WORKERS threads and MSCP_WORKERS+1 tasks, and each worker's pipeline one thread and
+// two tasks. With 4 workers that is 3+8 = 11 threads, all of the pool, and 4+5+8 = 17
+// tasks. A pipeline that finds either pool empty runs serially instead.
+#define MSCP_MAXSEG 16                                  // the most commands that can be merged into one transfer
+#define MSCP_EXTENTS 10                                 // the most open files the raw backend can know about
+#define MSCP_CLMT 256                                   // DWORDs in a unit's cluster link map, enough for 127 fragments
+#define MSCP_UNITS 8                                    // the number of units, each with its own image file
+#define MSCP_DRIVES 2                                   // the number of SD cards searched for unit images
+
+struct CacheLine;
+class Elevator;
+
+// a buffer that is passed between the stages of the read/write pipeline
+// The data of a read may not be in the buffer's own data, but in lines of the
+// block cache, so each block of it is reached through part.
+struct BlockBuffer
+    {
+    uint32_t data[MSCP_CHUNK/4] __ALIGNED(32);          // the block data, cache line aligned so the SD card DMA can use it directly
+    uint32_t *part[MSCP_CHUNK/512];                     // for a read, where each block of the chunk is, in data or in the block cache
+    CacheLine *line[MSCP_CHUNK/512];                    // and the cache line, pinned until the chunk has gone over the Qbus, or null
+    unsigned off;                                       // offset of the data within the transfer
+    unsigned len;                                       // number of valid bytes in data
+    FIL *fil;                                           // for write-behind, the file the data is to be written to
+    FSIZE_t pos;                                        // and the position in that file
+    uint8_t trace;                                      // the trace tag of the command the buffer is working for, 0 for none
+    };
+
+// a piece of PDP-11 memory, one of the pieces a (possibly merged) transfer is made of
+struct Segment
+    {
+    uint32_t addr;                                      // PDP-11 address
+    unsigned size;                                      // bytes
+    };
+
+// the state of a unit
+struct MSCPunit
+    {
+    FIL fil;                                            // the unit's image file, UNIT<n>.img
+    DWORD clmt[MSCP_CLMT];                              // the image's cluster link map
+    bool online;
+    bool fastseek;                                      // the image has a cluster link map
+    bool raw;                                           // the image is contiguous, and uses the raw backend
+    BYTE drive;                                         // the SD card the image is on
+    uint32_t size;                                      // the size of the unit, in blocks
+
+    unsigned reads;                                     // statistics: read commands
+    unsigned writes;                                    // write commands
+    unsigned long rdblocks;                             // blocks read
+    unsigned long wrblocks;                             // blocks written
+    unsigned errors;                                    // transfers that failed
+    unsigned wb_failed;                                 // write-backs of its dirty cached blocks that failed in a row
+    bool write_failed;                                  // so many did that the next transfer ends with ST_DAT
+
+    uint32_t next_lbn;                                  // read-ahead: where the next read of a sequential stream would start
+    uint32_t ahead;                                     // the end of the blocks read ahead of it
+    unsigned run;                                       // sequential reads in a row
+    unsigned ra_depth;                                  // blocks to read ahead, adapted to how many were used
+    unsigned ra_trigger;                                // sequential reads before reading ahead, adapted the same way
+    unsigned ra_blocks;                                 // statistics: blocks read ahead
+    unsigned ra_used;                                   // of those, blocks the host read
     };
 
 
 extern void MSCP_poll();
+extern bool MSCP_pipeline;
+extern bool MSCP_write_behind;
+extern bool MSCP_raw;
+extern bool MSCP_elevator;
+extern bool MSCP_parallel_drives;
+extern bool MSCP_doorbell;
+extern bool MSCP_trace;
+extern bool MSCP_cache;
+extern bool MSCP_write_back;
+extern bool MSCP_readahead;
+extern unsigned MSCP_scans;
+extern MSCPunit units[MSCP_UNITS];
+extern unsigned MSCP_inflight;
+extern unsigned MSCP_max_inflight;
+
+extern unsigned ReadSerial(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved);
+extern unsigned ReadPipelined(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved);
+extern unsigned WriteSerial(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved);
+extern unsigned WritePipelined(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved);
+extern unsigned WriteBehind(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved);
+extern unsigned WriteBehindFlush(unsigned count = ~0u);
+extern unsigned WriteBehindPending();
+extern const Elevator &MSCP_scheduler();
+extern unsigned CacheFlush(unsigned count = ~0u, FIL *fil = nullptr);
+extern bool BuildLinkMap(FIL &fil, DWORD *tbl, unsigned len);
+extern bool AttachExtent(FIL &fil);
+extern void DetachExtent(FIL &fil);
 
 
 #endif // MSCP_H
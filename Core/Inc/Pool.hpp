@@ -0,0 +1,144 @@
+////////////////////////////////////////////////////////////////////////////////
+// Pool.hpp
+// Pools of fixed size objects for the I/O path: command contexts and block buffers.
+//
+// A Pool<T, N> holds N objects of type T, made once at startup, and hands them out
+// and takes them back in constant time. The free ones are a stack, linked by index
+// in an array beside the objects, so that an object's contents are left alone while
+// it is free. The top of the stack is changed with LDREX/STREX, so that threads and
+// interrupt handlers can take and give at once without disabling interrupts. An
+// interrupt between the LDREX and the STREX makes the STREX fail and the loop try
+// again, which also keeps a take from being fooled by the top object being taken
+// and given back in the meantime.
+//
+// The objects are where the Pool is. Declare it __DTCM for the zero wait state DTCM,
+// which the CPU and the MDMA can reach but the SD card DMA can't, or as an ordinary
+// static for the AXI SRAM (.bss in RAM_D1), which every DMA can reach. Anything an SD
+// card transfer goes to or from must be in the AXI SRAM.
+//
+// Each pool counts the objects in use, the most ever in use at once (its watermark),
+// and the times a caller found it empty and had to wait. A caller that waits takes
+// once with take(), which counts the miss, and then tries again with try_take(). The "mem" command shows them for every pool.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <stdint.h>
+#include "cmsis.h"
+
+#ifdef QBUS_SIM
+// the simulator has one CPU and no interrupts, and its threads only switch when they yield
+template<typename T> static inline T PoolLoad(T volatile &place) { return place; }
+template<typename T> static inline bool PoolStore(T value, T volatile &place) { place = value; return true; }
+static inline void PoolCancel() {}
+#else
+template<typename T> static inline T PoolLoad(T volatile &place) { return __LDREX(place); }
+template<typename T> static inline bool PoolStore(T value, T volatile &place) { return __STREX(value, place) == 0; }
+static inline void PoolCancel() { __CLREX(); }
+#endif
+
+
+// what "mem" shows of a pool, and the chain of all of them
+
+class PoolStats
+    {
+    protected:
+
+    void taken();
+    void given();
+    void missed();
+
+    public:
+
+    const char *name;
+    unsigned size;                                      // bytes in each object
+    unsigned count;                                     // objects in the pool
+    const void *base;                                   // where they are
+    unsigned volatile used;                             // objects taken now
+    unsigned volatile peak;                             // the most taken at once, the watermark
+    unsigned volatile empty;                            // waits for a free object, counted once each
+    PoolStats *next;                                    // the next pool made
+
+    static PoolStats *first;                            // the first pool made, constant initialized so it is there for the constructors
+
+    PoolStats(const char *name, unsigned size, unsigned count, const void *base);
+    void clear();                                       // start the watermark again from the objects in use now
+    };
+
+extern void PoolCommand(char *p);                       // "mem", the report of every pool
+
+
+template<typename T, unsigned N>
+class Pool : public PoolStats
+    {
+    static_assert(N > 0 && N < 65536, "a pool's links are 16 bits");
+
+    T items[N];
+    uint16_t below[N];                                  // for each free object, the index+1 of the one below it on the stack, 0 at the bottom
+    unsigned volatile top;                              // the index+1 of the free object on top, 0 if none is free
+
+    public:
+
+    Pool(const char *name) : PoolStats(name, sizeof(T), N, items)
+        {
+        reset();
+        }
+
+    // make every object free, only while none is in use
+    void reset()
+        {
+        for(unsigned i=0; i<N; i++)below[i] = i;
+        top = N;
+        used = 0;
+        }
+
+    // take a free object, returns null if there is none, and counts the miss
+    T *take()
+        {
+        T *item = try_take();
+
+        if(item == nullptr)missed();
+        return item;
+        }
+
+    // the same, but a miss isn't counted, for a caller trying again while it waits
+    T *try_take()
+        {
+        unsigned t;
+
+        do  {
+            t = PoolLoad(top);
+            if(t == 0)
+                {
+                PoolCancel();
+                return nullptr;
+                }
+            } while(!PoolStore((unsigned)below[t-1], top));
+
+        taken();
+        return &items[t-1];
+        }
+
+    // give back an object taken from this pool
+    void give(T *item)
+        {
+        unsigned i = item - items;
+        unsigned t;
+
+        do  {
+            t = PoolLoad(top);
+            below[i] = t;
+            } while(!PoolStore(i+1, top));
+
+        given();
+        }
+
+    // the index of an object in the pool, 0 to N-1
+    inline unsigned index(const T *item) const
+        {
+        return item - items;
+        }
+    };
+
+#endif // POOL_HPP
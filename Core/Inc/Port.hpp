@@ -6,7 +6,7 @@
 
 class Port
     {
-    Context *first;
+    Context *first = nullptr;                           // the chain of suspended threads, empty for a Port made on the stack
 
     public:
 
@@ -14,6 +14,7 @@ class Port
     void suspend_switch();
     bool resume(void * x = 0);
     void resume_switch();
+    bool await(volatile int &status);                   // sleep while an interrupt's <status> is 0, true if it ended above 0
 
     inline operator bool() { return first != nullptr; }
 
@@ -5,6 +5,9 @@
 
 
 // define addresses of registers in the FPGA
+#ifdef QBUS_SIM
+#include "QbusSim.hpp"                                          // the simulator's model of the FPGA, see sim/README.txt
+#else
 #define QBASE 0x60000000
 #define FADDR_ST        (*(uint16_t volatile *)(QBASE + 0))         // status register, see Q_Sts
 #define FADDR_SA        (*(uint16_t volatile *)(QBASE + 2))         // the SA register
@@ -13,6 +16,38 @@
 #define FADDR_HI        (*(uint16_t volatile *)(QBASE + 8))         // high word of Qbus address (6 bits only)
 #define FADDR_DATA_OUT  (*(uint16_t volatile *)(QBASE + 10))        // data to be written to Qbus
 #define FADDR_DATA_IN   (*(uint16_t volatile *)(QBASE + 12))        // read the current data on the Qbus
+#define FADDR_DMA_CNT   (*(uint16_t volatile *)(QBASE + 16))        // burst engine word count, 1 to QDMA_WORDS
+#define FADDR_DMA_TEN   (*(uint16_t volatile *)(QBASE + 18))        // burst engine words per bus tenure, 0 for the whole burst
+#define FADDR_DMA_CT    (*(uint16_t volatile *)(QBASE + 20))        // burst engine control and status, see below
+#define FADDR_DMA_HOLD  (*(uint16_t volatile *)(QBASE + 22))        // burst engine holdoff between tenures, in 100 ns clocks
+#define FADDR_IRQ_VEC   (*(uint16_t volatile *)(QBASE + 24))        // interrupt vector
+#define FADDR_IRQ_CT    (*(uint16_t volatile *)(QBASE + 26))        // interrupt control and status, see below
+#define FADDR_IRQ_HOLD  (*(uint16_t volatile *)(QBASE + 28))        // interrupt holdoff after each acknowledge, in 100 ns clocks
+#define FADDR_DMA_FIFO  (*(uint16_t volatile *)(QBASE + 30))        // burst engine data port, the next word of the window, see below
+#define FADDR_DMA_BUF   ((uint16_t volatile *)(QBASE + 128))        // burst engine data window, QDMA_WORDS words
+#endif
+
+#define QDMA_WORDS      64                                          // the most words in one burst
+#define QDMA_TENURE     8                                           // default words per bus tenure
+#define QDMA_START      0x0001                                      // FADDR_DMA_CT write: start a burst
+#define QDMA_DATO       0x0002                                      // FADDR_DMA_CT write: the burst writes to the PDP-11
+#define QDMA_BLOCK      0x0004                                      // FADDR_DMA_CT write: use block mode (DATBI/DATBO) where the memory allows it
+#define QDMA_DEMAND     0x0008                                      // FADDR_DMA_CT write: also end a tenure when another device wants the bus
+#define QDMA_BUSY       0x0001                                      // FADDR_DMA_CT read: a burst is running
+#define QDMA_NXM        0x0002                                      // FADDR_DMA_CT read: the last burst got no BRPLY and was abandoned
+#define QDMA_BLOCKED    0x0004                                      // FADDR_DMA_CT read: the memory took part of the last burst in block mode
+#define QDMA_GRANT      0x0008                                      // FADDR_DMA_CT read: state of BDMGI, another device wants the bus
+#define QDMA_FIFO       0x0010                                      // FADDR_DMA_CT read: the FPGA has the data port FADDR_DMA_FIFO
+
+// FADDR_DMA_FIFO writes the words of a DATO burst into the window one after another,
+// and reads the words of a DATI burst out of it, so that the MDMA can move a burst's
+// data to and from a single address. Writing FADDR_DMA_CNT puts it back at word 0.
+
+#define QIRQ_REQUEST    0x0001                                      // FADDR_IRQ_CT write: request an interrupt, merged with one still waiting
+#define QIRQ_LEVEL(n)   (((n)-4)<<1)                                // FADDR_IRQ_CT read/write: BR4, BR5 or BR6
+#define QIRQ_CANCEL     0x0008                                      // FADDR_IRQ_CT write: drop a request not yet acknowledged
+#define QIRQ_PENDING    0x0001                                      // FADDR_IRQ_CT read: requested but not yet acknowledged
+#define QIRQ_ASSERTED   0x0008                                      // FADDR_IRQ_CT read: the request is on the bus (not held off)
 
 union Q_Sts
     {
@@ -76,13 +111,36 @@ struct Q_Ctl
 
 
 
+extern bool Qbus_burst;
+extern bool Qbus_block;
+extern unsigned Qbus_tenure;
+extern unsigned Qbus_holdoff;
+extern bool Qbus_demand;
+extern unsigned Qbus_nxm;
+extern unsigned Qbus_bursts;
+extern unsigned Qbus_block_bursts;
+extern bool Qbus_mdma;
+extern unsigned Qbus_mdma_words;
+extern bool Qbus_irq;
+extern uint16_t vector;
+extern unsigned Qbus_irq_level;
+extern unsigned Qbus_irq_holdoff;
+extern unsigned Qbus_interrupts;
+extern unsigned Qbus_irq_merged;
+
 extern void QbusInit();
+extern void QbusPolicy();
 extern void QDMAbegin();
 extern void QDMAend();
 extern uint16_t Qread(uint32_t addr);
 extern void Qwrite(uint32_t addr, uint16_t data);
-extern void QReadBlock(uint32_t addr, uint16_t *buffer, int size);
-extern void QWriteBlock(uint32_t addr, uint16_t *buffer, int size);
+extern int QReadBlock(uint32_t addr, uint16_t *buffer, int size);
+extern int QWriteBlock(uint32_t addr, uint16_t *buffer, int size);
 extern void Qinterrupt();
+extern void QinterruptCancel();
+extern bool QinterruptAvailable();
+extern bool QMDMAInit();
+extern bool QMDMAWrite(const uint16_t *buffer, int size);
+extern bool QMDMARead(uint16_t *buffer, int size);
 
 #endif // QBUS_HPP
@@ -0,0 +1,60 @@
+////////////////////////////////////////////////////////////////////////////////
+// Trace.hpp
+// A trace of where each MSCP command's time goes.
+//
+// Each stage of a command records an event, stamped with the cycle counter, in a
+// ring buffer. Recording one takes a few instructions and no lock, so the trace
+// is left on. The "trace" command turns the ring into a histogram of how long
+// each stage took, over the commands still in it.
+//
+// Each event carries the tag of the command it belongs to, the number of its
+// MSCPcontext plus one. Tag 0 is for transfers that are not MSCP commands, such
+// as the benchmarks', and those are not recorded. A merged transfer's card and
+// Qbus events carry the tag of its first command.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <stdint.h>
+#include "cmsis.h"
+#include "cyccnt.hpp"
+
+#define TRACE_SIZE 2048                                 // events in the ring, a power of 2
+
+enum TraceEvent
+    {
+    TR_DESC,                                            // the command's descriptor was taken from the ring
+    TR_PACKET,                                          // its packet has been read from the host
+    TR_START,                                           // a worker has started it
+    TR_SD,                                              // an SD card command was issued
+    TR_SD_DONE,                                         // its data has all moved
+    TR_DMA,                                             // a chunk's Qbus DMA started
+    TR_DMA_DONE,                                        // and ended
+    TR_END,                                             // the end packet has been sent
+    TR_EVENTS
+    };
+
+struct TraceEntry
+    {
+    uint32_t time;                                      // xCYCCNT
+    uint8_t event;
+    uint8_t tag;
+    };
+
+extern TraceEntry trace_ring[TRACE_SIZE];
+extern uint32_t trace_count;                            // events ever recorded, the next one goes at trace_count % TRACE_SIZE
+extern bool MSCP_trace;                                 // when false, nothing is recorded
+
+static inline void Trace(TraceEvent event, unsigned tag)
+    {
+    if(tag == 0 || !MSCP_trace)return;
+
+    uint32_t i = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED) % TRACE_SIZE;
+
+    trace_ring[i].time = Now();
+    trace_ring[i].event = event;
+    trace_ring[i].tag = tag;
+    }
+
+#endif // TRACE_HPP
@@ -25,6 +25,8 @@ inline bool COMPILER_BARRIER()
 #define __OPTIMIZE(n) __attribute__((__optimize__(n)))
 #define __FLATTEN __attribute__((__flatten__))
 #define __NAKED __attribute__((__naked__))
+#define __DTCM __attribute__((__section__(".dtcm")))       // zero wait state RAM for data only the CPU uses, not cleared at startup
+#define __DMA_RAM __attribute__((__section__(".dma_ram")))  // D2 SRAM for buffers DMA1 and DMA2 move, since they can't reach the DTCM, not cleared at startup
 
 #ifndef __NOINLINE
 #define __NOINLINE __attribute__ ((noinline))
@@ -8,7 +8,12 @@
 #include "cmsis.h"
 
 #define xDWT_CONTROL (*(uint32_t volatile *)0xE0001000)
+#ifdef QBUS_SIM
+extern uint32_t volatile *QbusSimCyccnt();        // the simulator's cycle counter, which moves on each time it is read
+#define xCYCCNT (*QbusSimCyccnt())
+#else
 #define xCYCCNT (*(uint32_t volatile *)0xE0001004)
+#endif
 #define xDEMCR (*(uint32_t volatile *)0xE000EDFC)
 #define xLAR (*(uint32_t volatile *)0xE0001FB0)
 
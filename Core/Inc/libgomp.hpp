@@ -12,9 +12,9 @@
 
 #define GOMP_STACK_SIZE 3072
 
-#define GOMP_MAX_NUM_THREADS 8
+#define GOMP_MAX_NUM_THREADS 12                         // background and 11 in the pool, see MSCP_WORKERS for who uses them
 #define GOMP_NUM_TEAMS 4
-#define GOMP_NUM_TASKS 16
+#define GOMP_NUM_TASKS 20                               // one for each member of every team at once, see MSCP_WORKERS
 
 #define OMP_NUM_THREADS 4
 
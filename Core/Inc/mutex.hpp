@@ -27,6 +27,11 @@ class mutex
             }
         }
 
+    inline bool waiting()                               // true if another thread is waiting for the lock
+        {
+        return mwait;
+        }
+
     inline void unlock()
         {
         flag = false;
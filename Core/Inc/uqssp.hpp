@@ -1,12 +1,19 @@
 #ifndef UQSSP_H
 #define UQSSP_H
 
+#include <stddef.h>
 #include "MSCP.hpp"
 
 #define MAX_COMMANDS 16                 // the maximum number of packets that can be buffered by the controller
+#define UQ_CMD_USED (offsetof(command, LBN) + 4)    // bytes of a command packet, with its UQSSP header, that the controller looks at
 
 void Qinit();                           // initialize/synchronize MSCP communication between host and controller
-extern command *GetPacket();            // get a command packet sent by the host
+extern command *GetPacket(command &pkt, unsigned trace = 0); // get a command packet sent by the host
 void PutPacket(response *rsp);          // send a response packet to the host
 
+extern unsigned UQ_desc_reads;          // bursts reading descriptors from the host
+extern unsigned UQ_desc_writes;         // bursts giving descriptors back to the host
+extern unsigned UQ_commands;            // command packets received
+extern unsigned UQ_responses;           // response packets sent
+
 #endif // UQSSP_H
@@ -0,0 +1,158 @@
+// The block cache, see BlockCache.hpp
+
+#include <stdint.h>
+#include <string.h>
+#include "BlockCache.hpp"
+
+
+// empty the cache and clear the counters
+
+void BlockCache::reset()
+    {
+    memset(lines, 0, sizeof(lines));
+    memset(hand, 0, sizeof(hand));
+    now = 0;
+    hits = 0;
+    misses = 0;
+    fills = 0;
+    evictions = 0;
+    writebacks = 0;
+    bypassed = 0;
+    dirty = 0;
+    }
+
+
+// the set a block goes in
+// Consecutive blocks of a file go in consecutive sets, so a run of them is spread over the cache.
+
+unsigned BlockCache::setOf(const void *file, uint32_t block)
+    {
+    return (block + ((uintptr_t)file >> 4)) % BCACHE_SETS;
+    }
+
+void BlockCache::touch(CacheLine *l)
+    {
+    l->used = ++now;
+    l->ref = true;
+    }
+
+
+// find the line holding a block, and count it as used unless <use> is false
+// returns null if the block is not in the cache
+
+CacheLine *BlockCache::find(const void *file, uint32_t block, bool use)
+    {
+    CacheLine *set = lines[setOf(file, block)];
+
+    for(unsigned w=0; w<BCACHE_WAYS; w++)
+        {
+        if(set[w].file == file && set[w].block == block)
+            {
+            if(use)touch(&set[w]);
+            return &set[w];
+            }
+        }
+    return nullptr;
+    }
+
+
+// choose the line to put a block in, an empty one if there is one, else by LRU or CLOCK
+// A dirty line is only chosen if it is on <drive>, so that the caller can write it back, -1 for none.
+// A pinned line is never chosen.
+// returns null if every line in the set is dirty or pinned, and can't be chosen
+
+CacheLine *BlockCache::victim(const void *file, uint32_t block, int drive)
+    {
+    unsigned s = setOf(file, block);
+    CacheLine *set = lines[s];
+    CacheLine *best = nullptr;
+
+    for(unsigned w=0; w<BCACHE_WAYS; w++)
+        {
+        if(set[w].file == nullptr && set[w].pins == 0)return &set[w];
+        }
+
+    if(clock)                                           // the hand goes round, giving each used line a second chance
+        {
+        for(unsigned n=0; n<2*BCACHE_WAYS; n++)
+            {
+            CacheLine *l = &set[hand[s]];
+
+            hand[s] = (hand[s] + 1) % BCACHE_WAYS;
+            if(l->pins || (l->dirty && l->drive != drive))continue;
+            if(!l->ref)return l;
+            l->ref = false;
+            }
+        return nullptr;
+        }
+
+    for(unsigned w=0; w<BCACHE_WAYS; w++)               // the least recently used
+        {
+        CacheLine *l = &set[w];
+
+        if(l->pins || (l->dirty && l->drive != drive))continue;
+        if(best == nullptr || (int32_t)(l->used - best->used) < 0)best = l;
+        }
+    return best;
+    }
+
+
+// the line now holds a block, clean
+
+void BlockCache::fill(CacheLine *l, const void *file, uint32_t block, unsigned drive)
+    {
+    if(l->file)++evictions;
+    ++fills;
+    setDirty(l, false);
+    l->file = file;
+    l->block = block;
+    l->drive = drive;
+    touch(l);
+    }
+
+
+void BlockCache::setDirty(CacheLine *l, bool d)
+    {
+    if(d && !l->dirty)++dirty;
+    if(!d && l->dirty)--dirty;
+    l->dirty = d;
+    }
+
+void BlockCache::drop(CacheLine *l)
+    {
+    setDirty(l, false);
+    l->file = nullptr;
+    }
+
+
+// drop all the lines of a file, which is about to be closed
+// Dirty lines should have been written back first, or their data is lost.
+
+void BlockCache::invalidate(const void *file)
+    {
+    for(auto &set : lines)
+        {
+        for(auto &l : set)
+            {
+            if(l.file == file)drop(&l);
+            }
+        }
+    }
+
+
+// find a dirty line, of <file> if it isn't null
+// returns null if there is none
+
+CacheLine *BlockCache::dirtyLine(const void *file)
+    {
+    if(dirty == 0)return nullptr;
+
+    for(auto &set : lines)
+        {
+        for(auto &l : set)
+            {
+            if(l.file && l.dirty && (file == nullptr || l.file == file))return &l;
+            }
+        }
+    return nullptr;
+    }
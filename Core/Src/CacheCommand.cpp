@@ -0,0 +1,52 @@
+// Show and set how the MSCP block cache is used, and its statistics.
+// "cache [c] [on|off] [wt|wb] [lru|clock] [ra|nora]"
+
+#include <stdio.h>
+#include "local.h"
+#include "ff.h"
+#include "MSCP.hpp"
+#include "BlockCache.hpp"
+
+extern BlockCache block_cache;                          // in MSCP.cpp
+extern unsigned cache_errors;
+
+void CacheCommand(char *p)
+    {
+    bool clear = false;
+
+    for(; *p; skip(&p))
+        {
+        if(p[0]=='c' && p[1]=='l')block_cache.clock = true;
+        else if(p[0]=='c')clear = true;
+        else if(p[0]=='l')block_cache.clock = false;
+        else if(p[0]=='o' && p[1]=='n')MSCP_cache = true;
+        else if(p[0]=='w' && p[1]=='b')MSCP_write_back = true;
+        else if(p[0]=='r')MSCP_readahead = true;
+        else if(p[0]=='n')MSCP_readahead = false;
+        else if(p[0]=='o' || (p[0]=='w' && p[1]=='t'))
+            {
+            CacheFlush();                               // nothing may be left only in the cache
+            if(p[0]=='o')MSCP_cache = false;
+            else MSCP_write_back = false;
+            }
+        }
+
+    unsigned looked = block_cache.hits + block_cache.misses;
+
+    printf("cache %s, %s, %s, %u blocks, %s\n", MSCP_cache ? "on" : "off", MSCP_write_back ? "write-back" : "write-through",
+        block_cache.clock ? "CLOCK" : "LRU", BCACHE_SETS*BCACHE_WAYS, MSCP_readahead ? "read-ahead" : "no read-ahead");
+    printf("hits %u, misses %u, hit rate %.1f%%\n", block_cache.hits, block_cache.misses, looked ? 100.0f*block_cache.hits/looked : 0.0f);
+    printf("fills %u, evictions %u, write-backs %u, bypassed %u, dirty %u, lost %u\n", block_cache.fills, block_cache.evictions,
+        block_cache.writebacks, block_cache.bypassed, block_cache.dirty, cache_errors);
+
+    if(clear)
+        {
+        block_cache.hits = 0;
+        block_cache.misses = 0;
+        block_cache.fills = 0;
+        block_cache.evictions = 0;
+        block_cache.writebacks = 0;
+        block_cache.bypassed = 0;
+        cache_errors = 0;
+        }
+    }
@@ -0,0 +1,188 @@
+// The MSCP request scheduler, see Elevator.hpp
+
+#include <stdint.h>
+#include "Elevator.hpp"
+
+
+// clear the queue, the head positions, and the counters
+
+void Elevator::reset()
+    {
+    nqueued = 0;
+    nactive = 0;
+    for(auto &h : head)h = 0;
+    seq = 0;
+    taken = 0;
+    merged = 0;
+    aged = 0;
+    maxskips = 0;
+    }
+
+
+// two requests conflict if they cannot run in either order,
+// that is, if they are on the same unit and overlap, and either writes,
+// or either is not a transfer at all
+
+bool Elevator::conflicts(Request *a, Request *b)
+    {
+    if(a->unit != b->unit)return false;
+    if(a->kind == REQ_OTHER || b->kind == REQ_OTHER)return true;
+    if(a->kind == REQ_READ && b->kind == REQ_READ)return false;
+    return a->LBN < b->end() && b->LBN < a->end();
+    }
+
+
+// a queued request may start if it conflicts with no earlier queued request
+// and with no request that is still in progress
+
+bool Elevator::eligible(unsigned i)
+    {
+    Request *r = queue[i];
+
+    for(unsigned j=0; j<i; j++)
+        {
+        if(conflicts(queue[j], r))return false;
+        }
+
+    for(unsigned j=0; j<nactive; j++)
+        {
+        for(Request *a = active[j]; a; a = a->next)
+            {
+            if(conflicts(a, r))return false;
+            }
+        }
+
+    return true;
+    }
+
+
+// remove a request from the queue, keeping the rest in arrival order
+
+Request *Elevator::remove(unsigned i)
+    {
+    Request *r = queue[i];
+
+    for(unsigned j=i+1; j<nqueued; j++)queue[j-1] = queue[j];
+    --nqueued;
+
+    return r;
+    }
+
+
+// queue a request
+// returns false if the queue is full
+
+bool Elevator::add(Request *r)
+    {
+    if(nqueued + nactive >= ELEVATOR_MAX)return false;
+
+    r->next = nullptr;
+    r->seq = seq++;
+    r->skips = 0;
+    queue[nqueued++] = r;
+
+    return true;
+    }
+
+
+// choose the next transfer to start
+// returns the first request of the transfer, with any merged requests linked to it through next,
+// or nullptr if no queued request can start now
+
+Request *Elevator::take()
+    {
+    int pick = -1;
+
+    for(unsigned i=0; i<nqueued && pick<0; i++)         // a request that has waited too long goes first
+        {
+        if(queue[i]->skips >= ELEVATOR_MAX_SKIPS && eligible(i))
+            {
+            pick = i;
+            ++aged;
+            }
+        }
+
+    if(pick<0 && !reorder)                              // without reordering, only the oldest request can start
+        {
+        if(nqueued > 0 && eligible(0))pick = 0;
+        }
+
+    for(unsigned i=0; i<nqueued && pick<0; i++)         // then anything that is not a transfer, oldest first
+        {
+        if(queue[i]->kind == REQ_OTHER && eligible(i))pick = i;
+        }
+
+    if(pick < 0)                                        // then the transfer nearest ahead of its unit's head, wrapping around to the lowest LBN
+        {
+        uint32_t best = ~0u;
+
+        for(unsigned i=0; i<nqueued; i++)
+            {
+            uint32_t distance = queue[i]->LBN - head[queue[i]->unit % ELEVATOR_UNITS];
+
+            if(distance < best && eligible(i))
+                {
+                best = distance;
+                pick = i;
+                }
+            }
+        }
+
+    if(pick < 0)return nullptr;
+
+    for(int i=0; i<pick; i++)                           // every earlier request has now been passed over
+        {
+        if(++queue[i]->skips > maxskips)maxskips = queue[i]->skips;
+        }
+
+    Request *r = remove(pick);
+    Request *tail = r;
+    unsigned total = r->size;
+
+    while(reorder && r->kind != REQ_OTHER && tail->size%512 == 0)   // merge requests that continue where this one ends
+        {
+        unsigned i;
+
+        for(i=0; i<nqueued; i++)
+            {
+            Request *q = queue[i];
+
+            if(q->unit == r->unit
+            && q->kind == r->kind
+            && q->LBN == tail->end()
+            && total + q->size <= ELEVATOR_MAX_MERGE
+            && eligible(i))
+                {
+                break;
+                }
+            }
+
+        if(i == nqueued)break;                          // nothing more to merge
+
+        tail->next = remove(i);
+        tail = tail->next;
+        total += tail->size;
+        ++merged;
+        }
+
+    head[r->unit % ELEVATOR_UNITS] = tail->end();
+    active[nactive++] = r;
+    ++taken;
+
+    return r;
+    }
+
+
+// a transfer started by take has finished
+
+void Elevator::done(Request *r)
+    {
+    for(unsigned i=0; i<nactive; i++)
+        {
+        if(active[i] == r)
+            {
+            active[i] = active[--nactive];
+            return;
+            }
+        }
+    }
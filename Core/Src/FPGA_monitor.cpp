@@ -9,6 +9,7 @@
 extern int getline_nchar;       // When this is nonzero, the user has started typing a line on the console. It is impolite to interrupt that line.
 
 Port FPGA_Port;
+volatile bool *FPGA_doorbell = nullptr;         // when set, FPGA interrupts set this flag rather than being reported on the console
 
 
 void Clear_FPGA_IRQ()
@@ -21,7 +22,8 @@ void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
     if (GPIO_Pin == FPGA_IRQ_Pin)
         {
         Clear_FPGA_IRQ();
-        FPGA_Port.resume();
+        if(FPGA_doorbell)*FPGA_doorbell = true;
+        else FPGA_Port.resume();
         }
     }
 
@@ -10,212 +10,1608 @@
 #include "MSCP.hpp"
 #include "serial.h"
 #include "ContextFIFO.hpp"
+#include "FIFO.hpp"
+#include "Pool.hpp"
+#include "Port.hpp"
+#include "mutex.hpp"
+#include "omp.h"
+#include "libgomp.hpp"
+#include "Elevator.hpp"
+#include "Trace.hpp"
+#include "BlockCache.hpp"
 #include "ff.h"
+#include "diskio.h"
 
 
 
-extern response rsp;
-extern FIL fil;
-extern uint32_t qbuf[512/4];
+bool MSCP_pipeline = true;                              // when true, overlap SD card transfers with Qbus DMA
+bool MSCP_write_behind = false;                         // when true, end a write once its data is in controller RAM
 
+bool MSCP_parallel_drives = true;                       // when true, each drive has its own lock, so transfers on both SD cards can overlap
 
-// get get packets from host, process them, and send replies
+static mutex disk_locks[_VOLUMES];                      // held while a thread positions and transfers a file on a drive, since FatFs is not reentrant
 
-void MSCP_poll()
+static Pool<BlockBuffer, MSCP_WBBUF> wbbufs("write-behind buffers");  // buffers holding write-behind data, in AXI SRAM for the SD card DMA
+static FIFO<BlockBuffer *, MSCP_WBBUF> wb_queue;        // write-behind buffers waiting to be written to the card, oldest first
+static mutex wb_lock;                                   // keeps concurrent flushes from writing the queue out of order
+unsigned wb_errors = 0;                                 // number of write-behind chunks that could not be written
+
+
+// An in-flight command. The command packet is read from the host directly into
+// one of these, and it stays here, along with its response, until the end packet
+// has been sent. The scheduler below is used by several threads, which is safe
+// because threads only switch when they suspend or resume. The pool is safe anyway.
+
+struct MSCPcontext : Request                            // the scheduler's view of the command, filled in from the packet
+    {
+    command cmd;
+    response rsp;
+    };
+
+static Pool<MSCPcontext, MAX_COMMANDS> contexts __DTCM ("command contexts");   // packets are parsed and built in place, never by the SD card DMA
+static_assert(MAX_COMMANDS < 256, "a context's trace tag must fit in a byte");
+static Elevator elevator;                               // commands received from the host, waiting for a worker
+bool MSCP_elevator = true;                              // when true, the scheduler reorders and merges queued commands, else starts them in arrival order
+static_assert(MAX_COMMANDS <= ELEVATOR_MAX, "the scheduler must be able to hold every outstanding command");
+static Port workPort;                                   // where idle workers wait for a command
+static bool stopping = false;                           // tells the workers to exit
+
+static BlockBuffer workerbufs[MSCP_WORKERS][MSCP_NBUF]; // each worker's pipeline buffers
+static_assert(GOMP_MAX_NUM_THREADS-1 >= 3 + MSCP_OMP_THREADS, "the thread pool must hold background's region and MSCP_poll's, see MSCP_WORKERS");
+static_assert(GOMP_NUM_TASKS >= 4 + MSCP_OMP_TASKS, "the task pool must hold background's region and MSCP_poll's, see MSCP_WORKERS");
+
+MSCPunit units[MSCP_UNITS];                             // the state of each unit
+
+unsigned MSCP_inflight = 0;                             // number of commands received but not yet ended
+unsigned MSCP_max_inflight = 0;                         // high water mark of the above
+bool MSCP_doorbell = true;                              // when true, read the command ring only after the host polls (reads IP) or a command ends
+static volatile bool doorbell = false;                  // set by the FPGA interrupt when the host reads IP, and by the workers when a command ends
+unsigned MSCP_scans = 0;                                // number of times the command ring was read until empty
+
+bool MSCP_trace = true;                                 // when true, record where each command's time goes, see Trace.hpp
+TraceEntry trace_ring[TRACE_SIZE] __DTCM;               // not cleared at startup, only the last trace_count entries are looked at
+uint32_t trace_count = 0;
+
+
+// Raw backend
+//
+// A unit image that occupies one contiguous run of clusters can be read and written
+// with disk_read/disk_write at a computed sector number, with no FAT lookups and no
+// copying through FatFs's sector buffer. At online time the image's cluster chain is
+// walked once, and if it is contiguous its extent is recorded here. Transfers that are
+// not whole sectors, or that go past the end of the extent, still go through FatFs.
+
+struct Extent
+    {
+    FIL *fil;                                           // the open image file, or null if this entry is unused
+    BYTE drv;                                           // the physical drive the file is on
+    DWORD lba;                                          // the sector number of the start of the file
+    DWORD count;                                        // the number of sectors in the file
+    };
+
+bool MSCP_raw = true;                                   // when true, use the raw backend for contiguous unit images
+static Extent extents[MSCP_EXTENTS];
+
+
+// find the extent of an open file, if it has one
+
+static Extent *ExtentOf(FIL &fil)
+    {
+    for(auto &ext : extents)
+        {
+        if(ext.fil == &fil)return &ext;
+        }
+    return nullptr;
+    }
+
+
+// Build a cluster link map for an open file in <tbl>, which is <len> DWORDs long, and attach
+// it to the file, so that f_lseek finds a position by scanning the file's fragments rather than
+// following its FAT chain from the start. The map needs two DWORDs per fragment, plus two.
+// Returns false, leaving the file without a map, if the table is too small.
+
+bool BuildLinkMap(FIL &fil, DWORD *tbl, unsigned len)
+    {
+    tbl[0] = len;
+    fil.cltbl = tbl;
+    if(f_lseek(&fil, CREATE_LINKMAP) != FR_OK)
+        {
+        fil.cltbl = nullptr;
+        return false;
+        }
+    return true;
+    }
+
+
+// Check whether an open file is contiguous on the card, and if it is, record
+// its location so that the raw backend can be used for it.
+// If the file has a cluster link map, that is used, else the FAT chain is walked.
+// Returns true if the file is contiguous.
+
+bool AttachExtent(FIL &fil)
+    {
+    DWORD local[4];                                     // room for a cluster link map of exactly one fragment
+    DWORD *tbl = fil.cltbl;
+    FATFS *fs = fil.obj.fs;
+
+    DetachExtent(fil);
+
+    if(tbl == nullptr)
+        {
+        local[0] = NUM_ELEMENTS(local);
+        fil.cltbl = local;
+        FRESULT res = f_lseek(&fil, CREATE_LINKMAP);    // fails with FR_NOT_ENOUGH_CORE if there is more than one fragment
+        fil.cltbl = nullptr;
+        if(res != FR_OK)return false;
+        tbl = local;
+        }
+
+    DWORD count = (f_size(&fil) + 511) / 512;
+
+    if(tbl[0] != 4 || tbl[1]*fs->csize < count)         // more than one fragment, or empty
+        {
+        return false;
+        }
+
+    for(auto &ext : extents)
+        {
+        if(ext.fil == nullptr)
+            {
+            ext.fil = &fil;
+            ext.drv = fs->drv;
+            ext.lba = fs->database + (tbl[2]-2) * fs->csize;
+            ext.count = count;
+            return true;
+            }
+        }
+
+    return false;                                       // no room to record it
+    }
+
+
+// forget the extent of a file that is about to be closed or reopened
+
+void DetachExtent(FIL &fil)
+    {
+    Extent *ext = ExtentOf(fil);
+
+    if(ext)ext->fil = nullptr;
+    }
+
+
+// Find the extent to use for a raw transfer, or return null if the transfer must go through FatFs.
+
+static Extent *RawExtent(FIL &fil, FSIZE_t pos, unsigned len)
+    {
+    if(!MSCP_raw)return nullptr;
+
+    Extent *ext = ExtentOf(fil);
+
+    if(ext == nullptr
+    || pos%512 != 0
+    || len%512 != 0
+    || pos/512 + len/512 > ext->count)
+        {
+        return nullptr;
+        }
+
+    f_sync(&fil);                                       // make sure FatFs has no unwritten data for the file (a no-op if nothing has changed)
+    return ext;
+    }
+
+
+// Find the lock for the drive a file is on.
+// FatFs keeps the state of each volume separately, and each SD card has its own SPI bus and DMA streams,
+// so only threads using the same drive need to take turns. Without MSCP_parallel_drives they all do.
+// Take the lock through the reference returned, so that changing MSCP_parallel_drives can't unbalance it.
+
+static mutex &DiskLock(FIL &fil)
+    {
+    BYTE drv = fil.obj.fs->drv;
+
+    return disk_locks[MSCP_parallel_drives && drv < _VOLUMES ? drv : 0];
+    }
+
+
+// Lock every drive, in order, for operations that use FatFs state shared by all volumes,
+// such as the long file name buffer used by f_open.
+
+static void LockAllDrives()
+    {
+    for(auto &lock : disk_locks)lock.lock();
+    }
+
+static void UnlockAllDrives()
+    {
+    for(auto &lock : disk_locks)lock.unlock();
+    }
+
+
+// Read part of a file at an explicit position, with the disk lock of its drive held.
+// The disk lock keeps a command running in another thread from moving the file pointer in between.
+// Returns true if all <len> bytes were read.
+
+static bool ReadDisk(FIL &fil, FSIZE_t pos, void *buf, unsigned len)
+    {
+    FRESULT res = FR_OK;
+    UINT br = 0;                                        // bytes read
+
+    if(Extent *ext = RawExtent(fil, pos, len))
+        {
+        if(disk_read(ext->drv, (BYTE *)buf, ext->lba + pos/512, len/512) != RES_OK)
+            {
+            printf("raw read failed at sector %lu, count %u\n", ext->lba + (DWORD)(pos/512), len/512);
+            return false;
+            }
+        return true;
+        }
+
+    if(f_tell(&fil) != pos)                             // skip the seek if this block follows the last one
+        {
+        res = f_lseek(&fil, pos);
+        }
+    if(res == FR_OK)
+        {
+        res = f_read(&fil, buf, len, &br);
+        }
+
+    if(res != FR_OK || br != len)
+        {
+        printf("read failed at position %lu, bytes read %d, status %d\n", (unsigned long)pos, br, res);
+        return false;
+        }
+    return true;
+    }
+
+// Write part of a file at an explicit position, with the disk lock of its drive held.
+// Returns true if all <len> bytes were written.
+
+static bool WriteDisk(FIL &fil, FSIZE_t pos, const void *buf, unsigned len)
+    {
+    FRESULT res = FR_OK;
+    UINT bw = 0;                                        // bytes written
+
+    if(Extent *ext = RawExtent(fil, pos, len))
+        {
+        DWORD sect = ext->lba + pos/512;
+
+        if(fil.sect >= sect && fil.sect < sect + len/512)   // if FatFs has a copy of one of these sectors in its buffer
+            {
+            fil.sect = 0;                               // make it read the sector again
+            }
+
+        if(disk_write(ext->drv, (const BYTE *)buf, sect, len/512) != RES_OK)
+            {
+            printf("raw write failed at sector %lu, count %u\n", sect, len/512);
+            return false;
+            }
+        return true;
+        }
+
+    if(f_tell(&fil) != pos)
+        {
+        res = f_lseek(&fil, pos);
+        }
+    if(res == FR_OK)
+        {
+        res = f_write(&fil, buf, len, &bw);
+        }
+
+    if(res != FR_OK || bw != len)
+        {
+        printf("write failed at position %lu, bytes written %d, status %d\n", (unsigned long)pos, bw, res);
+        return false;
+        }
+    return true;
+    }
+
+
+// Block cache
+//
+// The blocks of the unit images are kept in a BlockCache (see BlockCache.hpp), which is
+// only used with the lock of the drive the image is on held. A read that finds all its
+// blocks there doesn't use the card. Any other read goes to the card, and its blocks are
+// put in the cache, except that a dirty block already there is newer than the card, and
+// is copied over what was read instead.
+// Write-through, a write goes to the card, and updates any of its blocks in the cache.
+// Write-back, a write only goes to the cache, and its blocks are written to the card when
+// their lines are reused, when the dispatcher is idle, and before the unit goes offline.
+// A block that can't have a line, because its set is full of another drive's dirty
+// blocks, is written through. Transfers that are not whole blocks bypass the cache.
+// A dirty block whose write-back fails stays dirty, so that it is tried again and its
+// line isn't reused. After WB_RETRIES failures in a row the unit's next transfer ends
+// with ST_DAT, and a block still dirty when the unit goes offline is lost.
+
+bool MSCP_cache = true;                                 // when true, cache unit image blocks in controller RAM
+bool MSCP_write_back = false;                           // when true, writes only go to the cache, and reach the card later
+BlockCache block_cache;
+unsigned cache_errors = 0;                              // dirty blocks that could not be written back, and were lost
+
+#define CACHE_RUN (MSCP_CHUNK/512)                      // the most blocks in a transfer the cache takes
+#define WB_RETRIES 3                                    // write-backs of a unit that fail in a row before the host is told
+
+static MSCPunit *UnitOf(FIL &fil)
+    {
+    for(auto &u : units)
+        {
+        if(&u.fil == &fil)return &u;
+        }
+    return nullptr;                                     // the benchmarks' files are not cached, they are opened on the stack
+    }
+
+static bool UnitFile(FIL &fil)
+    {
+    return UnitOf(fil) != nullptr;
+    }
+
+static bool Cacheable(FIL &fil, FSIZE_t pos, unsigned len)
+    {
+    return MSCP_cache && pos%512 == 0 && len%512 == 0 && len/512 <= CACHE_RUN && UnitFile(fil);
+    }
+
+
+// write a dirty line to the card, with the disk lock of its drive held
+// The dirty blocks that follow it in the file, up to a chunk, go in the same card command.
+// Returns false, leaving them all dirty, if the card write fails.
+
+static bool WriteBack(CacheLine *l)
+    {
+    static uint32_t run[MSCP_DRIVES][CACHE_RUN][512/4]; // for each drive, since the card command may let another drive's thread run
+    FIL &fil = *(FIL *)l->file;
+    CacheLine *lines[CACHE_RUN];
+    unsigned n = 0;
+
+    lines[n++] = l;
+    while(n < CACHE_RUN && (l = block_cache.find(&fil, lines[0]->block + n, false)) != nullptr && l->dirty)
+        {
+        lines[n++] = l;
+        }
+
+    uint32_t (*buf)[512/4] = run[lines[0]->drive];
+    MSCPunit *u = UnitOf(fil);
+
+    for(unsigned i=0; i<n; i++)
+        {
+        memcpy(buf[i], block_cache.dataOf(lines[i]), 512);
+        }
+    if(!WriteDisk(fil, (FSIZE_t)lines[0]->block*512, buf, n*512))
+        {
+        if(u && ++u->wb_failed >= WB_RETRIES)u->write_failed = true;
+        return false;
+        }
+    if(u)u->wb_failed = 0;
+    for(unsigned i=0; i<n; i++)
+        {
+        block_cache.setDirty(lines[i], false);
+        }
+    block_cache.writebacks += n;
+    return true;
+    }
+
+
+// a line to put a block in, writing back the dirty block that was in it if need be
+// returns null if there is none, or the write-back failed
+
+static CacheLine *LineFor(FIL &fil, uint32_t block)
+    {
+    CacheLine *l = block_cache.victim(&fil, block, fil.obj.fs->drv);
+
+    if(l == nullptr)
+        {
+        ++block_cache.bypassed;
+        return nullptr;
+        }
+    if(l->dirty && !WriteBack(l))
+        {
+        ++block_cache.bypassed;
+        return nullptr;
+        }
+    block_cache.fill(l, &fil, block, fil.obj.fs->drv);
+    return l;
+    }
+
+
+// the chunk's blocks are in the buffer's own data
+// returns the parts, for QTransfer
+
+static uint32_t *const *OwnParts(BlockBuffer &buf)
+    {
+    for(unsigned i=0; i<MSCP_CHUNK/512; i++)
+        {
+        buf.part[i] = buf.data + i*512/4;
+        buf.line[i] = nullptr;
+        }
+    return buf.part;
+    }
+
+// the chunk has gone over the Qbus, its cache lines can be reused
+
+static void Unpin(BlockBuffer &buf)
+    {
+    for(auto &l : buf.line)
+        {
+        if(l)block_cache.unpin(l);
+        l = nullptr;
+        }
+    }
+
+// point a read's buffer at the cache lines its blocks are in, if they are all there
+// returns false, having changed nothing, if any is missing
+
+static bool CacheRefer(FIL &fil, FSIZE_t pos, BlockBuffer &buf)
+    {
+    CacheLine *lines[CACHE_RUN];
+    unsigned n = buf.len/512;
+
+    for(unsigned i=0; i<n; i++)
+        {
+        if((lines[i] = block_cache.find(&fil, pos/512 + i)) == nullptr)return false;
+        }
+    for(unsigned i=0; i<n; i++)
+        {
+        block_cache.pin(lines[i]);
+        buf.part[i] = block_cache.dataOf(lines[i]);
+        buf.line[i] = lines[i];
+        }
+    block_cache.hits += n;
+    return true;
+    }
+
+// point a read's buffer at lines for all its blocks, for the card to read them into
+// Returns false, having changed nothing, if a block is dirty, or has no line to go in.
+
+static bool CacheClaim(FIL &fil, FSIZE_t pos, BlockBuffer &buf)
+    {
+    unsigned n = buf.len/512;
+    bool fresh[CACHE_RUN];                              // the line is new, and holds nothing yet
+    unsigned i;
+
+    for(i=0; i<n; i++)
+        {
+        uint32_t block = pos/512 + i;
+        CacheLine *l = block_cache.find(&fil, block);
+
+        if(l && l->dirty)break;                         // the card is older than it
+        if((fresh[i] = l == nullptr) && (l = LineFor(fil, block)) == nullptr)break;
+
+        block_cache.pin(l);                             // so that the next block can't take its line
+        buf.part[i] = block_cache.dataOf(l);
+        buf.line[i] = l;
+        }
+    if(i == n)return true;
+
+    while(i--)
+        {
+        if(fresh[i])block_cache.drop(buf.line[i]);
+        }
+    Unpin(buf);
+    OwnParts(buf);
+    return false;
+    }
+
+// after a read from the card, put its blocks in the cache, or take the dirty ones from it
+
+static void CacheFill(FIL &fil, FSIZE_t pos, void *buf, unsigned len)
+    {
+    for(unsigned i=0; i<len/512; i++)
+        {
+        uint32_t block = pos/512 + i;
+        char *data = (char *)buf + i*512;
+        CacheLine *l = block_cache.find(&fil, block);
+
+        if(l && l->dirty)memcpy(data, block_cache.dataOf(l), 512);
+        else if(l == nullptr && (l = LineFor(fil, block)) != nullptr)memcpy(block_cache.dataOf(l), data, 512);
+        }
+    }
+
+// a write-back write, each block into the cache, or to the card if it can't have a line
+// returns true if all the blocks were taken
+
+static bool CacheWrite(FIL &fil, FSIZE_t pos, const void *buf, unsigned len, unsigned trace)
+    {
+    bool ok = true;
+
+    for(unsigned i=0; i<len/512; i++)
+        {
+        uint32_t block = pos/512 + i;
+        const char *data = (const char *)buf + i*512;
+        CacheLine *l = block_cache.find(&fil, block);
+
+        if(l == nullptr)l = LineFor(fil, block);
+        if(l)
+            {
+            memcpy(block_cache.dataOf(l), data, 512);
+            block_cache.setDirty(l, true);
+            continue;
+            }
+
+        Trace(TR_SD, trace);
+        if(!WriteDisk(fil, (FSIZE_t)block*512, data, 512))ok = false;
+        Trace(TR_SD_DONE, trace);
+        }
+    return ok;
+    }
+
+// after a write to the card, update its blocks in the cache, which are now clean
+// if <keep> is false they are dropped instead, since the write was not cached
+
+static void CacheUpdate(FIL &fil, FSIZE_t pos, const void *buf, unsigned len, bool keep)
+    {
+    for(unsigned i=0; i<len/512; i++)
+        {
+        CacheLine *l = block_cache.find(&fil, pos/512 + i);
+
+        if(l == nullptr)continue;
+        if(!keep)
+            {
+            block_cache.drop(l);
+            continue;
+            }
+        memcpy(block_cache.dataOf(l), (const char *)buf + i*512, 512);
+        block_cache.setDirty(l, false);
+        }
+    }
+
+// before a read or write that bypasses the cache, write back the dirty blocks it covers
+// returns false if any of them is still dirty, and the card is older than it
+
+static bool CacheWriteBackRange(FIL &fil, FSIZE_t pos, unsigned len)
+    {
+    for(uint32_t block = pos/512; block < (pos + len + 511)/512; block++)
+        {
+        CacheLine *l = block_cache.find(&fil, block);
+
+        if(l && l->dirty && !WriteBack(l))return false;
+        }
+    return true;
+    }
+
+
+// Write back up to <count> dirty blocks, of <fil> if it is not null, else of each unit.
+// Stops at the first of a file that fails, which stays dirty for the next time. A unit
+// whose write-backs have kept failing is left alone until the host has been told.
+// Returns the number of blocks tried.
+
+unsigned CacheFlush(unsigned count, FIL *fil)
+    {
+    unsigned n = 0;
+    CacheLine *l;
+
+    if(fil == nullptr)
+        {
+        for(auto &u : units)
+            {
+            if(n < count && u.online && !u.write_failed)n += CacheFlush(count - n, &u.fil);
+            }
+        return n;
+        }
+
+    while(n < count && (l = block_cache.dirtyLine(fil)) != nullptr)
+        {
+        FIL *f = (FIL *)l->file;
+        mutex &disk_lock = DiskLock(*f);
+
+        disk_lock.lock();
+        bool ok = !l->dirty || l->file != f || WriteBack(l);    // unless another thread got to it while this one waited for the lock
+        disk_lock.unlock();
+        ++n;
+        if(!ok)break;
+        }
+
+    return n;
+    }
+
+
+// Read a chunk of a file at an explicit position into a buffer, through the cache if it is
+// a unit image. <buf>'s len says how much, and its trace tag is the command's.
+// A read that is all in the cache is not copied: the buffer's parts point at the lines.
+// A read of a contiguous image that is not goes from the card straight into lines, which
+// it then points at. Any other read goes into the buffer's own data.
+// Returns true if all the bytes were read.
+
+extern "C" DRESULT SD_disk_readv(BYTE pdrv, BYTE *const *parts, DWORD sector, UINT count);   // in FATFS_SD.c
+
+static bool ReadChunk(FIL &fil, FSIZE_t pos, BlockBuffer &buf)
+    {
+    mutex &disk_lock = DiskLock(fil);
+    unsigned len = buf.len;
+    bool cached = Cacheable(fil, pos, len);
+    Extent *ext;
+    bool ok;
+
+    OwnParts(buf);
+    disk_lock.lock();
+    if(cached && CacheRefer(fil, pos, buf))
+        {
+        disk_lock.unlock();
+        return true;
+        }
+
+    if(cached && (ext = RawExtent(fil, pos, len)) != nullptr && CacheClaim(fil, pos, buf))
+        {
+        Trace(TR_SD, buf.trace);
+        ok = SD_disk_readv(ext->drv, (BYTE *const *)buf.part, ext->lba + pos/512, len/512) == RES_OK;
+        Trace(TR_SD_DONE, buf.trace);
+
+        if(ok)block_cache.misses += len/512;
+        else
+            {
+            printf("raw read failed at sector %lu, count %u\n", ext->lba + (DWORD)(pos/512), len/512);
+            for(unsigned i=0; i<len/512; i++)block_cache.drop(buf.line[i]);
+            Unpin(buf);
+            OwnParts(buf);
+            }
+        disk_lock.unlock();
+        return ok;
+        }
+
+    if(!cached && block_cache.dirty && UnitFile(fil) && !CacheWriteBackRange(fil, pos, len))
+        {
+        disk_lock.unlock();                             // the card would give the host stale data
+        return false;
+        }
+
+    Trace(TR_SD, buf.trace);
+    ok = ReadDisk(fil, pos, buf.data, len);
+    Trace(TR_SD_DONE, buf.trace);
+
+    if(ok && cached)
+        {
+        CacheFill(fil, pos, buf.data, len);
+        block_cache.misses += len/512;
+        }
+    disk_lock.unlock();
+    return ok;
+    }
+
+// Write part of a file at an explicit position, through the cache if it is a unit image.
+// Returns true if all <len> bytes were written.
+
+static bool WriteAt(FIL &fil, FSIZE_t pos, const void *buf, unsigned len, unsigned trace)
+    {
+    mutex &disk_lock = DiskLock(fil);
+    bool cached = Cacheable(fil, pos, len);
+    bool ok;
+
+    disk_lock.lock();
+    if(cached && MSCP_write_back)
+        {
+        ok = CacheWrite(fil, pos, buf, len, trace);
+        }
+    else if(!cached && block_cache.dirty && UnitFile(fil) && !CacheWriteBackRange(fil, pos, len))
+        {
+        ok = false;                                     // the write may not cover all of a dirty block, which would be lost
+        }
+    else
+        {
+        Trace(TR_SD, trace);
+        ok = WriteDisk(fil, pos, buf, len);
+        Trace(TR_SD_DONE, trace);
+
+        if(cached || UnitFile(fil))CacheUpdate(fil, pos, buf, len, cached);
+        }
+    disk_lock.unlock();
+    return ok;
+    }
+
+
+// Read-ahead
+//
+// Booting or loading a big image reads a unit from one end to the other, and each
+// read would wait for the card after the one before it has ended. Each unit keeps
+// track of where its reads go. Once a few reads in a row have each started where
+// the last one ended, the dispatcher uses the time it has nothing else to do to
+// read the blocks after them into the block cache, a chunk at a time, so that the
+// next read finds them there.
+// How soon and how far ahead it reads adapt to how much of what it read was used.
+// When the stream stops with blocks read ahead that the host never took, the depth
+// halves, and once it is down to a chunk, the reads it takes to start double. When
+// the host catches up with the read-ahead, so that its read went beyond what had
+// been read ahead, they go back the other way. So short sequential runs, like the
+// small files of RT-11, soon stop being read ahead, and long ones, like a boot or
+// a big image being loaded, are read ahead further.
+
+#define RA_TRIGGER 2                                    // the fewest sequential reads before reading ahead
+#define RA_TRIGGER_MAX 32                               // and the most
+#define RA_MIN (MSCP_CHUNK/512)                         // the least depth, in blocks
+#define RA_MAX 32                                       // and the most, a quarter of the cache
+
+bool MSCP_readahead = true;                             // when true, read ahead for sequential reads into the cache
+
+// note a read of a unit, before it is done
+
+static void ReadStream(MSCPunit &u, uint32_t lbn, unsigned blocks)
+    {
+    uint32_t end = lbn + blocks;
+
+    if(lbn == u.next_lbn)                               // the stream goes on
+        {
+        if(u.ahead > lbn)u.ra_used += (u.ahead < end ? u.ahead : end) - lbn;
+        if(u.ahead > lbn && u.ahead < end)              // the host caught up
+            {
+            if(u.ra_trigger > RA_TRIGGER)u.ra_trigger /= 2;
+            else if(u.ra_depth < RA_MAX)u.ra_depth *= 2;
+            }
+        ++u.run;
+        }
+    else
+        {
+        if(u.ahead > u.next_lbn)                        // and didn't take what was read ahead
+            {
+            if(u.ra_depth > RA_MIN)u.ra_depth /= 2;
+            else if(u.ra_trigger < RA_TRIGGER_MAX)u.ra_trigger *= 2;
+            }
+        u.ahead = lbn;                                  // what was read ahead is left in the cache, but no longer counted
+        u.run = 1;
+        }
+
+    u.next_lbn = end;
+    if(u.ahead < end)u.ahead = end;
+    }
+
+// Read one chunk ahead of a unit's sequential reads, into the block cache.
+// Returns true if it read anything.
+
+static bool ReadAhead()
+    {
+    static uint32_t buf[MSCP_CHUNK/4];                  // only the dispatcher reads ahead
+
+    if(!MSCP_readahead || !MSCP_cache)return false;
+
+    for(auto &u : units)
+        {
+        if(!u.online || u.run < u.ra_trigger || u.ahead >= u.next_lbn + u.ra_depth || u.ahead >= u.size)continue;
+
+        uint32_t lbn = u.ahead;
+        unsigned blocks = u.size - lbn < RA_MIN ? u.size - lbn : RA_MIN;
+        FSIZE_t pos = (FSIZE_t)lbn * 512;
+        mutex &disk_lock = DiskLock(u.fil);
+        bool ok = false;
+
+        disk_lock.lock();
+        if(u.online && u.ahead == lbn)                  // unless the unit went offline, or the stream moved, while this waited
+            {
+            ok = ReadDisk(u.fil, pos, buf, blocks*512);
+            if(ok)CacheFill(u.fil, pos, buf, blocks*512);
+            }
+        disk_lock.unlock();
+
+        if(!ok)
+            {
+            u.run = 0;                                  // don't try again until the host reads on
+            return true;
+            }
+        if(u.ahead == lbn)u.ahead = lbn + blocks;
+        u.ra_blocks += blocks;
+        return true;
+        }
+
+    return false;
+    }
+
+
+// the total size of a transfer
+
+static unsigned SegSize(const Segment *segs, unsigned nsegs)
+    {
+    unsigned size = 0;
+
+    for(unsigned i=0; i<nsegs; i++)size += segs[i].size;
+
+    return size;
+    }
+
+
+// DMA part of a transfer between a buffer and PDP-11 memory.
+// <off> is the offset of the buffer within the transfer, and the segments
+// are the pieces of PDP-11 memory the transfer is made of, in order.
+// <part> says where each 512 bytes of the buffer are, which need not follow
+// one another in memory, as when a read is sent straight from the block cache.
+// Returns the bytes of the buffer moved, less than <len> if the PDP-11 didn't reply to a burst.
+
+static unsigned QTransfer(const Segment *segs, unsigned nsegs, unsigned off, uint32_t *const *part, unsigned len, bool toHost, unsigned trace)
+    {
+    unsigned at = 0;                                    // bytes of the buffer done
+
+    Trace(TR_DMA, trace);
+
+    for(unsigned i=0; i<nsegs && len>0; i++)
+        {
+        if(off >= segs[i].size)                         // skip the segments before the buffer
+            {
+            off -= segs[i].size;
+            continue;
+            }
+
+        unsigned n = segs[i].size-off < len ? segs[i].size-off : len;
+        uint32_t addr = segs[i].addr+off;
+
+        len -= n;
+        off = 0;
+
+        while(n > 0)                                    // as much of the segment as is in one piece of memory at a time
+            {
+            unsigned first = at/512;
+            unsigned k = 512 - at%512;
+            uint16_t *p = (uint16_t *)part[first] + at%512/2;
+
+            while(k < n && part[(at+k)/512] == part[first] + ((at+k)/512 - first)*512/4)k += 512;
+            if(k > n)k = n;
+
+            unsigned moved = 2 * (toHost ? QWriteBlock(addr, p, k/2) : QReadBlock(addr, p, k/2));
+
+            at += moved;
+            if(moved < k)break;                         // the PDP-11 didn't reply
+            addr += k;
+            n -= k;
+            }
+        if(n > 0)break;
+        }
+
+    Trace(TR_DMA_DONE, trace);
+    return at;
+    }
+
+
+// Read a file into PDP-11 memory one chunk at a time, each SD card read
+// followed by the Qbus DMA of that chunk. This is the original (non-pipelined) read.
+// Only the first of the buffers is used.
+// Returns the MSCP status of the transfer, ST_HST if the PDP-11 didn't reply to a burst,
+// and sets <moved> to the bytes of it done, from the start: for a read, those put in
+// PDP-11 memory, for a write, those taken from it and written to the card.
+
+unsigned ReadSerial(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved)
+    {
+    unsigned size = SegSize(segs, nsegs);
+
+    for(unsigned off=0; off<size; off += MSCP_CHUNK)
+        {
+        unsigned len = size-off < MSCP_CHUNK ? size-off : MSCP_CHUNK;
+
+        bufs[0].len = len;
+        if(!ReadChunk(fil, pos+off, bufs[0]))
+            {
+            moved = off;
+            return ST_DRV;
+            }
+
+        unsigned n = QTransfer(segs, nsegs, off, bufs[0].part, len, true, bufs[0].trace);
+        Unpin(bufs[0]);
+        if(n < len)
+            {
+            moved = off + n;
+            return ST_HST;
+            }
+        }
+
+    moved = size;
+    return ST_SUC;
+    }
+
+
+// Read a file into PDP-11 memory using a two-stage pipeline.
+// Thread 0 (the caller) fetches chunks from the SD card into free buffers.
+// Thread 1 DMAs filled buffers into PDP-11 memory and returns them to the free FIFO.
+// While one chunk is moving over the Qbus, the next one(s) can be fetched from the card.
+// Each stage suspends at its Port when it has nothing to do, and is resumed by the other stage.
+// If no thread is available for the second stage, the read is done serially.
+// Returns the MSCP status of the transfer, and the bytes of it done in <moved>, as ReadSerial.
+// Of two failures, the one nearer the start of the transfer is the one reported.
+
+unsigned ReadPipelined(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved)
+    {
+    FIFO<BlockBuffer *, MSCP_NBUF> empty;               // buffers waiting to be filled from the SD card
+    FIFO<BlockBuffer *, MSCP_NBUF> full;                // buffers waiting to be sent over the Qbus
+    Port fetchPort;                                     // where the fetch thread waits for an empty buffer
+    Port dmaPort;                                       // where the DMA thread waits for a full buffer
+    bool done = false;                                  // set by the fetch thread when it has queued the last chunk
+    bool failed = false;                                // set by the DMA thread if the PDP-11 doesn't reply
+    unsigned status = ST_SUC;
+    unsigned size = SegSize(segs, nsegs);
+
+    moved = size;
+    for(unsigned i=0; i<MSCP_NBUF; i++)empty.add(&bufs[i]);
+
+    #pragma omp parallel num_threads(2)
+    if(omp_get_num_threads() < 2)                       // if the thread pool was empty
+        {
+        status = ReadSerial(fil, pos, segs, nsegs, bufs, moved);
+        }
+    else if(omp_get_thread_num() == 0)                  // the fetch thread
+        {
+        for(unsigned off=0; off<size && !failed; off += MSCP_CHUNK)
+            {
+            BlockBuffer *buf;
+
+            while(!empty.take(buf))                     // wait for a free buffer
+                {
+                fetchPort.suspend();
+                }
+
+            buf->off = off;
+            buf->len = size-off < MSCP_CHUNK ? size-off : MSCP_CHUNK;
+
+            if(!ReadChunk(fil, pos+off, *buf))
+                {
+                if(off < moved)
+                    {
+                    moved = off;
+                    status = ST_DRV;
+                    }
+                break;
+                }
+
+            full.add(buf);                              // pass the filled buffer to the DMA thread
+            dmaPort.resume();                           // and wake it if it is waiting
+            }
+
+        done = true;                                    // tell the DMA thread there are no more chunks coming
+        dmaPort.resume();
+        }
+    else                                                // the DMA thread
+        {
+        while(true)
+            {
+            BlockBuffer *buf;
+
+            if(!full.take(buf))                         // if nothing to send
+                {
+                if(done)break;                          // and nothing more coming, then we're done
+                dmaPort.suspend();                      // else wait for the fetch thread
+                continue;
+                }
+
+            if(!failed)                                 // after a failure, just drain the remaining buffers
+                {
+                unsigned n = QTransfer(segs, nsegs, buf->off, buf->part, buf->len, true, buf->trace);
+
+                if(n < buf->len)
+                    {
+                    failed = true;
+                    if(buf->off + n < moved)
+                        {
+                        moved = buf->off + n;
+                        status = ST_HST;
+                        }
+                    }
+                }
+            Unpin(*buf);
+
+            empty.add(buf);                             // return the buffer to the fetch thread
+            fetchPort.resume();
+            }
+        }
+
+    return status;
+    }
+
+
+// Write a file from PDP-11 memory one chunk at a time, each Qbus DMA
+// followed by the SD card write of that chunk. This is the original (non-pipelined) write.
+// Only the first of the buffers is used.
+// Returns the MSCP status of the transfer, and the bytes of it done in <moved>, as ReadSerial.
+// A chunk the PDP-11 didn't give all of isn't written.
+
+unsigned WriteSerial(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved)
     {
-    command *cmd;
+    unsigned size = SegSize(segs, nsegs);
 
-    while(!ControlC)
+    for(unsigned off=0; off<size; off += MSCP_CHUNK)
         {
-        cmd = GetPacket();                              // get a command packet
-        if(cmd == nullptr)                              // if nothing returned
+        unsigned len = size-off < MSCP_CHUNK ? size-off : MSCP_CHUNK;
+
+        if(QTransfer(segs, nsegs, off, OwnParts(bufs[0]), len, false, bufs[0].trace) < len)
             {
-            yield();                                    // wait a bit, let other processes run
-            continue;                                   // and go try again
+            moved = off;
+            return ST_HST;
             }
 
-        memset(&rsp, 0, sizeof(rsp));
+        if(!WriteAt(fil, pos+off, bufs[0].data, len, bufs[0].trace))
+            {
+            moved = off;
+            return ST_DRV;
+            }
+        }
+
+    moved = size;
+    return ST_SUC;
+    }
+
 
-        rsp.cmdref = cmd->cmdref;
-        rsp.unit = cmd->unit;
-        rsp.endcode = cmd->opcode | OP_END;
+// Write a file from PDP-11 memory using a two-stage pipeline, the mirror image of ReadPipelined.
+// Thread 0 (the caller) DMAs chunks from PDP-11 memory into free buffers.
+// Thread 1 writes filled buffers to the SD card, in order, and returns them to the free FIFO.
+// Returns the MSCP status of the transfer, and the bytes of it done in <moved>, as ReadPipelined.
+// The chunks the DMA thread had passed on before the PDP-11 failed to reply are still written.
+
+unsigned WritePipelined(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved)
+    {
+    FIFO<BlockBuffer *, MSCP_NBUF> empty;               // buffers waiting to be filled from the Qbus
+    FIFO<BlockBuffer *, MSCP_NBUF> full;                // buffers waiting to be written to the SD card
+    Port dmaPort;                                       // where the DMA thread waits for an empty buffer
+    Port writePort;                                     // where the write thread waits for a full buffer
+    bool done = false;                                  // set by the DMA thread when it has queued the last chunk
+    bool failed = false;                                // set by the write thread if the card write fails
+    unsigned status = ST_SUC;
+    unsigned size = SegSize(segs, nsegs);
 
+    moved = size;
+    for(unsigned i=0; i<MSCP_NBUF; i++)empty.add(&bufs[i]);
 
-        if(cmd->msgtype == 0 && cmd->vcid == 0)         // if sequential MSCP command
+    #pragma omp parallel num_threads(2)
+    if(omp_get_num_threads() < 2)                       // if the thread pool was empty
+        {
+        status = WriteSerial(fil, pos, segs, nsegs, bufs, moved);
+        }
+    else if(omp_get_thread_num() == 0)                  // the DMA thread
+        {
+        for(unsigned off=0; off<size && !failed; off += MSCP_CHUNK)
             {
-            switch(cmd->opcode)                         // process the command
-                {
-            case OP_ONL:                                // online
-                {
-                printf("OP_ONL packet received, unit = %d\n", cmd->unit);
+            BlockBuffer *buf;
 
-                char name[16];
-                snprintf(name, sizeof(name), "UNIT%d.img", cmd->unit);
+            while(!empty.take(buf))                     // wait for a free buffer
+                {
+                dmaPort.suspend();
+                }
 
-                if(f_open(&fil, name, FA_READ | FA_WRITE) != FR_OK)
+            buf->off = off;
+            buf->len = size-off < MSCP_CHUNK ? size-off : MSCP_CHUNK;
+            if(QTransfer(segs, nsegs, off, OwnParts(*buf), buf->len, false, buf->trace) < buf->len)
+                {
+                if(off < moved)
                     {
-                    printf("opening %s failed\n", name);
-                    return;
+                    moved = off;
+                    status = ST_HST;
                     }
-                printf("%s online\n", name);
-
-                unsigned size = (f_size(&fil) + 511)/ 512;
-                printf("size = %d blocks\n", size);
-
-                rsp.msglen = 44;
-                rsp.status = ST_SUC;
-                rsp.multiunit_code = cmd->unit;
-                rsp.unit_flags = 0;
-                rsp.id.dev_class = UID_DISK;
-                rsp.id.model = UID_RA92;
-                rsp.id.serno_hi = 0;
-                rsp.id.serno_lo = cmd->unit; // on the RQDX3 this is the unit number
-                rsp.media_type_identifier = DU_SD32;
-                rsp.unit_size = size;
-                rsp.volume_serial_number = 3141592654;
-                PutPacket(&rsp);
-
+                empty.add(buf);
                 break;
                 }
 
-            case OP_RD:                                 // read
-                {
-                unsigned start = cmd->LBN * 512;
-                unsigned size = cmd->bytecount;
-                uint32_t addr = cmd->buffer_address;
-                FRESULT res;
+            full.add(buf);                              // pass the filled buffer to the write thread
+            writePort.resume();                         // and wake it if it is waiting
+            }
+
+        done = true;                                    // tell the write thread there are no more chunks coming
+        writePort.resume();
+        }
+    else                                                // the write thread
+        {
+        while(true)
+            {
+            BlockBuffer *buf;
 
-                printf("OP_RD packet received, LBN = %ld, size = %d, dest = %08lo\n", cmd->LBN, size, addr);
+            if(!full.take(buf))                         // if nothing to write
+                {
+                if(done)break;                          // and nothing more coming, then we're done
+                writePort.suspend();                    // else wait for the DMA thread
+                continue;
+                }
 
-                if((size & 1) != 0)                   // if bytecount not even return illegal cmd + illegal bytecount
+            if(!failed && !WriteAt(fil, pos+buf->off, buf->data, buf->len, buf->trace)) // after a failure, just drain the remaining buffers
+                {
+                if(buf->off < moved)
                     {
-                    printf("illegal read byte count, must be an even number of bytes\n");
-                    rsp.msglen = 32;
-                    rsp.status = ST_CMD | I_BCNT;
-                    PutPacket(&rsp);
-
-                    break;
+                    moved = buf->off;
+                    status = ST_DRV;
                     }
+                failed = true;
+                }
 
-                res = f_lseek(&fil, start);
-                if(res != FR_OK)
-                    {
-                    printf("read: seek to %d failed\n", start);
-                    rsp.msglen = 32;
-                    rsp.status = ST_DRV;
-                    PutPacket(&rsp);
+            empty.add(buf);                             // return the buffer to the DMA thread
+            dmaPort.resume();
+            }
+        }
 
-                    break;
-                    }
+    return status;
+    }
 
-                for(unsigned off=0; off<size; off += 512)
-                    {
-                    unsigned expected;
-                    unsigned br; // Bytes read
 
-                    if(size-off < 512)
-                        {
-                        expected = size-off;
-                        }
-                    else
-                        {
-                        expected = 512;
-                        }
+// Write-behind
+//
+// A write is ended (its end packet sent to the host) as soon as its data has been
+// DMAed into controller RAM. The buffered data is written to the SD card later,
+// in the order it was received, by WriteBehindFlush, which is called when the
+// controller is idle, when it runs out of buffers, and before any other command,
+// so that a later command always sees the data of an earlier write.
 
-                    res = f_read(&fil, qbuf, expected, &br);
-                    if(res == FR_OK && br==expected)
-                        {
-                        QWriteBlock(addr, (uint16_t *)&qbuf, expected/2);
-                        addr += 512;
-                        }
-                    else
-                        {
-                        printf("block read failed at offset %d, bytes read %d, status %d\n", off, br, res);
-                        rsp.msglen = 32;
-                        rsp.status = ST_DRV;
-                        PutPacket(&rsp);
+// DMA a write into write-behind buffers, flushing older buffers as needed to make room.
+// The write-behind buffers are used instead of <bufs>, only the trace tag is taken from them.
+// Returns the MSCP status of the transfer, and in <moved> the bytes of it buffered, which
+// are written to the card even if the PDP-11 then fails to reply.
 
-                        break;
-                        }
-                    }
+unsigned WriteBehind(FIL &fil, FSIZE_t pos, const Segment *segs, unsigned nsegs, BlockBuffer *bufs, unsigned &moved)
+    {
+    unsigned size = SegSize(segs, nsegs);
 
-                rsp.msglen = 32;
-                rsp.status = ST_SUC;
-                PutPacket(&rsp);
+    for(unsigned off=0; off<size; off += MSCP_CHUNK)
+        {
+        BlockBuffer *buf;
 
-                break;
-                }
+        if((buf = wbbufs.take()) == nullptr)            // if all the buffers are in use
+            {
+            do  {
+                WriteBehindFlush(1);                    // write back the oldest one
+                } while((buf = wbbufs.try_take()) == nullptr);
+            }
+
+        buf->off = off;
+        buf->len = size-off < MSCP_CHUNK ? size-off : MSCP_CHUNK;
+        buf->fil = &fil;
+        buf->pos = pos + off;
+        if(QTransfer(segs, nsegs, off, OwnParts(*buf), buf->len, false, bufs[0].trace) < buf->len)
+            {
+            wbbufs.give(buf);                           // nothing of this chunk is written
+            moved = off;
+            return ST_HST;
+            }
+
+        wb_queue.add(buf);
+        }
+
+    moved = size;
+    return ST_SUC;
+    }
+
+
+// Write up to <count> of the oldest write-behind buffers to the SD card (all of them by default).
+// Returns the number of buffers written.
+
+unsigned WriteBehindFlush(unsigned count)
+    {
+    unsigned n = 0;
+    BlockBuffer *buf;
+
+    wb_lock.lock();
+    while(n < count && wb_queue.take(buf))
+        {
+        if(!WriteAt(*buf->fil, buf->pos, buf->data, buf->len, 0))  // after the end packet, so not part of the command's trace
+            {
+            ++wb_errors;
+            }
+
+        wbbufs.give(buf);
+        ++n;
+        }
+    wb_lock.unlock();
+
+    return n;
+    }
+
+
+// the scheduler, for its counts
+
+const Elevator &MSCP_scheduler()
+    {
+    return elevator;
+    }
+
+
+// the number of write-behind buffers not yet written to the card
+
+unsigned WriteBehindPending()
+    {
+    return wbbufs.used;
+    }
+
+
+// the tag a command's events are traced with
+
+static inline unsigned TraceTag(Request *r)
+    {
+    return contexts.index(static_cast<MSCPcontext *>(r)) + 1;
+    }
+
+
+// check whether a command is a well formed read or write, which can be handed to the scheduler as a transfer
+
+static ReqKind Classify(command *cmd)
+    {
+    if(cmd->msgtype != 0 || cmd->vcid != 0)return REQ_OTHER;
+    if(cmd->opcode == OP_RD && (cmd->bytecount & 1) == 0)return REQ_READ;
+    if(cmd->opcode == OP_WR && (cmd->bytecount & 511) == 0)return REQ_WRITE;
+    return REQ_OTHER;
+    }
+
+
+// Bring a unit online by opening its image, UNIT<n>.img, on the first SD card that has one.
+// Builds the image's cluster link map and looks for a contiguous extent for the raw backend.
+// A unit that is already online stays as it is.
+// Returns true if the unit is online.
+
+static bool UnitOnline(unsigned n)
+    {
+    if(n >= MSCP_UNITS)
+        {
+        printf("no unit %u\n", n);
+        return false;
+        }
+
+    MSCPunit &u = units[n];
+    FRESULT res = FR_NO_FILE;
+    char name[16];
+
+    if(u.online)return true;
+
+    LockAllDrives();
+    for(u.drive=0; u.drive<MSCP_DRIVES; u.drive++)
+        {
+        snprintf(name, sizeof(name), "%u:UNIT%u.img", u.drive, n);
+        res = f_open(&u.fil, name, FA_READ | FA_WRITE);
+        if(res == FR_OK)break;
+        }
+    if(res == FR_OK)
+        {
+        u.fastseek = BuildLinkMap(u.fil, u.clmt, MSCP_CLMT);
+        u.raw = AttachExtent(u.fil);
+        }
+    UnlockAllDrives();
+
+    if(res != FR_OK)
+        {
+        printf("UNIT%u.img not found\n", n);
+        return false;
+        }
+
+    u.size = (f_size(&u.fil) + 511) / 512;
+    u.next_lbn = 0;
+    u.ahead = 0;
+    u.run = 0;
+    u.ra_depth = RA_MIN;
+    u.ra_trigger = RA_TRIGGER;
+    u.wb_failed = 0;
+    u.write_failed = false;
+    u.online = true;
+
+    printf("%s online, %lu blocks, %s\n", name, u.size, u.raw ? "contiguous, using raw I/O" : "fragmented, using FatFs");
+    if(u.fastseek)printf("%lu fragments, fast seek enabled\n", (u.clmt[0]-2)/2);
+    else printf("too many fragments for the cluster link map, fast seek disabled\n");
+
+    return true;
+    }
+
+
+// Take a unit offline, closing its image.
+// Returns false if cached blocks of it could not be written back, and were lost.
+
+static bool UnitAvailable(unsigned n)
+    {
+    if(n >= MSCP_UNITS || !units[n].online)return true;
+
+    MSCPunit &u = units[n];
+
+    WriteBehindFlush();                                 // nothing buffered may refer to the file after it is closed
+
+    mutex &disk_lock = DiskLock(u.fil);
+    unsigned lost = 0;
+
+    disk_lock.lock();
+    while(CacheLine *l = block_cache.dirtyLine(&u.fil)) // nor may the cache, each block having one last try
+        {
+        if(WriteBack(l))continue;
+        block_cache.setDirty(l, false);
+        ++lost;
+        }
+    if(lost)printf("unit %u offline, %u cached blocks could not be written back\n", n, lost);
+    cache_errors += lost;
+    block_cache.invalidate(&u.fil);
+    DetachExtent(u.fil);
+    f_close(&u.fil);
+    disk_lock.unlock();
+
+    u.online = false;
+    return lost == 0;
+    }
+
+
+// process one command that is not a transfer, and fill in its response
+// returns true if a response should be sent
+
+static bool MSCP_execute(command *cmd, response &rsp)
+    {
+    memset(&rsp, 0, sizeof(rsp));
+
+    rsp.cmdref = cmd->cmdref;
+    rsp.unit = cmd->unit;
+    rsp.endcode = cmd->opcode | OP_END;
+
+    if(cmd->msgtype != 0 || cmd->vcid != 0)             // unrecognized protocol
+        {
+        printf("received packet, type %d, vcid %d\n", cmd->msgtype, cmd->vcid);
+        return false;
+        }
+
+    WriteBehindFlush();                                 // the command must see the buffered writes on the card first
+
+    switch(cmd->opcode)                                 // process the command
+        {
+    case OP_ONL:                                        // online
+        {
+        printf("OP_ONL packet received, unit = %d\n", cmd->unit);
+
+        if(!UnitOnline(cmd->unit))
+            {
+            rsp.msglen = 32;
+            rsp.status = ST_OFL;
+            return true;
+            }
+
+        rsp.msglen = 44;
+        rsp.status = ST_SUC;
+        rsp.multiunit_code = cmd->unit;
+        rsp.unit_flags = 0;
+        rsp.id.dev_class = UID_DISK;
+        rsp.id.model = UID_RA92;
+        rsp.id.serno_hi = 0;
+        rsp.id.serno_lo = cmd->unit; // on the RQDX3 this is the unit number
+        rsp.media_type_identifier = DU_SD32;
+        rsp.unit_size = units[cmd->unit].size;
+        rsp.volume_serial_number = 3141592654;
+
+        return true;
+        }
+
+    case OP_AVL:                                        // available, the host is done with the unit
+        printf("OP_AVL packet received, unit = %d\n", cmd->unit);
+        rsp.msglen = 12;
+        rsp.status = UnitAvailable(cmd->unit) ? ST_SUC : ST_DAT;
+        return true;
+
+    case OP_RD:                                         // a read that Classify rejected
+        printf("illegal read byte count, must be an even number of bytes\n");
+        rsp.msglen = 32;
+        rsp.status = ST_CMD | I_BCNT;                   // illegal cmd + illegal bytecount
+        return true;
+
+    case OP_WR:                                         // a write that Classify rejected
+        printf("illegal write byte count, must be a multiple of 512\n");
+        rsp.msglen = 32;
+        rsp.status = ST_CMD | I_BCNT;
+        return true;
+
+    default:                                            // unimplemented command
+        printf("packet received with opcode %d\n", cmd->opcode);
+        rsp.msglen = 12;
+        rsp.endcode = OP_END;
+        rsp.status = ST_CMD | I_OPCD;
+        return true;
+        }
+    }
+
+
+// Execute a read or write, which may have several adjacent commands merged into it
+// by the scheduler, and send an end packet for each of the commands.
+
+static void MSCP_transfer(MSCPcontext *group, BlockBuffer *bufs)
+    {
+    Segment segs[MSCP_MAXSEG];
+    unsigned nsegs = 0;
+    unsigned size = 0;
+    FSIZE_t start = (FSIZE_t)group->LBN * 512;
+    bool write = group->kind == REQ_WRITE;
+    MSCPunit *u = group->unit < MSCP_UNITS && units[group->unit].online ? &units[group->unit] : nullptr;
+    Request *outside = nullptr;                         // the first command that goes past the end of the unit, the rest follow it
+    unsigned status = ST_SUC;
+    unsigned moved = 0;                                 // bytes of the transfer done, from the start
+
+    for(unsigned i=0; i<MSCP_NBUF; i++)bufs[i].trace = TraceTag(group);
+
+    for(Request *r = group; r; r = r->next)
+        {
+        printf("%s packet received, unit = %u, LBN = %lu, size = %u, dest = %08lo\n", write ? "OP_WR" : "OP_RD", r->unit, r->LBN, r->size, r->addr);
+        if(u && r->end() > u->size)
+            {
+            outside = r;
+            break;
+            }
+        segs[nsegs].addr = r->addr;
+        segs[nsegs].size = r->size;
+        size += r->size;
+        ++nsegs;
+        }
+
+    if(u == nullptr)
+        {
+        printf("unit %u is not online\n", group->unit);
+        status = ST_OFL;
+        }
+    else if(nsegs > 0 && !write)
+        {
+        WriteBehindFlush();                             // the read must see the buffered writes on the card first
+        ReadStream(*u, group->LBN, size/512);
+        status = MSCP_pipeline ? ReadPipelined(u->fil, start, segs, nsegs, bufs, moved) : ReadSerial(u->fil, start, segs, nsegs, bufs, moved);
+        u->reads += nsegs;
+        u->rdblocks += size/512;
+        }
+    else if(nsegs > 0 && MSCP_write_behind)
+        {
+        status = WriteBehind(u->fil, start, segs, nsegs, bufs, moved);
+        u->writes += nsegs;
+        u->wrblocks += size/512;
+        }
+    else if(nsegs > 0)
+        {
+        WriteBehindFlush();
+        status = MSCP_pipeline ? WritePipelined(u->fil, start, segs, nsegs, bufs, moved) : WriteSerial(u->fil, start, segs, nsegs, bufs, moved);
+        u->writes += nsegs;
+        u->wrblocks += size/512;
+        }
+
+    if(u && status == ST_SUC && u->write_failed)        // the transfer itself was fine, but blocks it wrote earlier are stuck in the cache
+        {
+        printf("unit %u: cached blocks could not be written back\n", group->unit);
+        status = ST_DAT;
+        u->write_failed = false;
+        u->wb_failed = 0;
+        }
+    if(u && status != ST_SUC)++u->errors;
+
+    unsigned at = 0;                                    // where each command's data starts in the transfer
+    for(Request *r = group; r; r = r->next)             // the merged transfer succeeds or fails together, each command with its own byte count
+        {
+        MSCPcontext *ctx = static_cast<MSCPcontext *>(r);
+        unsigned done = moved > at ? moved - at : 0;
+
+        if(done > r->size)done = r->size;
+        at += r->size;
+
+        if(r == outside)
+            {
+            printf("LBN %lu is past the end of unit %u\n", r->LBN, r->unit);
+            status = ST_CMD | I_LBN;                    // this and every command after it in the transfer
+            }
 
-            case OP_WR:                                 // write
+        memset(&ctx->rsp, 0, sizeof(ctx->rsp));
+        ctx->rsp.msglen = 32;
+        ctx->rsp.cmdref = ctx->cmd.cmdref;
+        ctx->rsp.unit = ctx->cmd.unit;
+        ctx->rsp.endcode = ctx->cmd.opcode | OP_END;
+        ctx->rsp.status = status;
+        ctx->rsp.bytecount = done;
+        PutPacket(&ctx->rsp);
+        Trace(TR_END, TraceTag(r));
+        }
+    }
+
+
+// A worker thread. Takes transfers from the scheduler, executes them, and
+// sends their end packets. Several workers run at once, so while one is waiting
+// for the SD card or the Qbus another can make progress on a different command.
+// End packets are sent in the order the commands complete, not the order they arrived.
+
+static void MSCP_worker(BlockBuffer *bufs)
+    {
+    while(!stopping)
+        {
+        MSCPcontext *group = static_cast<MSCPcontext *>(elevator.take());
+
+        if(group == nullptr)                            // if there is nothing that can start now
+            {
+            workPort.suspend();                         // wait for the dispatcher, or for another worker to finish
+            continue;
+            }
+
+        for(Request *r = group; r; r = r->next)Trace(TR_START, TraceTag(r));
+
+        if(group->kind == REQ_OTHER)
+            {
+            if(MSCP_execute(&group->cmd, group->rsp))
                 {
-                unsigned start = cmd->LBN * 512;
-                unsigned size = cmd->bytecount;
-                uint32_t addr = cmd->buffer_address;
-                FRESULT res;
+                PutPacket(&group->rsp);
+                Trace(TR_END, TraceTag(group));
+                }
+            }
+        else
+            {
+            MSCP_transfer(group, bufs);
+            }
 
-                printf("OP_WR packet received, LBN = %ld, size = %d, dest = %08lo\n", cmd->LBN, size, addr);
+        elevator.done(group);
 
-                if((size & 511) != 0)                   // if bytecount not a multiple of block return illegal cmd + illegal bytecount
-                    {
-                    printf("illegal write byte count, must be a multiple of 512\n");
-                    rsp.msglen = 32;
-                    rsp.status = ST_CMD | I_BCNT;
-                    PutPacket(&rsp);
+        for(Request *r = group, *next; r; r = next)     // the end packets returned these commands' credits to the host
+            {
+            next = r->next;
+            --MSCP_inflight;
+            contexts.give(static_cast<MSCPcontext *>(r)); // so their buffers are free again
+            }
+        doorbell = true;                                // and the host may have queued more commands for them
 
-                    break;
-                    }
+        if(elevator)workPort.resume();                  // finishing may have let a queued request start
+        }
+    }
+
+
+extern volatile bool *FPGA_doorbell;                    // in FPGA_monitor.cpp
+
+
+// Get packets from host, and hand them to the scheduler and the worker threads.
+// Thread 0 (the caller) is the dispatcher, the other threads are workers.
+// The dispatcher reads the command ring until it is empty each time the doorbell rings, that is when
+// the host reads IP (the FPGA interrupts on that) or a command ends, and otherwise leaves the Qbus alone.
+
+void MSCP_poll()
+    {
+    contexts.reset();
+    elevator.reset();
+    stopping = false;
+    MSCP_inflight = 0;
+    MSCP_max_inflight = 0;
+    MSCP_scans = 0;
+    doorbell = true;                                    // the host may have queued commands already
+    FPGA_doorbell = &doorbell;
+
+    #pragma omp parallel num_threads(MSCP_WORKERS+1)
+        {
+        int id = omp_get_thread_num();                  // get it now, a nested parallel region in a worker changes it
 
-                res = f_lseek(&fil, start);
-                if(res != FR_OK)
+        if(id == 0)                                     // the dispatcher
+            {
+            bool scanning = false;                      // reading the command ring until it is empty
+            bool waiting = false;                       // for a worker to give back a context, counted once in the pool
+
+            while(!ControlC)
+                {
+                MSCPcontext *ctx;
+
+                if(!scanning)
                     {
-                    printf("write: seek to %d failed\n", start);
-                    rsp.msglen = 32;
-                    rsp.status = ST_DRV;
-                    PutPacket(&rsp);
+                    if(MSCP_doorbell && !doorbell)      // nothing new from the host
+                        {
+                        if(!WriteBehindFlush(1) && !CacheFlush(1) && !ReadAhead())  // use the idle time to write back or read ahead
+                            {
+                            yield();                    // or if there is nothing to write, let other processes run
+                            }
+                        continue;
+                        }
 
-                    break;
+                    doorbell = false;                   // a doorbell from now on means another scan
+                    (void)FADDR_ST;                     // clear IP_Read, so that the next poll interrupts again
+                    scanning = true;
+                    ++MSCP_scans;
                     }
 
-                for(unsigned off=0; off<size; off += 512)
+                if((ctx = waiting ? contexts.try_take() : contexts.take()) == nullptr)  // if every command buffer is in use
                     {
-                    unsigned br; // Bytes read
-
-                    QReadBlock(addr, (uint16_t *)&qbuf, 512/2);
-                    addr += 512;
+                    waiting = true;
+                    yield();                            // wait for a worker to finish one
+                    continue;
+                    }
+                waiting = false;
 
-                    res = f_write(&fil, qbuf, 512, &br);
-                    if(res != FR_OK || br != 512)
+                if(GetPacket(ctx->cmd, TraceTag(ctx)) == nullptr)  // if the ring is empty
+                    {
+                    contexts.give(ctx);
+                    scanning = false;                   // wait for the doorbell
+                    if(!MSCP_doorbell && !WriteBehindFlush(1) && !CacheFlush(1) && !ReadAhead())
                         {
-                        printf("block write failed at offset %d, bytes read %d, status %d\n", off, br, res);
-                        rsp.msglen = 32;
-                        rsp.status = ST_DRV;
-                        PutPacket(&rsp);
-
-                        break;
+                        yield();                        // polling, wait a bit, let other processes run
                         }
+                    continue;
                     }
 
-                rsp.msglen = 32;
-                rsp.status = ST_SUC;
-                PutPacket(&rsp);
+                ctx->kind = Classify(&ctx->cmd);
+                ctx->unit = ctx->cmd.unit;
+                ctx->LBN = ctx->cmd.LBN;
+                ctx->size = ctx->cmd.bytecount;
+                ctx->addr = ctx->cmd.buffer_address;
 
-                break;
+                if(++MSCP_inflight > MSCP_max_inflight)MSCP_max_inflight = MSCP_inflight;
+                elevator.reorder = MSCP_elevator;
+                elevator.add(ctx);                      // queue the command
+                workPort.resume();                      // and wake an idle worker if there is one
                 }
 
-
-            default:                                    // unimplemented command
-                printf("packet received with opcode %d\n", cmd->opcode);
-                rsp.msglen = 12;
-                rsp.endcode = OP_END;
-                rsp.status = ST_CMD | I_OPCD;
-                PutPacket(&rsp);
-                }
+            FPGA_doorbell = nullptr;                    // FPGA interrupts go back to the console
+            stopping = true;                            // tell the workers to quit
+            while(workPort.resume()){}                  // wake all the idle ones so they notice
             }
-        else                                            // unrecognized protocol
+        else
             {
-            printf("received packet, type %d, vcid %d\n", cmd->msgtype, cmd->vcid);
+            MSCP_worker(workerbufs[id-1]);
             }
         }
 
-
+    for(unsigned n=0; n<MSCP_UNITS; n++)                // the host has to bring the units online again after the next init
+        {
+        UnitAvailable(n);
+        }
     }
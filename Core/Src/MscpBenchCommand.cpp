@@ -0,0 +1,555 @@
+// Measure the throughput of the MSCP disk I/O paths.
+// Reads a unit image in 64 KB transfers (the size of a typical large MSCP read)
+// and DMAs it to PDP-11 memory, once with each version of the read path,
+// through FatFs and, if the image is contiguous, through the raw backend,
+// and reports blocks per second for each.
+// Writes are measured the same way, but to a scratch file, so no unit image is disturbed.
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "local.h"
+#include "main.h"
+#include "cmsis.h"
+#include "omp.h"
+#include "serial.h"
+#include "ff.h"
+#include "diskio.h"
+#include "MSCP.hpp"
+#include "Elevator.hpp"
+
+extern "C" int SD_UseDMA;                               // in FATFS_SD.c
+extern "C" uint32_t SD_Clock[2];
+
+#define BENCH_XFER (64*1024)                            // bytes per simulated MSCP transfer
+#define BENCH_FILE "BENCH.img"                          // scratch file for the write benchmark
+
+static BlockBuffer benchbufs[MSCP_NBUF];                // pipeline buffers, separate from the MSCP workers' buffers
+static BlockBuffer benchbufs2[MSCP_NBUF];               // the second drive's buffers in the two drive benchmark
+
+
+// time sequential reads of <blocks> blocks from the start of a file, in BENCH_XFER transfers
+static float bench_read(FIL &file, uint32_t addr, unsigned blocks, bool pipelined, BlockBuffer *bufs = benchbufs)
+    {
+    float start = omp_get_wtime_float();
+
+    for(unsigned lbn=0; lbn<blocks && !ControlC; lbn += BENCH_XFER/512)
+        {
+        unsigned size = (blocks-lbn)*512 < BENCH_XFER ? (blocks-lbn)*512 : BENCH_XFER;
+        Segment seg = {addr, size};
+        unsigned status, moved;
+
+        status = pipelined ? ReadPipelined(file, lbn*512, &seg, 1, bufs, moved) : ReadSerial(file, lbn*512, &seg, 1, bufs, moved);
+        if(status != ST_SUC)
+            {
+            printf("read at LBN %u failed, status %u\n", lbn, status);
+            return 0;
+            }
+        }
+
+    return omp_get_wtime_float() - start;
+    }
+
+
+// time sequential writes of <blocks> blocks to the start of a file, in BENCH_XFER transfers
+static float bench_write(FIL &file, uint32_t addr, unsigned blocks, unsigned (*write)(FIL &, FSIZE_t, const Segment *, unsigned, BlockBuffer *, unsigned &))
+    {
+    float start = omp_get_wtime_float();
+
+    for(unsigned lbn=0; lbn<blocks && !ControlC; lbn += BENCH_XFER/512)
+        {
+        unsigned size = (blocks-lbn)*512 < BENCH_XFER ? (blocks-lbn)*512 : BENCH_XFER;
+        Segment seg = {addr, size};
+        unsigned status, moved;
+
+        status = write(file, lbn*512, &seg, 1, benchbufs, moved);
+        if(status != ST_SUC)
+            {
+            printf("write at LBN %u failed, status %u\n", lbn, status);
+            return 0;
+            }
+        }
+
+    return omp_get_wtime_float() - start;
+    }
+
+
+static void report(const char *name, unsigned blocks, float elapsed)
+    {
+    if(elapsed > 0)printf("%-14s %u blocks in %f sec, %f blocks/sec\n", name, blocks, elapsed, blocks/elapsed);
+    }
+
+
+// Scheduler trace replay
+//
+// Feeds a stream of read and write requests through the MSCP request scheduler,
+// keeping up to MAX_COMMANDS-1 of them queued, the way a busy host would,
+// once in arrival order and once reordered and merged by the elevator.
+// The stream is either read from a trace file, one request per line ("r <lbn> <blocks>" or
+// "w <lbn> <blocks>"), or generated to look like 2.11BSD's buffer cache: several
+// processes each reading 1 KB file system blocks sequentially, interleaved, with
+// occasional jumps and small writes near the start of the disk (inodes).
+// Each resulting read transfer is done against the unit image, if it could be opened,
+// to time the SD card. Writes are counted but not done, so the image is not changed.
+
+struct TraceGen
+    {
+    FIL *tf;                                            // the trace file, or null to generate requests
+    unsigned count;                                     // how many requests to generate
+    uint32_t limit;                                     // the size of the unit in blocks
+    uint32_t seed;
+    uint32_t stream[4];                                 // where each simulated process is reading
+
+    uint32_t random()
+        {
+        seed = seed*1103515245 + 12345;
+        return seed >> 8;
+        }
+
+    bool next(Request &r)
+        {
+        if(tf)
+            {
+            char line[40];
+            char *p = line;
+
+            if(f_gets(line, sizeof(line), tf) == nullptr)return false;
+            r.kind = *p == 'w' ? REQ_WRITE : REQ_READ;
+            skip(&p);
+            r.LBN = getdec(&p) % limit;
+            skip(&p);
+            r.size = getdec(&p) * 512;
+            return true;
+            }
+
+        if(count == 0)return false;
+        --count;
+
+        if(random()%10 == 0)                            // an inode update
+            {
+            r.kind = REQ_WRITE;
+            r.LBN = random() % (limit/16) & ~1;
+            r.size = 1024;
+            return true;
+            }
+
+        uint32_t &pos = stream[random()%4];
+        if(random()%8 == 0)pos = random() % limit & ~1; // the process moves on to another file
+        r.kind = REQ_READ;
+        r.LBN = pos;
+        r.size = 1024;
+        pos = (pos + 2) % limit;
+        return true;
+        }
+    };
+
+
+static void bench_replay(const char *title, TraceGen gen, FIL *image, bool reorder)
+    {
+    static Request reqs[ELEVATOR_MAX];
+    Request *idle[ELEVATOR_MAX];
+    unsigned nidle = 0;
+    Elevator el;
+    unsigned requests = 0;
+    unsigned transfers = 0;
+    unsigned blocks = 0;
+    unsigned writes = 0;
+    float distance = 0;                                 // total head movement, in blocks
+    uint32_t head = 0;
+    bool more = true;
+
+    for(auto &r : reqs)idle[nidle++] = &r;
+    el.reorder = reorder;
+
+    float start = omp_get_wtime_float();
+
+    while(!ControlC)
+        {
+        while(more && nidle > 1)                        // keep the queue full, the host holds back one credit
+            {
+            Request *r = idle[--nidle];
+
+            r->unit = 0;
+            r->addr = 0;
+            if(!(more = gen.next(*r)))
+                {
+                ++nidle;
+                break;
+                }
+            el.add(r);
+            ++requests;
+            }
+
+        Request *g = el.take();
+        if(g == nullptr)break;                          // the trace has been used up
+
+        ++transfers;
+        distance += g->LBN > head ? g->LBN - head : head - g->LBN;
+
+        unsigned size = 0;
+        for(Request *r = g; r; r = r->next)
+            {
+            size += r->size;
+            head = r->end();
+            }
+        blocks += size/512;
+
+        if(g->kind == REQ_WRITE)
+            {
+            ++writes;
+            }
+        else if(image && f_lseek(image, (FSIZE_t)g->LBN*512) == FR_OK)
+            {
+            for(unsigned off=0; off<size; off += MSCP_CHUNK)
+                {
+                UINT br;
+                f_read(image, benchbufs[0].data, size-off < MSCP_CHUNK ? size-off : MSCP_CHUNK, &br);
+                }
+            }
+
+        el.done(g);
+        for(Request *r = g; r; r = r->next)idle[nidle++] = r;
+        }
+
+    float elapsed = omp_get_wtime_float() - start;
+
+    printf("%-10s %u requests, %u transfers (%u writes), %f blocks/transfer, head movement %.0f blocks, most skips %u, aged %u",
+        title, requests, transfers, writes, transfers ? (float)blocks/transfers : 0.0f, distance, el.maxskips, el.aged);
+    if(image)printf(", %f sec", elapsed);
+    printf("\n");
+    }
+
+
+static void bench_trace(char *p)
+    {
+    FIL image;
+    FIL trace;
+    char name[16];
+    TraceGen gen = {};
+
+    int unit = getdec(&p);
+    skip(&p);
+    gen.count = isdigit(*p) ? getdec(&p) : 1000;
+    skip(&p);
+    gen.seed = 1;
+    gen.limit = 100000;
+
+    snprintf(name, sizeof(name), "UNIT%d.img", unit);
+    bool have_image = f_open(&image, name, FA_READ) == FR_OK;
+    if(have_image)
+        {
+        gen.limit = f_size(&image)/512;
+        }
+    else
+        {
+        printf("%s not found, only scheduling\n", name);
+        }
+    for(int i=0; i<4; i++)gen.stream[i] = gen.random() % gen.limit & ~1;
+
+    if(*p)
+        {
+        char *q = p;
+        while(*q && *q!=' ')q++;
+        *q = 0;
+
+        if(f_open(&trace, p, FA_READ) != FR_OK)
+            {
+            printf("opening %s failed\n", p);
+            if(have_image)f_close(&image);
+            return;
+            }
+        gen.tf = &trace;
+        }
+
+    bench_replay("in order:", gen, have_image ? &image : nullptr, false);
+
+    if(gen.tf)f_lseek(gen.tf, 0);
+    bench_replay("elevator:", gen, have_image ? &image : nullptr, true);
+
+    if(gen.tf)f_close(gen.tf);
+    if(have_image)f_close(&image);
+    }
+
+
+// time random seeks, each followed by a one block read, over a whole unit image
+// returns the average time per seek in microseconds
+
+static float bench_seek(FIL &file, unsigned seeks)
+    {
+    uint32_t seed = 1;
+    DWORD blocks = f_size(&file)/512;
+    float start = omp_get_wtime_float();
+
+    for(unsigned i=0; i<seeks && !ControlC; i++)
+        {
+        UINT br;
+
+        seed = seed*1103515245 + 12345;
+        if(f_lseek(&file, (FSIZE_t)((seed>>8) % blocks) * 512) != FR_OK
+        || f_read(&file, benchbufs[0].data, 512, &br) != FR_OK)
+            {
+            printf("seek %u failed\n", i);
+            return 0;
+            }
+        }
+
+    return (omp_get_wtime_float() - start) * 1000000 / seeks;
+    }
+
+
+static void bench_seeks(char *p)
+    {
+    static DWORD clmt[MSCP_CLMT];
+    FIL file;
+    char name[16];
+
+    int unit = getdec(&p);
+    skip(&p);
+    unsigned seeks = isdigit(*p) ? getdec(&p) : 1000;
+
+    snprintf(name, sizeof(name), "UNIT%d.img", unit);
+    if(f_open(&file, name, FA_READ) != FR_OK)
+        {
+        printf("opening %s failed\n", name);
+        return;
+        }
+
+    if(f_size(&file) < 512)
+        {
+        printf("%s is empty\n", name);
+        f_close(&file);
+        return;
+        }
+
+    printf("FAT chain:   %f usec per seek\n", bench_seek(file, seeks));
+
+    if(BuildLinkMap(file, clmt, MSCP_CLMT))
+        {
+        printf("fast seek:   %f usec per seek (%lu fragments)\n", bench_seek(file, seeks), (clmt[0]-2)/2);
+        }
+    else
+        {
+        printf("%s has too many fragments for the cluster link map\n", name);
+        }
+
+    f_close(&file);
+    }
+
+
+// time raw sector reads from the start of an SD card, <count> sectors per command
+// returns sectors per second
+
+static float bench_card(BYTE drv, unsigned sectors, unsigned count)
+    {
+    float start = omp_get_wtime_float();
+
+    for(unsigned s=0; s<sectors && !ControlC; s += count)
+        {
+        if(disk_read(drv, (BYTE *)benchbufs[0].data, s, count) != RES_OK)
+            {
+            printf("read of sector %u failed\n", s);
+            return 0;
+            }
+        }
+
+    return sectors / (omp_get_wtime_float() - start);
+    }
+
+
+static void bench_cards(char *p)
+    {
+    BYTE drv = getdec(&p);
+    skip(&p);
+    unsigned sectors = isdigit(*p) ? getdec(&p) : 4096;
+    int dma = SD_UseDMA;
+
+    if(drv > 1)
+        {
+        printf("drive must be 0 or 1\n");
+        return;
+        }
+
+    printf("SPI clock %f MHz\n", SD_Clock[drv] / 1e6f);
+    SD_UseDMA = 0;
+    printf("programmed I/O, single:  %f sectors/sec\n", bench_card(drv, sectors, 1));
+    printf("programmed I/O, multi:   %f sectors/sec\n", bench_card(drv, sectors, MSCP_CHUNK/512));
+    SD_UseDMA = 1;
+    printf("DMA, single:             %f sectors/sec\n", bench_card(drv, sectors, 1));
+    printf("DMA, multi:              %f sectors/sec\n", bench_card(drv, sectors, MSCP_CHUNK/512));
+    SD_UseDMA = dma;
+    }
+
+
+// Two drives
+//
+// Reads an image on each SD card, first one card after the other, then both at once from two
+// threads, with the drives sharing one lock and with each drive having its own. With their own
+// locks (and DMA, see FATFS_SD.c) the two transfers overlap and the aggregate rate should be
+// close to the sum of the two.
+
+static float bench_both(FIL *files, uint32_t addr, unsigned blocks)
+    {
+    float start = omp_get_wtime_float();
+
+    #pragma omp parallel num_threads(2)
+    if(omp_get_num_threads() < 2)                       // if the thread pool was empty
+        {
+        bench_read(files[0], addr, blocks, false, benchbufs);
+        bench_read(files[1], addr, blocks, false, benchbufs2);
+        }
+    else
+        {
+        int i = omp_get_thread_num();
+
+        bench_read(files[i], addr, blocks, false, i == 0 ? benchbufs : benchbufs2);
+        }
+
+    return omp_get_wtime_float() - start;
+    }
+
+
+static void bench_drives(char *p)
+    {
+    FIL files[2];
+    char name[16];
+    bool parallel = MSCP_parallel_drives;
+
+    for(int drv=0; drv<2; drv++)
+        {
+        int unit = getdec(&p);
+        skip(&p);
+
+        snprintf(name, sizeof(name), "%d:UNIT%d.img", drv, unit);
+        if(f_open(&files[drv], name, FA_READ) != FR_OK)
+            {
+            printf("opening %s failed\n", name);
+            if(drv == 1)f_close(&files[0]);
+            return;
+            }
+        }
+
+    unsigned blocks = isdigit(*p) ? getdec(&p) : 1024;
+    skip(&p);
+    uint32_t addr = isxdigit(*p) ? gethex(&p) : 0;
+
+    for(auto &file : files)
+        {
+        if(blocks > f_size(&file)/512)blocks = f_size(&file)/512;
+        }
+
+    report("drive 0:", blocks, bench_read(files[0], addr, blocks, false));
+    report("drive 1:", blocks, bench_read(files[1], addr, blocks, false));
+    MSCP_parallel_drives = false;
+    report("both, 1 lock:", 2*blocks, bench_both(files, addr, blocks));
+    MSCP_parallel_drives = true;
+    report("both, 2 locks:", 2*blocks, bench_both(files, addr, blocks));
+    MSCP_parallel_drives = parallel;
+
+    f_close(&files[0]);
+    f_close(&files[1]);
+    }
+
+
+void MscpBenchCommand(char *p)
+    {
+    FIL file;
+    char name[16];
+
+    if(*p == 'w')
+        {
+        skip(&p);
+        unsigned blocks = isdigit(*p) ? getdec(&p) : 1024;
+        skip(&p);
+        uint32_t addr = isxdigit(*p) ? gethex(&p) : 0;
+
+        if(f_open(&file, BENCH_FILE, FA_READ | FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+            {
+            printf("creating %s failed\n", BENCH_FILE);
+            return;
+            }
+
+        report("serial:", blocks, bench_write(file, addr, blocks, WriteSerial));
+        report("pipelined:", blocks, bench_write(file, addr, blocks, WritePipelined));
+
+        float start = omp_get_wtime_float();
+        float queued = bench_write(file, addr, blocks, WriteBehind);
+        WriteBehindFlush();
+        float flushed = omp_get_wtime_float() - start;
+        report("write-behind:", blocks, queued);
+        report("  incl. flush:", blocks, flushed);
+
+        f_close(&file);
+        return;
+        }
+
+    if(*p == 's')
+        {
+        skip(&p);
+        bench_trace(p);
+        return;
+        }
+
+    if(*p == 'c')
+        {
+        skip(&p);
+        bench_cards(p);
+        return;
+        }
+
+    if(*p == 'd')
+        {
+        skip(&p);
+        bench_drives(p);
+        return;
+        }
+
+    if(*p == 'k')
+        {
+        skip(&p);
+        bench_seeks(p);
+        return;
+        }
+
+    if(*p != 'r')
+        {
+        printf("mb r <unit> <blocks> <addr>     time sequential 64 KB reads from UNIT<unit>.img to PDP-11 <addr>\n");
+        printf("mb w <blocks> <addr>            time sequential 64 KB writes from PDP-11 <addr> to %s\n", BENCH_FILE);
+        printf("mb s <unit> <requests> [trace]  replay a request trace through the scheduler, in order and reordered\n");
+        printf("mb k <unit> <seeks>             time random seeks in UNIT<unit>.img, with and without fast seek\n");
+        printf("mb c <drive> <sectors>          time raw sector reads from SD card <drive>, with and without DMA\n");
+        printf("mb d <u0> <u1> <blocks> <addr>  time reads of 0:UNIT<u0>.img and 1:UNIT<u1>.img, one after the other and at once\n");
+        return;
+        }
+    skip(&p);
+
+    int unit = getdec(&p);
+    skip(&p);
+    unsigned blocks = isdigit(*p) ? getdec(&p) : 1024;
+    skip(&p);
+    uint32_t addr = isxdigit(*p) ? gethex(&p) : 0;
+
+    snprintf(name, sizeof(name), "UNIT%d.img", unit);
+    if(f_open(&file, name, FA_READ) != FR_OK)
+        {
+        printf("opening %s failed\n", name);
+        return;
+        }
+
+    if(blocks > f_size(&file)/512)blocks = f_size(&file)/512;
+
+    report("serial:", blocks, bench_read(file, addr, blocks, false));
+    report("pipelined:", blocks, bench_read(file, addr, blocks, true));
+
+    if(AttachExtent(file))                              // the same again, bypassing FatFs
+        {
+        report("raw serial:", blocks, bench_read(file, addr, blocks, false));
+        report("raw pipelined:", blocks, bench_read(file, addr, blocks, true));
+        DetachExtent(file);
+        }
+    else
+        {
+        printf("%s is fragmented, no raw backend\n", name);
+        }
+
+    f_close(&file);
+    }
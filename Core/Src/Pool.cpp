@@ -0,0 +1,91 @@
+// The pools' statistics, and the "mem" command's report of them, see Pool.hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include "Pool.hpp"
+
+PoolStats *PoolStats::first = nullptr;
+
+
+// a pool is made, add it to the chain
+
+PoolStats::PoolStats(const char *name, unsigned size, unsigned count, const void *base) :
+    name(name), size(size), count(count), base(base), used(0), peak(0), empty(0), next(nullptr)
+    {
+    PoolStats **p = &first;
+
+    while(*p)p = &(*p)->next;                           // in the order they were made
+    *p = this;
+    }
+
+
+// count an object taken, and raise the watermark if this is the most yet
+
+void PoolStats::taken()
+    {
+    unsigned n, m;
+
+    do  {
+        n = PoolLoad(used) + 1;
+        } while(!PoolStore(n, used));
+
+    do  {
+        m = PoolLoad(peak);
+        if(n <= m)
+            {
+            PoolCancel();
+            return;
+            }
+        } while(!PoolStore(n, peak));
+    }
+
+void PoolStats::given()
+    {
+    unsigned n;
+
+    do  {
+        n = PoolLoad(used) - 1;
+        } while(!PoolStore(n, used));
+    }
+
+void PoolStats::missed()
+    {
+    unsigned n;
+
+    do  {
+        n = PoolLoad(empty) + 1;
+        } while(!PoolStore(n, empty));
+    }
+
+void PoolStats::clear()
+    {
+    peak = used;
+    empty = 0;
+    }
+
+
+// the memory an address is in, see MPU_Config and the linker script
+
+static const char *Where(const void *p)
+    {
+    uintptr_t a = (uintptr_t)p;
+
+    if(a >= 0x20000000 && a < 0x20020000)return "DTCM";
+    if(a >= 0x24000000 && a < 0x24050000)return "AXI SRAM";
+    return "";
+    }
+
+
+// mem {c}      show the pools, c to start their watermarks and wait counts again
+
+void PoolCommand(char *p)
+    {
+    bool clear = *p == 'c';
+
+    printf("pool                      size  count  in use  most  waits\n");
+    for(PoolStats *pool = PoolStats::first; pool; pool = pool->next)
+        {
+        printf("%-24s %5u %6u %7u %5u %6u  %s\n", pool->name, pool->size, pool->count, pool->used, pool->peak, pool->empty, Where(pool->base));
+        if(clear)pool->clear();
+        }
+    }
@@ -10,6 +10,8 @@
 #include "cmsis.h"
 #include <context.hpp>
 #include <Port.hpp>
+#include "ContextFIFO.hpp"
+#include "CriticalRegion.hpp"
 
 
 // Suspend the current context at the port
@@ -89,3 +91,23 @@ void Port::resume_switch()
     );
     }
 
+
+// Wait at the port for an interrupt handler to end a transfer, letting other threads run
+// in the meantime. The handler sets <status>, 0 while the transfer runs, above 0 when it
+// succeeded or below 0 when it failed, and then resumes the port.
+// returns true if the transfer succeeded
+bool Port::await(volatile int &status)
+    {
+    CRITICAL_REGION(InterruptLock)                      // the interrupt can't slip in between the test and the suspend
+        {
+        if(status == 0)
+            {
+            suspend();
+            }
+        }
+
+    yield();                                            // if the ISR resumed us we are running at interrupt level, get back to thread level
+
+    return status > 0;
+    }
+
@@ -0,0 +1,116 @@
+// Moves the data of the FPGA's burst engine between RAM and its window by MDMA (see Qbus.cpp).
+// A thread sleeps while its burst's data goes to or from FADDR_DMA_FIFO, and the MDMA
+// interrupt at the end of the block resumes it, so the core runs other threads rather
+// than doing a 60 to 80 ns FMC cycle per word itself.
+// Only the thread holding qbus_lock moves the window's data, so one channel each way is enough.
+
+#include <stdint.h>
+#include "main.h"
+#include "cmsis.h"
+#include "context.hpp"
+#include "Port.hpp"
+#include "Qbus.hpp"
+
+extern "C" MDMA_HandleTypeDef hmdma_qbus_out;           // used by MDMA_IRQHandler, in stm32h7xx_it.c
+extern "C" MDMA_HandleTypeDef hmdma_qbus_in;
+
+MDMA_HandleTypeDef hmdma_qbus_out;                      // RAM to the data port, for DATO
+MDMA_HandleTypeDef hmdma_qbus_in;                       // the data port to RAM, for DATI
+
+static Port QMDMA_Port;                                 // where the thread waits for the transfer
+static volatile int QMDMA_Status;                       // 0 while the MDMA is running, 1 when done, -1 on error
+static bool ready = false;
+
+
+static void Done(MDMA_HandleTypeDef *hmdma)
+    {
+    QMDMA_Status = 1;
+    QMDMA_Port.resume();
+    }
+
+static void Failed(MDMA_HandleTypeDef *hmdma)
+    {
+    QMDMA_Status = -1;
+    QMDMA_Port.resume();
+    }
+
+
+// set up a channel to move halfwords one at a time, a whole block for each software request
+// The port end doesn't increment, it is always FADDR_DMA_FIFO.
+
+static bool Setup(MDMA_HandleTypeDef *hmdma, MDMA_Channel_TypeDef *channel, bool toPort)
+    {
+    hmdma->Instance = channel;
+    hmdma->Init.Request = MDMA_REQUEST_SW;
+    hmdma->Init.TransferTriggerMode = MDMA_BLOCK_TRANSFER;
+    hmdma->Init.Priority = MDMA_PRIORITY_HIGH;
+    hmdma->Init.Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE;
+    hmdma->Init.SourceInc = toPort ? MDMA_SRC_INC_HALFWORD : MDMA_SRC_INC_DISABLE;
+    hmdma->Init.DestinationInc = toPort ? MDMA_DEST_INC_DISABLE : MDMA_DEST_INC_HALFWORD;
+    hmdma->Init.SourceDataSize = MDMA_SRC_DATASIZE_HALFWORD;
+    hmdma->Init.DestDataSize = MDMA_DEST_DATASIZE_HALFWORD;
+    hmdma->Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+    hmdma->Init.BufferTransferLength = 2*QDMA_WORDS;
+    hmdma->Init.SourceBurst = MDMA_SOURCE_BURST_SINGLE;
+    hmdma->Init.DestBurst = MDMA_DEST_BURST_SINGLE;
+    hmdma->Init.SourceBlockAddressOffset = 0;
+    hmdma->Init.DestBlockAddressOffset = 0;
+    if(HAL_MDMA_Init(hmdma) != HAL_OK)return false;
+
+    hmdma->XferCpltCallback = Done;
+    hmdma->XferErrorCallback = Failed;
+    return true;
+    }
+
+
+// set up both channels, once
+// returns false if they can't be used, and the CPU copies the window's data
+
+bool QMDMAInit()
+    {
+    if(ready)return true;
+
+    __HAL_RCC_MDMA_CLK_ENABLE();
+    if(!Setup(&hmdma_qbus_out, MDMA_Channel0, true))return false;
+    if(!Setup(&hmdma_qbus_in, MDMA_Channel1, false))return false;
+    HAL_NVIC_SetPriority(MDMA_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(MDMA_IRQn);
+    ready = true;
+    return true;
+    }
+
+
+// run a block transfer of <size> words and sleep until it ends, letting other threads run in the meantime
+// returns true if it succeeded
+
+static bool Run(MDMA_HandleTypeDef *hmdma, uint32_t src, uint32_t dst, int size)
+    {
+    QMDMA_Status = 0;
+    if(HAL_MDMA_Start_IT(hmdma, src, dst, 2*size, 1) != HAL_OK)return false;
+    return QMDMA_Port.await(QMDMA_Status);
+    }
+
+
+// move <size> words from <buffer> to the window, for a DATO burst
+// The MDMA reads memory, not the cache, so the buffer is cleaned first. Cleaning doesn't
+// change what is in the buffer, so it needn't be in whole cache lines.
+
+bool QMDMAWrite(const uint16_t *buffer, int size)
+    {
+    SCB_CleanDCache_by_Addr((uint32_t *)buffer, 2*size);
+    return Run(&hmdma_qbus_out, (uint32_t)buffer, (uint32_t)&FADDR_DMA_FIFO, size);
+    }
+
+
+// move <size> words from the window to <buffer>, after a DATI burst
+// The buffer must be whole cache lines, since the lines are dropped from the cache,
+// before so that no dirty line is evicted on top of what the MDMA writes, and after
+// to drop anything speculatively loaded during the transfer.
+
+bool QMDMARead(uint16_t *buffer, int size)
+    {
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t *)buffer, 2*size);
+    if(!Run(&hmdma_qbus_in, (uint32_t)&FADDR_DMA_FIFO, (uint32_t)buffer, size))return false;
+    SCB_InvalidateDCache_by_Addr((uint32_t *)buffer, 2*size);
+    return true;
+    }
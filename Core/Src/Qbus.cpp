@@ -8,6 +8,8 @@
 #include "local.h"
 #include "cyccnt.hpp"
 #include "Qbus.hpp"
+#include "ContextFIFO.hpp"
+#include "mutex.hpp"
 
 #define FMC_WRITE_TIME 60                       // minimum FMC write cycle time
 
@@ -20,7 +22,8 @@
 #define Q_TURN 300                              // turnaround from BRPLY deasserted to next BSYNC asserted
 #define Q_RDATA_SETUP 200                       // after BRPLY asserted, read data setup before taking data sample and deasserting BDIN
 #define Q_DMA_TURN 250                          // delay from BSACK asserted to BSYNC asserted by DMA master
-#define Q_DMA_HOLDOFF 4000                      // min delay from BSACK deasserted to next assertion of BDMR
+#define Q_DMA_HOLDOFF 4000                      // default min delay from BSACK deasserted to next assertion of BDMR
+#define Q_MAX_HOLDOFF 25500                     // the longest holdoff the FPGA can time, and the longest wait for any Target
 
 
 
@@ -28,10 +31,38 @@
 static Q_Ctl Ctl = {};                                      // CTL struct
 static unsigned stamp2 = 0;                                 // reference time stamp for Qbus turnaround (BSYNC-to-BSYNC delay)
 static unsigned Target = 0;
+static mutex qbus_lock;                                     // held by a thread that is bus master, either by Q_Ctl or through the burst engine
+
+static bool has_engine = false;                             // the FPGA has the burst engine
+static bool has_fifo = false;                               // and the data port, and the MDMA is set up to use it
+bool Qbus_burst = false;                                    // when true, block transfers are run by the FPGA's burst engine, which is off until turned on, see QbusInit
+bool Qbus_block = true;                                     // when true, bursts ask for block mode, falling back to single word cycles if the memory doesn't assert BREF
+unsigned Qbus_nxm = 0;                                      // number of bursts abandoned for lack of BRPLY
+
+// DMA tenure policy, see QbusPolicy
+unsigned Qbus_tenure = QDMA_TENURE;                         // the most words per bus tenure, 0 for no limit
+unsigned Qbus_holdoff = Q_DMA_HOLDOFF;                      // ns from the end of one tenure to the next bus request
+bool Qbus_demand = false;                                   // when true, also end a tenure as soon as another device wants the bus
+unsigned Qbus_bursts = 0;                                   // number of bursts run
+unsigned Qbus_block_bursts = 0;                             // number of bursts that the memory took at least partly in block mode
+
+// moving the burst engine's data, see WindowWrite and WindowRead
+#define QMDMA_MIN 16                                        // shorter bursts are copied by the CPU, quicker than starting the MDMA and switching threads
+bool Qbus_mdma = false;                                     // when true, the MDMA moves the data through FADDR_DMA_FIFO, which is off until turned on, see QbusInit
+unsigned Qbus_mdma_words = 0;                               // number of words moved by the MDMA
+
+// interrupts, see Qinterrupt
+static bool has_irq = false;                                // the FPGA can interrupt the PDP-11
+bool Qbus_irq = false;                                      // when true, interrupts are sent through the FPGA, which is off until turned on, see QbusInit
+uint16_t vector = 0;                                        // set by the host at UQSSP step 1, 0 if it doesn't want interrupts
+unsigned Qbus_irq_level = 4;                                // BR4, BR5 or BR6
+unsigned Qbus_irq_holdoff = 0;                              // us from one interrupt acknowledge to the next request
+unsigned Qbus_interrupts = 0;                               // number of interrupts requested
+unsigned Qbus_irq_merged = 0;                               // number of requests merged with one still waiting
 
 #define DELAYFOR(time)  do{__COMPILER_BARRIER(); for(unsigned stamp = Now(), end = TicksPer(time); Now()-stamp  < end;); __COMPILER_BARRIER();}while(false)
 #define DELAYFOR2(time) do{__COMPILER_BARRIER(); for(unsigned                end = TicksPer(time); Now()-stamp2 < end;); __COMPILER_BARRIER();}while(false)
-#define DELAYUNTIL(target) do{__COMPILER_BARRIER(); if((target)-Now()<TicksPer(Q_DMA_HOLDOFF))while((int)(target)-(int)Now() >0); __COMPILER_BARRIER();}while(false)
+#define DELAYUNTIL(target) do{__COMPILER_BARRIER(); if((target)-Now()<TicksPer(Q_MAX_HOLDOFF))while((int)(target)-(int)Now() >0); __COMPILER_BARRIER();}while(false)
 
 #define ASSERT(signal)    do {__COMPILER_BARRIER(); Ctl.signal = 1; FADDR_CT = Ctl.value; __COMPILER_BARRIER();}while(false)
 #define DEASSERT(signal)  do {__COMPILER_BARRIER(); Ctl.signal = 0; FADDR_CT = Ctl.value; __COMPILER_BARRIER();}while(false)
@@ -53,11 +84,62 @@ void QbusInit()
     ASSERT(Clear_SA);               // clear the SA register written by the PDP-11
     (void)FADDR_ST;                 // clear status bits and SA register register written by the PDP-11
     DEASSERT(Clear_SA);
+
+    FADDR_DMA_TEN = QDMA_TENURE;    // an FPGA without the burst engine reads this back as 0
+    has_engine = FADDR_DMA_TEN == QDMA_TENURE;
+    Qbus_burst = false;             // not until qbus/tb/tb_burst passes on the FPGA's qbus.sv, "b m block" turns it on
+    FADDR_DMA_CNT = 0;              // which also puts the data port at word 0
+    has_fifo = has_engine && (FADDR_DMA_CT & QDMA_FIFO) && QMDMAInit();
+    Qbus_mdma = false;              // likewise until qbus/tb/tb_fifo passes, "b m mdma" turns it on
+
+    FADDR_IRQ_HOLD = 1;             // likewise for the interrupt registers
+    has_irq = FADDR_IRQ_HOLD == 1;
+    Qbus_irq = false;               // and until qbus/tb/tb_iak passes, "b i on" turns them on, the host polling meanwhile
+    QinterruptCancel();
+    QbusPolicy();
+    }
+
+
+// Apply the DMA tenure policy, after changing Qbus_tenure, Qbus_holdoff, Qbus_demand, Qbus_burst, Qbus_mdma or Qbus_irq.
+// Long tenures and short holdoffs suit a machine where nothing else does DMA.
+// On a busy bus, Qbus_demand keeps tenures long while the bus is otherwise idle,
+// but gives the bus up as soon as another device asks for it (the FPGA sees BDMGI).
+
+void QbusPolicy()
+    {
+    if(Qbus_tenure > 127)Qbus_tenure = 127;
+    if(Qbus_holdoff > Q_MAX_HOLDOFF)Qbus_holdoff = Q_MAX_HOLDOFF;
+    if(Qbus_irq_level < 4 || Qbus_irq_level > 6)Qbus_irq_level = 4;
+    if(Qbus_irq_holdoff > 6553)Qbus_irq_holdoff = 6553;
+    if(!has_engine)Qbus_burst = false;
+    if(!has_fifo)Qbus_mdma = false;
+    if(!has_irq)Qbus_irq = false;
+
+    if(has_engine)
+        {
+        FADDR_DMA_TEN = Qbus_tenure;
+        FADDR_DMA_HOLD = (Qbus_holdoff + 99) / 100;
+        }
+    if(has_irq)
+        {
+        FADDR_IRQ_HOLD = Qbus_irq_holdoff * 10;
+        }
+    }
+
+
+// true if a CPU sequenced block transfer should give up the bus after word <i> of <size>
+
+static inline bool TenureOver(int i, int size)
+    {
+    if(i+1 >= size)return false;                            // the transfer is ending anyway
+    if(Qbus_demand && has_engine && (FADDR_DMA_CT & QDMA_GRANT))return true;
+    return Qbus_tenure && (i+1) % Qbus_tenure == 0;
     }
 
 void QDMAbegin()
     {
-    DELAYUNTIL(Target);                                     // wait until at least 4 usec since lst DMA
+    qbus_lock.lock();                                       // wait for any burst run by another thread
+    DELAYUNTIL(Target);                                     // wait until at least the holdoff since the last DMA
     __disable_irq();
     ASSERT(BDMR);
     WAITFOR(BSACK);
@@ -69,7 +151,68 @@ void QDMAend()
     {
     PULSE(DMA_done);                                        // this turns off BSACK
     __enable_irq();
-    Target = Now() + TicksPer(Q_DMA_HOLDOFF);             // must wait at least 4 usec before requesting DMA again
+    Target = Now() + TicksPer(Qbus_holdoff);              // must wait at least the holdoff before requesting DMA again
+    qbus_lock.unlock();
+    }
+
+
+// Run a burst of <size> words (at most QDMA_WORDS) in the FPGA's burst engine, as DATO if <write>, else DATI.
+// The FPGA does the bus request, the handshake of every cycle, and gives the bus up as set by QbusPolicy.
+// With Qbus_block, words after the first of each tenure are moved in block mode if the memory supports it.
+// Other threads run in the meantime. The data is in the window at FADDR_DMA_BUF, and the caller holds qbus_lock.
+// Returns false if the PDP-11 did not reply.
+
+static bool QBurst(uint32_t addr, int size, bool write)
+    {
+    DELAYUNTIL(Target);                                     // the holdoff after a CPU sequenced tenure
+    FADDR_LO = addr&0xFFFF;
+    FADDR_HI = addr>>16;
+    FADDR_DMA_CNT = size;
+    FADDR_DMA_CT = QDMA_START | (write ? QDMA_DATO : 0) | (Qbus_block ? QDMA_BLOCK : 0) | (Qbus_demand ? QDMA_DEMAND : 0);
+
+    uint16_t status;
+    while((status = FADDR_DMA_CT) & QDMA_BUSY)
+        {
+        yield();
+        }
+
+    ++Qbus_bursts;
+    if(status & QDMA_BLOCKED)++Qbus_block_bursts;
+
+    if(status & QDMA_NXM)
+        {
+        ++Qbus_nxm;
+        printf("Qbus burst at %08lo got no reply\n", addr);
+        return false;
+        }
+    return true;
+    }
+
+
+// Move a DATO burst's <size> words into the window, or a DATI burst's out of it.
+// Long enough bursts go by the MDMA, through FADDR_DMA_FIFO, and the thread sleeps
+// while it runs, else the CPU copies them. A read by the MDMA must be into whole
+// cache lines (see QMDMA.cpp), which the block buffers and cache lines are, and the
+// command and response packets aren't. If the MDMA fails the CPU does it over.
+
+static void WindowWrite(const uint16_t *buffer, int size)
+    {
+    if(Qbus_mdma && size >= QMDMA_MIN && QMDMAWrite(buffer, size))
+        {
+        Qbus_mdma_words += size;
+        return;
+        }
+    for(int j=0; j<size; j++)FADDR_DMA_BUF[j] = buffer[j];
+    }
+
+static void WindowRead(uint16_t *buffer, int size)
+    {
+    if(Qbus_mdma && size >= QMDMA_MIN && ((uintptr_t)buffer & 31) == 0 && (size & 15) == 0 && QMDMARead(buffer, size))
+        {
+        Qbus_mdma_words += size;
+        return;
+        }
+    for(int j=0; j<size; j++)buffer[j] = FADDR_DMA_BUF[j];
     }
 
 
@@ -148,45 +291,113 @@ void Qwrite(uint32_t addr, uint16_t data)
     DEASSERT(BSYNC);
     }
 
-void QReadBlock(uint32_t addr, uint16_t *buffer, int size)
+
+// Move <size> words between PDP-11 memory at <addr> and <buffer>, by the burst engine or CPU sequenced.
+// Returns the number of words moved, less than <size> if a burst got no reply. The words of
+// that burst are not counted, and for a read are not in the buffer.
+
+int QReadBlock(uint32_t addr, uint16_t *buffer, int size)
     {
+    if(Qbus_burst)
+        {
+        int i;
+
+        qbus_lock.lock();
+        for(i=0; i<size; i += QDMA_WORDS)
+            {
+            int n = size-i < QDMA_WORDS ? size-i : QDMA_WORDS;
+
+            if(!QBurst(addr+i*2, n, false))break;
+            WindowRead(&buffer[i], n);
+            }
+        qbus_lock.unlock();
+        return i < size ? i : size;
+        }
+
     QDMAbegin();
     for(int i=0; i<size; i++)
         {
         buffer[i] = Qread(addr+i*2);
-        if((i&7)==7 && i<size)
+        if(TenureOver(i, size))
             {
             QDMAend();
             QDMAbegin();
             }
         }
     QDMAend();
+    return size;
     }
 
-void QWriteBlock(uint32_t addr, uint16_t *buffer, int size)
+int QWriteBlock(uint32_t addr, uint16_t *buffer, int size)
     {
+    if(Qbus_burst)
+        {
+        int i;
+
+        qbus_lock.lock();
+        for(i=0; i<size; i += QDMA_WORDS)
+            {
+            int n = size-i < QDMA_WORDS ? size-i : QDMA_WORDS;
+
+            WindowWrite(&buffer[i], n);
+            if(!QBurst(addr+i*2, n, true))break;
+            }
+        qbus_lock.unlock();
+        return i < size ? i : size;
+        }
+
     QDMAbegin();
     for(int i=0; i<size; i++)
         {
         Qwrite(addr+i*2, buffer[i]);
-        if((i&7)==7 && i<size)
+        if(TenureOver(i, size))
             {
             QDMAend();
             QDMAbegin();
             }
         }
     QDMAend();
+    return size;
     }
 
 
 
-uint16_t vector = 0;
+// Interrupt the PDP-11 at <vector>, at level Qbus_irq_level.
+// The FPGA runs the acknowledge cycle. A request made while another is still waiting,
+// or held off after the last acknowledge (Qbus_irq_holdoff), is merged with it: the
+// host gets one interrupt, and finds all the responses sent before it was acknowledged.
 
 void Qinterrupt()
     {
-    if(vector)
+    if(vector == 0 || !Qbus_irq)return;                     // the host didn't enable interrupts, or they are off
+
+    if(FADDR_IRQ_CT & QIRQ_PENDING)
         {
+        ++Qbus_irq_merged;
+        return;
+        }
+
+    FADDR_IRQ_VEC = vector;
+    FADDR_IRQ_CT = QIRQ_REQUEST | QIRQ_LEVEL(Qbus_irq_level);
+    ++Qbus_interrupts;
+    }
+
 
+// drop a request not yet acknowledged, when the host initializes the controller
+
+void QinterruptCancel()
+    {
+    if(has_irq)
+        {
+        FADDR_IRQ_CT = QIRQ_CANCEL | QIRQ_LEVEL(Qbus_irq_level);
         }
     }
 
+
+// true if the FPGA can interrupt the PDP-11
+
+bool QinterruptAvailable()
+    {
+    return has_irq;
+    }
+
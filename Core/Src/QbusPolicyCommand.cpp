@@ -0,0 +1,187 @@
+// Set the Qbus DMA tenure policy, and compare policies on a simulated bus.
+// Also set the interrupt level and holdoff.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include "local.h"
+#include "main.h"
+#include "cmsis.h"
+#include "serial.h"
+#include "Qbus.hpp"
+
+#define SIM_TICKS 200000                                // simulated time, in 100 ns clocks (20 ms)
+#define SIM_CYCLE 12                                    // clocks per DATI or DATO cycle
+#define SIM_ARB 5                                       // clocks from a grant to the first cycle
+#define SIM_OTHER_WORDS 4                               // words moved by the other device per tenure
+#define SIM_QUEUE 16                                    // the most requests the other device can have waiting
+
+struct Policy
+    {
+    const char *name;
+    unsigned tenure;                                    // the most words per tenure, 0 for no limit
+    unsigned holdoff;                                   // ns from the end of one tenure to the next request
+    bool demand;                                        // end a tenure as soon as the other device asks for the bus
+    };
+
+
+// Simulated arbiter
+//
+// The controller always has data to move, as in a long disk transfer. Another device,
+// nearer the processor and so ahead of the controller in the grant chain, asks for the
+// bus at random, often enough to use <load> percent of it, and moves SIM_OTHER_WORDS
+// words each time. The bus is given to the other device whenever it is waiting and the
+// bus is free. Reports the controller's throughput and how long the other device waited.
+
+static void Simulate(const Policy &pol, unsigned load)
+    {
+    uint32_t seed = 12345;
+    uint32_t threshold = (uint32_t)(load * (4294967295.0f / 100 / (SIM_ARB + SIM_OTHER_WORDS*SIM_CYCLE)));
+    unsigned queue[SIM_QUEUE];                          // when each waiting request was made
+    unsigned head = 0, nqueued = 0;
+    enum { FREE, US, OTHER } owner = FREE;
+    unsigned busy = 0;                                  // clocks left in the current cycle or tenure
+    unsigned holdoff = 0;                               // clocks left before the controller may ask again
+    unsigned words = 0;                                 // words moved by the controller
+    unsigned tenure_words = 0;
+    unsigned tenures = 0;
+    unsigned waits = 0;
+    float wait_total = 0;
+    unsigned wait_max = 0;
+
+    for(unsigned t=0; t<SIM_TICKS; t++)
+        {
+        seed = seed*1103515245 + 12345;
+        if(seed < threshold && nqueued < SIM_QUEUE)     // the other device asks for the bus
+            {
+            queue[(head + nqueued++) % SIM_QUEUE] = t;
+            }
+
+        if(holdoff)--holdoff;
+        if(busy)
+            {
+            --busy;
+            continue;
+            }
+
+        if(owner == US)                                 // a cycle has ended, keep the bus or give it up
+            {
+            if((pol.tenure && tenure_words == pol.tenure) || (pol.demand && nqueued))
+                {
+                owner = FREE;
+                holdoff = pol.holdoff / 100;
+                }
+            else
+                {
+                busy = SIM_CYCLE;
+                ++words;
+                ++tenure_words;
+                }
+            }
+        else if(owner == OTHER)
+            {
+            owner = FREE;
+            }
+
+        if(owner == FREE)
+            {
+            if(nqueued)
+                {
+                unsigned wait = t - queue[head];
+
+                head = (head + 1) % SIM_QUEUE;
+                --nqueued;
+                wait_total += wait;
+                if(wait > wait_max)wait_max = wait;
+                ++waits;
+                owner = OTHER;
+                busy = SIM_ARB + SIM_OTHER_WORDS*SIM_CYCLE;
+                }
+            else if(holdoff == 0)
+                {
+                owner = US;
+                busy = SIM_ARB;
+                tenure_words = 0;
+                ++tenures;
+                }
+            }
+        }
+
+    printf("%-16s %f KB/s  %6u tenures  other device waited %f us on average, %f us at most\n",
+        pol.name, words * 2 / (SIM_TICKS / 1e4f), tenures,
+        waits ? wait_total / waits / 10 : 0, wait_max / 10.0f);
+    }
+
+
+// b t {<words> {<holdoff ns>}} {demand|fixed}   set the tenure policy
+// b a {<load %>}                               compare policies with another device using <load> percent of the bus
+// b i {on|off} {<level> {<holdoff us>}}        turn interrupts on or off, set the level and holdoff
+
+void QbusPolicyCommand(char *p)
+    {
+    if(*p == 'i')
+        {
+        skip(&p);
+        if(p[0] == 'o')
+            {
+            Qbus_irq = p[1] == 'n';
+            skip(&p);
+            QbusPolicy();                               // which keeps them off if the FPGA can't send them
+            }
+        if(isdigit(*p))
+            {
+            Qbus_irq_level = getdec(&p);
+            skip(&p);
+            if(isdigit(*p))Qbus_irq_holdoff = getdec(&p);
+            QbusPolicy();
+            }
+
+        printf("%s, BR%u, holdoff %u us, vector %03o, %u interrupts, %u merged\n",
+            !QinterruptAvailable() ? "no interrupts in this FPGA" : Qbus_irq ? "interrupts on" : "interrupts off",
+            Qbus_irq_level, Qbus_irq_holdoff, vector, Qbus_interrupts, Qbus_irq_merged);
+        return;
+        }
+
+    if(*p == 'a')
+        {
+        skip(&p);
+        unsigned load = isdigit(*p) ? getdec(&p) : 20;
+        Policy policies[] =
+            {
+            {"fixed 8, 4 us", 8, 4000, false},          // the original policy
+            {"fixed 16, 2 us", 16, 2000, false},
+            {"fixed 64, 1 us", 64, 1000, false},
+            {"demand, 1 us", 0, 1000, true},
+            {"current", Qbus_tenure, Qbus_holdoff, Qbus_demand},
+            };
+
+        printf("other device using %u%% of the bus\n", load);
+        for(auto &pol : policies)
+            {
+            if(ControlC)break;
+            Simulate(pol, load);
+            }
+        return;
+        }
+
+    skip(&p);                                           // past the 't'
+
+    if(isdigit(*p))
+        {
+        Qbus_tenure = getdec(&p);
+        skip(&p);
+        if(isdigit(*p))
+            {
+            Qbus_holdoff = getdec(&p);
+            skip(&p);
+            }
+        }
+    if(*p == 'd')Qbus_demand = true;
+    else if(*p == 'f')Qbus_demand = false;
+
+    QbusPolicy();
+
+    printf("tenure %u words%s, holdoff %u ns, %s\n",
+        Qbus_tenure, Qbus_tenure ? "" : " (no limit)", Qbus_holdoff,
+        Qbus_demand ? "released early when another device wants the bus" : "fixed");
+    }
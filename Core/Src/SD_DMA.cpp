@@ -0,0 +1,64 @@
+// Lets a thread sleep while the data phase of an SD card transfer runs by DMA (see FATFS_SD.c).
+// The SPI interrupt at the end of the transfer resumes the thread.
+// Each card has its own SPI bus, DMA streams, and Port, so a thread can be moving data
+// to or from one card while another thread is doing the same with the other.
+
+#include <stdint.h>
+#include "main.h"
+#include "cmsis.h"
+#include "context.hpp"
+#include "Port.hpp"
+#include "ContextFIFO.hpp"
+
+extern SPI_HandleTypeDef hspi1;
+extern SPI_HandleTypeDef hspi3;
+
+static Port SD_Port[2];                                 // where a thread waits for each card's DMA
+static volatile int SD_Status[2];                       // 0 while the DMA is running, 1 when done, -1 on error
+
+
+static inline int SD_Drive(SPI_HandleTypeDef *hspi)
+    {
+    return hspi == &hspi1 ? 0 : 1;
+    }
+
+
+// call before starting a DMA transfer
+extern "C" void SD_DMA_Start(int drv)
+    {
+    SD_Status[drv] = 0;
+    }
+
+
+// wait for the DMA transfer to end, letting other threads run in the meantime
+// returns true if the transfer succeeded
+extern "C" int SD_DMA_Wait(int drv)
+    {
+    return SD_Port[drv].await(SD_Status[drv]);
+    }
+
+
+// let other threads run while polling a busy card, so that the other card's transfer can proceed
+extern "C" void SD_Idle()
+    {
+    yield();
+    }
+
+
+// HAL callbacks, called from the SPI interrupt at the end of a DMA transfer
+
+extern "C" void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+    {
+    int drv = SD_Drive(hspi);
+
+    SD_Status[drv] = 1;
+    SD_Port[drv].resume();
+    }
+
+extern "C" void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+    {
+    int drv = SD_Drive(hspi);
+
+    SD_Status[drv] = -1;
+    SD_Port[drv].resume();
+    }
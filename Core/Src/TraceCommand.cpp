@@ -0,0 +1,133 @@
+// Show where the MSCP commands' time went, from the trace in Trace.hpp.
+// Each stage's times, from one of a command's events to a later one, are put in
+// a histogram with a bin for each power of 2 microseconds.
+
+#include <stdio.h>
+#include <string.h>
+#include "cyccnt.hpp"
+#include "uqssp.hpp"
+#include "Trace.hpp"
+
+#define TRACE_BINS 24                                   // up to 2^23 usec, about 8 sec, beyond which the cycle counter wraps
+#define TRACE_LAST TR_EVENTS                            // as a stage's start, the command's event before the stage's end
+#define TRACE_SLOTS (TR_EVENTS+1)                       // the times kept for each command, one for each event and TRACE_LAST
+
+struct Stage
+    {
+    const char *name;
+    TraceEvent from;
+    TraceEvent to;
+    };
+
+static const Stage stages[] =
+    {
+    {"packet", TR_DESC, TR_PACKET},                     // reading the command packet from the host
+    {"queued", TR_PACKET, TR_START},                    // waiting for the scheduler and a worker
+    {"sd", TR_SD, TR_SD_DONE},                          // each SD card command
+    {"dma", TR_DMA, TR_DMA_DONE},                       // each chunk over the Qbus
+    {"end", (TraceEvent)TRACE_LAST, TR_END},            // from the last of those to the end packet having been sent
+    {"total", TR_DESC, TR_END},
+    };
+
+#define NSTAGES NUM_ELEMENTS(stages)
+
+static unsigned hist[NSTAGES][TRACE_BINS];
+static unsigned count[NSTAGES];
+static uint32_t longest[NSTAGES];                       // cycles
+static float sum[NSTAGES];                              // usec
+
+static void Add(unsigned s, uint32_t cycles)
+    {
+    unsigned us = cycles / CPU_FREQ_MHZ;
+    unsigned bin = 0;
+
+    while(us && bin < TRACE_BINS-1)                     // bin n holds times of at least 2^(n-1) usec
+        {
+        us >>= 1;
+        ++bin;
+        }
+
+    ++hist[s][bin];
+    ++count[s];
+    sum[s] += (float)cycles / CPU_FREQ_MHZ;
+    if(cycles > longest[s])longest[s] = cycles;
+    }
+
+void TraceCommand(char *p)
+    {
+    static uint32_t when[MAX_COMMANDS+1][TRACE_SLOTS];
+    static bool seen[MAX_COMMANDS+1][TRACE_SLOTS];
+
+    if(p[0] == 'o' && p[1] == 'n')MSCP_trace = true;
+    else if(p[0] == 'o' && p[1] == 'f')MSCP_trace = false;
+
+    uint32_t end = trace_count;
+    uint32_t start = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+    unsigned commands = 0;
+
+    memset(hist, 0, sizeof(hist));
+    memset(count, 0, sizeof(count));
+    memset(longest, 0, sizeof(longest));
+    memset(sum, 0, sizeof(sum));
+    memset(seen, 0, sizeof(seen));
+
+    for(uint32_t i=start; i<end; i++)                   // oldest first
+        {
+        TraceEntry &e = trace_ring[i % TRACE_SIZE];
+
+        if(e.tag > MAX_COMMANDS || e.event >= TR_EVENTS)continue;
+
+        uint32_t *t = when[e.tag];
+        bool *s = seen[e.tag];
+
+        if(e.event == TR_DESC)                          // a new command with this tag
+            {
+            memset(s, 0, TRACE_SLOTS);
+            }
+        if(e.event == TR_END && s[TR_DESC])++commands;
+
+        for(unsigned n=0; n<NSTAGES; n++)
+            {
+            if(stages[n].to == e.event && s[stages[n].from])Add(n, e.time - t[stages[n].from]);
+            }
+
+        t[e.event] = e.time;
+        s[e.event] = true;
+        t[TRACE_LAST] = e.time;
+        s[TRACE_LAST] = true;
+        }
+
+    printf("%lu events, %u whole commands, tracing %s\n", end - start, commands, MSCP_trace ? "on" : "off");
+    printf("stage     count    mean usec  max usec\n");
+    for(unsigned n=0; n<NSTAGES; n++)
+        {
+        if(count[n])printf("%-8s  %-7u  %-9.1f  %.1f\n", stages[n].name, count[n], sum[n]/count[n], (float)longest[n]/CPU_FREQ_MHZ);
+        }
+
+    unsigned lo = TRACE_BINS, hi = 0;                   // the bins anything is in
+
+    for(unsigned n=0; n<NSTAGES; n++)
+        {
+        for(unsigned b=0; b<TRACE_BINS; b++)
+            {
+            if(hist[n][b] == 0)continue;
+            if(b < lo)lo = b;
+            if(b > hi)hi = b;
+            }
+        }
+
+    if(lo <= hi)
+        {
+        printf("\nusec <  ");
+        for(auto &s : stages)printf("%8s", s.name);
+        printf("\n");
+        for(unsigned b=lo; b<=hi; b++)
+            {
+            printf("%-8u", 1u << b);
+            for(unsigned n=0; n<NSTAGES; n++)printf("%8u", hist[n][b]);
+            printf("\n");
+            }
+        }
+
+    if(p[0] == 'c')trace_count = 0;                     // "trace c" clears the trace after showing it
+    }
@@ -0,0 +1,68 @@
+// Show the state and statistics of each MSCP unit.
+
+#include <stdio.h>
+#include <string.h>
+#include "local.h"
+#include "main.h"
+#include "cmsis.h"
+#include "ff.h"
+#include "MSCP.hpp"
+#include "uqssp.hpp"
+
+extern "C" uint32_t SD_Clock[2];                        // in FATFS_SD.c, 0 until the card is initialized
+
+void UnitsCommand(char *p)
+    {
+    bool clear = *p == 'c';                             // "units c" clears the statistics after showing them
+
+    printf("unit  drive  blocks     backend  reads     blocks     writes    blocks     errors\n");
+
+    for(unsigned n=0; n<MSCP_UNITS; n++)
+        {
+        MSCPunit &u = units[n];
+
+        if(u.online)
+            {
+            printf("%-4u  %-5u  %-9lu  %-7s  %-8u  %-9lu  %-8u  %-9lu  %u\n",
+                n, u.drive, u.size, u.raw ? "raw" : u.fastseek ? "fastsk" : "FatFs",
+                u.reads, u.rdblocks, u.writes, u.wrblocks, u.errors);
+            if(u.ra_blocks)
+                {
+                printf("      read ahead %u blocks, %u of them read (%.1f%%), depth now %u\n",
+                    u.ra_blocks, u.ra_used, 100.0f*u.ra_used/u.ra_blocks, u.ra_depth);
+                }
+            }
+        else if(u.reads || u.writes)
+            {
+            printf("%-4u  offline                    %-8u  %-9lu  %-8u  %-9lu  %u\n",
+                n, u.reads, u.rdblocks, u.writes, u.wrblocks, u.errors);
+            }
+
+        if(clear)
+            {
+            u.reads = 0;
+            u.writes = 0;
+            u.rdblocks = 0;
+            u.wrblocks = 0;
+            u.errors = 0;
+            u.ra_blocks = 0;
+            u.ra_used = 0;
+            }
+        }
+
+    for(unsigned drv=0; drv<MSCP_DRIVES; drv++)
+        {
+        if(SD_Clock[drv])printf("SD card %u: SPI clock %f MHz\n", drv, SD_Clock[drv] / 1e6f);
+        }
+
+    printf("command ring read %u times, the most commands in progress %u\n", MSCP_scans, MSCP_max_inflight);
+    printf("%u commands, %u responses, %u descriptor reads, %u descriptor writes\n", UQ_commands, UQ_responses, UQ_desc_reads, UQ_desc_writes);
+    if(clear)
+        {
+        MSCP_scans = 0;
+        UQ_commands = 0;
+        UQ_responses = 0;
+        UQ_desc_reads = 0;
+        UQ_desc_writes = 0;
+        }
+    }
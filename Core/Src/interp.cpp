@@ -253,11 +253,13 @@ void interp()
             StackCommand(p);
             }
 
-        HELP(  "mem                             display free memory")
+        HELP(  "mem {c}                         display free memory and the I/O pools, c to clear their watermarks")
         else if(buf[0]=='m' && buf[1]=='e' && buf[2]=='m')
             {
             extern void mem();
+            extern void PoolCommand(char *p);
             mem();
+            PoolCommand(p);
             }
 
         HELP(  "spi <command> {<value>}         SPI2 tests")
@@ -504,12 +506,43 @@ void interp()
                     }
                 }
 
+            else if(p[0] == 't' || p[0] == 'a' || p[0] == 'i')
+                {
+                extern void QbusPolicyCommand(char *p);
+                QbusPolicyCommand(p);
+                }
+
+            else if(p[0] == 'm' && (p[1] == ' ' || p[1] == 0))
+                {
+                for(skip(&p); *p; skip(&p))
+                    {
+                    if(p[0] == 'c')Qbus_burst = false;          // CPU sequenced cycles
+                    else if(p[0] == 'b')                        // the FPGA's burst engine
+                        {
+                        Qbus_burst = true;
+                        Qbus_block = p[1] == 'l';
+                        }
+                    else if(p[0] == 'm')Qbus_mdma = true;       // the burst engine's data moved by MDMA
+                    else if(p[0] == 'n')Qbus_mdma = false;      // or by the CPU
+                    }
+                QbusPolicy();                                   // which keeps the burst engine off if the FPGA has none, and the MDMA without a data port
+
+                printf("%s, %u bursts, %u partly in block mode, %u without reply\n",
+                    !Qbus_burst ? "CPU sequenced" : Qbus_block ? "burst engine, block mode" : "burst engine, single word cycles",
+                    Qbus_bursts, Qbus_block_bursts, Qbus_nxm);
+                printf("burst data moved by %s, %u words by MDMA\n", Qbus_mdma ? "MDMA" : "the CPU", Qbus_mdma_words);
+                }
+
             else
                 {
                 printf("bus commands:\n");
                 printf("b r {r<repeat count>} <addr> {o} {<count>}   read words from Qbus\n");
                 printf("b ww {r<repeat count>} <addr> <data> ...     write words to Qbus\n");
                 printf("b d <addr> {o} {<count>}                     dump words from Qbus\n");
+                printf("b m {cpu|burst|block} {mdma|nomdma}          how block transfers are run, and burst counts\n");
+                printf("b t {<words> {<holdoff ns>}} {demand|fixed}  DMA tenure policy, 0 words for no limit\n");
+                printf("b a {<load %%>}                               compare tenure policies on a simulated bus\n");
+                printf("b i {on|off} {<level> {<holdoff us>}}        interrupts, their level (4-6) and holdoff after each acknowledge\n");
                 printf("Controller addresses:\n");
                 printf("0x60000000 IP, PDP-11 read = poll; PDP-11 write = init controller, data ignored\n");
                 printf("               controller read = read status and clear latched status bits\n");
@@ -545,13 +578,76 @@ void interp()
                 printf("0x60000008 HI high address (6 bits)\n");
                 printf("0x6000000A DATA_OUT data to be written to Qbus\n");
                 printf("0x6000000C DATA_IN data read from Qbus\n");
+                printf("0x60000010 DMA_CNT burst engine word count, 1 to 64\n");
+                printf("0x60000012 DMA_TEN burst engine words per bus tenure, 0 for the whole burst\n");
+                printf("0x60000014 DMA_CT burst engine control\n");
+                printf(" bit  0: write 1 to start a burst, reads 1 while it runs\n");
+                printf(" bit  1: write 1 for DATO, 0 for DATI; reads 1 if the last burst got no reply\n");
+                printf(" bit  2: write 1 for block mode; reads 1 if the memory took the last burst partly in block mode\n");
+                printf(" bit  3: write 1 to end a tenure when another device wants the bus; reads BDMGI\n");
+                printf("0x60000016 DMA_HOLD burst engine holdoff between tenures, in 100 ns clocks\n");
+                printf("0x60000018 IRQ_VEC interrupt vector\n");
+                printf("0x6000001A IRQ_CT interrupt control\n");
+                printf(" bit  0: write 1 to request an interrupt, reads 1 until it is acknowledged\n");
+                printf(" bit  2-1: level, 0 for BR4, 1 for BR5, 2 for BR6\n");
+                printf(" bit  3: write 1 to cancel a request; reads 1 while the request is on the bus\n");
+                printf("0x6000001C IRQ_HOLD interrupt holdoff after each acknowledge, in 100 ns clocks\n");
+                printf("0x60000080 DMA_BUF burst engine data window, 64 words\n");
                 }
             }
 
+        HELP(  "mb <op> <unit> <blocks> <addr>  MSCP disk I/O benchmark")
+        else if(buf[0]=='m' && buf[1]=='b')
+            {
+            extern void MscpBenchCommand(char *p);
+            MscpBenchCommand(p);
+            }
+
+        HELP(  "units [c]                       show MSCP unit state and statistics, c to clear them")
+        else if(buf[0]=='u' && buf[1]=='n' && buf[2]=='i' && buf[3]=='t')
+            {
+            extern void UnitsCommand(char *p);
+            UnitsCommand(p);
+            }
+
+        HELP(  "trace [c|on|off]                show where the MSCP commands' time went, c to clear the trace")
+        else if(buf[0]=='t' && buf[1]=='r' && buf[2]=='a')
+            {
+            extern void TraceCommand(char *p);
+            TraceCommand(p);
+            }
+
+        HELP(  "cache [c] [on|off] [wt|wb] [lru|clock] [ra|nora]  show or set the MSCP block cache and read-ahead, c to clear statistics")
+        else if(buf[0]=='c' && buf[1]=='a' && buf[2]=='c')
+            {
+            extern void CacheCommand(char *p);
+            CacheCommand(p);
+            }
+
 //              //                              //
-        HELP(  "mscp                            test MSCP")
+        HELP(  "mscp {s|p} {wb|wt} {raw|fat} {par|one} {bell|poll} {el|ord}  test MSCP (serial/pipelined, write-behind/write-through, raw/FatFs backend,")
+        HELP(  "                                SD cards in parallel/one at a time, read the ring on a doorbell/all the time,")
+        HELP(  "                                commands reordered and merged by the elevator/in arrival order)")
         else if(buf[0]=='m' && buf[1]=='s' && buf[2]=='c' && buf[3]=='p')
             {
+            for(; *p; skip(&p))
+                {
+                if(p[0]=='p' && p[1]=='a')MSCP_parallel_drives = true;
+                else if(p[0]=='o' && p[1]=='n')MSCP_parallel_drives = false;
+                else if(p[0]=='b')MSCP_doorbell = true;
+                else if(p[0]=='p' && p[1]=='o')MSCP_doorbell = false;
+                else if(p[0]=='s')MSCP_pipeline = false;
+                else if(p[0]=='p')MSCP_pipeline = true;
+                else if(p[0]=='w' && p[1]=='b')MSCP_write_behind = true;
+                else if(p[0]=='w' && p[1]=='t')MSCP_write_behind = false;
+                else if(p[0]=='r' && p[1]=='a')MSCP_raw = true;
+                else if(p[0]=='f' && p[1]=='a')MSCP_raw = false;
+                else if(p[0]=='e' && p[1]=='l')MSCP_elevator = true;
+                else if(p[0]=='o' && p[1]=='r')MSCP_elevator = false;
+                }
+            printf("%s, %s, %s, %s, %s, %s\n", MSCP_pipeline ? "pipelined" : "serial", MSCP_write_behind ? "write-behind" : "write-through", MSCP_raw ? "raw" : "FatFs",
+                MSCP_parallel_drives ? "drives in parallel" : "one drive at a time", MSCP_doorbell ? "doorbell" : "polled", MSCP_elevator ? "elevator" : "in order");
+
             Qinit();
             MSCP_poll();
             }
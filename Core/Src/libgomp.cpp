@@ -166,7 +166,9 @@ const char *thread_names[] =
     "thread 6",
     "thread 7",
     "thread 8",
-    "thread 9"
+    "thread 9",
+    "thread 10",
+    "thread 11"
     };
 
 
@@ -22,6 +22,34 @@
 
 /* USER CODE BEGIN 0 */
 
+// DMA channels for the data phase of SD card transfers (see FATFS_SD.c)
+DMA_HandleTypeDef hdma_spi1_rx;
+DMA_HandleTypeDef hdma_spi1_tx;
+DMA_HandleTypeDef hdma_spi3_rx;
+DMA_HandleTypeDef hdma_spi3_tx;
+
+// set up one direction of an SD card SPI for byte-wide DMA
+static void SD_DMA_Init(DMA_HandleTypeDef *hdma, DMA_Stream_TypeDef *stream, uint32_t request, uint32_t direction, IRQn_Type irq)
+{
+  hdma->Instance = stream;
+  hdma->Init.Request = request;
+  hdma->Init.Direction = direction;
+  hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma->Init.MemInc = DMA_MINC_ENABLE;
+  hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma->Init.Mode = DMA_NORMAL;
+  hdma->Init.Priority = DMA_PRIORITY_HIGH;
+  hdma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+  if (HAL_DMA_Init(hdma) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  HAL_NVIC_SetPriority(irq, 5, 0);
+  HAL_NVIC_EnableIRQ(irq);
+}
+
 /* USER CODE END 0 */
 
 SPI_HandleTypeDef hspi1;
@@ -233,6 +261,14 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* spiHandle)
 
   /* USER CODE BEGIN SPI1_MspInit 1 */
 
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    SD_DMA_Init(&hdma_spi1_rx, DMA1_Stream0, DMA_REQUEST_SPI1_RX, DMA_PERIPH_TO_MEMORY, DMA1_Stream0_IRQn);
+    SD_DMA_Init(&hdma_spi1_tx, DMA1_Stream1, DMA_REQUEST_SPI1_TX, DMA_MEMORY_TO_PERIPH, DMA1_Stream1_IRQn);
+    __HAL_LINKDMA(spiHandle, hdmarx, hdma_spi1_rx);
+    __HAL_LINKDMA(spiHandle, hdmatx, hdma_spi1_tx);
+    HAL_NVIC_SetPriority(SPI1_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(SPI1_IRQn);
+
   /* USER CODE END SPI1_MspInit 1 */
   }
   else if(spiHandle->Instance==SPI2)
@@ -291,6 +327,14 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* spiHandle)
 
   /* USER CODE BEGIN SPI3_MspInit 1 */
 
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    SD_DMA_Init(&hdma_spi3_rx, DMA1_Stream2, DMA_REQUEST_SPI3_RX, DMA_PERIPH_TO_MEMORY, DMA1_Stream2_IRQn);
+    SD_DMA_Init(&hdma_spi3_tx, DMA1_Stream3, DMA_REQUEST_SPI3_TX, DMA_MEMORY_TO_PERIPH, DMA1_Stream3_IRQn);
+    __HAL_LINKDMA(spiHandle, hdmarx, hdma_spi3_rx);
+    __HAL_LINKDMA(spiHandle, hdmatx, hdma_spi3_tx);
+    HAL_NVIC_SetPriority(SPI3_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(SPI3_IRQn);
+
   /* USER CODE END SPI3_MspInit 1 */
   }
   else if(spiHandle->Instance==SPI5)
@@ -58,7 +58,15 @@
 extern PCD_HandleTypeDef hpcd_USB_OTG_HS;
 /* USER CODE BEGIN EV */
 
-extern uint16_t Timer1, Timer2;
+extern uint16_t Timer1[2], Timer2[2];
+extern SPI_HandleTypeDef hspi1;
+extern SPI_HandleTypeDef hspi3;
+extern DMA_HandleTypeDef hdma_spi1_rx;
+extern DMA_HandleTypeDef hdma_spi1_tx;
+extern DMA_HandleTypeDef hdma_spi3_rx;
+extern DMA_HandleTypeDef hdma_spi3_tx;
+extern MDMA_HandleTypeDef hmdma_qbus_out;
+extern MDMA_HandleTypeDef hmdma_qbus_in;
 
 /* USER CODE END EV */
 
@@ -186,8 +194,11 @@ void SysTick_Handler(void)
 {
   /* USER CODE BEGIN SysTick_IRQn 0 */
 
-    if(Timer1 > 0)Timer1--;
-    if(Timer2 > 0)Timer2--;
+    for(int i=0; i<2; i++)
+        {
+        if(Timer1[i] > 0)Timer1[i]--;
+        if(Timer2[i] > 0)Timer2[i]--;
+        }
 
   /* USER CODE END SysTick_IRQn 0 */
   HAL_IncTick();
@@ -233,4 +244,46 @@ void OTG_HS_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief These handle the DMA and SPI interrupts of the SD card data transfers.
+  */
+void DMA1_Stream0_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi1_rx);
+}
+
+void DMA1_Stream1_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi1_tx);
+}
+
+void DMA1_Stream2_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi3_rx);
+}
+
+void DMA1_Stream3_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi3_tx);
+}
+
+void SPI1_IRQHandler(void)
+{
+  HAL_SPI_IRQHandler(&hspi1);
+}
+
+void SPI3_IRQHandler(void)
+{
+  HAL_SPI_IRQHandler(&hspi3);
+}
+
+/**
+  * @brief This handles the MDMA interrupt of the Qbus burst engine's data (see QMDMA.cpp).
+  */
+void MDMA_IRQHandler(void)
+{
+  HAL_MDMA_IRQHandler(&hmdma_qbus_out);
+  HAL_MDMA_IRQHandler(&hmdma_qbus_in);
+}
+
 /* USER CODE END 1 */
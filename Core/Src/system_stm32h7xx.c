@@ -78,7 +78,7 @@
 
 /************************* Miscellaneous Configuration ************************/
 /*!< Uncomment the following line if you need to use initialized data in D2 domain SRAM (AHB SRAM) */
-/* #define DATA_IN_D2_SRAM */
+#define DATA_IN_D2_SRAM                 /* the SD card DMA buffers, __DMA_RAM in cmsis.h */
 
 /* Note: Following vector table addresses must be defined in line with linker
          configuration. */
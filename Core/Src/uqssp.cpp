@@ -1,6 +1,7 @@
 #include <MSCP.hpp>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "local.h"
 #include "main.h"
 #include "cmsis.h"
@@ -9,47 +10,78 @@
 #include "uqssp.hpp"
 #include "serial.h"
 #include "ContextFIFO.hpp"
+#include "mutex.hpp"
+#include "Trace.hpp"
 
 
 
-command cmd = {};
-response rsp = {};
-
 FIFOctl rsp_fifo;
 FIFOctl cmd_fifo;
-extern uint16_t vector;
 
-int credits = MAX_COMMANDS;
+int credits = MAX_COMMANDS-1;                   // command buffers not yet credited to the host (the host starts with one implicit credit)
+static mutex rsp_lock;                          // serializes responses from concurrently running commands
+
+
+unsigned UQ_desc_reads = 0;                     // bursts reading descriptors from the host
+unsigned UQ_desc_writes = 0;                    // bursts giving descriptors back to the host
+unsigned UQ_commands = 0;                       // command packets received
+unsigned UQ_responses = 0;                      // response packets sent
 
 
 // get a descriptor from a FIFO
+// Descriptors are read UQ_BATCH at a time, up to the end of the FIFO, and the run of them owned by the
+// controller is kept, so that most calls don't use the Qbus. The host can't take back a descriptor
+// the controller owns, so the copy stays good until the controller gives it back.
+// returns 0 if the FIFO is empty
+
 uint32_t GetDesc(FIFOctl &fifo)
     {
-    uint32_t addr;                              // the calculated address of the descriptor
-    uint32_t desc = 0;                          // the descriptor
-    int owner;                                  // the owner flag isolated form the descriptor
-
-    addr = fifo.addr + fifo.index;              // calculate the address
-    QReadBlock(addr, (uint16_t *)&desc, 2);     // read the descriptor
-    owner = desc>>31;                           // get the owner bit
-    desc &= 0x7fffffff;                         // clear the owner bit in the descriptor
-    if(owner == 0)return 0;                     // if the controller does not own the descriptor pointed to by the index, the FIFO is empty, return 0
-    printf("GetDesc from FIFO %08lo, index %d, descriptor %011lo\n", fifo.addr, fifo.index, desc);
-    return desc;                                // else return the descriptor
+    unsigned i = fifo.index/4;                  // the number of the descriptor
+
+    if(fifo.ahead == 0)                         // if none are left from the last read, read some more
+        {
+        unsigned n = fifo.size - i;             // up to the end of the FIFO
+
+        if(n > UQ_BATCH)n = UQ_BATCH;
+        QReadBlock(fifo.addr + fifo.index, (uint16_t *)&fifo.desc[i], n*2);
+        ++UQ_desc_reads;
+        while(fifo.ahead < n && (fifo.desc[i + fifo.ahead] & 0x80000000) != 0)
+            {
+            ++fifo.ahead;                       // count the ones owned by the controller
+            }
+        if(fifo.ahead == 0)return 0;            // if the controller does not own the descriptor pointed to by the index, the FIFO is empty, return 0
+        }
+
+    --fifo.ahead;
+    fifo.index = (fifo.index + 4) & (fifo.size*4 - 1);   // increment the index, with FIFO wraparound
+    return fifo.desc[i] & 0x7fffffff;           // return the descriptor without the owner bit
     }
 
-// put a descriptor to a FIFO
-void PutDesc(FIFOctl &fifo, uint32_t desc)
+
+// give the descriptors used since the last call back to the host, all in one burst
+// Called at least whenever the index wraps around, so that they are contiguous.
+
+void PutDesc(FIFOctl &fifo)
     {
-    uint32_t addr;                              // the calculated address of the descriptor
     uint32_t buf;                               // a buffer for reading/writing descriptors
 
-    printf("PutDesc to FIFO %08lo, index %d, descriptor %011lo\n", fifo.addr, fifo.index, desc);
+    if(fifo.used == 0)return;
+
+    unsigned end = fifo.index ? fifo.index/4 : fifo.size;  // the descriptor after the last one used
+    unsigned first = end - fifo.used;
+    bool flag = (fifo.desc[first] & 0x40000000) != 0;   // the interrupt flag, as the host set it
 
-    addr = fifo.addr + fifo.index;              // calculate the address of the indexed descriptor
-    buf = desc | 0x40000000;                    // set the interrupt flag in the descriptor
-    QWriteBlock(fifo.addr+2, (uint16_t *)&buf + 1, 1); // write only the upper word of the descriptor
-    if((desc&0x40000000) != 0)                  // if the interrupt flag in the descriptor was set before
+    for(unsigned i=first; i<end; i++)
+        {
+        fifo.desc[i] = (fifo.desc[i] & 0x7fffffff) | 0x40000000;  // clear the owner bit, and set the interrupt flag
+        }
+    QWriteBlock(fifo.addr + first*4, (uint16_t *)&fifo.desc[first], fifo.used*2);
+    ++UQ_desc_writes;
+    fifo.used = 0;
+
+    // Each descriptor but the first follows one given back in the same burst, so only the first can need an interrupt.
+
+    if(flag)                                    // if the interrupt flag in the descriptor was set before
         {
         if(fifo.size == 1)                      // if the FIFO size is 1, always interrupt
             {
@@ -59,7 +91,8 @@ void PutDesc(FIFOctl &fifo, uint32_t desc)
             }
         else                                    // if the FIFO size > 1, only interrupt if the
             {                                   // previous descriptor is not owned by the host
-            addr = fifo.addr + ((fifo.index - 4) & (fifo.size*4 - 1)) + 2;   // get addr of prev descriptor
+            uint32_t addr = fifo.addr + ((first*4 - 4) & (fifo.size*4 - 1)) + 2;   // get addr of prev descriptor
+            buf = 0;
             QReadBlock(addr, (uint16_t *)&buf+1, 1); // read it
             if((buf&0x80000000) != 0)           // if owned by controller (cmd FIFO was full, or rsp FIFO was empty)
                 {
@@ -69,29 +102,49 @@ void PutDesc(FIFOctl &fifo, uint32_t desc)
                 }
             }
         }
-    fifo.index = (fifo.index + 4) & (fifo.size*4 - 1);   // increment the index, with FIFO wraparound
     }
 
 
-command *GetPacket()
+// read the next command packet from the host into <pkt>
+// Only the part of the packet the controller looks at is read, through the LBN of a transfer.
+// Anything beyond msglen is cleared rather than left over from the last command in <pkt>.
+// <trace> is the trace tag the command will have, see Trace.hpp.
+// returns nullptr if there is none
+
+command *GetPacket(command &pkt, unsigned trace)
     {
     uint32_t desc;
 
     desc = GetDesc(cmd_fifo);                   // get a descriptor from the FIFO
     if(desc == 0)return nullptr;                // return nothing if empty
+    Trace(TR_DESC, trace);
 
-    QReadBlock((desc&017777777) - 4, (uint16_t *)&cmd, sizeof(command)/2); // read the packet from the host to the controller's packet buffer
-    PutDesc(cmd_fifo, desc);                    // send the command packet back to the host
+    QReadBlock((desc&017777777) - 4, (uint16_t *)&pkt, UQ_CMD_USED/2);  // read the packet from the host to the controller's packet buffer
+    Trace(TR_PACKET, trace);
+    ++UQ_commands;
+    if(pkt.msglen + 4u < UQ_CMD_USED)                   // a short command
+        {
+        memset((char *)&pkt + pkt.msglen + 4, 0, UQ_CMD_USED - 4 - pkt.msglen);
+        }
 
-    return &cmd;                                // return the copy of the packet
+    ++cmd_fifo.used;
+    if(cmd_fifo.ahead == 0 || cmd_fifo.index == 0)  // after the last packet of those read together
+        {
+        PutDesc(cmd_fifo);                      // send the command packets back to the host
+        }
+
+    return &pkt;                                // return the copy of the packet
     }
 
 void PutPacket(response *rsp)                   // address of response packet, points to 4 byte UQSSP header
     {
     uint32_t desc;
 
+    rsp_lock.lock();                            // one response at a time, so that the descriptor and credits stay consistent
+
     while((desc = GetDesc(rsp_fifo)) == 0)      // try to get a host-side response packet buffer
         {
+        PutDesc(rsp_fifo);                      // let the host have any responses held back, so it can free some
         yield();                                // wait a bit then try again
         }
 
@@ -108,8 +161,17 @@ void PutPacket(response *rsp)                   // address of response packet, p
         }
 
     QWriteBlock((desc&017777777) - 4, (uint16_t *)rsp, (rsp->msglen + 4) / 2);  // copy the response packet to the host buffer
+    ++UQ_responses;
+
+    ++rsp_fifo.used;
+    if(!rsp_lock.waiting()                      // unless another response is right behind this one,
+    || rsp_fifo.index == 0                      // and will be given back to the host with it,
+    || rsp_fifo.used == UQ_BATCH)
+        {
+        PutDesc(rsp_fifo);                      // send the response packets to the host
+        }
 
-    PutDesc(rsp_fifo, desc);                    // send the response packet to the host
+    rsp_lock.unlock();
     }
 
 
@@ -123,19 +185,25 @@ void Qinit()
     printf("waiting for init\n");
     while(Qsts.value=FADDR_ST, Qsts.IP_Written == 0)if(ControlC)return;     // wait for init (write to IP register)
     printf("init received\n");
+    QinterruptCancel();                                                             // anything left from before the init
+    vector = 0;
     FADDR_SA = 005000;
     printf("wrote step1, waiting for response\n");
     while(Qsts.value=FADDR_ST, Qsts.SA_Written == 0)if(ControlC)return;
     printf("received %6o\n", s1=FADDR_SA);
+    if(s1 & 0200)vector = (s1 & 0177) << 2;                                         // IE, and the vector/4
     FADDR_SA = 010000;
+    Qinterrupt();                                                                   // with IE, each step interrupts
     printf("wrote step2, waiting for response\n");
     while(Qsts.value=FADDR_ST, Qsts.SA_Written == 0)if(ControlC)return;
     printf("received %6o\n", s2=FADDR_SA);
     FADDR_SA = 020000;
+    Qinterrupt();
     printf("wrote step3, waiting for response\n");
     while(Qsts.value=FADDR_ST, Qsts.SA_Written == 0)if(ControlC)return;
     printf("received %6o\n", s3=FADDR_SA);
     FADDR_SA = 040463;
+    Qinterrupt();
     printf("wrote step4, waiting for response\n");
     while(Qsts.value=FADDR_ST, Qsts.SA_Written == 0)if(ControlC)return;
     printf("received %6o\n", s4=FADDR_SA);
@@ -149,7 +217,11 @@ void Qinit()
     cmd_fifo.flag = rsp_fifo.addr - 4;
     rsp_fifo.index = 0;
     cmd_fifo.index = 0;
+    rsp_fifo.used = rsp_fifo.ahead = 0;
+    cmd_fifo.used = cmd_fifo.ahead = 0;
+    credits = MAX_COMMANDS-1;
 
     printf("rsp FIFO at %06lo, size %d\n", rsp_fifo.addr, rsp_fifo.size);
     printf("cmd FIFO at %06lo, size %d\n", cmd_fifo.addr, cmd_fifo.size);
+    if(vector)printf("interrupts at vector %03o, BR%u%s\n", vector, Qbus_irq_level, Qbus_irq ? "" : QinterruptAvailable() ? ", but they are off, b i on sends them" : ", but the FPGA can't send them");
     }
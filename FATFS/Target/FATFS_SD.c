@@ -7,7 +7,9 @@
  * For More Information, Tutorials, etc.
  * Visit Website: www.DeepBlueMbedded.com
  */
+#include <string.h>
 #include "main.h"
+#include "cmsis.h"
 #include "diskio.h"
 #include "FATFS_SD.h"
 
@@ -16,10 +18,36 @@
 #define bool BYTE
 
 static volatile DSTATUS Stat[2] = {STA_NOINIT, STA_NOINIT};  /* Disk Status */
-uint16_t Timer1, Timer2; 		/* 1ms Timer Counters */
+uint16_t Timer1[2], Timer2[2]; 	/* 1ms Timer Counters, one pair per card so that both can be busy at once */
 static uint8_t CardType[2]; 		/* Type 0:MMC, 1:SDC, 2:Block addressing */
 static uint8_t PowerFlag[2] = {0, 0};	/* Power flag */
 
+int SD_UseDMA = 1;          /* move the 512 byte data phase of reads and writes by DMA */
+
+/* DMA buffers, aligned to the 32 byte cache line so that cache maintenance can't touch their neighbors,
+   and in the D2 SRAM, since with the RAM linker script .bss is in the DTCM, which DMA1 can't reach */
+static uint8_t SD_Ones[512] __DMA_RAM __attribute__((aligned(32)));        /* 0xFF, shifted out while receiving */
+static uint8_t SD_Scratch[512] __DMA_RAM __attribute__((aligned(32)));     /* whatever comes back while transmitting */
+static uint8_t SD_Bounce[2][512] __DMA_RAM __attribute__((aligned(32)));   /* for callers' buffers the DMA can't use as they are */
+
+/* DMA1 reaches the AXI SRAM in D1 and the AHB SRAM in D2, but not the DTCM, where the stacks are */
+#ifndef SD_DMA_REACHES
+#define SD_DMA_REACHES(a) ((uintptr_t)(a) - D1_AXISRAM_BASE < 320*1024 || (uintptr_t)(a) - D2_AHBSRAM_BASE < 32*1024)
+#endif
+#define SD_DMA_USABLE(a) (((uintptr_t)(a) & 31) == 0 && SD_DMA_REACHES(a))
+
+/* SPI clock, chosen for each slot when its card is initialized */
+#define SD_INIT_HZ      400000      /* the fastest a card may be clocked before it is initialized */
+#define SD_DEFAULT_HZ   25000000    /* the fastest in default speed mode */
+#define SD_HIGH_HZ      50000000    /* the fastest in high speed mode */
+#define SD_PROBES       4           /* reads of the probe sector that must all match at a rate */
+uint32_t SD_Clock[2];               /* the SPI clock of each slot, in Hz */
+static uint8_t SD_Probe[2][2][512] __DMA_RAM __attribute__((aligned(32)));  /* per slot, the reference copy and a fresh copy of the probe sector */
+
+extern void SD_DMA_Start(int drv);
+extern int SD_DMA_Wait(int drv);
+extern void SD_Idle(void);
+
 //-----[ SPI Functions ]-----
 
 /* slave select */
@@ -58,6 +86,53 @@ static uint8_t SPI_RxByte(BYTE drv)
   return data;
 }
 
+/* SPI transmit and receive a block by DMA, sleeping until it is done
+   both buffers must be cache line aligned, and where the DMA can reach them */
+static bool SPI_DMA(BYTE drv, const uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+  SCB_CleanDCache_by_Addr((uint32_t *)tx, len);                  /* the DMA reads memory, not the cache */
+  SCB_CleanInvalidateDCache_by_Addr((uint32_t *)rx, len);        /* and no dirty line may be evicted on top of what it writes */
+
+  while(!__HAL_SPI_GET_FLAG(HSPI_SDCARD(drv), SPI_FLAG_TXP));
+  SD_DMA_Start(drv);
+  if (HAL_SPI_TransmitReceive_DMA(HSPI_SDCARD(drv), (uint8_t *)tx, rx, len) != HAL_OK) return FALSE;
+  if (!SD_DMA_Wait(drv)) return FALSE;
+
+  SCB_InvalidateDCache_by_Addr((uint32_t *)rx, len);             /* drop anything speculatively loaded during the transfer */
+  return TRUE;
+}
+
+/* SPI receive a 512 byte data block into the caller's buffer, by DMA */
+static bool SPI_RxBlockDMA(BYTE drv, BYTE *buff)
+{
+  if (SD_DMA_USABLE(buff)) return SPI_DMA(drv, SD_Ones, buff, 512);
+
+  if (!SPI_DMA(drv, SD_Ones, SD_Bounce[drv], 512)) return FALSE;
+  memcpy(buff, SD_Bounce[drv], 512);
+  return TRUE;
+}
+
+/* SPI transmit a 512 byte data block from the caller's buffer, by DMA */
+static bool SPI_TxBlockDMA(BYTE drv, const BYTE *buff)
+{
+  if (SD_DMA_USABLE(buff)) return SPI_DMA(drv, buff, SD_Scratch, 512);
+
+  memcpy(SD_Bounce[drv], buff, 512);
+  return SPI_DMA(drv, SD_Bounce[drv], SD_Scratch, 512);
+}
+
+/* set the SPI clock to the kernel clock divided by 2 << n (n is 0 to 7), returns the new rate in Hz */
+static uint32_t SPI_SetClock(BYTE drv, uint32_t n)
+{
+  SPI_HandleTypeDef *hspi = HSPI_SDCARD(drv);
+  /* the divider can only be changed while the SPI is disabled, which it is between transfers */
+  __HAL_SPI_DISABLE(hspi);
+  hspi->Init.BaudRatePrescaler = n << SPI_CFG1_MBR_Pos;
+  MODIFY_REG(hspi->Instance->CFG1, SPI_CFG1_MBR, hspi->Init.BaudRatePrescaler);
+  SD_Clock[drv] = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SPI123) >> (n + 1);
+  return SD_Clock[drv];
+}
+
 /* SPI receive a byte via pointer */
 static void SPI_RxBytePtr(BYTE drv, uint8_t *buff)
 {
@@ -71,11 +146,13 @@ static uint8_t SD_ReadyWait(BYTE drv)
 {
   uint8_t res;
   /* timeout 500ms */
-  Timer2 = 500;
+  Timer2[drv] = 500;
   /* if SD goes ready, receives 0xFF */
-  do {
-    res = SPI_RxByte(drv);
-  } while ((res != 0xFF) && Timer2);
+  /* while the card is busy (programming a block written by DMA), let the other card's thread run */
+  while ((res = SPI_RxByte(drv)) != 0xFF && Timer2[drv])
+  {
+    if (SD_UseDMA) SD_Idle();
+  }
   return res;
 }
 
@@ -127,17 +204,25 @@ static bool SD_RxDataBlock(BYTE drv, BYTE *buff, UINT len)
 {
   uint8_t token;
   /* timeout 200ms */
-  Timer1 = 200;
-  /* loop until receive a response or timeout */
-  do {
-    token = SPI_RxByte(drv);
-  } while((token == 0xFF) && Timer1);
+  Timer1[drv] = 200;
+  /* loop until receive a response or timeout, letting the other card's thread run meanwhile */
+  while ((token = SPI_RxByte(drv)) == 0xFF && Timer1[drv])
+  {
+    if (SD_UseDMA) SD_Idle();
+  }
   /* invalid response */
   if(token != 0xFE) return FALSE;
   /* receive data */
-  do {
-    SPI_RxBytePtr(drv, buff++);
-  } while(--len);
+  if (SD_UseDMA && len == 512)
+  {
+    if (!SPI_RxBlockDMA(drv, buff)) return FALSE;
+  }
+  else
+  {
+    do {
+      SPI_RxBytePtr(drv, buff++);
+    } while(--len);
+  }
   /* discard CRC */
   SPI_RxByte(drv);
   SPI_RxByte(drv);
@@ -157,7 +242,14 @@ static bool SD_TxDataBlock(BYTE drv, const uint8_t *buff, BYTE token)
   /* if it's not STOP token, transmit data */
   if (token != 0xFD)
   {
-    SPI_TxBuffer(drv, (uint8_t*)buff, 512);
+    if (SD_UseDMA)
+    {
+      if (!SPI_TxBlockDMA(drv, buff)) return FALSE;
+    }
+    else
+    {
+      SPI_TxBuffer(drv, (uint8_t*)buff, 512);
+    }
     /* discard CRC */
     SPI_RxByte(drv);
     SPI_RxByte(drv);
@@ -169,9 +261,16 @@ static bool SD_TxDataBlock(BYTE drv, const uint8_t *buff, BYTE token)
       if ((resp & 0x1F) == 0x05) break;
       i++;
     }
-    /* recv buffer clear */
-    while (SPI_RxByte(drv) == 0);
+    /* recv buffer clear, the card holds the line low while it programs the block */
+    /* so as in SD_ReadyWait, let the other card's thread run, and give up after 500ms */
+    Timer2[drv] = 500;
+    while (SPI_RxByte(drv) == 0 && Timer2[drv])
+    {
+      if (SD_UseDMA) SD_Idle();
+    }
   }
+  /* the STOP token has no data, and so no response */
+  if (token == 0xFD) return TRUE;
   /* transmit 0x05 accepted */
   if ((resp & 0x1F) == 0x05) return TRUE;
 
@@ -210,12 +309,69 @@ static BYTE SD_SendCmd(BYTE drv, BYTE cmd, uint32_t arg)
 
 //-----[ user_diskio.c Functions ]-----
 
+/* switch an SDv2 card to high speed mode
+   returns the fastest clock the card can now take */
+static uint32_t SD_HighSpeed(BYTE drv)
+{
+  uint8_t status[64];
+  uint32_t max = SD_DEFAULT_HZ;
+  SELECT(drv);
+  /* SWITCH_FUNC, mode 1 (switch), function group 1 (access mode) to function 1 (high speed) */
+  if (SD_SendCmd(drv, CMD6, 0x80FFFFF1) == 0 && SD_RxDataBlock(drv, status, 64))
+  {
+    /* the function now selected in group 1 is in the low bits of byte 16 */
+    if ((status[16] & 0x0F) == 1) max = SD_HIGH_HZ;
+  }
+  DESELECT(drv);
+  SPI_RxByte(drv);
+  /* the card may take 8 clocks to change over */
+  SPI_RxByte(drv);
+  return max;
+}
+
+/* check that the probe sector (sector 0) reads back the same as its reference copy, SD_PROBES times running */
+static bool SD_ProbeVerify(BYTE drv)
+{
+  for (int i = 0; i < SD_PROBES; i++)
+  {
+    if (SD_disk_read(drv, SD_Probe[drv][1], 0, 1) != RES_OK) return FALSE;
+    if (memcmp(SD_Probe[drv][0], SD_Probe[drv][1], 512) != 0) return FALSE;
+  }
+  return TRUE;
+}
+
+/* Raise the SPI clock of an initialized card from divider <slow> (the initialization rate)
+   one step at a time, up to <max> Hz, for as long as the probe sector reads back the same as
+   it did at the initialization rate. Stops at the last rate that worked. */
+static void SD_ClockRamp(BYTE drv, uint32_t slow, uint32_t max)
+{
+  uint32_t n, good = slow;
+  bool failed = FALSE;
+  /* the reference copy, read at the initialization rate */
+  if (SD_disk_read(drv, SD_Probe[drv][0], 0, 1) != RES_OK) return;
+  for (n = slow; n > 0 && !failed; n--)
+  {
+    if (SPI_SetClock(drv, n - 1) > max) break;
+    if (SD_ProbeVerify(drv)) good = n - 1;
+    else failed = TRUE;
+  }
+  SPI_SetClock(drv, good);
+  /* after a failed probe, make sure the card is still in step at the rate chosen */
+  if (failed && !SD_ProbeVerify(drv)) SPI_SetClock(drv, slow);
+}
+
 /* initialize SD */
 DSTATUS SD_disk_initialize(BYTE drv)
 {
   uint8_t n, type, ocr[4];
+  uint32_t slow, max = SD_DEFAULT_HZ;
+  /* the DMA shifts these out while receiving */
+  memset(SD_Ones, 0xFF, sizeof(SD_Ones));
   /* no disk */
   if(Stat[drv] & STA_NODISK) return Stat[drv];
+  /* start at no more than 400 kHz */
+  for (slow = 0; slow < 7 && (HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SPI123) >> (slow + 1)) > SD_INIT_HZ; slow++);
+  SPI_SetClock(drv, slow);
   /* power on */
   SD_PowerOn(drv);
   /* slave select */
@@ -226,7 +382,7 @@ DSTATUS SD_disk_initialize(BYTE drv)
   if (SD_SendCmd(drv, CMD0, 0) == 1)
   {
     /* timeout 1 sec */
-    Timer1 = 1000;
+    Timer1[drv] = 1000;
     /* SDC V2+ accept CMD8 command, http://elm-chan.org/docs/mmc/mmc_e.html */
     if (SD_SendCmd(drv, CMD8, 0x1AA) == 1)
     {
@@ -241,10 +397,10 @@ DSTATUS SD_disk_initialize(BYTE drv)
         /* ACMD41 with HCS bit */
         do {
           if (SD_SendCmd(drv, CMD55, 0) <= 1 && SD_SendCmd(drv, CMD41, 1UL << 30) == 0) break;
-        } while (Timer1);
+        } while (Timer1[drv]);
 
         /* READ_OCR */
-        if (Timer1 && SD_SendCmd(drv, CMD58, 0) == 0)
+        if (Timer1[drv] && SD_SendCmd(drv, CMD58, 0) == 0)
         {
           /* Check CCS bit */
           for (n = 0; n < 4; n++)
@@ -271,9 +427,9 @@ DSTATUS SD_disk_initialize(BYTE drv)
         {
           if (SD_SendCmd(drv, CMD1, 0) == 0) break; /* CMD1 */
         }
-      } while (Timer1);
+      } while (Timer1[drv]);
       /* SET_BLOCKLEN */
-      if (!Timer1 || SD_SendCmd(drv, CMD16, 512) != 0) type = 0;
+      if (!Timer1[drv] || SD_SendCmd(drv, CMD16, 512) != 0) type = 0;
     }
   }
   CardType[drv] = type;
@@ -284,6 +440,9 @@ DSTATUS SD_disk_initialize(BYTE drv)
   if (type)
   {
     Stat[drv] &= ~STA_NOINIT;
+    /* then find the fastest clock the card and the board can sustain */
+    if (type & CT_SD2) max = SD_HighSpeed(drv);
+    SD_ClockRamp(drv, slow, max);
   }
   else
   {
@@ -299,8 +458,8 @@ DSTATUS SD_disk_status(BYTE drv)
   return Stat[drv];
 }
 
-/* read sector */
-DRESULT SD_disk_read(BYTE drv, BYTE* buff, DWORD sector, UINT count)
+/* read sectors, into one buffer, or if parts isn't null, each into its own 512 byte part */
+static DRESULT SD_ReadSectors(BYTE drv, BYTE* buff, BYTE* const* parts, DWORD sector, UINT count)
 {
   /* pdrv should be 0 */
   if (!count) return RES_PARERR;
@@ -316,7 +475,7 @@ DRESULT SD_disk_read(BYTE drv, BYTE* buff, DWORD sector, UINT count)
   if (count == 1)
   {
     /* READ_SINGLE_BLOCK */
-    if ((SD_SendCmd(drv, CMD17, sector) == 0) && SD_RxDataBlock(drv, buff, 512)) count = 0;
+    if ((SD_SendCmd(drv, CMD17, sector) == 0) && SD_RxDataBlock(drv, parts ? parts[0] : buff, 512)) count = 0;
   }
   else
   {
@@ -324,8 +483,8 @@ DRESULT SD_disk_read(BYTE drv, BYTE* buff, DWORD sector, UINT count)
     if (SD_SendCmd(drv, CMD18, sector) == 0)
     {
       do {
-        if (!SD_RxDataBlock(drv, buff, 512)) break;
-        buff += 512;
+        if (!SD_RxDataBlock(drv, parts ? *parts++ : buff, 512)) break;
+        if (!parts) buff += 512;
       } while (--count);
 
       /* STOP_TRANSMISSION */
@@ -340,6 +499,19 @@ DRESULT SD_disk_read(BYTE drv, BYTE* buff, DWORD sector, UINT count)
   return count ? RES_ERROR : RES_OK;
 }
 
+/* read sector */
+DRESULT SD_disk_read(BYTE drv, BYTE* buff, DWORD sector, UINT count)
+{
+  return SD_ReadSectors(drv, buff, NULL, sector, count);
+}
+
+/* read sectors, each into its own buffer, so that the DMA can put each block where it is wanted
+   in one READ_MULTIPLE_BLOCK; the parts should be cache line aligned and outside the DTCM, or they go through SD_Bounce */
+DRESULT SD_disk_readv(BYTE drv, BYTE* const* parts, DWORD sector, UINT count)
+{
+  return SD_ReadSectors(drv, NULL, parts, sector, count);
+}
+
 /* write sector */
 #if _USE_WRITE == 1
 DRESULT SD_disk_write(BYTE drv, const BYTE* buff, DWORD sector, UINT count)
@@ -22,6 +22,7 @@ extern SPI_HandleTypeDef    hspi3;
 //-----[ MMC/SDC Commands ]-----
 #define CMD0     (0x40+0)     	/* GO_IDLE_STATE */
 #define CMD1     (0x40+1)     	/* SEND_OP_COND */
+#define CMD6     (0x40+6)     	/* SWITCH_FUNC */
 #define CMD8     (0x40+8)     	/* SEND_IF_COND */
 #define CMD9     (0x40+9)     	/* SEND_CSD */
 #define CMD10    (0x40+10)    	/* SEND_CID */
@@ -43,10 +44,14 @@ extern SPI_HandleTypeDef    hspi3;
 #define CT_SDC		0x06	/* SD */
 #define CT_BLOCK	0x08	/* Block addressing */
 
+extern int SD_UseDMA;              /* nonzero to move the data phase of reads and writes by DMA */
+extern uint32_t SD_Clock[2];       /* the SPI clock of each drive, in Hz, chosen by the probe ramp in SD_disk_initialize */
+
 //-----[ Prototypes For All User External Functions ]-----
 DSTATUS SD_disk_initialize(BYTE pdrv);
 DSTATUS SD_disk_status(BYTE pdrv);
 DRESULT SD_disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
+DRESULT SD_disk_readv(BYTE pdrv, BYTE* const* parts, DWORD sector, UINT count);
 DRESULT SD_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT SD_disk_ioctl(BYTE pdrv, BYTE cmd, void* buff);
 
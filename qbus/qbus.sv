@@ -61,10 +61,15 @@ module qbus (
     input logic BDINf,
     input logic BDOUTf,
     input logic BRPLYf,
+    input logic BREFf,
     input logic BWTBTf,
     input logic BBS7f,
     input logic BDMGIf,
     input logic BINITf,
+    input logic BIAKIf,
+    input logic BIRQ5f,
+    input logic BIRQ6f,
+    input logic BIRQ7f,
     output logic Outbound,
     output logic BRPLYg,
     
@@ -99,6 +104,29 @@ module qbus (
     parameter [21:0] FADDR_DATA_OUT = 10;
     parameter [21:0] FADDR_DATA_IN = 12;
     parameter [21:0] FADDR_TEST = 14;
+    parameter [21:0] FADDR_DMA_CNT = 16;
+    parameter [21:0] FADDR_DMA_TEN = 18;
+    parameter [21:0] FADDR_DMA_CT = 20;
+    parameter [21:0] FADDR_DMA_HOLD = 22;
+    parameter [21:0] FADDR_IRQ_VEC = 24;
+    parameter [21:0] FADDR_IRQ_CT = 26;
+    parameter [21:0] FADDR_IRQ_HOLD = 28;
+    parameter [21:0] FADDR_DMA_FIFO = 30;                   // data port, the next word of the window
+    parameter [21:0] FADDR_DMA_BUF = 128;                   // 64 words, up to 254
+
+    // burst engine timing, in cycles of the 10 MHz clock (see Qbus.cpp for the CPU sequenced equivalents)
+    parameter DMA_WORDS = 64;                               // size of the data window
+    parameter T_ADDR_SETUP = 2;                             // address setup before BSYNC asserted, 150 ns
+    parameter T_ADDR_HOLD = 1;                              // address hold after BSYNC asserted, 100 ns
+    parameter T_DATA_SETUP = 1;                             // data setup before BDOUT asserted, 100 ns
+    parameter T_RDATA_SETUP = 2;                            // after BRPLY asserted, read data setup before sampling it, 200 ns
+    parameter T_BDOUT_HOLD = 2;                             // BDOUT hold after BRPLY asserted, 150 ns
+    parameter T_DATA_HOLD = 1;                              // data hold after BDOUT deasserted, 100 ns
+    parameter T_SYNC_HOLD = 2;                              // BSYNC hold after BDOUT deasserted, 175 ns
+    parameter T_TURN = 3;                                   // BRPLY deasserted to next BSYNC, 300 ns
+    parameter T_DMA_TURN = 3;                               // BSACK asserted to first BSYNC, 250 ns
+    parameter T_DMA_HOLDOFF = 40;                           // BSACK deasserted to next BDMR, 4 us, until the H723 sets Dma_holdoff
+    parameter T_NXM = 100;                                  // no BRPLY for 10 us, nonexistent memory
 
     // addresses of registers as seen from the PDP-11
     parameter [21:0] QADDR_IP = 22'o17772150;
@@ -144,6 +172,45 @@ module qbus (
     logic [15:0] ROMdata;           // data from the boot ROM
     
     logic [15:0] TestReg;           // test register
+
+    // burst engine, see "Qbus burst engine" below
+    logic [6:0] Dma_count;          // words to transfer, 1 to DMA_WORDS, written by H723
+    logic [6:0] Dma_tenure;         // the most words to transfer per bus tenure, written by H723
+    logic Dma_write;                // direction of the burst, 1 for DATO (to the PDP-11), written by H723
+    logic Dma_block;                // use block mode (DATBI/DATBO) where the memory allows it, written by H723
+    logic Dma_demand;               // end a tenure early only when another device wants the bus, written by H723
+    logic [7:0] Dma_holdoff = T_DMA_HOLDOFF;    // clocks from the end of one tenure to the next request, written by H723
+    logic Dma_blocked;              // the last burst moved at least one word in block mode
+    logic Dma_go;                   // toggled by the H723 to start a burst
+    logic Dma_done;                 // set equal to Dma_go by the engine when the burst has ended
+    logic Dma_nxm;                  // the last burst ended because a word got no BRPLY
+    logic [15:0] Dma_out [0:DMA_WORDS-1];   // data for DATO, written by H723
+    logic [15:0] Dma_in [0:DMA_WORDS-1];    // data from DATI, read by H723
+    logic [5:0] Fifo_out = 0;       // the word of Dma_out the next write of the data port goes to
+    logic [5:0] Fifo_reads = 0;     // reads of the data port, counted on NOE
+    logic [5:0] Fifo_mark = 0;      // Fifo_reads when the data port was last put back at word 0
+    wire [5:0] Fifo_in = Fifo_reads - Fifo_mark;    // the word of Dma_in the next read of the data port comes from
+`ifdef QBUS_DATA_PORT
+    localparam DATA_PORT = 1'b1;    // the data port is built in, see "Qbus burst engine"
+`else
+    localparam DATA_PORT = 1'b0;
+`endif
+    logic Eng_BSYNC, Eng_BDIN, Eng_BDOUT, Eng_BWTBT, Eng_BBS7, Eng_BDMR;  // master signals driven by the engine
+    logic Eng_addr_oe;              // engine is driving the address
+    logic Eng_data_oe;              // engine is driving the data
+    logic Eng_release;              // engine is ending its bus tenure
+    logic [21:0] Eng_addr;          // address of the current word
+    logic [15:0] Eng_data;          // data of the current DATO word
+
+    // interrupts, see "Qbus interrupts" below
+    logic [15:0] Irq_vector;        // vector given to the processor, written by H723
+    logic [1:0] Irq_level;          // 0, 1 or 2 for BR4, BR5 or BR6, written by H723
+    logic [15:0] Irq_holdoff;       // clocks from one interrupt acknowledge to the next request, written by H723
+    logic Irq_go;                   // toggled by the H723 to request an interrupt
+    logic Irq_done;                 // set equal to Irq_go when the processor acknowledges the interrupt
+    logic Irq_armed;                // a request was asserted, with none above it, when the processor began the acknowledge
+    logic Irq_raise;                // the request is asserted on the bus
+    logic Irq_ack;                  // answering an interrupt acknowledge
     
     // interrupt the H723 if the PDP-11 has read or written any register
     assign FPGA_IRQ = IP_Read || IP_Written || SA_Read || SA_Written || TestReg[0];
@@ -152,8 +219,6 @@ module qbus (
     wire F_IP_read_enable = !NE1 && !NOE && Faddress[21:0] == FADDR_IP[21:0];
   
 
-    assign BIAKOg = 0;
-
     assign PLL_RSTN = 1;            // the PLL needs this held high
     
     
@@ -220,6 +285,82 @@ module qbus (
             end
         end
 
+`ifdef QBUS_BURST_ENGINE
+    // FMC write of the burst engine registers, kept apart from the above since the data window is memory
+    always_ff @(posedge NWE)
+        begin
+        if (!NE1 && Faddress[21:1] == FADDR_DMA_CNT[21:1])
+            begin
+            Dma_count <= DA_IN[6:0];
+`ifdef QBUS_DATA_PORT
+            Fifo_out <= 0;                                  // the data port starts again at word 0
+            Fifo_mark <= Fifo_reads;
+`endif
+            end
+        else if (!NE1 && Faddress[21:1] == FADDR_DMA_TEN[21:1])
+            begin
+            Dma_tenure <= DA_IN[6:0];
+            end
+        else if (!NE1 && Faddress[21:1] == FADDR_DMA_HOLD[21:1])
+            begin
+            Dma_holdoff <= DA_IN[7:0];
+            end
+        else if (!NE1 && Faddress[21:1] == FADDR_DMA_CT[21:1])
+            begin
+            Dma_write <= DA_IN[1];
+`ifdef QBUS_BLOCK_MODE
+            Dma_block <= DA_IN[2];
+`else
+            Dma_block <= 0;                                 // every word a cycle of its own, see "Qbus burst engine"
+`endif
+            Dma_demand <= DA_IN[3];
+            if (DA_IN[0]) Dma_go <= !Dma_done;              // start, unless a burst is already running
+            end
+`ifdef QBUS_DATA_PORT
+        else if (!NE1 && Faddress[21:1] == FADDR_DMA_FIFO[21:1])
+            begin
+            Dma_out[Fifo_out] <= DA_IN;
+            Fifo_out <= Fifo_out + 1'b1;
+            end
+`endif
+        else if (!NE1 && Faddress[21:7] == FADDR_DMA_BUF[21:7])
+            begin
+            Dma_out[Faddress[6:1]] <= DA_IN;
+            end
+        end
+
+`ifdef QBUS_DATA_PORT
+    // FMC read of the data port moves it on to the next word, at the end of the cycle
+    // Counted apart from the reset by FADDR_DMA_CNT above, which is clocked by NWE.
+    always_ff @(posedge NOE)
+        begin
+        if (!NE1 && Faddress[21:1] == FADDR_DMA_FIFO[21:1])
+            begin
+            Fifo_reads <= Fifo_reads + 1'b1;
+            end
+        end
+`endif
+`endif
+
+    // FMC write of the interrupt registers
+    always_ff @(posedge NWE)
+        begin
+        if (!NE1 && Faddress[21:1] == FADDR_IRQ_VEC[21:1])
+            begin
+            Irq_vector <= DA_IN;
+            end
+        else if (!NE1 && Faddress[21:1] == FADDR_IRQ_HOLD[21:1])
+            begin
+            Irq_holdoff <= DA_IN;
+            end
+        else if (!NE1 && Faddress[21:1] == FADDR_IRQ_CT[21:1])
+            begin
+            Irq_level <= DA_IN[2:1];
+            if (DA_IN[3]) Irq_go <= Irq_done;               // cancel a request not yet acknowledged
+            else if (DA_IN[0]) Irq_go <= !Irq_done;         // request, unless one is already waiting
+            end
+        end
+
     // FMC read
     
     always_ff @(posedge NL) // latch the status bits at the beginning of any cycle
@@ -281,6 +422,46 @@ module qbus (
                 begin
                 DA_OUT = TestReg;       // Drive the AD bus with test register data
                 end
+`ifdef QBUS_BURST_ENGINE
+            else if(Faddress[21:1] == FADDR_DMA_CNT[21:1])
+                begin
+                DA_OUT = {9'b0, Dma_count};
+                end
+            else if(Faddress[21:1] == FADDR_DMA_TEN[21:1])
+                begin
+                DA_OUT = {9'b0, Dma_tenure};
+                end
+            else if(Faddress[21:1] == FADDR_DMA_CT[21:1])
+                begin
+                DA_OUT = {11'b0, DATA_PORT, !BDMGIf, Dma_blocked, Dma_nxm, Dma_go != Dma_done};  // busy from the moment the H723 starts a burst
+                end
+            else if(Faddress[21:1] == FADDR_DMA_HOLD[21:1])
+                begin
+                DA_OUT = {8'b0, Dma_holdoff};
+                end
+`ifdef QBUS_DATA_PORT
+            else if(Faddress[21:1] == FADDR_DMA_FIFO[21:1])
+                begin
+                DA_OUT = Dma_in[Fifo_in];
+                end
+`endif
+            else if(Faddress[21:7] == FADDR_DMA_BUF[21:7])
+                begin
+                DA_OUT = Dma_in[Faddress[6:1]];
+                end
+`endif
+            else if(Faddress[21:1] == FADDR_IRQ_VEC[21:1])
+                begin
+                DA_OUT = Irq_vector;
+                end
+            else if(Faddress[21:1] == FADDR_IRQ_CT[21:1])
+                begin
+                DA_OUT = {12'b0, Irq_raise, Irq_level, Irq_go != Irq_done};  // pending from the moment the H723 requests it
+                end
+            else if(Faddress[21:1] == FADDR_IRQ_HOLD[21:1])
+                begin
+                DA_OUT = Irq_holdoff;
+                end
             end
         end
 
@@ -335,6 +516,10 @@ module qbus (
             end
         end
 
+    // The selects above are left over from the last cycle once BSYNC goes away, and an
+    // interrupt acknowledge is a BDIN without BSYNC, so slave reads also look at BSYNC.
+    wire Q_cycle = !BSYNCf;
+
     // QBus read, clocked part
     always_ff @(posedge BDINf or posedge F_IP_read_enable)
         begin
@@ -343,11 +528,11 @@ module qbus (
             IP_Read <= 0;
             SA_Read <= 0;
             end
-        else if (Q_IP_selected)
+        else if (Q_IP_selected && Q_cycle)
             begin
             IP_Read <= 1;
             end
-        else if (Q_SA_selected)
+        else if (Q_SA_selected && Q_cycle)
             begin
             SA_Read <= 1;
             end
@@ -398,18 +583,40 @@ module qbus (
                 BDALf_OE = 22'h3FFFFF;                      // enable the FPGA bus drivers to output the data
                 Outbound = 1;                               // enable the gate drivers
                 end
+            // the same for cycles run by the burst engine
+            else if (Eng_addr_oe)
+                begin
+                BDALf_OUT = Eng_addr;
+                BDALf_OE = 22'h3FFFFF;
+                Outbound = 1;
+                end
+            else if(Eng_data_oe)
+                begin
+                BDALf_OUT[21:16] = 6'b000000;               // no parity
+                BDALf_OUT[15:0] = Eng_data;
+                BDALf_OE = 22'h3FFFFF;
+                Outbound = 1;
+                end
+            end
+
+        // interrupt acknowledge, the vector goes on the bus with BRPLY
+        else if (Irq_ack)
+            begin
+            BDALf_OUT[15:0] = Irq_vector;
+            BDALf_OE = 22'h3FFFFF;                          // enable the FPGA bus drivers to output the data
+            Outbound = 1;                                   // enable the gate drivers
             end
 
         // transactions performed as bus slave
         // Qbus read of IP register
-        else if (Q_IP_selected && OutGate)
+        else if (Q_IP_selected && Q_cycle && OutGate)
             begin
             BDALf_OE = 22'h3FFFFF;                          // enable the FPGA bus drivers to output the data
             Outbound = 1;                                   // enable the gate drivers
             end
             
         // Qbus read of SA register
-        else if (Q_SA_selected && OutGate)
+        else if (Q_SA_selected && Q_cycle && OutGate)
             begin
             BDALf_OUT[21:18] = 4'b0000;
             BDALf_OUT[17] = 0;                              // memory parity error enable
@@ -420,7 +627,7 @@ module qbus (
             end
             
         // Qbus read of boot ROM
-        else if (Q_ROM_selected && OutGate)
+        else if (Q_ROM_selected && Q_cycle && OutGate)
             begin
             BDALf_OUT[21:18] = 4'b0000;
             BDALf_OUT[17] = 0;                              // memory parity error enable
@@ -434,7 +641,7 @@ module qbus (
 
         
     // assert BRPLY as needed
-    assign BRPLYg = !BSACKg && (Q_IP_selected || Q_SA_selected || Q_ROM_selected) && (!BDINf || !BDOUTf);
+    assign BRPLYg = !BSACKg && ((Q_IP_selected || Q_SA_selected || Q_ROM_selected) && Q_cycle && (!BDINf || !BDOUTf) || Irq_ack);
 
     
     
@@ -445,17 +652,18 @@ module qbus (
 ///////////////////////////////////////////
 
 
-    // the Q_Ctl register enables the H723 to control the bus master outputs
-    assign BSYNCg  = Q_Ctl[0];
-    assign BDINg   = Q_Ctl[1];
-    assign BDOUTg  = Q_Ctl[2];
-    assign BWTBTg  = Q_Ctl[3];
-    assign BDMRg   = Q_Ctl[4];
+    // the Q_Ctl register enables the H723 to control the bus master outputs,
+    // and the burst engine drives the same signals when it runs
+    assign BSYNCg  = Q_Ctl[0] || Eng_BSYNC;
+    assign BDINg   = Q_Ctl[1] || Eng_BDIN;
+    assign BDOUTg  = Q_Ctl[2] || Eng_BDOUT;
+    assign BWTBTg  = Q_Ctl[3] || Eng_BWTBT;
+    assign BDMRg   = Q_Ctl[4] || Eng_BDMR;
     assign BREFg   = Q_Ctl[5];
-    assign BBS7g   = Q_Ctl[6];
-    assign BIRQ4g  = Q_Ctl[7];
-    assign BIRQ5g  = Q_Ctl[8];
-    assign BIRQ6g  = Q_Ctl[9];
+    assign BBS7g   = Q_Ctl[6] || Eng_BBS7;
+    assign BIRQ4g  = Q_Ctl[7] || Irq_raise;                        // every level asserts BIRQ4 as well, for single level processors
+    assign BIRQ5g  = Q_Ctl[8] || Irq_raise && Irq_level == 1;
+    assign BIRQ6g  = Q_Ctl[9] || Irq_raise && Irq_level == 2;
 
     
     // Detect assertion of BRPLYL
@@ -490,8 +698,386 @@ module qbus (
     wire DMA_grant = !BDMGIf && BDMRg && BSYNCf && BRPLYf;
     wire DMA_done = !NE1 && !NWE && Faddress[21:1] == FADDR_CT[21:1] && !NBL1 && DA_IN[15];
 
-    // when DMA_grant is received, assert BSACKL, and keep on asserting it until the H723 says DMA is done
-    SRFF BSACK_inst (.set(DMA_grant), .reset(DMA_done), .Q(BSACKg));
+    // when DMA_grant is received, assert BSACKL, and keep on asserting it until the H723 or the burst engine says DMA is done
+    SRFF BSACK_inst (.set(DMA_grant), .reset(DMA_done || Eng_release), .Q(BSACKg));
+
+
+
+///////////////////////////////////////////
+///
+///  Qbus burst engine
+///
+///////////////////////////////////////////
+
+    // Runs a block of DATI or DATO cycles as bus master, so that the H723 doesn't have to
+    // sequence each one through Q_Ctl. The H723 loads the start address (FADDR_LO/HI),
+    // the word count, and for DATO the data (into the window at FADDR_DMA_BUF), then
+    // starts the burst by writing FADDR_DMA_CT. The engine requests the bus, runs up to
+    // Dma_tenure cycles, gives the bus up for the holdoff time, and requests it again,
+    // until all the words have been moved. DATI data is left in the same window.
+    // The H723 does not touch the window while the engine is busy, so the two sides
+    // never use a buffer at the same time.
+    //
+    // The window can also be filled and emptied through the data port, FADDR_DMA_FIFO,
+    // one word after another from word 0, which lets the H723's MDMA move a burst's data
+    // to and from a single address. Writing FADDR_DMA_CNT puts the port back at word 0.
+    // Bit 4 of FADDR_DMA_CT reads as 1 to say the port is there, which it is only with
+    // QBUS_DATA_PORT defined. That too is left out of the Efinity project until
+    // qbus/tb/tb_fifo has passed, so Qbus.cpp sees no port and never starts the MDMA.
+    //
+    // In block mode the engine asks for each word after the first to follow without a new
+    // address portion: for DATBI by asserting BBS7 with BDIN, for DATBO by asserting BWTBT
+    // with BDOUT. A memory that can do so asserts BREF with BRPLY, and the next word is
+    // then moved with only another BDIN or BDOUT. If the memory doesn't assert BREF, the
+    // next word gets an ordinary cycle of its own. A block never crosses a 16 word
+    // boundary, nor the end of a tenure. Block mode needs QBUS_BLOCK_MODE defined as
+    // well, which is left out of the Efinity project until tb_burst's block cases
+    // pass; without it the engine ignores QDMA_BLOCK and never asks for the next word.
+    //
+    // A tenure ends after Dma_tenure words (0 for no limit) or at the end of the burst.
+    // With Dma_demand it also ends as soon as a DMA grant comes in from upstream while
+    // the engine has the bus, which means another device is waiting for it.
+    //
+    // This part is synchronous to the 10 MHz clock. The Qbus inputs it watches are
+    // synchronized first, which adds up to 200 ns to each handshake.
+    //
+    // The engine is built only with QBUS_BURST_ENGINE defined, which qbus/tb/Makefile
+    // does and the Efinity project doesn't, until qbus/tb/tb_burst has passed against
+    // it. Without it the registers read as 0, so Qbus.cpp finds no engine and runs
+    // every cycle itself through Q_Ctl.
+
+`ifdef QBUS_BURST_ENGINE
+    typedef enum logic [3:0] {
+        E_IDLE,         // waiting for the H723 to start a burst
+        E_HOLDOFF,      // waiting out the holdoff since the last tenure
+        E_REQUEST,      // BDMR asserted, waiting for BSACK
+        E_TURN,         // waiting from BSACK or the last BRPLY to the next cycle
+        E_ADDRESS,      // address on the bus, before BSYNC
+        E_SYNC,         // BSYNC asserted, address hold
+        E_DATA,         // DATO data on the bus before BDOUT, or the gap before the next BDIN of a block
+        E_REPLY,        // waiting for BRPLY
+        E_SAMPLE,       // DATI, BRPLY asserted, waiting for the data to settle
+        E_DOUT_HOLD,    // DATO, BRPLY asserted, holding BDOUT
+        E_DATA_HOLD,    // DATO, holding the data after BDOUT
+        E_UNREPLY,      // waiting for BRPLY to be deasserted
+        E_SYNC_HOLD,    // holding BSYNC after the cycle
+        E_RELEASE       // ending the tenure
+    } Eng_state_t;
+
+    Eng_state_t Eng_state;
+    logic [1:0] Go_sync;            // Dma_go synchronized to the clock
+    logic [1:0] BRPLY_sync;         // BRPLY (true when asserted) synchronized to the clock
+    logic [1:0] BREF_sync;          // BREF (true when asserted) synchronized to the clock
+    logic Eng_bref;                 // the memory asserted BREF with its reply to the current word
+    logic [1:0] BSACK_sync;         // BSACKg synchronized to the clock
+    logic [1:0] BDMGI_sync;         // BDMGI (true when asserted) synchronized to the clock
+    logic [6:0] Eng_word;           // index of the current word in the window
+    logic [6:0] Eng_tenure_left;    // words left in this tenure
+    logic [7:0] Eng_timer;          // cycles left in the current state
+
+    wire Eng_last = Eng_word + 1 == Dma_count;
+    wire Eng_IO_page = Eng_addr[21:13] == 9'o777;
+    wire Eng_wanted = Dma_demand && BDMGI_sync[1];      // another device wants the bus
+    wire Eng_more = Dma_block && !Eng_last && Eng_tenure_left != 1 && !Eng_wanted && Eng_addr[4:1] != 4'hF && !Eng_IO_page;  // ask for the next word in block mode
+
+    always_ff @(posedge clock)
+        begin
+        Go_sync <= {Go_sync[0], Dma_go};
+        BRPLY_sync <= {BRPLY_sync[0], !BRPLYf};
+        BREF_sync <= {BREF_sync[0], !BREFf};
+        BSACK_sync <= {BSACK_sync[0], BSACKg};
+        BDMGI_sync <= {BDMGI_sync[0], !BDMGIf};
+        if (Eng_timer != 0) Eng_timer <= Eng_timer - 1;
+
+        case (Eng_state)
+            E_IDLE:
+                begin
+                if (Go_sync[1] != Dma_done)
+                    begin
+                    Eng_addr <= Q_Addr;
+                    Eng_word <= 0;
+                    Dma_nxm <= 0;
+                    Dma_blocked <= 0;
+                    Eng_state <= E_HOLDOFF;
+                    end
+                end
+
+            E_HOLDOFF:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    Eng_BDMR <= 1;
+                    Eng_state <= E_REQUEST;
+                    end
+                end
+
+            E_REQUEST:
+                begin
+                if (BSACK_sync[1])
+                    begin
+                    Eng_BDMR <= 0;
+                    Eng_tenure_left <= Dma_tenure;
+                    Eng_timer <= T_DMA_TURN;
+                    Eng_state <= E_TURN;
+                    end
+                end
+
+            E_TURN:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    Eng_addr_oe <= 1;
+                    Eng_BBS7 <= Eng_IO_page;
+                    Eng_BWTBT <= Dma_write;
+                    Eng_data <= Dma_out[Eng_word[5:0]];
+                    Eng_timer <= T_ADDR_SETUP;
+                    Eng_state <= E_ADDRESS;
+                    end
+                end
+
+            E_ADDRESS:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    Eng_BSYNC <= 1;
+                    Eng_timer <= T_ADDR_HOLD;
+                    Eng_state <= E_SYNC;
+                    end
+                end
+
+            E_SYNC:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    Eng_addr_oe <= 0;
+                    Eng_BBS7 <= 0;
+                    Eng_BWTBT <= 0;
+                    if (Dma_write)
+                        begin
+                        Eng_data_oe <= 1;
+                        Eng_timer <= T_DATA_SETUP;
+                        Eng_state <= E_DATA;
+                        end
+                    else
+                        begin
+                        Eng_BDIN <= 1;
+                        Eng_BBS7 <= Eng_more;
+                        Eng_timer <= T_NXM;
+                        Eng_state <= E_REPLY;
+                        end
+                    end
+                end
+
+            E_DATA:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    if (Dma_write)
+                        begin
+                        Eng_BDOUT <= 1;
+                        Eng_BWTBT <= Eng_more;
+                        end
+                    else
+                        begin
+                        Eng_BDIN <= 1;
+                        Eng_BBS7 <= Eng_more;
+                        end
+                    Eng_timer <= T_NXM;
+                    Eng_state <= E_REPLY;
+                    end
+                end
+
+            E_REPLY:
+                begin
+                if (BRPLY_sync[1])
+                    begin
+                    Eng_bref <= BREF_sync[1];
+                    Eng_timer <= Dma_write ? T_BDOUT_HOLD : T_RDATA_SETUP;
+                    Eng_state <= Dma_write ? E_DOUT_HOLD : E_SAMPLE;
+                    end
+                else if (Eng_timer == 0)                    // nonexistent memory, give up on the burst
+                    begin
+                    Dma_nxm <= 1;
+                    Eng_BDIN <= 0;
+                    Eng_BDOUT <= 0;
+                    Eng_BBS7 <= 0;
+                    Eng_BWTBT <= 0;
+                    Eng_data_oe <= 0;
+                    Eng_BSYNC <= 0;
+                    Eng_word <= Dma_count - 1;
+                    Eng_state <= E_RELEASE;
+                    end
+                end
+
+            E_SAMPLE:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    Dma_in[Eng_word[5:0]] <= ~BDALf_IN[15:0];
+                    Eng_BDIN <= 0;
+                    Eng_BBS7 <= 0;
+                    Eng_state <= E_UNREPLY;
+                    end
+                end
+
+            E_DOUT_HOLD:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    Eng_BDOUT <= 0;
+                    Eng_BWTBT <= 0;
+                    Eng_timer <= T_DATA_HOLD;
+                    Eng_state <= E_DATA_HOLD;
+                    end
+                end
+
+            E_DATA_HOLD:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    if (Eng_more && Eng_bref)                       // the next word of the block replaces this one
+                        begin
+                        Eng_data <= Dma_out[Eng_word[5:0] + 1];
+                        end
+                    else
+                        begin
+                        Eng_data_oe <= 0;
+                        end
+                    Eng_state <= E_UNREPLY;
+                    end
+                end
+
+            E_UNREPLY:
+                begin
+                if (!BRPLY_sync[1] && Eng_more && Eng_bref)     // block mode, on to the next word in the same cycle
+                    begin
+                    Dma_blocked <= 1;
+                    Eng_addr <= Eng_addr + 2;
+                    Eng_word <= Eng_word + 1;
+                    Eng_tenure_left <= Eng_tenure_left - 1;
+                    Eng_timer <= T_DATA_SETUP;
+                    Eng_state <= E_DATA;
+                    end
+                else if (!BRPLY_sync[1])
+                    begin
+                    Eng_timer <= Dma_write ? T_SYNC_HOLD : 0;
+                    Eng_state <= E_SYNC_HOLD;
+                    end
+                end
+
+            E_SYNC_HOLD:
+                begin
+                if (Eng_timer == 0)
+                    begin
+                    Eng_BSYNC <= 0;
+                    Eng_addr <= Eng_addr + 2;
+                    Eng_tenure_left <= Eng_tenure_left - 1;
+                    Eng_timer <= T_TURN;
+                    if (Eng_last || Eng_tenure_left == 1 || Eng_wanted)
+                        begin
+                        Eng_state <= E_RELEASE;
+                        end
+                    else
+                        begin
+                        Eng_word <= Eng_word + 1;
+                        Eng_state <= E_TURN;
+                        end
+                    end
+                end
+
+            E_RELEASE:
+                begin
+                Eng_release <= 1;                           // clear BSACK
+                if (!BSACK_sync[1])
+                    begin
+                    Eng_release <= 0;
+                    Eng_timer <= Dma_holdoff;
+                    if (Eng_last)
+                        begin
+                        Dma_done <= Go_sync[1];             // tell the H723 the burst is over
+                        Eng_state <= E_IDLE;
+                        end
+                    else
+                        begin
+                        Eng_word <= Eng_word + 1;
+                        Eng_state <= E_HOLDOFF;
+                        end
+                    end
+                end
+
+            default:
+                begin
+                Eng_state <= E_IDLE;
+                end
+        endcase
+        end
+`else
+    assign {Eng_BSYNC, Eng_BDIN, Eng_BDOUT, Eng_BWTBT, Eng_BBS7, Eng_BDMR} = 0;
+    assign Eng_addr_oe = 0;
+    assign Eng_data_oe = 0;
+    assign Eng_release = 0;
+    assign Eng_addr = 0;
+    assign Eng_data = 0;
+`endif
+
+
+
+
+///////////////////////////////////////////
+///
+///  Qbus interrupts
+///
+///////////////////////////////////////////
+
+    // The H723 loads the vector (written by the host at UQSSP step 1) and requests an
+    // interrupt by writing FADDR_IRQ_CT. The request is asserted on BIRQ4, and on BIRQ5
+    // or BIRQ6 as well for those levels, until the processor acknowledges it.
+    //
+    // The processor acknowledges with BDIN, without BSYNC, followed by BIAKI down the
+    // grant chain. A device that is requesting when BDIN arrives, with no request
+    // asserted at a higher level, takes the acknowledge: it puts its vector on BDAL,
+    // asserts BRPLY, drops its request, and doesn't pass BIAKI on. Every other device
+    // passes BIAKI on to BIAKO. The vector and BRPLY go away with BDIN.
+    //
+    // A request made while an earlier one is still waiting is merged with it. After each
+    // acknowledge the next request is held off for Irq_holdoff clocks, so that the
+    // firmware can limit the interrupt rate and the host takes several responses each time.
+
+    logic [1:0] Irq_ack_sync;       // Irq_ack synchronized to the clock
+    logic [15:0] Irq_timer;         // clocks left in the holdoff
+
+    assign Irq_raise = Irq_go != Irq_done && Irq_timer == 0 && Irq_ack_sync == 2'b00;
+    wire Irq_higher = !BIRQ7f || (Irq_level == 0 && (!BIRQ5f || !BIRQ6f)) || (Irq_level == 1 && !BIRQ6f);
+    assign Irq_ack = Irq_armed && !BIAKIf && !BDINf;
+
+    // decide at the start of an acknowledge whether it is ours
+    always_ff @(negedge BDINf or negedge BINITf)
+        begin
+        if(!BINITf)
+            begin
+            Irq_armed <= 0;
+            end
+        else
+            begin
+            Irq_armed <= BSYNCf && Irq_raise && !Irq_higher;
+            end
+        end
+
+    // the request ends when the processor takes it
+    always_ff @(posedge Irq_ack)
+        begin
+        Irq_done <= Irq_go;
+        end
+
+    // pass the acknowledge on unless it is ours
+    assign BIAKOg = !BIAKIf && !Irq_armed;
+
+    always_ff @(posedge clock)
+        begin
+        Irq_ack_sync <= {Irq_ack_sync[0], Irq_ack};
+        if (Irq_ack_sync[1]) Irq_timer <= Irq_holdoff;
+        else if (Irq_timer != 0) Irq_timer <= Irq_timer - 1;
+        end
 
 
      
@@ -0,0 +1,147 @@
+// A Qbus memory, as a slave for the testbenches
+//
+// WORDS words from byte address BASE. It answers DATI and DATO with BRPLY T_ACCESS
+// after BDIN or BDOUT, and drops BRPLY, and the data, once BDIN or BDOUT goes away.
+// In the I/O page (BBS7 with the address) and outside its range it doesn't answer.
+//
+// With BREF set it does block mode as well: a BDIN with BBS7, or a BDOUT with BWTBT,
+// asks for the next word to follow, and it asserts BREF with BRPLY to say that it will,
+// unless the next word is past a 16 word boundary. Without BREF it never asserts BREF,
+// and takes each word as a word of its own, as memories from before block mode do.
+//
+// The lines are true logic, 1 for asserted, as in bus.svh. The counts let the
+// testbenches see what cycles the master ran.
+
+module qmem #(
+    parameter [21:0] BASE = 0,
+    parameter WORDS = 4096,
+    parameter BREF = 0,
+    parameter T_ACCESS = 300            // ns from BDIN or BDOUT to BRPLY
+    ) (
+    input logic [21:0] bdal,
+    input logic sync, din, dout, wtbt, bs7,
+    output logic [21:0] bdal_out,
+    output logic rply,
+    output logic ref_out
+    );
+
+    logic [15:0] mem [0:WORDS-1];
+
+    logic selected = 0;                 // this cycle is ours
+    logic [21:0] addr;                  // address of the current word
+    logic write;                        // BWTBT with the address, DATO
+    logic first;                        // the next word is the first of the cycle
+    logic promised;                     // BREF went with the last word, so the next may follow without an address
+
+    int syncs = 0;                      // address portions of cycles to this memory
+    int words = 0;                      // words moved
+    int block_words = 0;                // words moved after the first of a cycle, so in block mode
+    int block_asks = 0;                 // words that asked for the next to follow
+    int boundary = 0;                   // of those, ones at the end of a 16 word block, which the master shouldn't ask for
+    int errors = 0;                     // protocol errors
+
+    initial
+        begin
+        bdal_out = 0;
+        rply = 0;
+        ref_out = 0;
+        end
+
+    wire [21:0] offset = addr - BASE;
+    wire [21:0] index = offset >> 1;
+
+    always @(posedge sync)
+        begin
+        selected = !bs7 && bdal >= BASE && bdal < BASE + 2*WORDS;
+        addr = {bdal[21:1], 1'b0};
+        write = wtbt;
+        first = 1;
+        promised = 0;
+        if (selected) syncs++;
+        end
+
+    always @(negedge sync)
+        begin
+        selected = 0;
+        end
+
+    // a word after the first of a cycle needs a BREF with the one before
+    task automatic start();
+        if (!first)
+            begin
+            if (!promised)
+                begin
+                $display("%t qmem: a second word in a cycle without BREF", $time);
+                errors++;
+                end
+            block_words++;
+            end
+        first = 0;
+    endtask
+
+    // the next word follows in the same cycle if the master asked, and this memory can
+    task automatic next(input logic asked);
+        if (asked)
+            begin
+            block_asks++;
+            if (addr[4:1] == 4'hF) boundary++;
+            end
+        ref_out = BREF && asked && addr[4:1] != 4'hF;
+    endtask
+
+    always @(posedge din)
+        begin
+        if (selected && sync)
+            begin
+            if (write)
+                begin
+                $display("%t qmem: BDIN in a DATO cycle", $time);
+                errors++;
+                end
+            start();
+            #(T_ACCESS);
+            if (selected && din)
+                begin
+                if (index >= WORDS) errors++;
+                bdal_out = {6'b0, mem[index]};
+                next(bs7);
+                rply = 1;
+                @(negedge din);
+                bdal_out = 0;
+                words++;
+                promised = ref_out;
+                rply = 0;
+                ref_out = 0;
+                addr = addr + 2;
+                end
+            end
+        end
+
+    always @(posedge dout)
+        begin
+        if (selected && sync)
+            begin
+            if (!write)
+                begin
+                $display("%t qmem: BDOUT in a DATI cycle", $time);
+                errors++;
+                end
+            start();
+            #(T_ACCESS);
+            if (selected && dout)
+                begin
+                if (index >= WORDS) errors++;
+                mem[index] = bdal[15:0];
+                next(wtbt);
+                rply = 1;
+                @(negedge dout);
+                words++;
+                promised = ref_out;
+                rply = 0;
+                ref_out = 0;
+                addr = addr + 2;
+                end
+            end
+        end
+
+endmodule
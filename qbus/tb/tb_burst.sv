@@ -0,0 +1,470 @@
+// The burst engine ("Qbus burst engine" in qbus.sv) run against two memories, an arbiter
+// and another DMA device, through the FMC registers as Qbus.cpp runs it. mem0 takes
+// every word as a cycle of its own; mem1 does block mode, asserting BREF.
+//
+// The arbiter grants the bus as the processor does: a grant down the chain for a
+// request, held until a device takes the bus with BSACK. It also grants while the FPGA
+// has the bus, when another device asks, which is how the FPGA learns in demand mode
+// that the bus is wanted. The FPGA has no BSACK input and so can't see another master's
+// BSACK, so the arbiter doesn't grant it the bus until that master has let it go.
+//
+// The other device sits after the FPGA on the grant chain. When it gets the bus it
+// holds it for 2 us without running cycles, and the testbench checks that the FPGA
+// drives nothing in that time.
+
+module tb_burst;
+
+    `include "bus.svh"
+
+    // memory at 0, without block mode
+    wire [21:0] m0_bdal;
+    wire m0_rply, m0_ref;
+    qmem #(.BASE(0), .WORDS(4096)) mem0 (
+        .bdal(bdal), .sync(sync), .din(din), .dout(dout), .wtbt(wtbt), .bs7(bs7),
+        .bdal_out(m0_bdal), .rply(m0_rply), .ref_out(m0_ref)
+    );
+
+    // memory at 64 KB, with block mode
+    localparam [21:0] MEM1_BASE = 22'o200000;
+    wire [21:0] m1_bdal;
+    wire m1_rply, m1_ref;
+    qmem #(.BASE(MEM1_BASE), .WORDS(4096), .BREF(1)) mem1 (
+        .bdal(bdal), .sync(sync), .din(din), .dout(dout), .wtbt(wtbt), .bs7(bs7),
+        .bdal_out(m1_bdal), .rply(m1_rply), .ref_out(m1_ref)
+    );
+
+    assign s_bdal = m0_bdal | m1_bdal;
+    assign s_rply = m0_rply || m1_rply;
+    assign s_ref = m0_ref || m1_ref;
+
+    localparam [21:0] NXM_ADDR = 22'o100000;    // past the end of mem0, and short of mem1
+
+
+    // the arbiter
+
+    int grants = 0;
+
+    initial
+        forever
+            begin
+            wait (dmr && (!sack || BSACKg && x_dmr));
+            #200;
+            if (dmr && (!sack || BSACKg && x_dmr))
+                begin
+                grants++;
+                dmgi = 1;
+                if (sack) @(negedge sack or negedge dmr);       // the FPGA lets the bus go first
+                if (dmr) @(posedge sack or negedge dmr);        // and a device takes it
+                #100 dmgi = 0;
+                #500;
+                end
+            end
+
+
+    // the other DMA device
+
+    int others = 0;                             // tenures it had
+    int overlaps = 0;                           // clocks the FPGA drove the bus while it had it
+
+    initial
+        forever
+            begin
+            @(posedge BDMGOg);
+            #100;
+            if (BDMGOg && x_dmr)
+                begin
+                others++;
+                x_sack = 1;
+                x_dmr = 0;
+                wait (!sync && !rply);
+                #2000 x_sack = 0;
+                end
+            end
+
+    always @(posedge clock)
+        begin
+        if (x_sack && (BSACKg || BSYNCg || BDINg || BDOUTg || BDALf_OE != 0)) overlaps++;
+        end
+
+
+    // the FPGA's tenures
+
+    function automatic int words();
+        return mem0.words + mem1.words;
+    endfunction
+
+    int tenures = 0;
+    int tenure_start;                           // words() when the current one began
+    int most_words = 0;                         // the most words in a tenure
+    time released = 0;                          // when BSACK last went away, 0 at the start of a test
+    time shortest_gap = 0;                      // the shortest time from then to the next BDMR
+
+    always @(posedge BSACKg)
+        begin
+        tenures++;
+        tenure_start = words();
+        end
+
+    always @(negedge BSACKg)
+        begin
+        if (words() - tenure_start > most_words) most_words = words() - tenure_start;
+        released = $time;
+        end
+
+    always @(posedge BDMRg)
+        begin
+        if (released != 0 && (shortest_gap == 0 || $time - released < shortest_gap)) shortest_gap = $time - released;
+        end
+
+    initial
+        begin
+        #20ms;
+        $display("tb_burst: timed out");
+        $fatal(1);
+        end
+
+
+    // the engine, as Qbus.cpp runs it
+
+    function automatic logic [15:0] pattern(input int seed, input int i);
+        return 16'(seed * 'h0123 + i * 'h0101) ^ 16'hA5A5;
+    endfunction
+
+    task automatic engine(input int tenure, input int holdoff);
+        fmc_write(FADDR_DMA_TEN, 16'(tenure));
+        fmc_write(FADDR_DMA_HOLD, 16'(holdoff));
+        released = 0;
+        shortest_gap = 0;
+        most_words = 0;
+    endtask
+
+    task automatic go(input logic [21:0] addr, input int count, input logic [15:0] flags);
+        fmc_write(FADDR_LO, addr[15:0]);
+        fmc_write(FADDR_HI, {10'b0, addr[21:16]});
+        fmc_write(FADDR_DMA_CNT, 16'(count));
+        fmc_write(FADDR_DMA_CT, QDMA_START | flags);
+    endtask
+
+    task automatic idle(output logic [15:0] status);
+        int polls = 0;
+        do
+            begin
+            #1000;
+            fmc_read(FADDR_DMA_CT, status);
+            end
+        while ((status & QDMA_BUSY) && ++polls < 5000);
+        check((status & QDMA_BUSY) == 0, "the burst never ended");
+    endtask
+
+    task automatic burst(input logic [21:0] addr, input int count, input logic [15:0] flags, output logic [15:0] status);
+        go(addr, count, flags);
+        idle(status);
+    endtask
+
+    // the word at <addr>, in whichever memory has it
+    function automatic void poke(input logic [21:0] addr, input logic [15:0] v);
+        if (addr >= MEM1_BASE) mem1.mem[(addr - MEM1_BASE)/2] = v;
+        else mem0.mem[addr/2] = v;
+    endfunction
+
+    function automatic logic [15:0] peek(input logic [21:0] addr);
+        return addr >= MEM1_BASE ? mem1.mem[(addr - MEM1_BASE)/2] : mem0.mem[addr/2];
+    endfunction
+
+    // memory at <addr> for a DATI, and what the window should hold after it
+    task automatic fill(input logic [21:0] addr, input int seed, input int count);
+        for (int i = 0; i < count; i++) poke(22'(addr + 2*i), pattern(seed, i));
+    endtask
+
+    task automatic check_window(input int seed, input int count);
+        logic [15:0] v;
+        int bad = 0;
+        for (int i = 0; i < count; i++)
+            begin
+            fmc_read(24'(FADDR_DMA_BUF + 2*i), v);
+            if (v != pattern(seed, i)) bad++;
+            end
+        check(bad == 0, $sformatf("%0d words of the window wrong", bad));
+    endtask
+
+    // the window for a DATO, and what memory at <addr> should hold after it
+    task automatic load_window(input int seed, input int count);
+        for (int i = 0; i < count; i++) fmc_write(24'(FADDR_DMA_BUF + 2*i), pattern(seed, i));
+    endtask
+
+    task automatic check_memory(input logic [21:0] addr, input int seed, input int count);
+        int bad = 0;
+        for (int i = 0; i < count; i++)
+            begin
+            if (peek(22'(addr + 2*i)) != pattern(seed, i)) bad++;
+            end
+        check(bad == 0, $sformatf("%0d words of memory wrong", bad));
+    endtask
+
+
+    initial
+        begin
+        logic [15:0] status, v;
+        int t, w, s, o, b, a;
+        time begun;
+
+        #1000;
+        fmc_write(FADDR_DMA_TEN, 8);
+        fmc_read(FADDR_DMA_TEN, v);
+        check(v == 8, "FADDR_DMA_TEN doesn't read back, so no engine");
+        fmc_read(FADDR_DMA_CT, v);
+        check((v & QDMA_BUSY) == 0, "busy before any burst");
+
+
+        // 64 words of DATI in one tenure
+        engine(0, 10);
+        fill(22'o1000, 1, 64);
+        t = tenures;
+        s = mem0.syncs;
+        burst(22'o1000, 64, 0, status);
+        check((status & (QDMA_NXM | QDMA_BLOCKED)) == 0, "DATI: NXM or blocked");
+        check(tenures - t == 1, $sformatf("DATI: %0d tenures", tenures - t));
+        check(mem0.syncs - s == 64, $sformatf("DATI: %0d cycles", mem0.syncs - s));
+        check(!BSACKg && !BDMRg, "DATI: still has the bus");
+        check_window(1, 64);
+
+
+        // 64 words of DATO in one tenure, leaving the words on either side alone
+        engine(0, 10);
+        mem0.mem[22'o2000/2 - 1] = 16'o177777;
+        mem0.mem[22'o2000/2 + 64] = 16'o177777;
+        load_window(2, 64);
+        t = tenures;
+        s = mem0.syncs;
+        burst(22'o2000, 64, QDMA_DATO, status);
+        check((status & (QDMA_NXM | QDMA_BLOCKED)) == 0, "DATO: NXM or blocked");
+        check(tenures - t == 1, $sformatf("DATO: %0d tenures", tenures - t));
+        check(mem0.syncs - s == 64, $sformatf("DATO: %0d cycles", mem0.syncs - s));
+        check_memory(22'o2000, 2, 64);
+        check(mem0.mem[22'o2000/2 - 1] == 16'o177777 && mem0.mem[22'o2000/2 + 64] == 16'o177777, "DATO: wrote outside the burst");
+
+
+        // split into tenures of 8 words, each held off 2 us after the last
+        engine(8, 20);
+        fill(22'o3000, 3, 64);
+        t = tenures;
+        burst(22'o3000, 64, 0, status);
+        check(tenures - t == 8, $sformatf("tenure 8: %0d tenures", tenures - t));
+        check(most_words == 8, $sformatf("tenure 8: %0d words in a tenure", most_words));
+        check(shortest_gap >= 2000, $sformatf("tenure 8: requested again %0t after letting the bus go", shortest_gap));
+        check_window(3, 64);
+
+        engine(8, 20);
+        load_window(4, 64);
+        t = tenures;
+        burst(22'o4000, 64, QDMA_DATO, status);
+        check(tenures - t == 8, $sformatf("DATO tenure 8: %0d tenures", tenures - t));
+        check(shortest_gap >= 2000, $sformatf("DATO tenure 8: requested again %0t after letting the bus go", shortest_gap));
+        check_memory(22'o4000, 4, 64);
+
+
+        // another device asks for the bus part way through: without demand mode the
+        // FPGA finishes the burst first, with it the FPGA lets the bus go after the word
+        // it is on
+        engine(0, 10);
+        fill(22'o5000, 5, 64);
+        t = tenures;
+        o = others;
+        w = mem0.words;
+        fork
+            burst(22'o5000, 64, 0, status);
+            begin
+            wait (mem0.words - w >= 16);
+            x_dmr = 1;
+            @(posedge x_sack);
+            check(mem0.words - w == 64, $sformatf("not demand: let the bus go after %0d words", mem0.words - w));
+            end
+        join
+        check(tenures - t == 1 && others - o == 1, $sformatf("not demand: %0d tenures, %0d for the other device", tenures - t, others - o));
+        check_window(5, 64);
+
+        engine(0, 10);
+        fill(22'o6000, 6, 64);
+        t = tenures;
+        o = others;
+        w = mem0.words;
+        fork
+            burst(22'o6000, 64, QDMA_DEMAND, status);
+            begin
+            wait (mem0.words - w >= 16);
+            x_dmr = 1;
+            @(posedge dmgi);
+            s = mem0.words;
+            @(negedge BSACKg);
+            check(mem0.words - s <= 2, $sformatf("demand: %0d more words after the grant came in", mem0.words - s));
+            end
+        join
+        check(tenures - t >= 2 && others - o == 1, $sformatf("demand: %0d tenures, %0d for the other device", tenures - t, others - o));
+        check((status & QDMA_NXM) == 0, "demand: NXM");
+        check_window(6, 64);
+
+
+        // the start crosses to the engine's clock: busy at once, a second start while
+        // busy does nothing, and busy stays clear once the burst has ended
+        engine(0, 10);
+        fill(22'o7000, 7, 64);
+        w = mem0.words;
+        go(22'o7000, 64, 0);
+        fmc_read(FADDR_DMA_CT, v);
+        check((v & QDMA_BUSY) != 0, "not busy straight after the start");
+        fmc_write(FADDR_DMA_CT, QDMA_START);
+        #5000;
+        fmc_write(FADDR_DMA_CT, QDMA_START);
+        idle(status);
+        check(mem0.words - w == 64, $sformatf("two starts: %0d words", mem0.words - w));
+        #20000;
+        fmc_read(FADDR_DMA_CT, v);
+        check((v & QDMA_BUSY) == 0, "busy again after the burst");
+        check(mem0.words - w == 64, $sformatf("two starts: %0d words later", mem0.words - w));
+        check_window(7, 64);
+        fill(22'o7000, 8, 64);
+        burst(22'o7000, 64, 0, status);
+        check(mem0.words - w == 128, "the next start after the burst didn't run");
+        check_window(8, 64);
+
+
+        // nonexistent memory, DATI and DATO: the burst ends with NXM after 10 us with no
+        // BRPLY, the FPGA lets the bus go, and the next burst runs as usual
+        engine(0, 10);
+        begun = $time;
+        burst(NXM_ADDR, 8, 0, status);
+        check((status & QDMA_NXM) != 0, "DATI NXM: no NXM");
+        check($time - begun >= 10us && $time - begun < 20us, $sformatf("DATI NXM: took %0t", $time - begun));
+        check(!BSACKg && !BSYNCg && !BDINg && !BDMRg && BDALf_OE == 0, "DATI NXM: still on the bus");
+
+        load_window(9, 8);
+        begun = $time;
+        burst(NXM_ADDR, 8, QDMA_DATO, status);
+        check((status & QDMA_NXM) != 0, "DATO NXM: no NXM");
+        check($time - begun >= 10us && $time - begun < 20us, $sformatf("DATO NXM: took %0t", $time - begun));
+        check(!BSACKg && !BSYNCg && !BDOUTg && !BDMRg && BDALf_OE == 0, "DATO NXM: still on the bus");
+
+        fill(22'o10000, 10, 16);
+        burst(22'o10000, 16, 0, status);
+        check((status & QDMA_NXM) == 0, "after NXM: NXM again");
+        check_window(10, 16);
+
+
+        check(mem0.block_asks == 0, "asked for block mode without QDMA_BLOCK");
+
+
+        // block mode, 64 words from the start of a 16 word block: a cycle for each block,
+        // with BBS7 or BWTBT and BREF on each word but the block's last, and the next
+        // DATBO word put on the bus from Dma_out as the last one's BDOUT ends
+        engine(0, 10);
+        fill(MEM1_BASE + 22'o1000, 11, 64);
+        s = mem1.syncs;
+        b = mem1.block_words;
+        a = mem1.block_asks;
+        burst(MEM1_BASE + 22'o1000, 64, QDMA_BLOCK, status);
+        check((status & QDMA_BLOCKED) != 0 && (status & QDMA_NXM) == 0, $sformatf("DATBI: status %o", status));
+        check(mem1.syncs - s == 4, $sformatf("DATBI: %0d cycles", mem1.syncs - s));
+        check(mem1.block_words - b == 60, $sformatf("DATBI: %0d words in block mode", mem1.block_words - b));
+        check(mem1.block_asks - a == 60, $sformatf("DATBI: asked for %0d words to follow", mem1.block_asks - a));
+        check_window(11, 64);
+
+        engine(0, 10);
+        load_window(12, 64);
+        poke(MEM1_BASE + 22'o2000 + 128, 16'o177777);
+        s = mem1.syncs;
+        b = mem1.block_words;
+        a = mem1.block_asks;
+        burst(MEM1_BASE + 22'o2000, 64, QDMA_BLOCK | QDMA_DATO, status);
+        check((status & QDMA_BLOCKED) != 0 && (status & QDMA_NXM) == 0, $sformatf("DATBO: status %o", status));
+        check(mem1.syncs - s == 4, $sformatf("DATBO: %0d cycles", mem1.syncs - s));
+        check(mem1.block_words - b == 60, $sformatf("DATBO: %0d words in block mode", mem1.block_words - b));
+        check(mem1.block_asks - a == 60, $sformatf("DATBO: asked for %0d words to follow", mem1.block_asks - a));
+        check_memory(MEM1_BASE + 22'o2000, 12, 64);
+        check(peek(MEM1_BASE + 22'o2000 + 128) == 16'o177777, "DATBO: wrote past the burst");
+
+        // 40 words from word 5 of a block: 11, 16 and 13 words, never asking past a boundary
+        engine(0, 10);
+        fill(MEM1_BASE + 22'o3000 + 10, 13, 40);
+        s = mem1.syncs;
+        b = mem1.block_words;
+        burst(MEM1_BASE + 22'o3000 + 10, 40, QDMA_BLOCK, status);
+        check(mem1.syncs - s == 3, $sformatf("unaligned DATBI: %0d cycles", mem1.syncs - s));
+        check(mem1.block_words - b == 37, $sformatf("unaligned DATBI: %0d words in block mode", mem1.block_words - b));
+        check_window(13, 40);
+
+        engine(0, 10);
+        load_window(14, 40);
+        s = mem1.syncs;
+        burst(MEM1_BASE + 22'o4000 + 10, 40, QDMA_BLOCK | QDMA_DATO, status);
+        check(mem1.syncs - s == 3, $sformatf("unaligned DATBO: %0d cycles", mem1.syncs - s));
+        check_memory(MEM1_BASE + 22'o4000 + 10, 14, 40);
+
+        // a block ends with the tenure
+        engine(8, 20);
+        fill(MEM1_BASE + 22'o5000, 15, 64);
+        t = tenures;
+        s = mem1.syncs;
+        b = mem1.block_words;
+        burst(MEM1_BASE + 22'o5000, 64, QDMA_BLOCK, status);
+        check(tenures - t == 8 && most_words == 8, $sformatf("DATBI tenure 8: %0d tenures, up to %0d words", tenures - t, most_words));
+        check(mem1.syncs - s == 8, $sformatf("DATBI tenure 8: %0d cycles", mem1.syncs - s));
+        check(mem1.block_words - b == 56, $sformatf("DATBI tenure 8: %0d words in block mode", mem1.block_words - b));
+        check_window(15, 64);
+
+        // and when another device wants the bus, in demand mode
+        engine(0, 10);
+        fill(MEM1_BASE + 22'o6000, 16, 64);
+        o = others;
+        w = words();
+        fork
+            burst(MEM1_BASE + 22'o6000, 64, QDMA_BLOCK | QDMA_DEMAND, status);
+            begin
+            wait (words() - w >= 20);
+            x_dmr = 1;
+            @(posedge dmgi);
+            s = words();
+            @(negedge BSACKg);
+            check(words() - s <= 2, $sformatf("DATBI demand: %0d more words after the grant came in", words() - s));
+            end
+        join
+        check(others - o == 1, "DATBI demand: the other device didn't get the bus");
+        check_window(16, 64);
+
+        // a memory without BREF: the engine asks, gets no BREF, and moves each word in a
+        // cycle of its own, and the status says no word went in block mode
+        engine(0, 10);
+        fill(22'o11000, 17, 64);
+        s = mem0.syncs;
+        a = mem0.block_asks;
+        burst(22'o11000, 64, QDMA_BLOCK, status);
+        check((status & (QDMA_BLOCKED | QDMA_NXM)) == 0, $sformatf("DATBI without BREF: status %o", status));
+        check(mem0.syncs - s == 64, $sformatf("DATBI without BREF: %0d cycles", mem0.syncs - s));
+        check(mem0.block_asks - a == 60, $sformatf("DATBI without BREF: asked for %0d words to follow", mem0.block_asks - a));
+        check_window(17, 64);
+
+        engine(0, 10);
+        load_window(18, 64);
+        s = mem0.syncs;
+        burst(22'o12000, 64, QDMA_BLOCK | QDMA_DATO, status);
+        check((status & (QDMA_BLOCKED | QDMA_NXM)) == 0, $sformatf("DATBO without BREF: status %o", status));
+        check(mem0.syncs - s == 64, $sformatf("DATBO without BREF: %0d cycles", mem0.syncs - s));
+        check_memory(22'o12000, 18, 64);
+
+        // and a memory with BREF after one without: Dma_blocked is the last burst's
+        fill(MEM1_BASE + 22'o7000, 19, 16);
+        burst(MEM1_BASE + 22'o7000, 16, QDMA_BLOCK, status);
+        check((status & QDMA_BLOCKED) != 0, "DATBI after DATBO without BREF: not blocked");
+        check_window(19, 16);
+        burst(MEM1_BASE + 22'o7000, 16, 0, status);
+        check((status & QDMA_BLOCKED) == 0, "DATI after DATBI: still blocked");
+
+
+        #5000;
+        check(overlaps == 0, $sformatf("drove the bus for %0d clocks while the other device had it", overlaps));
+        check(mem0.errors == 0 && mem1.errors == 0, $sformatf("%0d and %0d errors in mem0's and mem1's cycles", mem0.errors, mem1.errors));
+        check(mem1.boundary == 0, $sformatf("asked for %0d words past a 16 word boundary", mem1.boundary));
+        check(mem0.boundary == 0, $sformatf("asked mem0 for %0d words past a 16 word boundary", mem0.boundary));
+        finish("tb_burst");
+        end
+
+endmodule
@@ -0,0 +1,191 @@
+// The burst engine's data port, FADDR_DMA_FIFO, as the MDMA uses it (see QMDMA.cpp):
+// single FMC cycles back to back, to and from the one address.
+//
+// Reads of the port are counted on the rising edge of NOE (Fifo_reads), and the word
+// they read is Fifo_reads - Fifo_mark. Writes to FADDR_DMA_CNT, clocked by NWE, put
+// the port back at word 0 by copying Fifo_reads to Fifo_mark, and Fifo_out to 0 for
+// writes. The testbench checks that the two sides agree through 64 reads and more,
+// through resets part way, and with the counters wrapping, and that nothing else moves
+// the port. The data goes through bursts to and from a memory, as Qbus.cpp runs them:
+// for DATO the port is written and then the burst started, which resets it; for DATI
+// the burst is started, which resets it, and then the port is read.
+
+module tb_fifo;
+
+    `include "bus.svh"
+
+    wire [21:0] m0_bdal;
+    wire m0_rply, m0_ref;
+    qmem #(.BASE(0), .WORDS(4096)) mem0 (
+        .bdal(bdal), .sync(sync), .din(din), .dout(dout), .wtbt(wtbt), .bs7(bs7),
+        .bdal_out(m0_bdal), .rply(m0_rply), .ref_out(m0_ref)
+    );
+
+    assign s_bdal = m0_bdal;
+    assign s_rply = m0_rply;
+    assign s_ref = m0_ref;
+
+    // the arbiter, with nobody else wanting the bus
+    initial
+        forever
+            begin
+            wait (dmr && !sack);
+            #200 dmgi = 1;
+            wait (sack);
+            #100 dmgi = 0;
+            end
+
+    initial
+        begin
+        #10ms;
+        $display("tb_fifo: timed out");
+        $fatal(1);
+        end
+
+
+    function automatic logic [15:0] pattern(input int seed, input int i);
+        return 16'(seed * 'h0123 + i * 'h0101) ^ 16'h5A5A;
+    endfunction
+
+    task automatic go(input logic [21:0] addr, input int count, input logic [15:0] flags);
+        fmc_write(FADDR_LO, addr[15:0]);
+        fmc_write(FADDR_HI, {10'b0, addr[21:16]});
+        fmc_write(FADDR_DMA_CNT, 16'(count));
+        fmc_write(FADDR_DMA_CT, QDMA_START | flags);
+    endtask
+
+    task automatic burst(input logic [21:0] addr, input int count, input logic [15:0] flags);
+        logic [15:0] status;
+        int polls = 0;
+        go(addr, count, flags);
+        do
+            begin
+            #1000;
+            fmc_read(FADDR_DMA_CT, status);
+            end
+        while ((status & QDMA_BUSY) && ++polls < 5000);
+        check((status & (QDMA_BUSY | QDMA_NXM)) == 0, $sformatf("burst at %o: status %o", addr, status));
+    endtask
+
+    // <count> words from the port, back to back, which should be the pattern from word <first>
+    task automatic port_read(input int seed, input int first, input int count, input string what);
+        logic [15:0] v;
+        int bad = 0, at = -1;
+        fmc_gap = 0;
+        for (int i = 0; i < count; i++)
+            begin
+            fmc_read(FADDR_DMA_FIFO, v);
+            if (v != pattern(seed, first + i))
+                begin
+                if (at < 0) at = i;
+                bad++;
+                end
+            end
+        fmc_gap = 20;
+        check(bad == 0, $sformatf("%s: %0d of %0d reads wrong, the first at %0d", what, bad, count, at));
+    endtask
+
+    // <count> words to the port, back to back, the pattern from word <first>
+    task automatic port_write(input int seed, input int first, input int count);
+        fmc_gap = 0;
+        for (int i = 0; i < count; i++) fmc_write(FADDR_DMA_FIFO, pattern(seed, first + i));
+        fmc_gap = 20;
+    endtask
+
+    task automatic fill(input logic [21:0] addr, input int seed, input int count);
+        for (int i = 0; i < count; i++) mem0.mem[addr/2 + i] = pattern(seed, i);
+    endtask
+
+    task automatic check_memory(input logic [21:0] addr, input int seed, input int count, input string what);
+        int bad = 0;
+        for (int i = 0; i < count; i++)
+            begin
+            if (mem0.mem[addr/2 + i] != pattern(seed, i)) bad++;
+            end
+        check(bad == 0, $sformatf("%s: %0d words of memory wrong", what, bad));
+    endtask
+
+
+    initial
+        begin
+        logic [15:0] v;
+
+        #1000;
+        fmc_write(FADDR_DMA_TEN, 0);
+        fmc_write(FADDR_DMA_HOLD, 10);
+        fmc_read(FADDR_DMA_CT, v);
+        check((v & QDMA_FIFO) != 0, "no data port");
+
+
+        // DATI, 64 reads of the port back to back
+        fill(22'o1000, 1, 64);
+        burst(22'o1000, 64, 0);
+        port_read(1, 0, 64, "64 reads");
+
+        // FADDR_DMA_CNT puts the port back at word 0, whether it was at the end of the
+        // window, part way, or never read since the last time
+        fmc_write(FADDR_DMA_CNT, 64);
+        port_read(1, 0, 64, "64 reads again");
+        fmc_write(FADDR_DMA_CNT, 64);
+        port_read(1, 0, 20, "20 reads");
+        fmc_write(FADDR_DMA_CNT, 64);
+        fmc_write(FADDR_DMA_CNT, 64);
+        port_read(1, 0, 64, "64 reads after 20");
+
+        // with Fifo_reads wrapping round in between, at each count from 1 to 63
+        for (int n = 1; n < 64; n++)
+            begin
+            fmc_write(FADDR_DMA_CNT, 64);
+            port_read(1, 0, n, $sformatf("%0d reads", n));
+            end
+        fmc_write(FADDR_DMA_CNT, 64);
+        port_read(1, 0, 64, "64 reads after the wrapping");
+
+        // reading the window and the registers, and writing the port, doesn't move it
+        fmc_write(FADDR_DMA_CNT, 64);
+        port_read(1, 0, 8, "8 reads");
+        fmc_read(FADDR_DMA_BUF + 2*40, v);
+        check(v == pattern(1, 40), "the window's word 40");
+        fmc_read(FADDR_DMA_CT, v);
+        fmc_read(FADDR_DMA_CNT, v);
+        port_write(2, 0, 8);
+        port_read(1, 8, 56, "56 reads after the window, the registers and writes");
+
+        // the next DATI burst starts it again, at that burst's data
+        fill(22'o2000, 3, 16);
+        burst(22'o2000, 16, 0);
+        port_read(3, 0, 16, "16 reads after a burst");
+
+
+        // DATO, 64 writes to the port back to back, then the burst
+        port_write(4, 0, 64);
+        burst(22'o3000, 64, QDMA_DATO);
+        check_memory(22'o3000, 4, 64, "64 writes");
+
+        // and again, the burst having put the port back at word 0
+        port_write(5, 0, 64);
+        burst(22'o3000, 64, QDMA_DATO);
+        check_memory(22'o3000, 5, 64, "64 writes again");
+
+        // written part way, then put back by FADDR_DMA_CNT, and written from word 0
+        port_write(6, 0, 20);
+        fmc_write(FADDR_DMA_CNT, 64);
+        port_write(7, 0, 64);
+        burst(22'o4000, 64, QDMA_DATO);
+        check_memory(22'o4000, 7, 64, "64 writes after 20");
+
+        // a short burst leaves the port at word 0 for the next one
+        port_write(8, 0, 16);
+        burst(22'o5000, 16, QDMA_DATO);
+        check_memory(22'o5000, 8, 16, "16 writes");
+        port_write(9, 0, 64);
+        burst(22'o5000, 64, QDMA_DATO);
+        check_memory(22'o5000, 9, 64, "64 writes after 16");
+
+
+        #5000;
+        check(mem0.errors == 0, $sformatf("%0d errors in mem0's cycles", mem0.errors));
+        finish("tb_fifo");
+        end
+
+endmodule
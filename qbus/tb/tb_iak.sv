@@ -0,0 +1,270 @@
+// Interrupts ("Qbus interrupts" in qbus.sv): the processor's interrupt acknowledge, with
+// the FPGA first on the BIAKI/BIAKO chain and another interrupter after it.
+//
+// The processor acknowledges as qbus.sv expects: BDIN without BSYNC, then BIAKI into the
+// FPGA, then it waits for BRPLY and takes the vector from BDAL. The other interrupter
+// requests on BIRQ4, and on BIRQ5, 6 or 7 as well for those levels, as the FPGA does. It
+// decides when BDIN arrives whether the acknowledge is its own, and answers it when its
+// BIAKI (the FPGA's BIAKO) comes, or passes it on. An acknowledge that comes out of the
+// end of the chain is one nobody took.
+
+module tb_iak;
+
+    `include "bus.svh"
+
+    assign s_bdal = 0;
+    assign s_rply = 0;
+    assign s_ref = 0;
+
+
+    // the other interrupter
+
+    logic req2 = 0;                             // requesting
+    int level2 = 4;                             // at BR4 to BR7
+    logic [15:0] vector2 = 16'o310;
+    logic armed2 = 0;
+    int taken2 = 0;                             // acknowledges it answered
+    wire iako2 = BIAKOg && !armed2;             // its BIAKO, the end of the chain
+    int unanswered = 0;
+
+    always @*
+        begin
+        x_irq4 = req2;
+        x_irq5 = req2 && level2 == 5;
+        x_irq6 = req2 && level2 == 6;
+        x_irq7 = req2 && level2 == 7;
+        end
+
+    always @(posedge din)
+        begin
+        armed2 = !sync && req2 && !(irq7 && level2 < 7 || irq6 && level2 < 6 || irq5 && level2 < 5);
+        end
+
+    always @(posedge BIAKOg)
+        begin
+        if (armed2 && din)
+            begin
+            x_bdal = {6'b0, vector2};
+            #100 x_rply = 1;
+            req2 = 0;
+            taken2++;
+            wait (!din);
+            x_bdal = 0;
+            x_rply = 0;
+            end
+        end
+
+    always @(negedge din)
+        begin
+        armed2 = 0;
+        end
+
+    always @(posedge iako2)
+        begin
+        unanswered++;
+        end
+
+
+    // the FPGA drives BDAL and BRPLY only for its own acknowledge, with BIAKI in, and then
+    // doesn't pass BIAKI on
+
+    int stray = 0;                              // clocks it drove the bus otherwise
+    int both = 0;                               // clocks it answered and passed BIAKO on at once
+
+    always @(posedge clock)
+        begin
+        #1;                                     // clear of the edges the processor's strobes change on
+        if ((BRPLYg || BDALf_OE != 0) && !(iaki && din && !sync)) stray++;
+        if (BIAKOg && (BRPLYg || BDALf_OE != 0)) both++;
+        end
+
+    initial
+        begin
+        #10ms;
+        $display("tb_iak: timed out");
+        $fatal(1);
+        end
+
+
+    // the processor
+
+    time acked;                                 // when the last acknowledge ended
+
+    // an acknowledge, with <gap> ns from BDIN to BIAKI; <vector> is 0 if nobody answered
+    task automatic iak(input int gap, output logic [15:0] vector);
+        vector = 0;
+        x_din = 1;
+        #(gap) iaki = 1;
+        for (int t = 0; t < 100 && !rply; t++) #100;
+        if (rply)
+            begin
+            #200 vector = bdal[15:0];
+            end
+        x_din = 0;
+        acked = $time;
+        for (int t = 0; t < 100 && rply; t++) #100;
+        check(!rply, "BRPLY held after BDIN");
+        #100 iaki = 0;
+        #500;
+    endtask
+
+    // a DATI to memory nobody has, while the FPGA may be requesting
+    task automatic dati(input logic [21:0] addr);
+        x_bdal = addr;
+        #150 x_sync = 1;
+        #100 x_bdal = 0;
+        x_din = 1;
+        #2000;
+        check(!rply, "BRPLY to a DATI of nothing");
+        x_din = 0;
+        #100 x_sync = 0;
+        #500;
+    endtask
+
+
+    // the FPGA, as Qinterrupt runs it
+
+    task automatic request(input int level, input logic [15:0] vector);
+        fmc_write(FADDR_IRQ_VEC, vector);
+        fmc_write(FADDR_IRQ_CT, QIRQ_REQUEST | 16'((level - 4) << 1));
+        #300;                                   // the request is asserted once it reaches the clock
+    endtask
+
+    task automatic other(input int level, input logic [15:0] vector);
+        level2 = level;
+        vector2 = vector;
+        req2 = 1;
+        #100;
+    endtask
+
+
+    initial
+        begin
+        logic [15:0] v;
+        int n;
+
+        #1000;
+        fmc_write(FADDR_IRQ_HOLD, 0);
+        fmc_read(FADDR_IRQ_HOLD, v);
+        check(v == 0, "FADDR_IRQ_HOLD doesn't read back");
+        check(!BIRQ4g && !BIRQ5g && !BIRQ6g, "requesting before any request");
+
+
+        // the FPGA alone, at each level
+        for (int level = 4; level <= 6; level++)
+            begin
+            request(level, 16'(16'o150 + 4*level));
+            fmc_read(FADDR_IRQ_CT, v);
+            check((v & (QIRQ_PENDING | QIRQ_ASSERTED)) == (QIRQ_PENDING | QIRQ_ASSERTED), $sformatf("BR%0d: status %o", level, v));
+            check(BIRQ4g && BIRQ5g == (level == 5) && BIRQ6g == (level == 6), $sformatf("BR%0d: the wrong lines", level));
+            n = unanswered;
+            iak(150, v);
+            check(v == 16'o150 + 4*level, $sformatf("BR%0d: vector %o", level, v));
+            check(unanswered == n, $sformatf("BR%0d: BIAKO passed on", level));
+            check(!BIRQ4g && !BIRQ5g && !BIRQ6g, $sformatf("BR%0d: still requesting after the acknowledge", level));
+            fmc_read(FADDR_IRQ_CT, v);
+            check((v & QIRQ_PENDING) == 0, $sformatf("BR%0d: still pending", level));
+            end
+
+
+        // not requesting: BIAKI goes straight through to the other interrupter
+        other(4, 16'o310);
+        iak(150, v);
+        check(v == 16'o310 && taken2 == 1, $sformatf("passed on: vector %o", v));
+
+        // nobody requesting: it comes out of the end of the chain
+        n = unanswered;
+        iak(150, v);
+        check(v == 0 && unanswered == n + 1, "nobody requesting: answered");
+
+
+        // both at BR4: the FPGA is first on the chain, then the other's turn
+        other(4, 16'o320);
+        request(4, 16'o154);
+        iak(150, v);
+        check(v == 16'o154, $sformatf("both BR4: vector %o first", v));
+        iak(150, v);
+        check(v == 16'o320, $sformatf("both BR4: vector %o second", v));
+
+
+        // a higher level further down the chain goes first, the FPGA's BR4 yields to
+        // BR5, BR6 and BR7, its BR5 to BR6 and BR7, and its BR6 to BR7
+        for (int level = 4; level <= 6; level++)
+            for (int higher = level + 1; higher <= 7; higher++)
+                begin
+                request(level, 16'o154);
+                other(higher, 16'o330);
+                n = taken2;
+                iak(150, v);
+                check(v == 16'o330 && taken2 == n + 1, $sformatf("BR%0d against BR%0d: vector %o first", level, higher, v));
+                check(BIRQ4g, $sformatf("BR%0d against BR%0d: gave up its request", level, higher));
+                iak(150, v);
+                check(v == 16'o154, $sformatf("BR%0d against BR%0d: vector %o second", level, higher, v));
+                end
+
+        // and a level below the FPGA's doesn't
+        request(6, 16'o154);
+        other(5, 16'o330);
+        iak(150, v);
+        check(v == 16'o154, $sformatf("BR6 against BR5: vector %o first", v));
+        iak(150, v);
+        check(v == 16'o330, $sformatf("BR6 against BR5: vector %o second", v));
+
+
+        // the acknowledge is decided when BDIN comes: a request asserted after that,
+        // before BIAKI, passes BIAKI on, and is taken by the next acknowledge
+        other(4, 16'o344);
+        n = taken2;
+        fork
+            iak(1000, v);
+            begin
+            #100;
+            request(4, 16'o154);
+            check(BIRQ4g, "request during the acknowledge: not asserted before BIAKI");
+            end
+        join
+        check(v == 16'o344 && taken2 == n + 1, $sformatf("request during the acknowledge: vector %o", v));
+        iak(150, v);
+        check(v == 16'o154, $sformatf("request during the acknowledge: then vector %o", v));
+
+
+        // a DATI, BDIN with BSYNC, isn't an acknowledge even while requesting
+        request(4, 16'o154);
+        dati(22'o1000);
+        check(BIRQ4g, "DATI: took the request");
+        iak(150, v);
+        check(v == 16'o154, $sformatf("DATI: then vector %o", v));
+
+
+        // a cancelled request isn't asserted and passes BIAKI on
+        request(4, 16'o154);
+        fmc_write(FADDR_IRQ_CT, QIRQ_CANCEL);
+        #300;
+        check(!BIRQ4g, "cancel: still requesting");
+        n = unanswered;
+        iak(150, v);
+        check(v == 0 && unanswered == n + 1, $sformatf("cancel: vector %o", v));
+
+
+        // the holdoff: the next request waits Irq_holdoff clocks from the acknowledge
+        fmc_write(FADDR_IRQ_HOLD, 50);
+        request(4, 16'o154);
+        iak(150, v);
+        request(4, 16'o154);
+        check(!BIRQ4g, "holdoff: requesting at once");
+        fmc_read(FADDR_IRQ_CT, v);
+        check((v & (QIRQ_PENDING | QIRQ_ASSERTED)) == QIRQ_PENDING, $sformatf("holdoff: status %o", v));
+        wait (BIRQ4g);
+        check($time - acked >= 5us && $time - acked < 6us, $sformatf("holdoff: requested %0t after the acknowledge", $time - acked));
+        iak(150, v);
+        check(v == 16'o154, $sformatf("holdoff: vector %o", v));
+        fmc_write(FADDR_IRQ_HOLD, 0);
+
+
+        #5000;
+        check(stray == 0, $sformatf("drove BDAL or BRPLY for %0d clocks outside its own acknowledge", stray));
+        check(both == 0, $sformatf("answered and passed BIAKO on at once for %0d clocks", both));
+        finish("tb_iak");
+        end
+
+endmodule
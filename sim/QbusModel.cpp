@@ -0,0 +1,583 @@
+// A model of the FPGA and the Qbus, see QbusModel.hpp
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "QbusModel.hpp"
+#include "Qbus.hpp"
+#include "context.hpp"
+#include "ContextFIFO.hpp"
+
+// Q_Ctl bits
+#define C_BSYNC         0x0001
+#define C_BDIN          0x0002
+#define C_BDOUT         0x0004
+#define C_BDMR          0x0010
+#define C_CLEAR_SA      0x1000
+#define C_DMA_DONE      0x8000
+
+// burst engine timing, in the FPGA's 100 ns clocks, as in qbus.sv
+#define T_ADDR_SETUP 2
+#define T_ADDR_HOLD 1
+#define T_DATA_SETUP 1
+#define T_RDATA_SETUP 2
+#define T_BDOUT_HOLD 2
+#define T_DATA_HOLD 1
+#define T_SYNC_HOLD 2
+#define T_TURN 3
+#define T_DMA_TURN 3
+#define T_DMA_HOLDOFF 40
+#define T_NXM 100
+
+#define UNREPLY_NS 75                                   // from BDIN or BDOUT negated to BRPLY negated
+
+SimTiming sim_timing;
+uint64_t sim_cycles = 0;
+SimBusStats sim_bus;
+uint32_t sim_mem_size = SIM_MEM_MAX - 8192;
+uint16_t sim_mem[SIM_MEM_MAX/2];
+
+unsigned host_interrupts = 0;
+uint16_t host_vector = 0;
+
+extern volatile bool *FPGA_doorbell;                    // the firmware's EXTI callback, in FPGA_monitor.cpp, sets this when FPGA_IRQ rises
+
+extern "C" void SimSwitch(void **save, void *load);
+extern void *SimStackInit(char *stack, unsigned size, void (*entry)());
+
+
+// the state of qbus.sv
+
+struct Fpga
+    {
+    uint16_t SA_Status = 0;                             // read by the PDP-11, written by the H723
+    uint16_t SA_Address = 0;                            // written by the PDP-11, read by the H723
+    bool IP_Read = false;
+    bool IP_Written = false;
+    bool SA_Read = false;
+    bool SA_Written = false;
+    bool BRPLY_Asserted = false;
+    bool BRPLY_Deasserted = false;
+    bool brply = false;                                 // BRPLY as last seen by a read of ST, for the two above
+    uint16_t Ctl = 0;
+    uint32_t Addr = 0;
+    uint16_t Data_out = 0;
+    uint16_t Test = 0;
+
+    // a CPU sequenced bus cycle
+    uint32_t cycle_addr = 0;                            // latched at BSYNC
+    uint16_t Data_in = 0;
+    bool nxm = false;                                   // nothing answers the address
+    uint64_t reply_at = 0;                              // when BRPLY comes
+    uint64_t unreply_at = 0;                            // when it goes away again
+    bool BSACK = false;
+    bool granting = false;                              // BDMR is asserted
+    uint64_t grant_at = 0;                              // and the grant comes at
+
+    // burst engine
+    uint16_t Dma_count = 0;
+    uint16_t Dma_tenure = 0;
+    uint16_t Dma_holdoff = T_DMA_HOLDOFF;
+    bool Dma_nxm = false;
+    bool Dma_blocked = false;
+    uint64_t Dma_busy_until = 0;
+    uint64_t Dma_released = 0;                          // the end of the last tenure
+    uint16_t Dma_in[QDMA_WORDS] = {};
+    uint16_t Dma_out[QDMA_WORDS] = {};
+    unsigned Fifo_out = 0;                              // the data port's next word of Dma_out
+    unsigned Fifo_in = 0;                               // and of Dma_in
+
+    // interrupts
+    uint16_t Irq_vector = 0;
+    uint16_t Irq_level = 0;
+    uint16_t Irq_holdoff = 0;
+    bool Irq_pending = false;
+    uint64_t Irq_request_at = 0;
+    uint64_t Irq_held_until = 0;
+    };
+
+static Fpga F;
+
+
+// time
+
+static uint64_t next_event = SIM_FOREVER;               // the soonest time anything below needs to happen
+static uint64_t host_wake = SIM_FOREVER;                // when the PDP-11 runs again
+static uint64_t irq_ack_at = SIM_FOREVER;               // when the PDP-11 acknowledges the interrupt request
+static void RunHost();
+
+uint64_t SimNs(uint64_t ns)
+    {
+    return ns * sim_timing.cpu_mhz / 1000;
+    }
+
+double SimSeconds(uint64_t cycles)
+    {
+    return cycles / (sim_timing.cpu_mhz * 1e6);
+    }
+
+static uint64_t Clocks(unsigned n)                      // FPGA clocks to CPU cycles
+    {
+    return SimNs(n * 100ull);
+    }
+
+static void Reschedule()
+    {
+    irq_ack_at = SIM_FOREVER;
+    if(F.Irq_pending)
+        {
+        uint64_t raise = F.Irq_request_at > F.Irq_held_until ? F.Irq_request_at : F.Irq_held_until;
+
+        irq_ack_at = raise + SimNs(sim_timing.irq_latency_ns);
+        }
+    next_event = host_wake < irq_ack_at ? host_wake : irq_ack_at;
+    }
+
+static void RunEvents()
+    {
+    if(sim_cycles >= irq_ack_at)                        // the PDP-11 acknowledges the interrupt, and takes the vector
+        {
+        F.Irq_pending = false;
+        F.Irq_held_until = sim_cycles + Clocks(F.Irq_holdoff);
+        host_vector = F.Irq_vector;
+        ++host_interrupts;
+        ++sim_bus.interrupts;
+        if(host_wake > sim_cycles)host_wake = sim_cycles;   // it stops waiting
+        }
+    if(sim_cycles >= host_wake)
+        {
+        RunHost();
+        }
+    Reschedule();
+    }
+
+void SimAdvance(uint64_t cycles)
+    {
+    uint64_t end = sim_cycles + cycles;
+
+    while(next_event <= end)
+        {
+        if(next_event > sim_cycles)sim_cycles = next_event;
+        RunEvents();
+        }
+    if(end > sim_cycles)sim_cycles = end;
+    }
+
+// the cycle counter, xCYCCNT in cyccnt.hpp
+
+uint32_t volatile *QbusSimCyccnt()
+    {
+    static uint32_t cyccnt;
+
+    SimAdvance(sim_timing.cyccnt_cycles);
+    cyccnt = (uint32_t)sim_cycles;
+    return &cyccnt;
+    }
+
+// a firmware thread waits, as for the SD card, while the other threads run
+
+void SimSleep(uint64_t ns)
+    {
+    uint64_t end = sim_cycles + SimNs(ns);
+
+    while(sim_cycles < end)
+        {
+        if(Context::pointer()->isBackground())
+            {
+            SimAdvance(end - sim_cycles);
+            }
+        else
+            {
+            yield();
+            SimAdvance(sim_timing.cyccnt_cycles);
+            }
+        }
+    }
+
+
+// the PDP-11, see HostStart
+
+static void (*host_code)();
+static char *host_stack;
+static void *host_sp;
+static void *host_return_sp;
+static bool host_running = false;
+static bool host_done = false;
+
+static void HostEntry()
+    {
+    host_code();
+    host_done = true;
+    host_wake = SIM_FOREVER;
+    for(;;)SimSwitch(&host_sp, host_return_sp);
+    }
+
+static void RunHost()
+    {
+    host_wake = SIM_FOREVER;
+    if(host_running || host_done)return;
+
+    host_running = true;
+    SimSwitch(&host_return_sp, host_sp);
+    host_running = false;
+    }
+
+// start running <code> as the PDP-11, <delay> ns from now
+
+void HostStart(void (*code)(), unsigned stack, uint64_t delay)
+    {
+    host_code = code;
+    host_stack = (char *)malloc(stack);
+    host_sp = SimStackInit(host_stack, stack, HostEntry);
+    host_done = false;
+    host_wake = sim_cycles + SimNs(delay);
+    Reschedule();
+    }
+
+// let time pass for the PDP-11, <ns>, or until it takes an interrupt
+
+void HostWait(uint64_t ns)
+    {
+    uint64_t cycles = SimNs(ns);
+
+    host_wake = sim_cycles + (cycles ? cycles : 1);
+    SimSwitch(&host_sp, host_return_sp);
+    }
+
+bool HostDone()
+    {
+    return host_done;
+    }
+
+// a DATI by the PDP-11 processor
+
+uint16_t HostRead(uint32_t addr)
+    {
+    addr &= ~1u;
+    if(addr < sim_mem_size)return sim_mem[addr/2];
+    if(addr == SIM_IP)
+        {
+        F.IP_Read = true;                               // the host polls, FPGA_IRQ rises
+        if(FPGA_doorbell)*FPGA_doorbell = true;
+        return 0;
+        }
+    if(addr == SIM_SA)
+        {
+        F.SA_Read = true;
+        return F.SA_Status;
+        }
+    return 0;
+    }
+
+// a DATO by the PDP-11 processor
+
+void HostWrite(uint32_t addr, uint16_t data)
+    {
+    addr &= ~1u;
+    if(addr < sim_mem_size)
+        {
+        sim_mem[addr/2] = data;
+        }
+    else if(addr == SIM_IP)                             // initialize the controller, which also resets the FPGA's registers
+        {
+        F.IP_Written = true;
+        F.SA_Status = 0;
+        F.Ctl = 0;
+        F.Addr = 0;
+        F.Data_out = 0;
+        if(FPGA_doorbell)*FPGA_doorbell = true;
+        }
+    else if(addr == SIM_SA)
+        {
+        F.SA_Address = data;
+        F.SA_Written = true;
+        if(FPGA_doorbell)*FPGA_doorbell = true;
+        }
+    }
+
+void QbusModelReset()
+    {
+    F = Fpga();
+    sim_cycles = 0;
+    sim_bus = SimBusStats();
+    host_wake = SIM_FOREVER;
+    host_interrupts = 0;
+    Reschedule();
+    }
+
+
+// the bus as the FPGA sees it
+
+static bool Brply()
+    {
+    if(F.Ctl & (C_BDIN | C_BDOUT))return !F.nxm && sim_cycles >= F.reply_at;
+    return sim_cycles < F.unreply_at;
+    }
+
+static bool Exists(uint32_t addr)
+    {
+    return addr < sim_mem_size;
+    }
+
+// a write of Q_Ctl, the H723 sequencing bus signals itself
+
+static void WriteCtl(uint16_t data)
+    {
+    uint16_t old = F.Ctl;
+
+    F.Ctl = data & 0x7FFF;
+    if(data & C_DMA_DONE)F.BSACK = false;
+
+    uint16_t rise = F.Ctl & ~old;
+    uint16_t fall = old & ~F.Ctl;
+
+    if(rise & C_BDMR)
+        {
+        F.granting = true;
+        F.grant_at = sim_cycles + SimNs(sim_timing.arb_ns);
+        }
+    if(fall & C_BDMR)
+        {
+        F.granting = false;
+        }
+    if(rise & C_BSYNC)
+        {
+        F.cycle_addr = F.Addr & ~1u;
+        F.nxm = !Exists(F.cycle_addr);
+        }
+    if((rise & C_BDIN) && (F.Ctl & C_BSYNC))            // DATI
+        {
+        if(!F.nxm)F.Data_in = sim_mem[F.cycle_addr/2];
+        F.reply_at = sim_cycles + SimNs(sim_timing.mem_reply_ns);
+        ++sim_bus.dati;
+        }
+    if((rise & C_BDOUT) && (F.Ctl & C_BSYNC))           // DATO
+        {
+        if(!F.nxm)sim_mem[F.cycle_addr/2] = F.Data_out;
+        F.reply_at = sim_cycles + SimNs(sim_timing.mem_reply_ns);
+        ++sim_bus.dato;
+        }
+    if(fall & (C_BDIN | C_BDOUT))
+        {
+        F.unreply_at = sim_cycles + SimNs(UNREPLY_NS);
+        }
+    }
+
+// start a burst, following the states of the burst engine in qbus.sv
+// The data moves at once, and the engine is busy until the time the burst would end.
+
+static void StartBurst(uint16_t ct)
+    {
+    if(sim_cycles < F.Dma_busy_until)return;            // a burst is already running
+
+    bool write = ct & QDMA_DATO;
+    bool block = (ct & QDMA_BLOCK) && sim_timing.block_memory;
+    uint32_t addr = F.Addr & ~1u;
+    unsigned count = F.Dma_count;
+    uint64_t reply = SimNs(sim_timing.mem_reply_ns);
+    uint64_t unreply = SimNs(UNREPLY_NS);
+    uint64_t t = F.Dma_released + Clocks(F.Dma_holdoff);
+
+    if(t < sim_cycles)t = sim_cycles;
+    F.Dma_nxm = false;
+    F.Dma_blocked = false;
+
+    for(unsigned word=0; word<count && !F.Dma_nxm; )
+        {
+        unsigned n = count - word;
+
+        if(F.Dma_tenure && n > F.Dma_tenure)n = F.Dma_tenure;
+        if(word)t += Clocks(F.Dma_holdoff);             // between tenures
+        t += SimNs(sim_timing.arb_ns) + Clocks(T_DMA_TURN);
+
+        for(unsigned i=0; i<n; i++, word++)
+            {
+            uint32_t a = addr + word*2;
+            bool first = i == 0 || !block;
+
+            if(first)t += Clocks(T_ADDR_SETUP + T_ADDR_HOLD);
+            else F.Dma_blocked = true;
+
+            if(!Exists(a))
+                {
+                t += Clocks(T_NXM);
+                F.Dma_nxm = true;
+                break;
+                }
+
+            if(write)
+                {
+                sim_mem[a/2] = F.Dma_out[word];
+                t += Clocks(T_DATA_SETUP) + reply + Clocks(T_BDOUT_HOLD + T_DATA_HOLD);
+                }
+            else
+                {
+                F.Dma_in[word] = sim_mem[a/2];
+                t += reply + Clocks(T_RDATA_SETUP);
+                }
+
+            if(!block || i == n-1)                      // the end of the bus cycle
+                {
+                t += (write ? Clocks(T_SYNC_HOLD) : 0) + unreply + Clocks(T_TURN);
+                }
+            }
+        }
+
+    sim_bus.burst_cycles += t - sim_cycles;
+    sim_bus.burst_words += count;
+    ++sim_bus.bursts;
+    F.Dma_busy_until = t;
+    F.Dma_released = t;
+    }
+
+
+// FMC reads and writes, see QbusSim.hpp
+
+uint16_t QbusSimRead(unsigned faddr)
+    {
+    uint16_t v = 0;
+
+    SimAdvance(SimNs(sim_timing.fmc_read_ns));
+    ++sim_bus.fmc_reads;
+
+    if(!sim_timing.engine && ((faddr >= 16 && faddr <= 22) || faddr >= 128))return 0;
+    if(!sim_timing.irq && faddr >= 24 && faddr <= 28)return 0;
+    if(!(sim_timing.engine && sim_timing.fifo) && faddr == 30)return 0;
+
+    switch(faddr)
+        {
+        case 0:                                         // ST, which clears the bits it reports
+            {
+            bool brply = Brply();
+
+            if(F.granting && sim_cycles >= F.grant_at)
+                {
+                F.BSACK = true;
+                F.granting = false;
+                ++sim_bus.grants;
+                }
+            if(brply && !F.brply)F.BRPLY_Asserted = true;
+            if(!brply && F.brply)F.BRPLY_Deasserted = true;
+            F.brply = brply;
+
+            Q_Sts sts = {};
+            sts.IP_Read = F.IP_Read;
+            sts.IP_Written = F.IP_Written;
+            sts.SA_Read = F.SA_Read;
+            sts.SA_Written = F.SA_Written;
+            sts.BRPLY = brply;
+            sts.BRPLY_Asserted = F.BRPLY_Asserted;
+            sts.BRPLY_Deasserted = F.BRPLY_Deasserted;
+            sts.BSACK = F.BSACK;
+            v = sts.value;
+
+            F.IP_Read = F.IP_Written = F.SA_Read = F.SA_Written = false;
+            F.BRPLY_Asserted = F.BRPLY_Deasserted = false;
+            if(F.Ctl & C_CLEAR_SA)F.SA_Address = 0;
+            break;
+            }
+        case 2:  v = F.SA_Address; break;
+        case 4:  v = F.Ctl; break;
+        case 6:  v = F.Addr & 0xFFFF; break;
+        case 8:  v = F.Addr >> 16; break;
+        case 10: v = F.Data_out; break;
+        case 12: v = F.Data_in; break;
+        case 14: v = F.Test; break;
+        case 16: v = F.Dma_count; break;
+        case 18: v = F.Dma_tenure; break;
+        case 20:
+            v = (sim_cycles < F.Dma_busy_until ? QDMA_BUSY : 0)
+              | (F.Dma_nxm ? QDMA_NXM : 0)
+              | (F.Dma_blocked ? QDMA_BLOCKED : 0)      // and no other device ever wants the bus
+              | (sim_timing.fifo ? QDMA_FIFO : 0);
+            break;
+        case 22: v = F.Dma_holdoff; break;
+        case 24: v = F.Irq_vector; break;
+        case 26:
+            v = (F.Irq_pending && sim_cycles >= F.Irq_held_until ? QIRQ_ASSERTED : 0)
+              | (F.Irq_level << 1)
+              | (F.Irq_pending ? QIRQ_PENDING : 0);
+            break;
+        case 28: v = F.Irq_holdoff; break;
+        case 30: v = F.Dma_in[F.Fifo_in++ % QDMA_WORDS]; break;
+        default:
+            if(faddr >= 128 && faddr < 128 + QDMA_WORDS*2)v = F.Dma_in[(faddr-128)/2];
+            break;
+        }
+    return v;
+    }
+
+void QbusSimWrite(unsigned faddr, uint16_t data)
+    {
+    SimAdvance(SimNs(sim_timing.fmc_write_ns));
+    ++sim_bus.fmc_writes;
+
+    if(!sim_timing.engine && ((faddr >= 16 && faddr <= 22) || faddr >= 128))return;
+    if(!sim_timing.irq && faddr >= 24 && faddr <= 28)return;
+    if(!(sim_timing.engine && sim_timing.fifo) && faddr == 30)return;
+
+    switch(faddr)
+        {
+        case 2:  F.SA_Status = data; break;
+        case 4:  WriteCtl(data); break;
+        case 6:  F.Addr = (F.Addr & ~0xFFFFu) | data; break;
+        case 8:  F.Addr = (F.Addr & 0xFFFF) | (uint32_t)(data & 077) << 16; break;
+        case 10: F.Data_out = data; break;
+        case 14: F.Test = data; break;
+        case 16:
+            F.Dma_count = data & 0177;
+            F.Fifo_out = F.Fifo_in = 0;
+            break;
+        case 18: F.Dma_tenure = data & 0177; break;
+        case 20: if(data & QDMA_START)StartBurst(data); break;
+        case 22: F.Dma_holdoff = data & 0377; break;
+        case 24: F.Irq_vector = data; break;
+        case 26:
+            F.Irq_level = (data >> 1) & 3;
+            if(data & QIRQ_CANCEL)
+                {
+                F.Irq_pending = false;
+                }
+            else if((data & QIRQ_REQUEST) && !F.Irq_pending)
+                {
+                F.Irq_pending = true;
+                F.Irq_request_at = sim_cycles;
+                }
+            Reschedule();
+            break;
+        case 28: F.Irq_holdoff = data; break;
+        case 30: F.Dma_out[F.Fifo_out++ % QDMA_WORDS] = data; break;
+        default:
+            if(faddr >= 128 && faddr < 128 + QDMA_WORDS*2)F.Dma_out[(faddr-128)/2] = data;
+            break;
+        }
+    }
+
+
+// the MDMA, in place of the firmware's QMDMA.cpp
+// It moves the words through the data port with an FMC cycle each, as the firmware's
+// loop would, but the thread sleeps meanwhile, and the others run. The FMC is taken
+// to be free for it, though on the board the others' FMC cycles would wait their turn.
+
+bool QMDMAInit()
+    {
+    return true;
+    }
+
+bool QMDMAWrite(const uint16_t *buffer, int size)
+    {
+    SimSleep(sim_timing.mdma_setup_ns + (uint64_t)size*sim_timing.fmc_write_ns);
+    for(int i=0; i<size; i++)F.Dma_out[F.Fifo_out++ % QDMA_WORDS] = buffer[i];
+    sim_bus.fmc_writes += size;
+    sim_bus.mdma_words += size;
+    return true;
+    }
+
+bool QMDMARead(uint16_t *buffer, int size)
+    {
+    SimSleep(sim_timing.mdma_setup_ns + (uint64_t)size*sim_timing.fmc_read_ns);
+    for(int i=0; i<size; i++)buffer[i] = F.Dma_in[F.Fifo_in++ % QDMA_WORDS];
+    sim_bus.fmc_reads += size;
+    sim_bus.mdma_words += size;
+    return true;
+    }
@@ -0,0 +1,93 @@
+////////////////////////////////////////////////////////////////////////////////
+// QbusModel.hpp
+// A model of the FPGA (qbus/qbus.sv) and of the Qbus behind it, for running the
+// firmware on Linux.
+//
+// The firmware side sees the FMC registers of Qbus.hpp (see include/QbusSim.hpp).
+// The PDP-11 side sees its memory, and the IP and SA registers in the I/O page.
+// DMA is granted, CPU sequenced bus cycles are answered and the burst engine moves
+// its data, all as qbus.sv does it, and interrupts are acknowledged by the PDP-11.
+//
+// Time is simulated, in cycles of the H723's clock, so that runs are repeatable.
+// It moves on with each read of the cycle counter, each FMC access and each thread
+// switch, by the amounts below. The time the firmware spends computing between
+// those is not counted. The bus cycles, bursts, interrupts and the SD cards
+// (sim/diskio.cpp) take the times set below, whatever the firmware is doing.
+//
+// The PDP-11 runs as a coroutine, with its own stack, driven by the clock: it runs
+// whenever the time it is waiting for has come, from within whichever thread moved
+// the clock on. So the firmware can spin on a register, as it does in Qinit, and
+// the PDP-11 still gets to answer.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef QBUSMODEL_HPP
+#define QBUSMODEL_HPP
+
+#include <stdint.h>
+
+#define SIM_MEM_MAX     (4u<<20)                        // bytes of PDP-11 memory, 22 bit addressing
+#define SIM_IO_PAGE     017760000u                      // the I/O page, the top 8 KB of the address space
+#define SIM_IP          017772150u                      // the controller's IP and SA registers
+#define SIM_SA          017772152u
+#define SIM_FOREVER     (~0ull)
+
+// timing, set before the run
+struct SimTiming
+    {
+    unsigned cpu_mhz = 550;                             // H723 clock, CPU_CLOCK_FREQUENCY
+    unsigned fmc_read_ns = 80;                          // an FMC read of an FPGA register
+    unsigned fmc_write_ns = 60;                         // an FMC write
+    unsigned cyccnt_cycles = 2;                         // a read of the cycle counter
+    unsigned switch_cycles = 150;                       // a thread switch
+    unsigned background_cycles = 200;                   // a pass of the background loop with nothing to do
+    unsigned mem_reply_ns = 250;                        // from BDIN or BDOUT to BRPLY from the PDP-11 memory
+    unsigned arb_ns = 600;                              // from BDMR to BDMGI from the processor
+    unsigned irq_latency_ns = 5000;                     // from the interrupt request to the acknowledge, including the processor's own delay
+    unsigned mdma_setup_ns = 500;                       // setting up the MDMA, and its interrupt at the end
+    bool block_memory = true;                           // the memory takes DATBI/DATBO
+    bool engine = true;                                 // the FPGA has the burst engine
+    bool irq = true;                                    // the FPGA has the interrupt registers
+    bool fifo = true;                                   // the FPGA has the burst engine's data port, for the MDMA
+    };
+
+extern SimTiming sim_timing;
+
+// time
+extern uint64_t sim_cycles;                             // the time now, in CPU cycles
+extern void SimAdvance(uint64_t cycles);                // move the clock on, running the PDP-11 if it is due
+extern uint64_t SimNs(uint64_t ns);                     // ns to cycles
+extern double SimSeconds(uint64_t cycles);
+extern void SimSleep(uint64_t ns);                      // a firmware thread waits for ns, letting the others run
+extern unsigned sim_omp_short;                          // parallel regions that got fewer threads than they asked for, in threads.cpp
+
+// bus statistics, for the report
+struct SimBusStats
+    {
+    uint64_t dati;                                      // CPU sequenced cycles
+    uint64_t dato;
+    uint64_t grants;                                    // DMA grants to CPU sequenced transfers
+    uint64_t bursts;
+    uint64_t burst_words;
+    uint64_t burst_cycles;                              // time the burst engine was busy
+    uint64_t interrupts;                                // acknowledged by the PDP-11
+    uint64_t fmc_reads;
+    uint64_t fmc_writes;
+    uint64_t mdma_words;                                // moved through the data port by the MDMA
+    };
+
+extern SimBusStats sim_bus;
+
+// the PDP-11 side
+extern uint32_t sim_mem_size;                           // bytes of memory, anything above is NXM
+extern uint16_t sim_mem[SIM_MEM_MAX/2];
+
+extern void QbusModelReset();                           // power up
+extern uint16_t HostRead(uint32_t addr);                // a DATI by the PDP-11, reaches IP and SA too
+extern void HostWrite(uint32_t addr, uint16_t data);    // a DATO by the PDP-11
+extern void HostStart(void (*code)(), unsigned stack, uint64_t delay);   // start the PDP-11 coroutine, delay ns from now
+extern void HostWait(uint64_t ns);                      // the PDP-11 waits, or until an interrupt if sooner
+extern bool HostDone();                                 // the PDP-11 code has returned
+extern unsigned host_interrupts;                        // interrupts taken by the PDP-11
+extern uint16_t host_vector;                            // the last vector
+
+#endif // QBUSMODEL_HPP
@@ -0,0 +1,62 @@
+////////////////////////////////////////////////////////////////////////////////
+// SimDisk.hpp
+// The SD cards, for the simulator.
+//
+// The firmware's own driver, FATFS/Target/FATFS_SD.c, runs the cards, as it does
+// on the board: FatFs's disk_* functions call it (diskio.cpp), and it talks to
+// each card a byte at a time over its SPI bus, with the data blocks moved by
+// programmed I/O or by DMA (SD_UseDMA). sdcard.cpp models the SPI peripherals,
+// their DMA, and the cards behind them, in SPI mode, on image files.
+//
+// A byte takes 8 clocks of the SPI clock FATFS_SD.c chose, and each HAL call takes
+// the CPU hal_ns besides. Programmed I/O keeps the CPU the whole time; a thread
+// waiting for a DMA transfer sleeps (SimSleep), and the other threads run. A card
+// answers a read command with its first block read_us later, and is busy for
+// write_us after a write. FATFS_SD.c polls for both, a byte at a time.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SIMDISK_HPP
+#define SIMDISK_HPP
+
+#include <stdint.h>
+#include "ff.h"
+
+#define SIM_DRIVES 2                                    // SD0: and SD1:
+
+struct SimDiskTiming
+    {
+    unsigned read_us = 150;                             // from a read command to its first block
+    unsigned block_us = 2;                              // from one block of a multiple block read to the next
+    unsigned write_us = 400;                            // programming a single block write, or a multiple block write after its stop token
+    unsigned write_block_us = 20;                       // programming each block of a multiple block write
+    unsigned init_ms = 10;                              // from the first ACMD41 until the card is initialized
+    unsigned kernel_mhz = 100;                          // the SPI kernel clock, which FATFS_SD.c divides by 2 or more
+    bool high_speed = true;                             // the cards take CMD6 to high speed mode, so may be clocked at 50 MHz
+    unsigned hal_ns = 1000;                             // the CPU's time in each HAL SPI call, besides the bytes
+    unsigned dma_setup_ns = 1500;                       // starting a DMA transfer, and its interrupt at the end
+    };
+
+struct SimDiskStats
+    {
+    uint64_t reads;                                     // read commands
+    uint64_t writes;                                    // write commands
+    uint64_t rdsectors;
+    uint64_t wrsectors;
+    uint64_t busy;                                      // cycles the card was selected
+    uint64_t dma;                                       // blocks moved by DMA
+    uint64_t cache_faults;                              // DMA buffers without the cache maintenance they need
+    };
+
+extern SimDiskTiming sim_disk_timing;
+extern SimDiskStats sim_disk[SIM_DRIVES];
+extern uint64_t sim_disk_both;                          // cycles both cards were selected at once, so both had a command under way
+
+extern bool SimDiskOpen(unsigned drv, const char *path, unsigned mbytes); // open or create an image, returns true if it was created
+extern void SimDiskClose();
+
+// the images, for sdcard.cpp and for checking what the driver read and wrote
+extern uint32_t SimDiskSectors(unsigned drv);           // 0 if there is no image, so no card
+extern bool SimDiskRead(unsigned drv, void *buf, uint32_t sector);
+extern bool SimDiskWrite(unsigned drv, const void *buf, uint32_t sector);
+
+#endif // SIMDISK_HPP
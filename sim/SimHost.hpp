@@ -0,0 +1,49 @@
+////////////////////////////////////////////////////////////////////////////////
+// SimHost.hpp
+// The PDP-11's side of UQSSP and MSCP, for the simulator: a minimal class driver,
+// run as the PDP-11 coroutine of QbusModel.hpp.
+//
+// It goes through the four step initialization, sets up the command and response
+// rings in PDP-11 memory, and sends commands as the credits allow. The packet
+// layouts are the firmware's own, from MSCP.hpp.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SIMHOST_HPP
+#define SIMHOST_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include "MSCP.hpp"
+
+#define HOST_COMM       001000u                         // the communication area, the two interrupt flag words and the rings
+#define HOST_RINGS      (HOST_COMM + 4)
+#define HOST_CMDPKTS    004000u                         // one command packet for each command ring entry, 64 bytes each
+#define HOST_RSPPKTS    014000u                         // one response packet for each response ring entry
+#define HOST_DATA       040000u                         // data buffers from here up
+#define HOST_PKT        64                              // bytes per packet, with its UQSSP header
+
+struct HostConfig
+    {
+    unsigned cmd_ring = 4;                              // log2 of the number of command ring entries, 0 to 7
+    unsigned rsp_ring = 4;                              // and of response ring entries
+    bool interrupts = true;                             // take interrupts, rather than only polling the rings
+    uint16_t vector = 0154;                             // the usual vector of the first MSCP controller
+    unsigned poll_us = 20;                              // the longest wait between looks at the response ring
+    };
+
+extern HostConfig host_config;
+extern unsigned host_credits;                           // commands the controller can take now
+extern FILE *sim_report;                                // where the simulator reports, the firmware's stdout goes to the log
+
+extern bool HostInit();                                 // run the initialization, returns false if the controller didn't answer
+extern bool HostSend(command &cmd);                     // send a command, returns false if there is no credit or ring entry for it
+extern bool HostResponse(response &rsp);                // take the next response, returns false if there is none
+extern void HostIdle();                                 // wait for the controller, up to poll_us
+extern bool HostCommand(command &cmd, response &rsp);   // send a command and wait for its end packet
+
+extern void HostRead(uint32_t addr, void *buf, unsigned len);           // PDP-11 memory, as the processor sees it
+extern void HostWrite(uint32_t addr, const void *buf, unsigned len);
+
+extern void HostSmokeTest();                            // the default run, see host.cpp
+
+#endif // SIMHOST_HPP
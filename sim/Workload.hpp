@@ -0,0 +1,128 @@
+////////////////////////////////////////////////////////////////////////////////
+// Workload.hpp
+// Benchmark workloads for the simulator: the PDP-11 keeps a number of reads and
+// writes outstanding at the controller, and the times they take are measured.
+//
+// A workload is a list of phases, run one after the other. Each phase is given as
+// a line of settings, for example
+//
+//     name=oltp read=70 size=1,2,16 qd=8 lbn=hot:20:80 ops=2000
+//
+// name=<text>          what the report calls it
+// unit=<n>,<n>...      the units to use, the commands going to each in turn (0)
+// read=<percent>       the percentage of reads, the rest are writes (100)
+// size=<n>,<n>...      blocks per command, each command picks one at random (16)
+// qd=<n>               commands kept outstanding, up to WL_DEPTH (1)
+// lbn=seq              where the commands go: one after another from block 0 (seq)
+// lbn=rand             anywhere, at random
+// lbn=hot:<a>:<b>      b percent of them in the first a percent of the span
+// span=<blocks>        only the first <blocks> blocks of the unit (all of it)
+// ops=<n>              commands to send (1000)
+// ms=<n>               or stop sending after <n> ms of simulated time
+// seed=<n>             for the random numbers (1)
+// trace=<file>         or replay a file of requests, "r <lbn> <blocks>" or "w <lbn> <blocks>"
+//                      a line, in order, once through unless ops= is given (see gentrace.cpp)
+// cache=off|wt|wb      use the block cache write-through, write-back, or not
+// cache=...:lru|clock  and choose its replacement policy
+// ra=on|off            read ahead of sequential reads, or not
+// burst=on|off         run block transfers in the FPGA's burst engine, or sequence each cycle from the CPU
+// mdma=on|off          move the burst engine's data by MDMA, or by the CPU
+// pipeline=on|off      overlap the card and the Qbus within a transfer, or do one after the other
+// behind=on|off        end a write once its data is in controller RAM, and write it to the card later
+// elevator=on|off      reorder and merge queued commands, or start them in arrival order
+// backend=raw|fat      move blocks of a contiguous unit image straight to the card, or through FatFs
+// fastseek=on|off      let FatFs seek with the unit image's cluster link map, or make it follow the FAT chain
+// sd=dma|pio           move the SD cards' data blocks by DMA, or by programmed I/O (SD_UseDMA in FATFS_SD.c)
+// drives=par|one       give each SD card its own lock, so that transfers on both can overlap, or share one
+//
+// card=<n>,<n>...      make it a card phase: a firmware thread for each card reads and writes it directly,
+//                      with FATFS_SD.c, rather than the PDP-11 sending MSCP commands, as the console's "mb c"
+//                      does. With both cards, the two threads run at once.
+//                      read=, size= in sectors, lbn=, ops=, ms= and seed= apply, and span= is the number
+//                      of sectors at the end of the card it uses (16384), which must be clear of the unit image.
+//                      What it writes and reads is checked against the card image.
+// offset=<bytes>       where a card phase's buffer starts, past a cache line, so 1 to 31 take the driver's
+//                      bounce buffer with DMA (0)
+//
+// The firmware settings (cache= to drives=) only hold for the phase that gives them.
+// Each phase starts from the firmware's defaults, as they were when the workload
+// started, so a phase measures the same thing wherever it is in the file.
+//
+// Each phase reports its IOPS, MB/s and the latency percentiles, measured from
+// the host putting the command in the ring to it taking the end packet out, and
+// how many of the blocks read were found in the block cache, or read ahead. With
+// write-behind, the phase then waits for the last write to reach the card, and
+// reports how long that took.
+// It also reports the transfers the scheduler started, the commands it merged into
+// them and the SD card commands they took, the most commands in flight at once,
+// whether the credits ever failed to add up (the commands in flight, the host's
+// credits and those the controller hasn't sent yet can't be more than its
+// MAX_COMMANDS buffers, and the last can't be negative), and how many OpenMP
+// parallel regions got fewer threads than they asked for, so that a pipeline ran
+// serially. A phase on units on both cards also reports how long both cards
+// were selected at once, which is the time their transfers overlapped.
+//
+// A card phase reports its sectors/s, the latencies of its reads and writes on the
+// card, how many blocks went by DMA, and whether the DMA found the data cache
+// maintenance it needs done (see sdcard.cpp), for each card. With both cards it
+// then reports their sectors/s together, and how long both were selected at once.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef WORKLOAD_HPP
+#define WORKLOAD_HPP
+
+#include <stdint.h>
+
+#define WL_PHASES 64                                    // the most phases in a workload
+#define WL_SIZES 8                                      // the most sizes in a phase
+#define WL_DEPTH 32                                     // the most commands outstanding
+#define WL_UNITS 4                                      // the most units in a phase
+#define WL_CARDS 2                                      // the most cards in a card phase
+#define WL_MAXBLOCKS 128                                // the largest command, each outstanding command has a buffer this big
+
+enum WlDist { WL_SEQ, WL_RAND, WL_HOT };
+enum WlCache { WL_DEFAULT, WL_OFF, WL_WT, WL_WB };       // WL_DEFAULT is however the firmware starts
+
+struct WlPhase
+    {
+    char name[24];
+    unsigned units[WL_UNITS] = {0};
+    unsigned nunits = 1;
+    unsigned read_pct = 100;
+    unsigned sizes[WL_SIZES] = {16};
+    unsigned nsizes = 1;
+    unsigned depth = 1;
+    WlDist dist = WL_SEQ;
+    unsigned hot_space = 20;                            // percent of the span that is hot
+    unsigned hot_io = 80;                               // percent of the commands that go there
+    uint32_t span = 0;
+    unsigned ops = 1000;
+    unsigned ms = 0;
+    uint32_t seed = 1;
+    char trace[64] = {};                                // the file of requests, empty for none
+    WlCache cache = WL_DEFAULT;
+    int clock = -1;                                     // 1 for CLOCK, 0 for LRU, -1 for the default
+    int readahead = -1;                                 // 1 to read ahead, 0 not to, -1 for the default
+    int burst = -1;                                     // 1 to use the burst engine, 0 not to, -1 for the default
+    int mdma = -1;                                      // 1 to use the MDMA, 0 not to, -1 for the default
+    int pipeline = -1;                                  // 1 for pipelined transfers, 0 for serial, -1 for the default
+    int behind = -1;                                    // 1 for write-behind, 0 for write-through, -1 for the default
+    int elevator = -1;                                  // 1 to reorder and merge, 0 for arrival order, -1 for the default
+    int raw = -1;                                       // 1 for the raw backend, 0 for FatFs, -1 for the default
+    int fastseek = -1;                                  // 0 to seek without the cluster link map, else with it if the unit has one
+    int sddma = -1;                                     // 1 for the SD cards' data by DMA, 0 by programmed I/O, -1 for the default
+    int parallel = -1;                                  // 1 for a lock for each drive, 0 for one for both, -1 for the default
+    unsigned cards[WL_CARDS];                           // the SD cards a card phase uses
+    unsigned ncards = 0;                                // 0 for an MSCP phase
+    unsigned offset = 0;                                // bytes past a cache line that a card phase's buffer starts
+    };
+
+extern WlPhase wl_phases[WL_PHASES];
+extern unsigned wl_nphases;
+
+extern bool WorkloadParse(const char *spec);            // add a phase, returns false and says why if the spec is bad
+extern bool WorkloadFile(const char *path);             // add a phase for each line of a file, # starts a comment
+extern void HostWorkload();                             // run the phases, as the PDP-11
+extern void WorkloadBackground();                       // called by the background loop, to start a card phase's threads
+
+#endif // WORKLOAD_HPP
@@ -0,0 +1,122 @@
+// The SD cards, for the simulator, see SimDisk.hpp
+// FatFs's disk_* functions, as FATFS/Target/user_diskio.c connects them to the
+// firmware's driver, and the card images the model in sdcard.cpp reads and writes.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "main.h"
+#include "ff.h"
+#include "diskio.h"
+#include "SimDisk.hpp"
+
+extern "C" {
+#include "FATFS_SD.h"                                   // the firmware's driver, which has no extern "C" of its own
+}
+
+SimDiskTiming sim_disk_timing;
+SimDiskStats sim_disk[SIM_DRIVES];
+
+static int fds[SIM_DRIVES] = {-1, -1};
+static DWORD sectors[SIM_DRIVES];
+
+
+// open the image of drive <drv>, making one of <mbytes> if there is none
+// returns true if it was made, and so needs formatting
+
+bool SimDiskOpen(unsigned drv, const char *path, unsigned mbytes)
+    {
+    bool created = false;
+    int fd = open(path, O_RDWR);
+
+    if(fd < 0)
+        {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if(fd < 0 || ftruncate(fd, (off_t)mbytes << 20) != 0)
+            {
+            perror(path);
+            return false;
+            }
+        created = true;
+        }
+
+    fds[drv] = fd;
+    sectors[drv] = lseek(fd, 0, SEEK_END) / 512;
+    sim_disk[drv] = SimDiskStats();
+    return created;
+    }
+
+void SimDiskClose()
+    {
+    for(auto &fd : fds)
+        {
+        if(fd >= 0)close(fd);
+        fd = -1;
+        }
+    }
+
+
+// the images
+
+uint32_t SimDiskSectors(unsigned drv)
+    {
+    return drv < SIM_DRIVES && fds[drv] >= 0 ? sectors[drv] : 0;
+    }
+
+bool SimDiskRead(unsigned drv, void *buf, uint32_t sector)
+    {
+    return sector < SimDiskSectors(drv) && pread(fds[drv], buf, 512, (off_t)sector*512) == 512;
+    }
+
+bool SimDiskWrite(unsigned drv, const void *buf, uint32_t sector)
+    {
+    return sector < SimDiskSectors(drv) && pwrite(fds[drv], buf, 512, (off_t)sector*512) == 512;
+    }
+
+
+// FatFs's drives 0 and 1 are the cards
+
+DSTATUS disk_initialize(BYTE pdrv)
+    {
+    return pdrv < SIM_DRIVES ? SD_disk_initialize(pdrv) : STA_NOINIT;
+    }
+
+DSTATUS disk_status(BYTE pdrv)
+    {
+    return pdrv < SIM_DRIVES ? SD_disk_status(pdrv) : STA_NOINIT;
+    }
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+    {
+    return pdrv < SIM_DRIVES ? SD_disk_read(pdrv, buff, sector, count) : RES_PARERR;
+    }
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+    {
+    return pdrv < SIM_DRIVES ? SD_disk_write(pdrv, buff, sector, count) : RES_PARERR;
+    }
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+    {
+    return pdrv < SIM_DRIVES ? SD_disk_ioctl(pdrv, cmd, buff) : RES_PARERR;
+    }
+
+DWORD get_fattime()                                     // a fixed time, so that runs make the same images
+    {
+    return ((DWORD)(2024 - 1980) << 25) | (1 << 21) | (1 << 16);
+    }
+
+// the code page conversions, ASCII only, as in FATFS/Target/user_diskio.c
+
+WCHAR ff_convert(WCHAR chr, UINT dir)
+    {
+    (void)dir;
+    return chr < 128 ? chr : '?';
+    }
+
+WCHAR ff_wtoupper(WCHAR wc)
+    {
+    return wc >= 'a' && wc <= 'z' ? wc - ('a' - 'A') : wc;
+    }
@@ -0,0 +1,164 @@
+// Make block traces for the workload's trace= setting, see Workload.hpp.
+//
+//     gentrace rt11|bsd <requests> [<seed>] > <file>
+//
+// Writes one request per line, "r <lbn> <blocks>" or "w <lbn> <blocks>", the format
+// the firmware's "mb s" command replays. These are not recordings. They are made
+// to have the shape of what the two systems do to a disk, so that the cache can be
+// measured until traces taken from real PDP-11s are put beside them.
+//
+// rt11     An RT-11 volume: the home block, and a directory of 2 block segments
+//          from block 6, which every lookup, create and close reads from the start,
+//          and the close rewrites. Files are contiguous, and programs are read whole,
+//          a few blocks at a time, a few of them (the utilities, the compiler) often.
+//
+// bsd      A 2.11BSD file system, of 1 KB blocks: the superblock at block 1, the
+//          inodes after it, which are read and written back all the time, and
+//          directories and files spread over the rest. A few processes each read
+//          a file 1 KB at a time, interleaved, and the writes are mostly of inodes
+//          and of the blocks being appended to.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VOLUME 32768                                    // blocks, the simulator's 16 MB unit images
+
+static uint32_t seed = 1;
+static unsigned left;                                   // requests still to write
+
+static uint32_t Random(uint32_t n)                      // 0 to n-1, the firmware's benchmarks use the same generator
+    {
+    seed = seed*1103515245 + 12345;
+    return (seed >> 8) % n;
+    }
+
+static void Request(char kind, uint32_t lbn, unsigned blocks)
+    {
+    if(left == 0)return;
+    --left;
+    printf("%c %u %u\n", kind, (unsigned)lbn, blocks);
+    }
+
+
+// RT-11
+
+#define RT_DIR 6                                        // the first directory segment
+#define RT_SEGS 4                                       // segments in use
+#define RT_FILES 60                                     // files on the volume
+#define RT_HOT 6                                        // of which this many programs are run most of the time
+
+static void RT11()
+    {
+    uint32_t start[RT_FILES];
+    unsigned length[RT_FILES];
+    uint32_t next = RT_DIR + 2*RT_SEGS + 8;             // after the directory
+    uint32_t free = VOLUME/2;                           // where new files go
+
+    for(unsigned f=0; f<RT_FILES; f++)
+        {
+        start[f] = next;
+        length[f] = 4 + Random(60);
+        next += length[f];
+        }
+
+    while(left)
+        {
+        unsigned segs = 1 + Random(RT_SEGS);            // a lookup reads segments until it finds the file
+
+        Request('r', 1, 1);                             // the home block, when the volume is looked at
+        for(unsigned s=0; s<segs; s++)Request('r', RT_DIR + 2*s, 2);
+
+        if(Random(5) == 0)                              // a new file, written and entered in the directory
+            {
+            unsigned len = 1 + Random(32);
+
+            if(free + len >= VOLUME)free = VOLUME/2;
+            for(unsigned b=0; b<len; b += 4)Request('w', free + b, len - b < 4 ? len - b : 4);
+            free += len;
+            Request('w', RT_DIR + 2*(segs-1), 2);
+            continue;
+            }
+
+        unsigned f = Random(3) ? Random(RT_HOT) : Random(RT_FILES);     // a program, read a few blocks at a time
+        for(unsigned b=0; b<length[f]; b += 4)
+            {
+            Request('r', start[f] + b, length[f] - b < 4 ? length[f] - b : 4);
+            }
+        }
+    }
+
+
+// 2.11BSD, in 1 KB blocks of 2 sectors
+
+#define BSD_INODES 400                                  // 1 KB blocks of inodes, after the superblock
+#define BSD_HOTDIRS 32                                  // directories looked in most of the time
+#define BSD_PROCS 4                                     // processes reading files
+
+static void BSD()
+    {
+    uint32_t blocks = VOLUME/2;
+    uint32_t data = 2 + BSD_INODES;                     // the first data block
+    uint32_t dirs[BSD_HOTDIRS];
+    uint32_t stream[BSD_PROCS];
+    uint32_t append = data + Random(blocks - data);
+
+    for(auto &d : dirs)d = data + Random(blocks - data);
+    for(auto &s : stream)s = data + Random(blocks - data);
+
+    while(left)
+        {
+        unsigned what = Random(100);
+
+        if(what < 25)                                   // an inode, most of them of the files in use
+            {
+            uint32_t ino = Random(4) ? Random(BSD_INODES/10) : Random(BSD_INODES);
+
+            Request(Random(3) ? 'r' : 'w', 2*(2 + ino), 2);
+            }
+        else if(what < 40)                              // a directory, in a path lookup
+            {
+            Request('r', 2*dirs[Random(4) ? Random(BSD_HOTDIRS/4) : Random(BSD_HOTDIRS)], 2);
+            }
+        else if(what < 50)                              // a file being written, a block at a time
+            {
+            if(++append >= blocks)append = data;
+            Request('w', 2*append, 2);
+            }
+        else if(what < 51)                              // the superblock, by update every 30 seconds
+            {
+            Request('w', 2, 2);
+            }
+        else                                            // a file being read
+            {
+            uint32_t &s = stream[Random(BSD_PROCS)];
+
+            if(Random(16) == 0)s = data + Random(blocks - data);   // the process moves on to another file
+            Request('r', 2*s, 2);
+            if(++s >= blocks)s = data;
+            }
+        }
+    }
+
+
+int main(int argc, char **argv)
+    {
+    if(argc < 3)
+        {
+        fprintf(stderr, "usage: gentrace rt11|bsd <requests> [<seed>]\n");
+        return 1;
+        }
+
+    left = strtoul(argv[2], nullptr, 10);
+    if(argc > 3)seed = strtoul(argv[3], nullptr, 10);
+
+    if(strcmp(argv[1], "rt11") == 0)RT11();
+    else if(strcmp(argv[1], "bsd") == 0)BSD();
+    else
+        {
+        fprintf(stderr, "gentrace: no system %s\n", argv[1]);
+        return 1;
+        }
+    return 0;
+    }
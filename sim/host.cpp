@@ -0,0 +1,231 @@
+// The PDP-11's side of UQSSP and MSCP, for the simulator, see SimHost.hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "QbusModel.hpp"
+#include "SimHost.hpp"
+
+#define OWN     0x80000000u                             // in a descriptor: the controller owns it
+#define FLAG    0x40000000u                             // interrupt when the controller gives it back
+
+HostConfig host_config;
+unsigned host_credits = 0;
+
+static unsigned cmd_size;                               // ring entries
+static unsigned rsp_size;
+static unsigned cmd_index;                              // the next entry to use
+static unsigned rsp_index;
+static int32_t cmdref = 0;
+
+
+void HostRead(uint32_t addr, void *buf, unsigned len)
+    {
+    uint16_t *p = (uint16_t *)buf;
+
+    for(unsigned i=0; i<len/2; i++)p[i] = HostRead(addr + i*2);
+    }
+
+void HostWrite(uint32_t addr, const void *buf, unsigned len)
+    {
+    const uint16_t *p = (const uint16_t *)buf;
+
+    for(unsigned i=0; i<len/2; i++)HostWrite(addr + i*2, p[i]);
+    }
+
+static uint32_t CmdRing()
+    {
+    return HOST_RINGS + rsp_size*4;                     // the command ring follows the response ring
+    }
+
+static uint32_t GetDesc(uint32_t ring, unsigned i)
+    {
+    return HostRead(ring + i*4) | (uint32_t)HostRead(ring + i*4 + 2) << 16;
+    }
+
+static void SetDesc(uint32_t ring, unsigned i, uint32_t desc)
+    {
+    HostWrite(ring + i*4, desc & 0xFFFF);
+    HostWrite(ring + i*4 + 2, desc >> 16);              // the half with the owner bit goes last
+    }
+
+
+// wait for the controller to go to the next step of the initialization
+// returns false if it doesn't within a second
+
+static bool Step(uint16_t bit)
+    {
+    for(unsigned i=0; i<200000; i++)
+        {
+        if(HostRead(SIM_SA) & bit)return true;
+        HostWait(5000);
+        }
+    fprintf(sim_report, "the controller didn't go to the step after SA=%06o\n", bit);
+    return false;
+    }
+
+bool HostInit()
+    {
+    HostConfig &cfg = host_config;
+
+    cmd_size = 1 << cfg.cmd_ring;
+    rsp_size = 1 << cfg.rsp_ring;
+    cmd_index = 0;
+    rsp_index = 0;
+    host_credits = 1;                                   // the host starts with one, the end packet of the first command brings the rest
+
+    for(uint32_t a=HOST_COMM; a<CmdRing() + cmd_size*4; a+=2)HostWrite(a, (uint16_t)0);
+
+    HostWrite(SIM_IP, 0);                               // initialize
+    if(!Step(004000))return false;
+    HostWrite(SIM_SA, 0100000 | cfg.cmd_ring << 11 | cfg.rsp_ring << 8 | (cfg.interrupts ? 0200 | (cfg.vector>>2 & 0177) : 0));
+    if(!Step(010000))return false;
+    HostWrite(SIM_SA, HOST_RINGS & 0xFFFF);
+    if(!Step(020000))return false;
+    HostWrite(SIM_SA, HOST_RINGS >> 16);
+    if(!Step(040000))return false;
+    HostWrite(SIM_SA, 1);                               // GO
+
+    for(unsigned i=0; i<rsp_size; i++)                  // give the controller the response buffers
+        {
+        uint32_t pkt = HOST_RSPPKTS + i*HOST_PKT;
+
+        HostWrite(pkt, HOST_PKT - 4);
+        SetDesc(HOST_RINGS, i, (pkt + 4) | OWN | FLAG);
+        }
+    return true;
+    }
+
+
+// send a command, polling the controller (reading IP) so that it looks at the ring
+// returns false if there is no credit, or the next ring entry is still the controller's
+
+bool HostSend(command &cmd)
+    {
+    if(host_credits == 0)return false;
+    if(GetDesc(CmdRing(), cmd_index) & OWN)return false;
+
+    uint32_t pkt = HOST_CMDPKTS + cmd_index*HOST_PKT;
+
+    cmd.msglen = 48;
+    cmd.credits = 0;
+    cmd.msgtype = 0;
+    cmd.vcid = 0;
+    HostWrite(pkt, &cmd, sizeof(cmd));
+    SetDesc(CmdRing(), cmd_index, (pkt + 4) | OWN | (host_config.interrupts ? FLAG : 0));
+    cmd_index = (cmd_index + 1) % cmd_size;
+    --host_credits;
+
+    (void)HostRead(SIM_IP);
+    return true;
+    }
+
+
+// take the next response, and give its buffer back to the controller
+// returns false if there is none
+
+bool HostResponse(response &rsp)
+    {
+    if(GetDesc(HOST_RINGS, rsp_index) & OWN)return false;
+
+    uint32_t pkt = HOST_RSPPKTS + rsp_index*HOST_PKT;
+
+    HostRead(pkt, &rsp, sizeof(rsp));
+    host_credits += rsp.credits;
+
+    HostWrite(pkt, HOST_PKT - 4);
+    SetDesc(HOST_RINGS, rsp_index, (pkt + 4) | OWN | FLAG);
+    rsp_index = (rsp_index + 1) % rsp_size;
+    return true;
+    }
+
+void HostIdle()
+    {
+    HostWait(host_config.poll_us * 1000ull);           // an interrupt ends the wait early
+    }
+
+
+// send a command and wait for its end packet, dropping any other response
+// returns true if it succeeded
+
+bool HostCommand(command &cmd, response &rsp)
+    {
+    cmd.cmdref = ++cmdref;
+    while(!HostSend(cmd))HostIdle();
+
+    for(;;)
+        {
+        while(!HostResponse(rsp))HostIdle();
+        if(rsp.cmdref == cmd.cmdref)return (rsp.status & 037) == ST_SUC;
+        }
+    }
+
+
+// The default run: bring unit 0 online, write a pattern to it, read it back, and check it.
+
+#define SMOKE_BLOCKS 256                                // blocks written and read
+#define SMOKE_XFER 16                                   // blocks per command
+
+static uint16_t Pattern(uint32_t lbn, unsigned w)
+    {
+    return (uint16_t)(lbn*256 + w) ^ 0125252;
+    }
+
+void HostSmokeTest()
+    {
+    command cmd;
+    response rsp;
+
+    if(!HostInit())return;
+    fprintf(sim_report, "init done at %f ms\n", SimSeconds(sim_cycles)*1e3);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = OP_ONL;
+    cmd.unit = 0;
+    if(!HostCommand(cmd, rsp))
+        {
+        fprintf(sim_report, "unit 0 didn't come online, status %o\n", rsp.status);
+        return;
+        }
+    fprintf(sim_report, "unit 0 online, %u blocks\n", (unsigned)rsp.unit_size);
+
+    for(int pass=0; pass<2; pass++)
+        {
+        bool write = pass == 0;
+        uint64_t start = sim_cycles;
+
+        for(uint32_t lbn=0; lbn<SMOKE_BLOCKS; lbn+=SMOKE_XFER)
+            {
+            for(unsigned w=0; w<SMOKE_XFER*256; w++)
+                {
+                sim_mem[HOST_DATA/2 + w] = write ? Pattern(lbn, w) : 0;
+                }
+
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.opcode = write ? OP_WR : OP_RD;
+            cmd.unit = 0;
+            cmd.bytecount = SMOKE_XFER*512;
+            cmd.buffer_address = HOST_DATA;
+            cmd.LBN = lbn;
+            if(!HostCommand(cmd, rsp))
+                {
+                fprintf(sim_report, "%s at LBN %u failed, status %o\n", write ? "write" : "read", (unsigned)lbn, rsp.status);
+                return;
+                }
+
+            for(unsigned w=0; w<SMOKE_XFER*256 && !write; w++)
+                {
+                if(sim_mem[HOST_DATA/2 + w] != Pattern(lbn, w))
+                    {
+                    fprintf(sim_report, "read LBN %u word %u: %06o, should be %06o\n",
+                        (unsigned)(lbn + w/256), w%256, sim_mem[HOST_DATA/2 + w], Pattern(lbn, w));
+                    return;
+                    }
+                }
+            }
+
+        double t = SimSeconds(sim_cycles - start);
+        fprintf(sim_report, "%s %u blocks, %u per command: %f ms, %f KB/s\n",
+            write ? "wrote" : "read and checked", SMOKE_BLOCKS, SMOKE_XFER, t*1e3, SMOKE_BLOCKS/2 / t);
+        }
+    }
@@ -0,0 +1,2 @@
+// serial.h includes Fifo.hpp, which only works on a file system that ignores case.
+#include "FIFO.hpp"
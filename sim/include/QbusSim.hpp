@@ -0,0 +1,44 @@
+// The FPGA registers of Qbus.hpp, for the simulator
+// Each access goes to the model of qbus.sv in sim/QbusModel.cpp, which also takes the
+// time of the FMC cycle. Reading FADDR_ST clears the status bits, as in the FPGA, so
+// it is a function call, and (void)FADDR_ST still reads it.
+
+#ifndef QBUSSIM_HPP
+#define QBUSSIM_HPP
+
+#include <stdint.h>
+
+extern uint16_t QbusSimRead(unsigned faddr);
+extern void QbusSimWrite(unsigned faddr, uint16_t data);
+
+struct QbusSimReg
+    {
+    unsigned faddr;
+
+    operator uint16_t() const { return QbusSimRead(faddr); }
+    const QbusSimReg &operator=(uint16_t data) const { QbusSimWrite(faddr, data); return *this; }
+    };
+
+struct QbusSimWindow
+    {
+    QbusSimReg operator[](unsigned i) const { return QbusSimReg{128 + i*2}; }
+    };
+
+#define FADDR_ST        (QbusSimRead(0))
+#define FADDR_SA        (QbusSimReg{2})
+#define FADDR_CT        (QbusSimReg{4})
+#define FADDR_LO        (QbusSimReg{6})
+#define FADDR_HI        (QbusSimReg{8})
+#define FADDR_DATA_OUT  (QbusSimReg{10})
+#define FADDR_DATA_IN   (QbusSimReg{12})
+#define FADDR_DMA_CNT   (QbusSimReg{16})
+#define FADDR_DMA_TEN   (QbusSimReg{18})
+#define FADDR_DMA_CT    (QbusSimReg{20})
+#define FADDR_DMA_HOLD  (QbusSimReg{22})
+#define FADDR_IRQ_VEC   (QbusSimReg{24})
+#define FADDR_IRQ_CT    (QbusSimReg{26})
+#define FADDR_IRQ_HOLD  (QbusSimReg{28})
+#define FADDR_DMA_FIFO  (QbusSimReg{30})
+#define FADDR_DMA_BUF   (QbusSimWindow{})
+
+#endif // QBUSSIM_HPP
@@ -0,0 +1,53 @@
+// The parts of CMSIS's cmsis_compiler.h used by the firmware built in the simulator.
+// There is one CPU and no interrupts, so the barriers only stop the compiler,
+// and disabling interrupts does nothing.
+
+#ifndef CMSIS_COMPILER_SIM_H
+#define CMSIS_COMPILER_SIM_H
+
+#include <stdint.h>
+
+#ifndef __ASM
+#define __ASM                   __asm
+#endif
+#ifndef __INLINE
+#define __INLINE                inline
+#endif
+#ifndef __STATIC_INLINE
+#define __STATIC_INLINE         static inline
+#endif
+#ifndef __STATIC_FORCEINLINE
+#define __STATIC_FORCEINLINE    __attribute__((always_inline)) static inline
+#endif
+#ifndef __NO_RETURN
+#define __NO_RETURN             __attribute__((__noreturn__))
+#endif
+#ifndef __USED
+#define __USED                  __attribute__((used))
+#endif
+#ifndef __WEAK
+#define __WEAK                  __attribute__((weak))
+#endif
+#ifndef __PACKED
+#define __PACKED                __attribute__((packed, aligned(1)))
+#endif
+#ifndef __ALIGNED
+#define __ALIGNED(x)            __attribute__((aligned(x)))
+#endif
+#ifndef __RESTRICT
+#define __RESTRICT              __restrict
+#endif
+#ifndef __COMPILER_BARRIER
+#define __COMPILER_BARRIER()    __asm__ __volatile__("":::"memory")
+#endif
+
+__STATIC_FORCEINLINE void __enable_irq(void) {}
+__STATIC_FORCEINLINE void __disable_irq(void) {}
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void) { return 0; }
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t priMask) { (void)priMask; }
+__STATIC_FORCEINLINE void __NOP(void) {}
+__STATIC_FORCEINLINE void __DSB(void) { __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __ISB(void) { __COMPILER_BARRIER(); }
+__STATIC_FORCEINLINE void __DMB(void) { __COMPILER_BARRIER(); }
+
+#endif // CMSIS_COMPILER_SIM_H
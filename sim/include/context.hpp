@@ -0,0 +1,65 @@
+// context.hpp for the simulator
+//
+// The same threads as Core/Inc/context.hpp, with the same rules: a Context holds one
+// thread while it is not running, the running thread's Context is at the head of a chain
+// of pending Contexts, and the background is at the end of the chain and never suspends.
+// The chain pointer that the firmware keeps in r9 is a variable here, and a thread is
+// saved by pushing the x86-64 callee-saved registers on its own stack (sim/threads.cpp).
+//
+// Each Context also holds the thread's place in its OpenMP team, which the firmware's
+// libgomp keeps in the omp_thread object r9 points to.
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdint.h>
+#include "cmsis.h"
+
+// the code of a thread
+typedef uint32_t THREADFN(uintptr_t arg);
+
+class Context
+    {
+    public:
+
+    void *sp = nullptr;                     // the saved stack pointer, with the saved registers just above it
+    Context *next = nullptr;                // contextchain pointer, this continues the LIFO chain
+    void *value = nullptr;                  // passed from Port::resume to Port::suspend
+    int team_id = 0;                        // omp_get_thread_num
+    int team_count = 1;                     // omp_get_num_threads
+
+    void static suspend();                  // suspend self until resumed
+    void resume();                          // resume a suspended thread
+    void start(THREADFN *fn, char *stack, unsigned size, uintptr_t arg);    // an internal function to start a new thread
+    void switchTo(Context *to);             // save the running thread here, and run <to>
+
+    bool isBackground()
+        {
+        return next==nullptr;
+        }
+
+    // spawn a new thread, which runs until it suspends
+    template<unsigned N>
+    __FORCEINLINE void spawn(THREADFN *fn,  // code
+               char (&stack)[N],            // reference to the stack. The template can determine the stack size from the reference.
+               uintptr_t arg = 0)
+        {
+        start(fn, stack, N, arg);
+        }
+
+    static void init();                     // powerup init of the thread system
+
+    // Thread::done -- test whether a thread is running
+    // arg: the thread's stack
+    // return: true if the thread is done, false if it is still running.
+    template<unsigned N>
+    static inline bool done(char (&stack)[N])
+        {
+        return stack[N-4] == 1;
+        }
+
+    // get a pointer to the current context
+    static Context *pointer();
+    };
+
+#endif // CONTEXT_H
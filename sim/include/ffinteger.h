@@ -0,0 +1,20 @@
+// FatFs's integer.h, for the simulator
+// The original makes DWORD and LONG longs, which are 64 bits on a Linux host.
+// This is included ahead of everything, with -include, so that integer.h finds _FF_INTEGER defined.
+
+#ifndef _FF_INTEGER
+#define _FF_INTEGER
+
+#include <stdint.h>
+
+typedef int             INT;
+typedef unsigned int    UINT;
+typedef unsigned char   BYTE;
+typedef short           SHORT;
+typedef unsigned short  WORD;
+typedef unsigned short  WCHAR;
+typedef int32_t         LONG;
+typedef uint32_t        DWORD;
+typedef uint64_t        QWORD;
+
+#endif
@@ -0,0 +1,27 @@
+// main.h for the simulator
+// The firmware's main.h brings in the HAL and names the board's pins. Here that is only
+// the little of them FATFS_SD.c uses, see stm32h7xx_hal.h.
+
+#ifndef __MAIN_H
+#define __MAIN_H
+
+#include "stm32h7xx_hal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern GPIO_TypeDef sim_gpio[2];                        // a port for each card's chip select, in sim/sdcard.cpp
+
+#define SPI1_NSS_GPIO_Port      (&sim_gpio[0])
+#define SPI1_NSS_Pin            1
+#define SPI3_NSS_GPIO_Port      (&sim_gpio[1])
+#define SPI3_NSS_Pin            1
+
+void Error_Handler(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MAIN_H
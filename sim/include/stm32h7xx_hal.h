@@ -0,0 +1,67 @@
+// The parts of the HAL and CMSIS that FATFS/Target/FATFS_SD.c uses, for the simulator:
+// the SPI peripherals the SD cards are on, their chip selects, and the data cache
+// maintenance done around the SPI DMA. sim/sdcard.cpp has the model behind them.
+// ffconf.h includes this too, and FatFs needs none of it.
+
+#ifndef STM32H7XX_HAL_SIM_H
+#define STM32H7XX_HAL_SIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum { HAL_OK = 0, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+
+typedef struct
+    {
+    uint32_t CFG1;                                      // only MBR, the clock divider, is modelled
+    } SPI_TypeDef;
+
+typedef struct
+    {
+    uint32_t BaudRatePrescaler;
+    } SPI_InitTypeDef;
+
+typedef struct
+    {
+    SPI_TypeDef *Instance;
+    SPI_InitTypeDef Init;
+    } SPI_HandleTypeDef;
+
+typedef struct
+    {
+    uint32_t ODR;
+    } GPIO_TypeDef;
+
+typedef enum { GPIO_PIN_RESET = 0, GPIO_PIN_SET } GPIO_PinState;
+
+#define SPI_CFG1_MBR_Pos        28
+#define SPI_CFG1_MBR            (7u << SPI_CFG1_MBR_Pos)
+#define SPI_FLAG_TXP            2u
+
+#define RCC_PERIPHCLK_SPI123    0x1000u
+
+#define MODIFY_REG(REG, CLEARMASK, SETMASK) ((REG) = (((REG) & ~(CLEARMASK)) | (SETMASK)))
+
+#define __HAL_SPI_GET_FLAG(h, flag) 1                   // a byte can always be queued, the model takes its time in the transfer
+#define __HAL_SPI_DISABLE(h)    ((void)(h))
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx, uint16_t size);
+uint32_t HAL_RCCEx_GetPeriphCLKFreq(uint32_t clk);
+
+#define SD_DMA_REACHES(addr) 1                          // the model's DMA reaches all of memory
+
+void SCB_CleanDCache_by_Addr(uint32_t *addr, int32_t size);
+void SCB_InvalidateDCache_by_Addr(uint32_t *addr, int32_t size);
+void SCB_CleanInvalidateDCache_by_Addr(uint32_t *addr, int32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STM32H7XX_HAL_SIM_H
@@ -0,0 +1,210 @@
+// Run the MSCP firmware on Linux, against the models of the FPGA, the Qbus and the SD cards.
+// See README.txt.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "context.hpp"
+#include "ContextFIFO.hpp"
+#include "Qbus.hpp"
+#include "uqssp.hpp"
+#include "MSCP.hpp"
+#include "ff.h"
+#include "QbusModel.hpp"
+#include "SimDisk.hpp"
+#include "SimHost.hpp"
+#include "Workload.hpp"
+
+
+// what the files built here need from the rest of the firmware
+
+unsigned CPU_CLOCK_FREQUENCY = 550;
+volatile bool ControlC = false;
+volatile bool *FPGA_doorbell = nullptr;
+uint32_t LastTimeStamp = 0;
+FILE *sim_report = stderr;
+
+extern "C" void Error_Handler()
+    {
+    fprintf(sim_report, "Error_Handler called\n");
+    exit(1);
+    }
+
+extern "C" void memcpy32(uint32_t *dst, uint32_t *src, uint32_t size)
+    {
+    memcpy(dst, src, size);
+    }
+
+
+static FATFS FatFs[SIM_DRIVES];
+
+// open or make the card images, each with one unit image of <unit_mb> on it, UNIT0.img on SD0: and so on
+
+static bool Cards(const char *dir, unsigned mbytes, unsigned unit_mb)
+    {
+    static BYTE work[_MAX_SS*8];
+
+    for(unsigned drv=0; drv<SIM_DRIVES; drv++)
+        {
+        char path[256], name[16];
+        FIL fil;
+
+        snprintf(path, sizeof(path), "%s/sd%u.img", dir, drv);
+        snprintf(name, sizeof(name), "%u:", drv);
+        bool made = SimDiskOpen(drv, path, mbytes);
+
+        if(made && f_mkfs(name, FM_ANY, 0, work, sizeof(work)) != FR_OK)
+            {
+            fprintf(sim_report, "can't format %s\n", path);
+            return false;
+            }
+        if(f_mount(&FatFs[drv], name, 1) != FR_OK)
+            {
+            fprintf(sim_report, "can't mount %s\n", path);
+            return false;
+            }
+
+        snprintf(name, sizeof(name), "%u:UNIT%u.img", drv, drv);
+        if(made && f_open(&fil, name, FA_WRITE | FA_CREATE_NEW) == FR_OK)   // extended on an empty card, so it is contiguous
+            {
+            FSIZE_t size = (FSIZE_t)unit_mb << 20;
+
+            // Seeking past the end allocates the clusters without writing them, so the card image
+            // stays sparse, and reads as zeros, however big the unit is.
+            if(f_lseek(&fil, size) != FR_OK || f_tell(&fil) != size)
+                {
+                fprintf(sim_report, "no room for a %u MB unit on %s\n", unit_mb, path);
+                f_close(&fil);
+                return false;
+                }
+            f_close(&fil);
+            }
+        }
+    return true;
+    }
+
+
+// the firmware, as the console's "mscp" command runs it
+
+static char fwstack[256*1024];
+
+static uint32_t Firmware(uintptr_t arg)
+    {
+    (void)arg;
+
+    QbusInit();
+    Qbus_irq = true;                                    // as "b i on" does, since the host takes interrupts unless -i
+    QbusPolicy();
+    Qinit();
+    if(!ControlC)MSCP_poll();
+    return 0;
+    }
+
+// the PDP-11, which boots a little after the firmware starts, runs the workload or the
+// smoke test, and types ^C at the console when it is done
+
+static void Host()
+    {
+    if(wl_nphases)HostWorkload();
+    else HostSmokeTest();
+    ControlC = true;
+    }
+
+static void Usage()
+    {
+    fprintf(stderr,
+        "usage: mscpsim [options]\n"
+        "  -d <dir>     where the SD card images are, made if they don't exist (.)\n"
+        "  -m <MB>      size of a new card image (64)\n"
+        "  -u <MB>      size of the unit image made on a new card (16)\n"
+        "  -l <file>    the firmware's output (mscpsim.log)\n"
+        "  -c           no burst engine, CPU sequenced DMA only\n"
+        "  -i           no interrupts, the host only polls\n"
+        "  -b           the memory doesn't do block mode\n"
+        "  -x           no data port in the FPGA, the CPU copies the burst engine's data, not the MDMA\n"
+        "  -w <phase>   run a workload phase, as settings, see Workload.hpp, may be repeated\n"
+        "  -f <file>    run the workload in a file, a phase on each line (bench.txt is the standard one)\n");
+    exit(2);
+    }
+
+int main(int argc, char **argv)
+    {
+    const char *dir = ".";
+    const char *log = "mscpsim.log";
+    unsigned mbytes = 64;
+    unsigned unit_mb = 16;
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:m:u:l:cibxw:f:")) != -1)
+        {
+        switch(opt)
+            {
+            case 'd': dir = optarg; break;
+            case 'm': mbytes = atoi(optarg); break;
+            case 'u': unit_mb = atoi(optarg); break;
+            case 'l': log = optarg; break;
+            case 'c': sim_timing.engine = false; break;
+            case 'i': host_config.interrupts = false; break;
+            case 'b': sim_timing.block_memory = false; break;
+            case 'x': sim_timing.fifo = false; break;
+            case 'w': if(!WorkloadParse(optarg))return 2; break;
+            case 'f': if(!WorkloadFile(optarg))return 2; break;
+            default: Usage();
+            }
+        }
+
+    sim_report = fdopen(dup(1), "w");                   // the report goes to the terminal
+    setvbuf(sim_report, nullptr, _IOLBF, 0);
+    if(freopen(log, "w", stdout) == nullptr)            // and the firmware's printfs to the log
+        {
+        perror(log);
+        return 1;
+        }
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    CPU_CLOCK_FREQUENCY = sim_timing.cpu_mhz;
+    Context::init();
+    if(!Cards(dir, mbytes, unit_mb))return 1;
+    for(auto &s : sim_disk)s = SimDiskStats();          // count only the run, not making the cards
+    QbusModelReset();                                   // and power up with the clock at 0
+
+    HostStart(Host, 1024*1024, 100000);
+
+    Context fw;
+    fw.spawn(Firmware, fwstack);
+    while(!Context::done(fwstack))                      // the background loop
+        {
+        undefer();
+        WorkloadBackground();
+        SimAdvance(sim_timing.background_cycles);
+        }
+
+    double t = SimSeconds(sim_cycles);
+    fprintf(sim_report, "simulated %f s: %llu bursts, %llu words, %llu by MDMA, %llu CPU sequenced cycles, %llu interrupts\n",
+        t, (unsigned long long)sim_bus.bursts, (unsigned long long)sim_bus.burst_words, (unsigned long long)sim_bus.mdma_words,
+        (unsigned long long)(sim_bus.dati + sim_bus.dato), (unsigned long long)sim_bus.interrupts);
+    for(unsigned drv=0; drv<SIM_DRIVES; drv++)
+        {
+        fprintf(sim_report, "SD%u: %llu reads, %llu writes, %llu sectors, busy %f s, %llu blocks by DMA, cache maintenance %s\n", drv,
+            (unsigned long long)sim_disk[drv].reads, (unsigned long long)sim_disk[drv].writes,
+            (unsigned long long)(sim_disk[drv].rdsectors + sim_disk[drv].wrsectors), SimSeconds(sim_disk[drv].busy),
+            (unsigned long long)sim_disk[drv].dma, sim_disk[drv].cache_faults ? "wrong" : "ok");
+        }
+
+    extern void TraceCommand(char *p);
+    extern void PoolCommand(char *p);
+    char none[] = "";
+    TraceCommand(none);                                 // and the trace of the last commands to the log
+    PoolCommand(none);                                  // and the pools' watermarks
+
+    for(unsigned drv=0; drv<SIM_DRIVES; drv++)
+        {
+        char name[4] = {(char)('0' + drv), ':'};
+
+        f_mount(nullptr, name, 0);
+        }
+    SimDiskClose();
+    return 0;
+    }
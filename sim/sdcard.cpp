@@ -0,0 +1,485 @@
+// The SPI peripherals the SD cards are on, their DMA, and the cards, for the simulator,
+// see SimDisk.hpp. FATFS/Target/FATFS_SD.c runs against these as it does against the HAL
+// on the board; this file also stands in for SD_DMA.cpp, and for the SysTick handler's
+// counting down of the driver's timeouts.
+//
+// A card answers in SPI mode, a byte for each byte the driver sends: commands and their
+// responses, data blocks started by a token and ended by a CRC, 0xFF while a read isn't
+// ready and 0x00 while a write is being programmed. The bytes go at the SPI clock the
+// driver set in CFG1, and the card's own delays are those of SimDiskTiming.
+//
+// The DMA checks the data cache maintenance the driver does around it: both buffers must
+// be whole cache lines, the transmit buffer cleaned and the receive buffer cleaned and
+// invalidated before the transfer, and the receive buffer invalidated again after it.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "context.hpp"
+#include "ContextFIFO.hpp"
+#include "main.h"
+#include "QbusModel.hpp"
+#include "SimDisk.hpp"
+
+#define SIM_CACHE_LINE 32
+
+extern "C" uint16_t Timer1[2], Timer2[2];               // FATFS_SD.c's timeouts, in ms
+extern FILE *sim_report;
+
+static SPI_TypeDef spi_regs[SIM_DRIVES];
+SPI_HandleTypeDef hspi1 = {&spi_regs[0], {}};           // SD0:, as in the board's main.c
+SPI_HandleTypeDef hspi3 = {&spi_regs[1], {}};           // SD1:
+GPIO_TypeDef sim_gpio[SIM_DRIVES];
+
+enum CardOp { OP_NONE, OP_READ, OP_READ_MULTI, OP_WRITE, OP_WRITE_MULTI };
+
+struct Card
+    {
+    bool selected;
+    uint64_t selected_at;
+    bool idle = true;                                   // until ACMD41 initializes it
+    uint64_t init_done;                                 // when it will have, once the first ACMD41 starts it
+    bool app;                                           // the last command was CMD55, so this one is an ACMD
+    uint8_t cmd[6];                                     // the command coming in
+    unsigned cmd_len;
+    uint8_t out[520];                                   // what it has to send: a response, or a token, a data block and its CRC
+    unsigned out_len;
+    unsigned out_pos;
+    CardOp op;
+    uint32_t sector;                                    // the next one to read or write
+    uint64_t ready;                                     // when the next block of a read is ready
+    uint64_t busy;                                      // until when it is programming a write
+    bool receiving;                                     // a block being written is coming in
+    uint8_t block[514];                                 // with its CRC
+    unsigned block_len;
+    };
+
+static Card cards[SIM_DRIVES];
+static unsigned selected;                               // cards selected now
+static uint64_t both_since;                             // since when both have been
+
+uint64_t sim_disk_both;
+
+struct CacheOp                                          // the last maintenance of each kind
+    {
+    uintptr_t addr;
+    int32_t size;
+    };
+
+static CacheOp cleaned, clean_invalidated;
+
+struct DmaState
+    {
+    uint64_t end;                                       // when the transfer running, or the last, ends
+    uintptr_t rx;                                       // its receive buffer, which must be invalidated once it ends
+    unsigned len;
+    bool invalidate;                                    // and hasn't been yet
+    };
+
+static DmaState dma[SIM_DRIVES];
+
+
+static inline unsigned Drive(SPI_HandleTypeDef *hspi)
+    {
+    return hspi == &hspi1 ? 0 : 1;
+    }
+
+static uint64_t Us(unsigned us)
+    {
+    return SimNs(us * 1000ull);
+    }
+
+// one byte at the SPI clock the driver set, kernel clock divided by 2 << MBR
+
+static uint64_t ByteCycles(unsigned drv)
+    {
+    unsigned mbr = (spi_regs[drv].CFG1 & SPI_CFG1_MBR) >> SPI_CFG1_MBR_Pos;
+    uint64_t hz = (sim_disk_timing.kernel_mhz * 1000000ull) >> (mbr + 1);
+
+    return SimNs(8000000000ull / hz);
+    }
+
+// the SysTick handler's part: count the driver's timeouts down once a ms
+
+static void Tick()
+    {
+    static uint64_t next;
+    uint64_t ms = SimNs(1000000);
+
+    if(next > sim_cycles + ms)next = sim_cycles;        // the clock was reset after the cards were made
+    while(sim_cycles >= next)
+        {
+        for(int i=0; i<2; i++)
+            {
+            if(Timer1[i] > 0)Timer1[i]--;
+            if(Timer2[i] > 0)Timer2[i]--;
+            }
+        next += ms;
+        }
+    }
+
+
+// the cards
+
+static void Send(Card &c, uint8_t b)
+    {
+    if(c.out_len < sizeof(c.out))c.out[c.out_len++] = b;
+    }
+
+static void SendBlock(Card &c, const uint8_t *data, unsigned len)
+    {
+    Send(c, 0xFE);                                      // the start token
+    for(unsigned i=0; i<len; i++)Send(c, data[i]);
+    Send(c, 0xFF);                                      // the CRC, which the driver ignores
+    Send(c, 0xFF);
+    }
+
+// a command has come in, at time <t>
+
+static void Command(unsigned drv, uint64_t t)
+    {
+    Card &c = cards[drv];
+    unsigned cmd = c.cmd[0] & 0x3F;
+    uint32_t arg = (uint32_t)c.cmd[1] << 24 | c.cmd[2] << 16 | c.cmd[3] << 8 | c.cmd[4];
+    bool app = c.app;
+    uint8_t r1 = c.idle ? 0x01 : 0x00;
+    uint8_t reg[64] = {};
+
+    c.app = false;
+    c.out_len = c.out_pos = 0;
+    if(cmd == 12)Send(c, 0xFF);                         // the stuff byte after STOP_TRANSMISSION
+    Send(c, 0xFF);                                      // a byte before the response
+
+    switch(cmd)
+        {
+        case 0:                                         // GO_IDLE_STATE
+            c.idle = true;
+            c.init_done = 0;
+            c.op = OP_NONE;
+            Send(c, 0x01);
+            break;
+
+        case 8:                                         // SEND_IF_COND, an SDv2 card echoes the voltage and check pattern
+            Send(c, r1);
+            Send(c, 0x00);
+            Send(c, 0x00);
+            Send(c, (arg >> 8) & 0x0F);
+            Send(c, arg & 0xFF);
+            break;
+
+        case 55:                                        // APP_CMD
+            c.app = true;
+            Send(c, r1);
+            break;
+
+        case 41:                                        // SD_SEND_OP_COND, as ACMD41
+            if(!app)
+                {
+                Send(c, r1 | 0x04);
+                break;
+                }
+            if(c.init_done == 0)c.init_done = t + Us(sim_disk_timing.init_ms * 1000);
+            if(t >= c.init_done)c.idle = false;
+            Send(c, c.idle ? 0x01 : 0x00);
+            break;
+
+        case 58:                                        // READ_OCR: powered up, SDHC, 3.2-3.4 V
+            Send(c, r1);
+            Send(c, 0xC0);
+            Send(c, 0xFF);
+            Send(c, 0x80);
+            Send(c, 0x00);
+            break;
+
+        case 6:                                         // SWITCH_FUNC, the 64 byte status, with function 1 of group 1 selected if it can be
+            Send(c, r1);
+            reg[16] = sim_disk_timing.high_speed && (arg & 0x0F) == 1 ? 0x01 : 0x00;
+            SendBlock(c, reg, 64);
+            break;
+
+        case 9:                                         // SEND_CSD, version 2, its size in 512 KB units
+            {
+            uint32_t csize = SimDiskSectors(drv) / 1024 - 1;
+
+            Send(c, r1);
+            reg[0] = 0x40;
+            reg[7] = (csize >> 16) & 0x3F;
+            reg[8] = csize >> 8;
+            reg[9] = csize;
+            SendBlock(c, reg, 16);
+            break;
+            }
+
+        case 10:                                        // SEND_CID
+            Send(c, r1);
+            memcpy(reg, "\x03SDSIMUL\x10", 9);
+            SendBlock(c, reg, 16);
+            break;
+
+        case 12:                                        // STOP_TRANSMISSION
+            c.op = OP_NONE;
+            Send(c, r1);
+            break;
+
+        case 16:                                        // SET_BLOCKLEN
+            Send(c, r1);
+            break;
+
+        case 17:                                        // READ_SINGLE_BLOCK
+        case 18:                                        // READ_MULTIPLE_BLOCK
+        case 24:                                        // WRITE_BLOCK
+        case 25:                                        // WRITE_MULTIPLE_BLOCK
+            if(arg >= SimDiskSectors(drv))
+                {
+                Send(c, r1 | 0x40);                     // parameter error
+                break;
+                }
+            Send(c, r1);
+            c.sector = arg;
+            if(cmd == 17 || cmd == 18)
+                {
+                c.op = cmd == 17 ? OP_READ : OP_READ_MULTI;
+                c.ready = t + Us(sim_disk_timing.read_us);
+                ++sim_disk[drv].reads;
+                }
+            else
+                {
+                c.op = cmd == 24 ? OP_WRITE : OP_WRITE_MULTI;
+                ++sim_disk[drv].writes;
+                }
+            break;
+
+        default:
+            Send(c, r1 | 0x04);                         // illegal command
+            break;
+        }
+    }
+
+// exchange a byte with card <drv> at time <t>: it takes <mosi> and returns what it sends
+
+static uint8_t Exchange(unsigned drv, uint8_t mosi, uint64_t t)
+    {
+    Card &c = cards[drv];
+
+    if(!c.selected || SimDiskSectors(drv) == 0)return 0xFF;
+
+    if(c.receiving)                                     // a block being written
+        {
+        c.block[c.block_len++] = mosi;
+        if(c.block_len < sizeof(c.block))return 0xFF;
+        c.receiving = false;
+        c.out_len = c.out_pos = 0;
+        Send(c, SimDiskWrite(drv, c.block, c.sector) ? 0xE5 : 0xED);   // data accepted, or a write error
+        ++c.sector;
+        ++sim_disk[drv].wrsectors;
+        c.busy = t + Us(c.op == OP_WRITE_MULTI ? sim_disk_timing.write_block_us : sim_disk_timing.write_us);
+        if(c.op == OP_WRITE)c.op = OP_NONE;
+        return 0xFF;
+        }
+
+    if(c.out_pos < c.out_len)
+        {
+        uint8_t b = c.out[c.out_pos++];
+
+        if(c.out_pos == c.out_len && c.op == OP_READ_MULTI)c.ready = t + Us(sim_disk_timing.block_us);
+        return b;
+        }
+    if(t < c.busy)return 0x00;
+
+    if(c.cmd_len || (mosi & 0xC0) == 0x40)              // a command, which may end a multiple block read
+        {
+        c.cmd[c.cmd_len++] = mosi;
+        if(c.cmd_len == sizeof(c.cmd))
+            {
+            c.cmd_len = 0;
+            Command(drv, t);
+            }
+        return 0xFF;
+        }
+
+    if(c.op == OP_WRITE || c.op == OP_WRITE_MULTI)
+        {
+        if(mosi == (c.op == OP_WRITE ? 0xFE : 0xFC))    // the start token of the next block
+            {
+            c.receiving = true;
+            c.block_len = 0;
+            }
+        else if(mosi == 0xFD && c.op == OP_WRITE_MULTI) // the stop token
+            {
+            c.op = OP_NONE;
+            c.busy = t + Us(sim_disk_timing.write_us);
+            }
+        return 0xFF;
+        }
+
+    if((c.op == OP_READ || c.op == OP_READ_MULTI) && t >= c.ready)
+        {
+        uint8_t data[512];
+
+        c.out_len = c.out_pos = 0;
+        if(!SimDiskRead(drv, data, c.sector))
+            {
+            c.op = OP_NONE;
+            return 0x08;                                // an error token, out of range
+            }
+        ++c.sector;
+        ++sim_disk[drv].rdsectors;
+        if(c.op == OP_READ)c.op = OP_NONE;
+        SendBlock(c, data, 512);
+        return c.out[c.out_pos++];
+        }
+
+    return 0xFF;
+    }
+
+
+// the chip selects, active low
+
+extern "C" void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state)
+    {
+    (void)pin;
+    unsigned drv = port - sim_gpio;
+    Card &c = cards[drv];
+    bool select = state == GPIO_PIN_RESET;
+
+    if(select == c.selected)return;
+    c.selected = select;
+    if(select)
+        {
+        c.selected_at = sim_cycles;
+        if(++selected == SIM_DRIVES)both_since = sim_cycles;
+        }
+    else
+        {
+        if(selected-- == SIM_DRIVES)sim_disk_both += sim_cycles - both_since;
+        sim_disk[drv].busy += sim_cycles - c.selected_at;
+        c.cmd_len = 0;
+        c.out_len = c.out_pos = 0;
+        }
+    }
+
+
+// programmed I/O, the CPU waits for each byte
+
+static HAL_StatusTypeDef Transfer(SPI_HandleTypeDef *hspi, const uint8_t *tx, uint8_t *rx, uint16_t size)
+    {
+    unsigned drv = Drive(hspi);
+    uint64_t byte = ByteCycles(drv);
+
+    SimAdvance(SimNs(sim_disk_timing.hal_ns));
+    for(unsigned i=0; i<size; i++)
+        {
+        SimAdvance(byte);
+        uint8_t b = Exchange(drv, tx ? tx[i] : 0xFF, sim_cycles);
+        if(rx)rx[i] = b;
+        }
+    Tick();
+    return HAL_OK;
+    }
+
+extern "C" HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout)
+    {
+    (void)timeout;
+    return Transfer(hspi, data, nullptr, size);
+    }
+
+extern "C" HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx, uint16_t size, uint32_t timeout)
+    {
+    (void)timeout;
+    return Transfer(hspi, tx, rx, size);
+    }
+
+extern "C" uint32_t HAL_RCCEx_GetPeriphCLKFreq(uint32_t clk)
+    {
+    (void)clk;
+    return sim_disk_timing.kernel_mhz * 1000000;
+    }
+
+
+// the data cache maintenance, which there is no cache to do, but the DMA checks
+
+static bool Lines(uintptr_t addr, unsigned size)
+    {
+    return addr % SIM_CACHE_LINE == 0 && size % SIM_CACHE_LINE == 0;
+    }
+
+static bool Covers(const CacheOp &op, uintptr_t addr, unsigned size)
+    {
+    return op.addr <= addr && addr + size <= op.addr + op.size;
+    }
+
+static void CacheFault(unsigned drv, const char *what, uintptr_t addr, unsigned size)
+    {
+    if(sim_disk[drv].cache_faults++ == 0)
+        {
+        fprintf(sim_report, "SD%u: the DMA's %s buffer, %u bytes at %p, %s\n", drv, what, size, (void *)addr,
+            Lines(addr, size) ? "hasn't had the cache maintenance it needs" : "isn't whole cache lines");
+        }
+    }
+
+extern "C" void SCB_CleanDCache_by_Addr(uint32_t *addr, int32_t size)
+    {
+    cleaned = {(uintptr_t)addr, size};
+    }
+
+extern "C" void SCB_CleanInvalidateDCache_by_Addr(uint32_t *addr, int32_t size)
+    {
+    clean_invalidated = {(uintptr_t)addr, size};
+    }
+
+extern "C" void SCB_InvalidateDCache_by_Addr(uint32_t *addr, int32_t size)
+    {
+    CacheOp op = {(uintptr_t)addr, size};
+
+    for(auto &d : dma)
+        {
+        if(d.invalidate && sim_cycles >= d.end && Covers(op, d.rx, d.len))d.invalidate = false;
+        }
+    }
+
+
+// the DMA, which moves the bytes at the SPI clock while the thread that started it sleeps
+
+extern "C" HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, uint8_t *tx, uint8_t *rx, uint16_t size)
+    {
+    unsigned drv = Drive(hspi);
+    DmaState &d = dma[drv];
+    uint64_t byte = ByteCycles(drv);
+    uint64_t t = sim_cycles + SimNs(sim_disk_timing.hal_ns + sim_disk_timing.dma_setup_ns);
+
+    if(d.invalidate)CacheFault(drv, "last receive", d.rx, d.len);
+    if(!Lines((uintptr_t)tx, size) || !Covers(cleaned, (uintptr_t)tx, size))CacheFault(drv, "transmit", (uintptr_t)tx, size);
+    if(!Lines((uintptr_t)rx, size) || !Covers(clean_invalidated, (uintptr_t)rx, size))CacheFault(drv, "receive", (uintptr_t)rx, size);
+
+    for(unsigned i=0; i<size; i++)
+        {
+        t += byte;
+        rx[i] = Exchange(drv, tx[i], t);
+        }
+    d = {t, (uintptr_t)rx, size, true};
+    ++sim_disk[drv].dma;
+    SimAdvance(SimNs(sim_disk_timing.hal_ns));
+    return HAL_OK;
+    }
+
+
+// SD_DMA.cpp's part: the thread sleeps until the transfer ends, and yields while polling a card
+
+extern "C" void SD_DMA_Start(int drv)
+    {
+    (void)drv;
+    }
+
+extern "C" int SD_DMA_Wait(int drv)
+    {
+    uint64_t end = dma[drv].end;
+
+    if(end > sim_cycles)SimSleep(((end - sim_cycles) * 1000 + sim_timing.cpu_mhz - 1) / sim_timing.cpu_mhz);
+    Tick();
+    return 1;
+    }
+
+extern "C" void SD_Idle()
+    {
+    yield();
+    }
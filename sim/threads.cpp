@@ -0,0 +1,305 @@
+// The thread system and the OpenMP runtime, for the simulator
+//
+// These take the place of context.cpp, ContextFIFO.cpp, Port.cpp and libgomp.cpp, and
+// follow them: a thread runs until it suspends itself, resumes another, or returns, and
+// a thread that resumes another is pending until that one suspends. Each switch takes
+// SimTiming::switch_cycles of simulated time.
+//
+// Switching saves the x86-64 callee-saved registers on the thread's stack, as the
+// firmware saves r4-r11 in the Context. Nothing else needs saving, since a switch is
+// always a function call. This is much faster than swapcontext, which makes a system
+// call on every switch to save the signal mask.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "context.hpp"
+#include "ContextFIFO.hpp"
+#include "Port.hpp"
+#include "omp.h"
+#include "libgomp.hpp"
+#include "QbusModel.hpp"
+
+// The firmware's pools, less what background's region holds: background itself and
+// three threads, one of which is the console thread that runs MSCP_poll, and their
+// four tasks (see MSCP_WORKERS). So a parallel region is cut short here when it would be
+// on the board.
+#define SIM_OMP_THREADS (GOMP_MAX_NUM_THREADS - 4)      // threads in the OpenMP pool, besides the ones that start parallel regions
+#define SIM_OMP_TASKS (GOMP_NUM_TASKS - 4)              // tasks, one for each member of each team
+#define SIM_OMP_STACK (256*1024)                        // bytes of stack for each
+
+
+// save the registers on the stack, store sp in *save, then load sp from <load>, and the registers from that stack
+
+extern "C" void SimSwitch(void **save, void *load);
+
+__asm__(
+"   .text                               \n"
+"   .globl  SimSwitch                   \n"
+"   .type   SimSwitch, @function        \n"
+"SimSwitch:                             \n"
+"   pushq   %rbp                        \n"
+"   pushq   %rbx                        \n"
+"   pushq   %r12                        \n"
+"   pushq   %r13                        \n"
+"   pushq   %r14                        \n"
+"   pushq   %r15                        \n"
+"   movq    %rsp, (%rdi)                \n"
+"   movq    %rsi, %rsp                  \n"
+"   popq    %r15                        \n"
+"   popq    %r14                        \n"
+"   popq    %r13                        \n"
+"   popq    %r12                        \n"
+"   popq    %rbx                        \n"
+"   popq    %rbp                        \n"
+"   ret                                 \n"
+"   .size   SimSwitch, .-SimSwitch      \n"
+);
+
+
+// Set up a new stack so that switching to it calls <entry>, which must never return.
+// The top 16 bytes of the stack are left alone, for the done flag of Context::done.
+// Returns the sp to switch to.
+
+void *SimStackInit(char *stack, unsigned size, void (*entry)())
+    {
+    uintptr_t top = ((uintptr_t)stack + size - 16) & ~(uintptr_t)15;
+    void **sp = (void **)top;
+
+    *--sp = nullptr;                                    // where entry's return address would be, keeping the ABI's stack alignment
+    *--sp = (void *)entry;                              // SimSwitch returns to this
+    for(int i=0; i<6; i++)*--sp = nullptr;              // rbp, rbx, r12-r15
+
+    return sp;
+    }
+
+
+static Context background;                              // the thread running main
+static Context *current = &background;                  // the running thread, the head of the pending chain, r9 in the firmware
+
+ContextFIFO DeferFIFO;
+
+
+Context *Context::pointer()
+    {
+    return current;
+    }
+
+void Context::init()
+    {
+    current = &background;
+    background.next = nullptr;
+    }
+
+void Context::switchTo(Context *to)
+    {
+    SimAdvance(sim_timing.switch_cycles);
+    current = to;
+    SimSwitch(&sp, to->sp);
+    }
+
+
+// suspend self until resumed
+
+void Context::suspend()
+    {
+    Context *self = current;
+
+    if(self->isBackground())return;                     // the background must never suspend
+
+    self->switchTo(self->next);
+    }
+
+// resume a suspended thread, pending until it suspends
+
+void Context::resume()
+    {
+    Context *self = current;
+
+    next = self;
+    self->switchTo(this);
+    }
+
+
+// the start of every thread, see Context::start
+
+static THREADFN *starting_fn;
+static uintptr_t starting_arg;
+static char *starting_done;
+
+static void ThreadEntry()
+    {
+    THREADFN *fn = starting_fn;
+    uintptr_t arg = starting_arg;
+    char *done = starting_done;
+    Context *self = current;
+
+    fn(arg);
+
+    *done = 1;                                          // see Context::done
+    current = self->next;                               // the thread is gone, run the next pending one
+    SimSwitch(&self->sp, current->sp);
+    abort();                                            // nothing switches back to it
+    }
+
+// start a new thread, pending the running one until the new one suspends
+
+void Context::start(THREADFN *fn, char *stack, unsigned size, uintptr_t arg)
+    {
+    stack[size-4] = 0;
+    sp = SimStackInit(stack, size, ThreadEntry);
+    starting_fn = fn;
+    starting_arg = arg;
+    starting_done = &stack[size-4];
+    resume();
+    }
+
+
+// suspend the current thread in the FIFO, unless the FIFO is full, and run the next pending thread
+
+void ContextFIFO::suspend()
+    {
+    Context *self = current;
+
+    if(self->isBackground())return;                     // the background must never suspend
+    if(!add(self))return;
+
+    self->switchTo(self->next);
+    }
+
+// resume the oldest thread in the FIFO
+// returns false if there was none, else true once the resumed thread suspends
+
+bool ContextFIFO::resume()
+    {
+    Context *ctx;
+
+    if(!take(ctx))return false;
+
+    ctx->resume();
+    return true;
+    }
+
+
+// suspend the current thread at the port, returning the value it is resumed with
+
+void *Port::suspend()
+    {
+    Context *self = current;
+
+    if(self->isBackground())return nullptr;
+
+    Context *pending = self->next;
+
+    self->next = first;                                 // the port is a LIFO chain through the Contexts' next pointers
+    first = self;
+    self->switchTo(pending);
+    return self->value;
+    }
+
+// resume the last thread to suspend at the port, passing it <x>
+// returns false if there was none, else true once the resumed thread suspends
+
+bool Port::resume(void *x)
+    {
+    Context *ctx = first;
+
+    if(ctx == nullptr)return false;
+
+    first = ctx->next;
+    ctx->value = x;
+    ctx->resume();
+    return true;
+    }
+
+
+// OpenMP
+//
+// Only what the firmware's parallel regions use: a team is the thread that starts the
+// region, as thread 0, and threads from the pool. They all run the region, and the
+// starting thread waits for the others at the end. Each member takes a task. If the
+// pool runs out of either the team is smaller, as with the firmware's libgomp.
+
+struct OmpThread
+    {
+    Context ctx;
+    char *stack;
+    bool busy;
+    void (*fn)(void *);
+    void *data;
+    };
+
+static OmpThread pool[SIM_OMP_THREADS];
+static unsigned free_tasks = SIM_OMP_TASKS;
+unsigned sim_omp_short = 0;
+
+static uint32_t OmpMember(uintptr_t arg)
+    {
+    OmpThread *t = (OmpThread *)arg;
+
+    t->fn(t->data);
+    return 0;
+    }
+
+extern "C" void GOMP_parallel(void (*fn)(void *), void *data, unsigned num_threads, unsigned flags)
+    {
+    (void)flags;
+
+    OmpThread *team[SIM_OMP_THREADS];
+    unsigned n = 0;                                     // threads from the pool
+    Context *self = current;
+    int id = self->team_id;
+    int count = self->team_count;
+
+    if(num_threads == 0)num_threads = SIM_OMP_THREADS + 1;
+    bool master = free_tasks > 0;                       // the starting thread's own task, without which it runs the region alone
+    if(master)--free_tasks;
+    for(auto &t : pool)
+        {
+        if(!master || n+1 >= num_threads || free_tasks == 0)break;
+        if(t.busy)continue;
+        if(t.stack == nullptr)t.stack = (char *)malloc(SIM_OMP_STACK);
+        t.busy = true;
+        --free_tasks;
+        team[n++] = &t;
+        }
+    if(n+1 < num_threads)++sim_omp_short;
+
+    self->team_id = 0;
+    self->team_count = n+1;
+    for(unsigned i=0; i<n; i++)
+        {
+        team[i]->ctx.team_id = i+1;
+        team[i]->ctx.team_count = n+1;
+        team[i]->fn = fn;
+        team[i]->data = data;
+        team[i]->ctx.start(OmpMember, team[i]->stack, SIM_OMP_STACK, (uintptr_t)team[i]);
+        }
+
+    fn(data);
+
+    for(unsigned i=0; i<n; i++)                         // the barrier at the end of the region
+        {
+        while(team[i]->stack[SIM_OMP_STACK-4] != 1)
+            {
+            yield();
+            SimAdvance(sim_timing.cyccnt_cycles);
+            }
+        team[i]->busy = false;
+        ++free_tasks;
+        }
+    if(master)++free_tasks;
+
+    self->team_id = id;
+    self->team_count = count;
+    }
+
+extern "C" int omp_get_thread_num()
+    {
+    return current->team_id;
+    }
+
+extern "C" int omp_get_num_threads()
+    {
+    return current->team_count;
+    }
@@ -0,0 +1,829 @@
+// Benchmark workloads for the simulator, see Workload.hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "QbusModel.hpp"
+#include "SimHost.hpp"
+#include "BlockCache.hpp"
+#include "Elevator.hpp"
+#include "SimDisk.hpp"
+#include "Qbus.hpp"
+#include "uqssp.hpp"
+#include "context.hpp"
+#include "ContextFIFO.hpp"
+#include "diskio.h"
+#include "Workload.hpp"
+
+extern BlockCache block_cache;                          // in MSCP.cpp
+extern int credits;                                     // in uqssp.cpp, command buffers not yet credited to the host
+extern "C" int SD_UseDMA;                               // in FATFS_SD.c
+extern "C" uint32_t SD_Clock[2];
+extern "C" DRESULT SD_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
+extern "C" DRESULT SD_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count);
+
+WlPhase wl_phases[WL_PHASES];
+unsigned wl_nphases = 0;
+
+static uint32_t unit_size[MSCP_UNITS];                  // blocks, 0 until the unit has been brought online
+
+struct WlDefaults                                       // the firmware's settings a phase can change, as the workload found them
+    {
+    bool cache;
+    bool write_back;
+    bool clock;
+    bool readahead;
+    bool burst;
+    bool mdma;
+    bool pipeline;
+    bool behind;
+    bool elevator;
+    bool raw;
+    bool sddma;
+    bool parallel;
+    };
+
+static WlDefaults defaults;
+
+
+// the settings
+
+static bool Number(const char *&p, unsigned &n)
+    {
+    char *end;
+
+    n = strtoul(p, &end, 10);
+    if(end == p)return false;
+    p = end;
+    return true;
+    }
+
+// a list of numbers from <lo> to <hi>, "1,2,16"
+
+static bool List(const char *p, unsigned *v, unsigned most, unsigned &n, unsigned lo, unsigned hi)
+    {
+    n = 0;
+    do  {
+        if(n == most || !Number(p, v[n]) || v[n] < lo || v[n] > hi)return false;
+        ++n;
+        } while(*p++ == ',');
+    return p[-1] == 0;
+    }
+
+static bool Distinct(const unsigned *v, unsigned n)
+    {
+    for(unsigned i=0; i<n; i++)
+        {
+        for(unsigned j=0; j<i; j++)
+            {
+            if(v[i] == v[j])return false;
+            }
+        }
+    return true;
+    }
+
+static bool OnOff(const char *p, int &v)
+    {
+    if(strcmp(p, "on") == 0)v = 1;
+    else if(strcmp(p, "off") == 0)v = 0;
+    else return false;
+    return true;
+    }
+
+static bool Setting(WlPhase &ph, const char *key, const char *p, bool &ops_given)
+    {
+    if(strcmp(key, "name") == 0)
+        {
+        snprintf(ph.name, sizeof(ph.name), "%s", p);
+        return true;
+        }
+    if(strcmp(key, "size") == 0)return List(p, ph.sizes, WL_SIZES, ph.nsizes, 1, WL_MAXBLOCKS);
+    if(strcmp(key, "unit") == 0)
+        {
+        return List(p, ph.units, WL_UNITS, ph.nunits, 0, MSCP_UNITS - 1) && Distinct(ph.units, ph.nunits);
+        }
+    if(strcmp(key, "card") == 0)
+        {
+        return List(p, ph.cards, WL_CARDS, ph.ncards, 0, SIM_DRIVES - 1) && Distinct(ph.cards, ph.ncards);
+        }
+    if(strcmp(key, "trace") == 0)
+        {
+        if(strlen(p) >= sizeof(ph.trace))return false;
+        strcpy(ph.trace, p);
+        if(!ops_given)ph.ops = ~0u;                     // the whole trace
+        return true;
+        }
+    if(strcmp(key, "ra") == 0)return OnOff(p, ph.readahead);
+    if(strcmp(key, "burst") == 0)return OnOff(p, ph.burst);
+    if(strcmp(key, "mdma") == 0)return OnOff(p, ph.mdma);
+    if(strcmp(key, "pipeline") == 0)return OnOff(p, ph.pipeline);
+    if(strcmp(key, "behind") == 0)return OnOff(p, ph.behind);
+    if(strcmp(key, "elevator") == 0)return OnOff(p, ph.elevator);
+    if(strcmp(key, "fastseek") == 0)return OnOff(p, ph.fastseek);
+    if(strcmp(key, "sd") == 0)
+        {
+        if(strcmp(p, "dma") == 0)ph.sddma = 1;
+        else if(strcmp(p, "pio") == 0)ph.sddma = 0;
+        else return false;
+        return true;
+        }
+    if(strcmp(key, "drives") == 0)
+        {
+        if(strcmp(p, "par") == 0)ph.parallel = 1;
+        else if(strcmp(p, "one") == 0)ph.parallel = 0;
+        else return false;
+        return true;
+        }
+    if(strcmp(key, "backend") == 0)
+        {
+        if(strcmp(p, "raw") == 0)ph.raw = 1;
+        else if(strcmp(p, "fat") == 0)ph.raw = 0;
+        else return false;
+        return true;
+        }
+    if(strcmp(key, "cache") == 0)
+        {
+        if(strncmp(p, "off", 3) == 0)ph.cache = WL_OFF, p += 3;
+        else if(strncmp(p, "wt", 2) == 0)ph.cache = WL_WT, p += 2;
+        else if(strncmp(p, "wb", 2) == 0)ph.cache = WL_WB, p += 2;
+        else return false;
+        if(strcmp(p, ":lru") == 0)ph.clock = 0;
+        else if(strcmp(p, ":clock") == 0)ph.clock = 1;
+        else if(*p)return false;
+        return true;
+        }
+    if(strcmp(key, "lbn") == 0)
+        {
+        if(strcmp(p, "seq") == 0)ph.dist = WL_SEQ;
+        else if(strcmp(p, "rand") == 0)ph.dist = WL_RAND;
+        else if(strncmp(p, "hot:", 4) == 0)
+            {
+            p += 4;
+            ph.dist = WL_HOT;
+            if(!Number(p, ph.hot_space) || *p++ != ':' || !Number(p, ph.hot_io) || *p)return false;
+            return ph.hot_space > 0 && ph.hot_space < 100 && ph.hot_io <= 100;
+            }
+        else return false;
+        return true;
+        }
+
+    unsigned n;
+
+    if(!Number(p, n) || *p)return false;
+    if(strcmp(key, "read") == 0 && n <= 100)ph.read_pct = n;
+    else if(strcmp(key, "qd") == 0 && n > 0 && n <= WL_DEPTH)ph.depth = n;
+    else if(strcmp(key, "span") == 0)ph.span = n;
+    else if(strcmp(key, "ops") == 0)
+        {
+        ph.ops = n;
+        ops_given = true;
+        }
+    else if(strcmp(key, "ms") == 0)ph.ms = n;
+    else if(strcmp(key, "seed") == 0)ph.seed = n;
+    else if(strcmp(key, "offset") == 0 && n < 32)ph.offset = n;
+    else return false;
+    return true;
+    }
+
+bool WorkloadParse(const char *spec)
+    {
+    if(wl_nphases == WL_PHASES)
+        {
+        fprintf(stderr, "more than %u phases\n", WL_PHASES);
+        return false;
+        }
+
+    WlPhase &ph = wl_phases[wl_nphases];
+    bool ops_given = false;
+    char buf[256];
+    char *save;
+
+    ph = WlPhase();
+    snprintf(ph.name, sizeof(ph.name), "phase %u", wl_nphases+1);
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    for(char *tok = strtok_r(buf, " \t\r\n", &save); tok; tok = strtok_r(nullptr, " \t\r\n", &save))
+        {
+        char *eq = strchr(tok, '=');
+
+        if(eq)*eq = 0;
+        if(eq == nullptr || !Setting(ph, tok, eq+1, ops_given))
+            {
+            if(eq)*eq = '=';
+            fprintf(stderr, "bad setting \"%s\" in \"%s\"\n", tok, spec);
+            return false;
+            }
+        }
+
+    if(ph.ms && !ops_given)ph.ops = ~0u;                // a time limit alone
+    ++wl_nphases;
+    return true;
+    }
+
+bool WorkloadFile(const char *path)
+    {
+    FILE *f = fopen(path, "r");
+    char line[256];
+
+    if(f == nullptr)
+        {
+        perror(path);
+        return false;
+        }
+
+    while(fgets(line, sizeof(line), f))
+        {
+        char *p = strchr(line, '#');
+
+        if(p)*p = 0;
+        for(p = line; *p == ' ' || *p == '\t'; p++);
+        if(*p == 0 || *p == '\n' || *p == '\r')continue;
+        if(!WorkloadParse(p))
+            {
+            fclose(f);
+            return false;
+            }
+        }
+
+    fclose(f);
+    return true;
+    }
+
+
+// running it
+
+struct WlRandom                                         // the firmware's benchmarks use the same generator
+    {
+    uint32_t seed;
+
+    uint32_t next()
+        {
+        seed = seed*1103515245 + 12345;
+        return seed >> 8;
+        }
+
+    uint32_t below(uint32_t n)                          // 0 to n-1
+        {
+        uint64_t r = (uint64_t)next() << 24 | next();
+
+        return n ? r % n : 0;
+        }
+    };
+
+struct WlCommand                                        // a command the controller has
+    {
+    bool busy;
+    bool write;
+    int32_t cmdref;
+    unsigned blocks;
+    uint64_t sent;
+    };
+
+static bool Online(unsigned unit)
+    {
+    command cmd;
+    response rsp;
+
+    if(unit_size[unit])return true;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = OP_ONL;
+    cmd.unit = unit;
+    if(!HostCommand(cmd, rsp))
+        {
+        fprintf(sim_report, "unit %u didn't come online, status %o\n", unit, rsp.status);
+        return false;
+        }
+    unit_size[unit] = rsp.unit_size;
+    return true;
+    }
+
+// where the next command goes
+
+static uint32_t Place(const WlPhase &ph, WlRandom &rnd, uint32_t span, unsigned blocks, uint32_t &pos)
+    {
+    switch(ph.dist)
+        {
+        case WL_SEQ:
+            if(pos + blocks > span)pos = 0;
+            pos += blocks;
+            return pos - blocks;
+
+        case WL_RAND:
+            return rnd.below(span - blocks + 1);
+
+        case WL_HOT:
+            {
+            uint32_t hot = (uint64_t)span * ph.hot_space / 100;
+
+            if(hot < blocks)hot = blocks;
+            if(rnd.below(100) < ph.hot_io || span - hot < blocks)return rnd.below(hot - blocks + 1);
+            return hot + rnd.below(span - hot - blocks + 1);
+            }
+        }
+    return 0;
+    }
+
+struct WlRequest                                        // a line of a trace
+    {
+    bool write;
+    uint32_t lbn;
+    unsigned blocks;
+    };
+
+static bool ReadTrace(const WlPhase &ph, std::vector<WlRequest> &reqs)
+    {
+    FILE *f = fopen(ph.trace, "r");
+    char line[80];
+    WlRequest r;
+    char kind;
+
+    if(f == nullptr)
+        {
+        fprintf(sim_report, "%s: can't open %s\n", ph.name, ph.trace);
+        return false;
+        }
+
+    while(fgets(line, sizeof(line), f))
+        {
+        if(sscanf(line, " %c %u %u", &kind, &r.lbn, &r.blocks) != 3)continue;
+        if(r.blocks == 0 || r.blocks > WL_MAXBLOCKS)continue;
+        r.write = kind == 'w';
+        reqs.push_back(r);
+        }
+
+    fclose(f);
+    if(reqs.empty())fprintf(sim_report, "%s: no requests in %s\n", ph.name, ph.trace);
+    return !reqs.empty();
+    }
+
+static uint64_t CardCommands()                          // on both cards so far
+    {
+    uint64_t n = 0;
+
+    for(auto &d : sim_disk)n += d.reads + d.writes;
+    return n;
+    }
+
+static uint64_t CardSectors()
+    {
+    uint64_t n = 0;
+
+    for(auto &d : sim_disk)n += d.rdsectors + d.wrsectors;
+    return n;
+    }
+
+static void Latencies(const char *what, std::vector<uint64_t> &lat)
+    {
+    static const unsigned permille[] = {500, 900, 990, 999};
+
+    if(lat.empty())return;
+    std::sort(lat.begin(), lat.end());
+
+    fprintf(sim_report, "  %-5s %7zu, latency us: min %.1f", what, lat.size(), SimSeconds(lat.front())*1e6);
+    for(unsigned pm : permille)
+        {
+        size_t i = lat.size() * pm / 1000;
+
+        if(i >= lat.size())i = lat.size() - 1;
+        fprintf(sim_report, ", p%g %.1f", pm/10.0, SimSeconds(lat[i])*1e6);
+        }
+    fprintf(sim_report, ", max %.1f\n", SimSeconds(lat.back())*1e6);
+    }
+
+// the blocks read ahead on the phase's units so far, and how many of them were read
+
+static void ReadAhead(const WlPhase &ph, unsigned &blocks, unsigned &used)
+    {
+    blocks = used = 0;
+    for(unsigned i=0; i<ph.nunits; i++)
+        {
+        blocks += units[ph.units[i]].ra_blocks;
+        used += units[ph.units[i]].ra_used;
+        }
+    }
+
+// the phase's settings, or the defaults for those it doesn't give
+// Nothing is outstanding, so the controller is idle.
+
+static void Settings(const WlPhase &ph)
+    {
+    bool cache = ph.cache == WL_DEFAULT ? defaults.cache : ph.cache != WL_OFF;
+    bool write_back = ph.cache == WL_DEFAULT ? defaults.write_back : ph.cache == WL_WB;
+
+    if(!(cache && write_back))
+        {
+        while(block_cache.dirty)HostIdle();             // the dispatcher writes back what the last phase left while it is idle
+        }
+    MSCP_cache = cache;
+    MSCP_write_back = write_back;
+    block_cache.clock = ph.clock >= 0 ? ph.clock : defaults.clock;
+    MSCP_readahead = ph.readahead >= 0 ? ph.readahead : defaults.readahead;
+    Qbus_burst = ph.burst >= 0 ? ph.burst : defaults.burst;
+    Qbus_mdma = ph.mdma >= 0 ? ph.mdma : defaults.mdma;
+    MSCP_pipeline = ph.pipeline >= 0 ? ph.pipeline : defaults.pipeline;
+    MSCP_write_behind = ph.behind >= 0 ? ph.behind : defaults.behind;
+    MSCP_elevator = ph.elevator >= 0 ? ph.elevator : defaults.elevator;
+    MSCP_raw = ph.raw >= 0 ? ph.raw : defaults.raw;
+    SD_UseDMA = ph.sddma >= 0 ? ph.sddma : defaults.sddma;
+    MSCP_parallel_drives = ph.parallel >= 0 ? ph.parallel : defaults.parallel;
+    for(auto &u : units)                                // a unit opened with a cluster link map keeps it, unless the phase takes it away
+        {
+        if(u.online)u.fil.cltbl = u.fastseek && ph.fastseek != 0 ? u.clmt : nullptr;
+        }
+    QbusPolicy();                                       // which keeps the burst engine off if the FPGA has none, and the MDMA without a data port
+    }
+
+static bool RunPhase(const WlPhase &ph)
+    {
+    static int32_t cmdref = 0x10000;                    // clear of HostCommand's
+    WlCommand cmds[WL_DEPTH] = {};
+    WlCommand next = {};
+    command cmd;
+    bool rolled = false;
+    std::vector<uint64_t> rdlat, wrlat;
+    WlRandom rnd = {ph.seed};
+    unsigned sent = 0, busy = 0, errors = 0;
+    unsigned most = 0, overdrawn = 0;                   // the most commands in flight, and the times the credits didn't add up
+    uint64_t bytes = 0;
+    uint32_t pos = 0;
+    std::vector<WlRequest> reqs;
+
+    uint32_t span = ph.span;                            // the smallest of the units, if that's less
+
+    for(unsigned i=0; i<ph.nunits; i++)
+        {
+        unsigned unit = ph.units[i];
+
+        if(!Online(unit))return false;
+        if(span == 0 || unit_size[unit] < span)span = unit_size[unit];
+        }
+    if(ph.trace[0] && !ReadTrace(ph, reqs))return false;
+    Settings(ph);
+
+    for(unsigned i=0; i<ph.nsizes; i++)
+        {
+        if(ph.sizes[i] > span)
+            {
+            fprintf(sim_report, "%s: %u blocks is more than the span, %u\n", ph.name, ph.sizes[i], (unsigned)span);
+            return false;
+            }
+        }
+
+    unsigned ops = reqs.empty() || ph.ops != ~0u ? ph.ops : reqs.size();
+    unsigned hits = block_cache.hits, misses = block_cache.misses, writebacks = block_cache.writebacks;
+    unsigned ra_blocks, ra_used;
+    ReadAhead(ph, ra_blocks, ra_used);
+    uint64_t burst_words = sim_bus.burst_words, mdma_words = sim_bus.mdma_words;
+    unsigned short_teams = sim_omp_short;
+    unsigned transfers = MSCP_scheduler().taken, merged = MSCP_scheduler().merged;
+    uint64_t card_cmds = CardCommands(), card_sectors = CardSectors();
+    uint64_t both = sim_disk_both;
+    uint64_t start = sim_cycles;
+    uint64_t stop = ph.ms ? start + SimNs(ph.ms * 1000000ull) : SIM_FOREVER;
+
+    while(busy || (sent < ops && sim_cycles < stop))
+        {
+        bool progress = false;
+
+        for(unsigned i=0; i<ph.depth && sent < ops && sim_cycles < stop; i++)    // keep the queue full
+            {
+            if(cmds[i].busy)continue;
+
+            if(!rolled && !reqs.empty())                // the next command, from the trace
+                {
+                const WlRequest &r = reqs[sent % reqs.size()];
+                uint32_t blocks = r.blocks < span ? r.blocks : span;
+
+                memset(&cmd, 0, sizeof(cmd));
+                next.write = r.write;
+                next.blocks = blocks;
+                cmd.LBN = r.lbn % span;
+                if(cmd.LBN + blocks > span)cmd.LBN = span - blocks;
+                }
+            else if(!rolled)                            // or made up
+                {
+                memset(&cmd, 0, sizeof(cmd));
+                next.write = rnd.below(100) >= ph.read_pct;
+                next.blocks = ph.sizes[rnd.below(ph.nsizes)];
+                cmd.LBN = Place(ph, rnd, span, next.blocks, pos);
+                }
+            if(!rolled)                                 // kept until it can be sent
+                {
+                next.cmdref = ++cmdref;
+                cmd.cmdref = next.cmdref;
+                cmd.opcode = next.write ? OP_WR : OP_RD;
+                cmd.unit = ph.units[sent % ph.nunits];
+                cmd.bytecount = next.blocks * 512;
+                rolled = true;
+                }
+
+            cmd.buffer_address = HOST_DATA + i * WL_MAXBLOCKS*512;
+            next.sent = sim_cycles;
+            if(!HostSend(cmd))break;                    // no credit, wait for an end packet
+
+            cmds[i] = next;
+            cmds[i].busy = true;
+            rolled = false;
+            ++busy;
+            ++sent;
+            progress = true;
+            }
+
+        response rsp;
+
+        while(HostResponse(rsp))
+            {
+            for(auto &c : cmds)
+                {
+                if(!c.busy || c.cmdref != rsp.cmdref)continue;
+
+                (c.write ? wrlat : rdlat).push_back(sim_cycles - c.sent);
+                if((rsp.status & 037) == ST_SUC)bytes += c.blocks * 512;
+                else ++errors;
+                c.busy = false;
+                --busy;
+                break;
+                }
+            progress = true;
+            }
+
+        // The controller has a buffer for every command in flight or that the host has a credit for,
+        // and for every credit it hasn't sent yet, and no more.
+        if(busy > most)most = busy;
+        if(credits < 0 || busy + host_credits + credits > MAX_COMMANDS)++overdrawn;
+
+        if(!progress)HostIdle();
+        }
+
+    double t = SimSeconds(sim_cycles - start);
+    unsigned done = rdlat.size() + wrlat.size();
+    uint64_t ended = sim_cycles;
+    both = sim_disk_both - both;
+
+    while(WriteBehindPending())HostIdle();              // the dispatcher writes what is left behind while it is idle
+
+    fprintf(sim_report, "%s: %u commands in %.3f ms, %.0f IOPS, %.3f MB/s, %u errors\n",
+        ph.name, done, t*1e3, t > 0 ? done/t : 0, t > 0 ? bytes/t/(1<<20) : 0, errors);
+    short_teams = sim_omp_short - short_teams;
+    fprintf(sim_report, "  most in flight %u, credits %s, %u parallel regions short of threads\n",
+        most, overdrawn ? "overdrawn" : "ok", short_teams);
+
+    transfers = MSCP_scheduler().taken - transfers;
+    merged = MSCP_scheduler().merged - merged;
+    card_cmds = CardCommands() - card_cmds;
+    card_sectors = CardSectors() - card_sectors;
+    fprintf(sim_report, "  %u transfers, %u commands merged into them, %llu card commands for %llu sectors\n",
+        transfers, merged, (unsigned long long)card_cmds, (unsigned long long)card_sectors);
+    if(ph.nunits > 1)
+        {
+        fprintf(sim_report, "  both cards selected for %.3f ms, %.1f%% of the time\n",
+            SimSeconds(both)*1e3, t > 0 ? 100*SimSeconds(both)/t : 0);
+        }
+    if(!rdlat.empty() && !wrlat.empty())
+        {
+        std::vector<uint64_t> all(rdlat);
+
+        all.insert(all.end(), wrlat.begin(), wrlat.end());
+        Latencies("all", all);
+        }
+    Latencies("read", rdlat);
+    Latencies("write", wrlat);
+
+    if(sim_cycles != ended)
+        {
+        double flushed = SimSeconds(sim_cycles - start);
+
+        fprintf(sim_report, "  write-behind on the card %.3f ms after the last end packet, %.3f MB/s including that\n",
+            SimSeconds(sim_cycles - ended)*1e3, bytes/flushed/(1<<20));
+        }
+
+    hits = block_cache.hits - hits;
+    misses = block_cache.misses - misses;
+    writebacks = block_cache.writebacks - writebacks;
+    if(hits || misses)
+        {
+        fprintf(sim_report, "  cache %s %s, blocks read: %u hits, %u misses, hit rate %.1f%%, %u blocks written back\n",
+            !MSCP_cache ? "off" : MSCP_write_back ? "wb" : "wt", block_cache.clock ? "CLOCK" : "LRU",
+            hits, misses, hits + misses ? 100.0*hits/(hits + misses) : 0, writebacks);
+        }
+
+    unsigned ra_blocks_now, ra_used_now;
+    ReadAhead(ph, ra_blocks_now, ra_used_now);
+    ra_blocks = ra_blocks_now - ra_blocks;
+    ra_used = ra_used_now - ra_used;
+    if(ra_blocks)
+        {
+        fprintf(sim_report, "  read ahead %u blocks, %u of them read (%.1f%%), depth now %u\n",
+            ra_blocks, ra_used, 100.0*ra_used/ra_blocks, units[ph.units[0]].ra_depth);
+        }
+
+    burst_words = sim_bus.burst_words - burst_words;
+    mdma_words = sim_bus.mdma_words - mdma_words;
+    if(burst_words)
+        {
+        fprintf(sim_report, "  burst data %llu words, %llu of them moved by MDMA\n",
+            (unsigned long long)burst_words, (unsigned long long)mdma_words);
+        }
+    return true;
+    }
+
+// A card phase: raw transfers on SD cards, through FATFS_SD.c, as the console's "mb c" does them.
+// The host hands the phase to the background loop, which runs a firmware thread for each card, and waits.
+// The threads yield between commands, as the console's does, and while a card is busy if the driver does.
+
+#define WL_CARD_SPAN 16384                              // sectors at the end of the card, unless span= says
+
+enum WlCardState { WL_CARD_IDLE, WL_CARD_PENDING, WL_CARD_RUNNING, WL_CARD_DONE };
+
+struct WlCardRun
+    {
+    volatile WlCardState state;
+    const WlPhase *ph;
+    uint64_t start;
+    uint64_t end;
+    unsigned done;
+    unsigned errors;
+    uint64_t sectors;
+    std::vector<uint64_t> rdlat, wrlat;
+    };
+
+static WlCardRun card_run[SIM_DRIVES];
+static Context card_thread[SIM_DRIVES];
+static char card_stack[SIM_DRIVES][64*1024];
+
+// the pattern written to a sector
+
+static uint8_t Pattern(uint32_t sector, unsigned i, uint32_t seed)
+    {
+    return (uint8_t)(sector*31 + i + seed);
+    }
+
+static uint32_t CardThread(uintptr_t arg)
+    {
+    static uint8_t spaces[SIM_DRIVES][WL_MAXBLOCKS*512 + 64] __attribute__((aligned(32)));
+    BYTE drv = arg;
+    WlCardRun &run = card_run[drv];
+    const WlPhase &ph = *run.ph;
+    uint8_t (&space)[WL_MAXBLOCKS*512 + 64] = spaces[drv];
+    uint32_t sectors = SimDiskSectors(drv);
+    uint32_t span = ph.span && ph.span < sectors ? ph.span : WL_CARD_SPAN;
+    uint32_t base = sectors - span;                     // free space, past the unit image
+    uint8_t *buf = space + 32 + ph.offset;              // with a cache line of guard bytes before and after it
+    WlRandom rnd = {ph.seed};
+    uint32_t pos = 0;
+    uint64_t stop = ph.ms ? sim_cycles + SimNs(ph.ms * 1000000ull) : SIM_FOREVER;
+
+    run.start = sim_cycles;
+    for(unsigned n=0; n<ph.ops && sim_cycles < stop; n++)
+        {
+        unsigned count = ph.sizes[rnd.below(ph.nsizes)];
+        bool write = rnd.below(100) >= ph.read_pct;
+        uint32_t sector = base + Place(ph, rnd, span, count, pos);
+        uint64_t t = sim_cycles;
+        bool ok;
+
+        memset(space, 0xA5, sizeof(space));
+        if(write)
+            {
+            for(unsigned i=0; i<count*512; i++)buf[i] = Pattern(sector + i/512, i%512, ph.seed + n);
+            ok = SD_disk_write(drv, buf, sector, count) == RES_OK;
+            }
+        else
+            {
+            ok = SD_disk_read(drv, buf, sector, count) == RES_OK;
+            }
+        t = sim_cycles - t;
+
+        // check what the card has, or what was read, against the image, and that nothing else was touched
+        for(unsigned s=0; s<count && ok; s++)
+            {
+            uint8_t image[512];
+
+            ok = SimDiskRead(drv, image, sector + s) && memcmp(image, buf + s*512, 512) == 0;
+            }
+        for(uint8_t *p = space; p < space + sizeof(space) && ok; p++)
+            {
+            if(p == buf)p += count*512;
+            ok = *p == 0xA5;
+            }
+
+        if(!ok)++run.errors;
+        (write ? run.wrlat : run.rdlat).push_back(t);
+        run.sectors += count;
+        ++run.done;
+        yield();
+        }
+    run.end = sim_cycles;
+    run.state = WL_CARD_DONE;
+    return 0;
+    }
+
+void WorkloadBackground()
+    {
+    for(unsigned drv=0; drv<SIM_DRIVES; drv++)
+        {
+        if(card_run[drv].state != WL_CARD_PENDING)continue;
+
+        card_run[drv].state = WL_CARD_RUNNING;
+        card_thread[drv].spawn(CardThread, card_stack[drv], drv);
+        }
+    }
+
+static bool RunCardPhase(const WlPhase &ph)
+    {
+    for(unsigned i=0; i<ph.ncards; i++)
+        {
+        uint32_t sectors = SimDiskSectors(ph.cards[i]);
+
+        if(ph.span >= sectors || (ph.span == 0 && sectors < 2*WL_CARD_SPAN))
+            {
+            fprintf(sim_report, "%s: SD%u is too small\n", ph.name, ph.cards[i]);
+            return false;
+            }
+        }
+
+    while(block_cache.dirty || WriteBehindPending())HostIdle();  // the firmware leaves the cards alone from now on
+    Settings(ph);
+
+    SimDiskStats before[SIM_DRIVES];
+    uint64_t both = sim_disk_both;
+
+    for(unsigned i=0; i<ph.ncards; i++)
+        {
+        WlCardRun &run = card_run[ph.cards[i]];
+
+        before[ph.cards[i]] = sim_disk[ph.cards[i]];
+        run.ph = &ph;
+        run.done = run.errors = 0;
+        run.sectors = 0;
+        run.rdlat.clear();
+        run.wrlat.clear();
+        run.state = WL_CARD_PENDING;                    // all of them, so that the threads start together
+        }
+    for(unsigned i=0; i<ph.ncards; i++)
+        {
+        while(card_run[ph.cards[i]].state != WL_CARD_DONE)HostIdle();
+        }
+
+    uint64_t start = SIM_FOREVER, end = 0, sectors = 0;
+
+    for(unsigned i=0; i<ph.ncards; i++)
+        {
+        unsigned drv = ph.cards[i];
+        WlCardRun &run = card_run[drv];
+        double t = SimSeconds(run.end - run.start);
+        uint64_t dma = sim_disk[drv].dma - before[drv].dma;
+        uint64_t faults = sim_disk[drv].cache_faults - before[drv].cache_faults;
+
+        run.state = WL_CARD_IDLE;
+        start = std::min(start, run.start);
+        end = std::max(end, run.end);
+        sectors += run.sectors;
+
+        fprintf(sim_report, "%s: %u commands on SD%u in %.3f ms, %.0f sectors/s, %u errors\n",
+            ph.name, run.done, drv, t*1e3, t > 0 ? run.sectors/t : 0, run.errors);
+        Latencies("read", run.rdlat);
+        Latencies("write", run.wrlat);
+        fprintf(sim_report, "  %s at %.1f MHz, buffer %u bytes past a cache line, %llu blocks by DMA, cache maintenance %s\n",
+            SD_UseDMA ? "DMA" : "programmed I/O", SD_Clock[drv]/1e6, ph.offset, (unsigned long long)dma, faults ? "wrong" : "ok");
+        }
+
+    if(ph.ncards > 1)
+        {
+        double t = SimSeconds(end - start);
+
+        both = sim_disk_both - both;
+        fprintf(sim_report, "  both cards: %llu sectors in %.3f ms, %.0f sectors/s, both selected for %.3f ms, %.1f%% of the time\n",
+            (unsigned long long)sectors, t*1e3, t > 0 ? sectors/t : 0, SimSeconds(both)*1e3, t > 0 ? 100*SimSeconds(both)/t : 0);
+        }
+    return true;
+    }
+
+void HostWorkload()
+    {
+    if(!HostInit())return;
+
+    defaults.cache = MSCP_cache;                        // the controller is initialized, so its settings are as it chose them
+    defaults.write_back = MSCP_write_back;
+    defaults.clock = block_cache.clock;
+    defaults.readahead = MSCP_readahead;
+    defaults.burst = Qbus_burst;
+    defaults.mdma = Qbus_mdma;
+    defaults.pipeline = MSCP_pipeline;
+    defaults.behind = MSCP_write_behind;
+    defaults.elevator = MSCP_elevator;
+    defaults.raw = MSCP_raw;
+    defaults.sddma = SD_UseDMA;
+    defaults.parallel = MSCP_parallel_drives;
+
+    for(unsigned i=0; i<wl_nphases; i++)
+        {
+        const WlPhase &ph = wl_phases[i];
+
+        if(!(ph.ncards ? RunCardPhase(ph) : RunPhase(ph)))return;
+        }
+    }